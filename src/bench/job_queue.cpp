@@ -0,0 +1,115 @@
+// Measures the cost of enqueueing and dequeueing jobs, with and without contention.
+//
+// Usage: toytorrent_bench_job_queue [num_workers] [num_jobs]
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../job.hpp"
+#include "../trace.hpp"
+
+using namespace tt;
+
+// Does (almost) nothing, so only the queue's overhead is measured.
+class NopJob final : public job::IJob {
+   public:
+    explicit NopJob(std::atomic<std::size_t>& count) : m_count(count) {}
+    void process() override { m_count.fetch_add(1, std::memory_order_relaxed); }
+
+   private:
+    std::atomic<std::size_t>& m_count;
+};
+
+// Enqueues `n` NopJobs from within a worker, which exercises the lock-free path and stealing.
+class SpawnJob final : public job::IJob {
+   public:
+    SpawnJob(job::JobQueue& q, std::atomic<std::size_t>& count, const std::size_t n) : m_q(q), m_count(count), m_n(n) {}
+    void process() override {
+        for (std::size_t i = 0; i < m_n; i++) {
+            m_q.enqueue(std::make_unique<NopJob>(m_count));
+        }
+    }
+
+   private:
+    job::JobQueue& m_q;
+    std::atomic<std::size_t>& m_count;
+    std::size_t m_n;
+};
+
+template <typename F>
+static void run(const std::string& name, const std::size_t num_jobs, F f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    fmt::print("{:<40} {:>10.1f} ns/job\n", name, elapsed / static_cast<double>(num_jobs));
+}
+
+int main(int argc, char** argv) {
+    const std::size_t num_workers =
+        argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::max(std::thread::hardware_concurrency(), 1U);
+    const std::size_t num_jobs = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000000;
+    fmt::print("{} workers, {} jobs\n", num_workers, num_jobs);
+
+    job::JobQueue q{num_workers};
+    std::atomic<std::size_t> count{0};
+
+    // Everything enqueued up front from outside, then drained by all workers
+    run("external enqueue, then process", num_jobs, [&]() {
+        for (std::size_t i = 0; i < num_jobs; i++) {
+            q.enqueue(std::make_unique<NopJob>(count));
+        }
+        q.process();
+    });
+
+    // Several spawners enqueue into their own deques while the other workers steal
+    run("spawned from workers (local + steal)", num_jobs, [&]() {
+        const std::size_t spawners = std::max<std::size_t>(num_workers / 2, 1);
+        for (std::size_t i = 0; i < spawners; i++) {
+            q.enqueue(std::make_unique<SpawnJob>(q, count, num_jobs / spawners));
+        }
+        q.process();
+    });
+
+    // Several external threads enqueue concurrently while the workers drain
+    run("concurrent external producers", num_jobs, [&]() {
+        const std::size_t producers = 4;
+        std::vector<std::thread> threads{};
+        for (std::size_t p = 0; p < producers; p++) {
+            threads.emplace_back([&]() {
+                for (std::size_t i = 0; i < num_jobs / producers; i++) {
+                    q.enqueue(std::make_unique<NopJob>(count));
+                }
+            });
+        }
+        std::thread worker_driver{[&]() { q.process(); }};
+        for (auto& t : threads) {
+            t.join();
+        }
+        worker_driver.join();
+        // Workers stop once they run out of work, which may happen before the producers are done
+        q.process();
+    });
+
+    // The same as the first, to see what tracing costs
+    job::Tracer tracer{};
+    q.set_tracer(&tracer);
+    run("external enqueue, then process, traced", num_jobs, [&]() {
+        for (std::size_t i = 0; i < num_jobs; i++) {
+            q.enqueue(std::make_unique<NopJob>(count));
+        }
+        q.process();
+    });
+    q.set_tracer(nullptr);
+
+    fmt::print("{} jobs processed\n", count.load());
+    return EXIT_SUCCESS;
+}
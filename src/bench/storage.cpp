@@ -0,0 +1,91 @@
+// Measures flushing pieces to disk through each storage backend and option: throughput, and CPU time spent per GiB.
+// Pieces are flushed by jobs in parallel, as downloads do, and made durable once at the end.
+//
+// Usage: toytorrent_bench_storage path [num_pieces] [piece_size_kib] [queue_depth]
+
+#include <fmt/core.h>
+#include <sys/resource.h>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../job.hpp"
+#include "../torrent/piece.hpp"
+#include "../torrent/shared_constants.hpp"
+#include "../torrent/storage.hpp"
+
+using namespace tt;
+
+// User and system time the process used so far.
+static std::chrono::duration<double> cpu_time() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    const auto secs = [](const timeval& tv) {
+        return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1e6;
+    };
+    return std::chrono::duration<double>(secs(usage.ru_utime) + secs(usage.ru_stime));
+}
+
+static void run(const std::string& name, const std::filesystem::path& path, std::vector<piece::Piece>& pieces,
+                const storage::Config& config) {
+    std::filesystem::remove(path);
+    auto storage = storage::open(path, config);
+    storage->allocate(std::uint64_t{pieces.front().m_size} * pieces.size(), config.m_allocation);
+    job::JobQueue q{};
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto start_cpu = cpu_time();
+    for (auto& p : pieces) {
+        q.enqueue(piece::make_flush_job(p, *storage));
+    }
+    q.process();
+    storage->sync();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const auto cpu = cpu_time() - start_cpu;
+
+    const double gib = static_cast<double>(pieces.size()) * pieces.front().m_size / (1024.0 * 1024.0 * 1024.0);
+    fmt::print("{:<24} {:>8.2f} GiB/s {:>10.1f} ms CPU/GiB\n", name, gib / elapsed.count(),
+               cpu.count() * 1000.0 / gib);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fmt::print(stderr, "Usage: {} path [num_pieces] [piece_size_kib] [queue_depth]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const std::filesystem::path path{argv[1]};
+    const std::size_t num_pieces = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1024;
+    const std::uint32_t piece_size =
+        1024 * (argc > 3 ? static_cast<std::uint32_t>(std::strtoul(argv[3], nullptr, 10)) : 1024);
+    const unsigned queue_depth = argc > 4 ? static_cast<unsigned>(std::strtoul(argv[4], nullptr, 10))
+                                          : storage::Default_Queue_Depth;
+    fmt::print("{} pieces of {} KiB, queue depth {}\n", num_pieces, piece_size / 1024, queue_depth);
+
+    // Pieces that look downloaded and verified
+    std::vector<piece::Piece> pieces{};
+    const std::array<std::uint8_t, piece::Piece_Hash_Len> no_hash{};
+    const std::vector<std::uint8_t> subpiece(peer::Request_Subpiece_Size, 0xab);
+    for (std::size_t i = 0; i < num_pieces; i++) {
+        pieces.emplace_back(piece_size, static_cast<std::uint32_t>(i), no_hash, piece::State::HaveVerified);
+        for (std::size_t j = 0; j < pieces.back().m_subpieces.size(); j++) {
+            pieces.back().set_downloaded_subpiece_data(j, subpiece);
+        }
+    }
+
+    run("pwritev", path, pieces, {.m_backend = storage::Backend::Posix});
+    run("io_uring", path, pieces, {.m_backend = storage::Backend::Uring, .m_queue_depth = queue_depth});
+    run("mmap", path, pieces, {.m_backend = storage::Backend::Mmap});
+    run("pwritev, preallocated", path, pieces,
+        {.m_backend = storage::Backend::Posix, .m_allocation = storage::Allocation::Full});
+    run("pwritev, coalesced", path, pieces,
+        {.m_backend = storage::Backend::Posix, .m_coalesce_buffer = 64 * 1024 * 1024});
+    std::filesystem::remove(path);
+    return EXIT_SUCCESS;
+}
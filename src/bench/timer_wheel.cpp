@@ -0,0 +1,85 @@
+// Measures the cost of per-connection timers: arming, re-arming (as on every message received), and expiring.
+// Compares the timing wheel against an ordered multimap, which is what such timers are usually kept in.
+//
+// Usage: toytorrent_bench_timer_wheel [num_timers] [num_rounds]
+
+#include <fmt/core.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../reusable/timerwheel.hpp"
+
+struct WheelTimer : timerwheel::Timer {};
+
+struct MapTimer {
+    std::optional<std::multimap<std::uint64_t, MapTimer*>::iterator> m_it{};
+};
+
+template <typename F>
+static void run(const std::string& name, const std::size_t num_ops, F f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    fmt::print("{:<40} {:>10.1f} ns/op\n", name, elapsed / static_cast<double>(num_ops));
+}
+
+int main(int argc, char** argv) {
+    const std::size_t num_timers = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 50000;
+    const std::size_t num_rounds = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100;
+    fmt::print("{} timers, {} rounds\n", num_timers, num_rounds);
+
+    // Millisecond ticks: keepalives in 2 minutes, request timeouts in a few seconds
+    std::mt19937_64 rng{1};
+    std::vector<std::uint64_t> delays(num_timers * num_rounds);
+    for (auto& d : delays) {
+        d = rng() % 2 == 0 ? 120000 : 1000 + rng() % 10000;
+    }
+    const std::size_t num_ops = delays.size();
+    std::size_t fired = 0;
+
+    // Each round re-arms every timer, then time moves on a little and the ones due fire
+    run("timing wheel", num_ops, [&]() {
+        timerwheel::Wheel<WheelTimer> wheel{};
+        std::vector<WheelTimer> timers(num_timers);
+        std::uint64_t now = 0;
+        for (std::size_t r = 0; r < num_rounds; r++) {
+            for (std::size_t i = 0; i < num_timers; i++) {
+                wheel.schedule(&timers[i], now + delays[r * num_timers + i]);
+            }
+            now += 1500;
+            wheel.advance(now, [&](WheelTimer*) { fired++; });
+        }
+    });
+
+    run("std::multimap", num_ops, [&]() {
+        std::multimap<std::uint64_t, MapTimer*> map{};
+        std::vector<MapTimer> timers(num_timers);
+        std::uint64_t now = 0;
+        for (std::size_t r = 0; r < num_rounds; r++) {
+            for (std::size_t i = 0; i < num_timers; i++) {
+                auto& t = timers[i];
+                if (t.m_it.has_value()) {
+                    map.erase(t.m_it.value());
+                }
+                t.m_it = map.emplace(now + delays[r * num_timers + i], &t);
+            }
+            now += 1500;
+            while (!map.empty() && map.begin()->first <= now) {
+                map.begin()->second->m_it.reset();
+                map.erase(map.begin());
+                fired++;
+            }
+        }
+    });
+
+    fmt::print("{} timers fired\n", fired);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+#include "event_log.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace tt::log {
+std::atomic<EventLog*> detail::event_log{nullptr};
+
+static std::atomic<std::uint64_t> s_next_log_id{1};
+// Whether an event log exists, which is claimed before it's file is touched, unlike `detail::event_log`.
+static std::atomic<bool> s_claimed{false};
+
+// The block the current thread appends to, in the log it recorded to last.
+struct BlockCursor {
+    std::uint64_t m_log = 0;
+    std::uint32_t m_thread = 0;
+    std::size_t m_at = 0;
+    std::size_t m_end = 0;
+};
+static thread_local BlockCursor t_cursor{};
+
+static std::uint64_t steady_ns() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+static std::runtime_error os_error(const std::string_view what) {
+    return std::runtime_error(std::string(what) + ": " + std::strerror(errno));
+}
+
+EventLog::EventLog(const std::string& path, const std::size_t size)
+    : m_fd(-1),
+      m_map(nullptr),
+      m_size(std::max(size - size % events::Block_Size, 2 * events::Block_Size)),
+      m_id(s_next_log_id++),
+      m_start_ns(steady_ns()),
+      m_next_block(events::Block_Size),
+      m_next_thread(0) {
+    // Before opening, so another log's file isn't truncated if it's the same
+    if (s_claimed.exchange(true, std::memory_order_acq_rel)) {
+        throw std::runtime_error("EventLog: Already recording to another one");
+    }
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        const auto error = os_error("EventLog: Failed to open " + path);
+        s_claimed.store(false, std::memory_order_release);
+        throw error;
+    }
+    // Sparse, so only what's written takes up space
+    if (::ftruncate(m_fd, static_cast<off_t>(m_size)) != 0) {
+        const auto error = os_error("EventLog: Failed to size " + path);
+        ::close(m_fd);
+        s_claimed.store(false, std::memory_order_release);
+        throw error;
+    }
+    void* map = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED) {
+        const auto error = os_error("EventLog: Failed to map " + path);
+        ::close(m_fd);
+        s_claimed.store(false, std::memory_order_release);
+        throw error;
+    }
+    m_map = static_cast<std::uint8_t*>(map);
+
+    const auto unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::system_clock::now().time_since_epoch())
+                             .count();
+    const events::FileHeader header{events::Magic, events::Version, events::Block_Size,
+                                    static_cast<std::uint64_t>(unix_ns), 0};
+    std::memcpy(m_map, &header, sizeof(header));
+    detail::event_log.store(this, std::memory_order_release);
+}
+
+EventLog::~EventLog() {
+    detail::event_log.store(nullptr, std::memory_order_release);
+    const auto used = std::min(m_next_block.load(), m_size);
+    ::munmap(m_map, m_size);
+    // Failing to shrink only wastes (sparse) space
+    [[maybe_unused]] const auto truncated = ::ftruncate(m_fd, static_cast<off_t>(used));
+    ::close(m_fd);
+    s_claimed.store(false, std::memory_order_release);
+}
+
+std::uint64_t EventLog::dropped() const {
+    auto* header = reinterpret_cast<events::FileHeader*>(m_map);
+    return std::atomic_ref<std::uint64_t>(header->m_dropped).load(std::memory_order_relaxed);
+}
+
+void EventLog::record(const Subsystem subsystem, const Event event, const std::uint64_t* args,
+                      const std::size_t num_args) {
+    const auto time = steady_ns() - m_start_ns;
+    auto& c = t_cursor;
+    if (c.m_log != m_id) {
+        c = BlockCursor{m_id, m_next_thread++, 0, 0};
+    }
+    const std::size_t len = sizeof(events::EventHeader) + num_args * sizeof(std::uint64_t);
+    if (c.m_end - c.m_at < len) {
+        // The rest of the block stays zeroed, which marks it as unused
+        const auto block = m_next_block.fetch_add(events::Block_Size, std::memory_order_relaxed);
+        if (block + events::Block_Size > m_size) {
+            auto* header = reinterpret_cast<events::FileHeader*>(m_map);
+            std::atomic_ref<std::uint64_t>(header->m_dropped).fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+#ifdef MADV_POPULATE_WRITE
+        // One call for the whole block, rather than a page fault for each page of it. Best effort.
+        ::madvise(m_map + block, events::Block_Size, MADV_POPULATE_WRITE);
+#endif
+        c.m_at = block;
+        c.m_end = block + events::Block_Size;
+    }
+
+    auto* at = m_map + c.m_at;
+    const events::EventHeader header{time, c.m_thread, Event::None, static_cast<std::uint8_t>(subsystem),
+                                     static_cast<std::uint8_t>(num_args)};
+    std::memcpy(at, &header, sizeof(header));
+    if (num_args > 0) {
+        std::memcpy(at + sizeof(header), args, num_args * sizeof(std::uint64_t));
+    }
+    std::atomic_ref<Event>(reinterpret_cast<events::EventHeader*>(at)->m_event).store(event, std::memory_order_release);
+    c.m_at += len;
+}
+
+std::string_view event_name(const Event event) {
+    switch (event) {
+        case Event::None:
+            return "None";
+        case Event::PeerConnected:
+            return "PeerConnected";
+        case Event::MessageSent:
+            return "MessageSent";
+        case Event::MessageReceived:
+            return "MessageReceived";
+        case Event::PeerError:
+            return "PeerError";
+        default:
+            return "Unknown";
+    }
+}
+
+std::string_view peer_op_name(const PeerOp op) {
+    switch (op) {
+        case PeerOp::Connect:
+            return "connect";
+        case PeerOp::Handshake:
+            return "handshake";
+        case PeerOp::Send:
+            return "send";
+        case PeerOp::Receive:
+            return "receive";
+        default:
+            return "unknown";
+    }
+}
+}  // namespace tt::log
@@ -0,0 +1,134 @@
+#pragma once
+
+//! A binary log of structured events, for analysing what happened (e.g. why a download was slow) after the fact.
+//!
+//! Events are a timestamp, an event ID and a few raw integers, written straight into a memory-mapped file, so
+//! recording one costs about as much as reading the clock. Nothing is formatted until the file is decoded by
+//! `toytorrent_decode_events`. The file survives the process crashing, as the mapping is shared with the kernel.
+//!
+//! File layout: A `FileHeader`, followed by blocks of `Block_Size` bytes. Each thread reserves blocks of it's own,
+//! and appends records to them: an `EventHeader` followed by it's arguments. The rest of a block after the last
+//! record is zeros, which reads as `Event::None`.
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "log.hpp"
+
+namespace tt::log {
+
+/// What happened. The arguments of each are listed. Peers are identified by `peer::Peer::event_key()`.
+enum class Event : std::uint16_t {
+    /// Marks the unused rest of a block.
+    None = 0,
+    /// A connection to a peer was established, and handshaked. (peer, address high half, address low half, port)
+    /// The address is IPv6 (or v4-mapped), in network byte order.
+    PeerConnected,
+    /// A message was sent to a peer. (peer, type, payload length, first three 32-bit payload fields)
+    /// Fields the payload doesn't have are 0. For requests and pieces, they're the piece index and offset.
+    MessageSent,
+    /// A message was received from a peer. Same as `MessageSent`.
+    MessageReceived,
+    /// Talking to a peer failed. (peer, `PeerOp`)
+    PeerError,
+};
+
+/// What was being done when `Event::PeerError` happened.
+enum class PeerOp : std::uint8_t { Connect, Handshake, Send, Receive };
+
+/// Events with at most this many arguments can be recorded.
+const std::size_t Max_Event_Args = 6;
+
+namespace events {
+const std::array<char, 8> Magic = {'T', 'T', 'E', 'V', 'E', 'N', 'T', 'S'};
+const std::uint32_t Version = 1;
+/// Blocks threads write to. Also where the first block starts, so they're page-aligned.
+const std::size_t Block_Size = 64 * 1024;
+
+struct FileHeader {
+    std::array<char, 8> m_magic;
+    std::uint32_t m_version;
+    std::uint32_t m_block_size;
+    /// Wall clock time at the time event timestamps count from, in nanoseconds since the Unix epoch.
+    std::uint64_t m_start_unix_ns;
+    /// Events that didn't fit into the file anymore.
+    std::uint64_t m_dropped;
+};
+
+struct EventHeader {
+    /// Nanoseconds since the file was created.
+    std::uint64_t m_time_ns;
+    /// Small number for the thread that recorded the event, counting up from 0 in the order threads first did so.
+    std::uint32_t m_thread;
+    /// Written last, so a record that's torn by a crash reads as the end of the block.
+    Event m_event;
+    /// A `Subsystem`.
+    std::uint8_t m_subsystem;
+    std::uint8_t m_num_args;
+};
+static_assert(sizeof(EventHeader) == 16);
+}  // namespace events
+
+/// Records events into a file while it exists.
+///
+/// There can only be one at a time, which all threads record to. It must only be destroyed once no thread records
+/// events anymore.
+class EventLog {
+   public:
+    /// Default size of the file. It's sparse, so this is only an upper bound of what's used.
+    static const std::size_t Default_Size = 256 * 1024 * 1024;
+
+    /// Create (or truncate) the file at `path`, and start recording to it. Throws `std::runtime_error` on failure,
+    /// or if another `EventLog` exists.
+    explicit EventLog(const std::string& path, const std::size_t size = Default_Size);
+    EventLog(const EventLog&) = delete;
+    EventLog& operator=(const EventLog&) = delete;
+    /// Stop recording, and shrink the file to what's used.
+    ~EventLog();
+
+    /// Events dropped so far, as the file was full.
+    std::uint64_t dropped() const;
+
+    /// Append an event. Lock-free, and allocation-free apart from the first event of each thread.
+    void record(const Subsystem subsystem, const Event event, const std::uint64_t* args, const std::size_t num_args);
+
+   private:
+    int m_fd;
+    std::uint8_t* m_map;
+    std::size_t m_size;
+    /// Identifies this log in the threads' block caches.
+    std::uint64_t m_id;
+    std::uint64_t m_start_ns;
+    /// Offset of the next free block.
+    std::atomic<std::size_t> m_next_block;
+    std::atomic<std::uint32_t> m_next_thread;
+};
+
+namespace detail {
+extern std::atomic<EventLog*> event_log;
+}
+
+/// Whether events are being recorded.
+inline bool events_enabled() { return detail::event_log.load(std::memory_order_relaxed) != nullptr; }
+
+/// Record an event, if events are being recorded. All arguments are converted to 64-bit unsigned integers.
+template <typename... Args>
+void event(const Subsystem subsystem, const Event event, const Args... args) {
+    static_assert(sizeof...(Args) <= Max_Event_Args);
+    auto* l = detail::event_log.load(std::memory_order_acquire);
+    if (l == nullptr) {
+        return;
+    }
+    const std::array<std::uint64_t, sizeof...(Args)> raw = {static_cast<std::uint64_t>(args)...};
+    l->record(subsystem, event, raw.data(), raw.size());
+}
+
+/// Names for decoding.
+std::string_view event_name(const Event event);
+std::string_view peer_op_name(const PeerOp op);
+
+}  // namespace tt::log
@@ -0,0 +1,244 @@
+#include "io.hpp"
+
+#include <fmt/core.h>
+
+extern "C" {
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "job.hpp"
+#include "reusable/smolsocket.hpp"
+#include "task.hpp"
+
+namespace tt::io {
+
+// Events handled per call to epoll_wait().
+const std::size_t Max_Events = 256;
+
+Exception::Exception(const std::string_view& msg) : m_msg(msg) {}
+
+const char* Exception::what() const noexcept { return this->m_msg.c_str(); }
+
+Reactor::Wait::Wait(Reactor& reactor, const int fd, const std::uint32_t events,
+                    const std::optional<std::chrono::milliseconds> timeout)
+    : m_reactor(reactor), m_fd(fd), m_events(events), m_deadline() {
+    if (timeout.has_value()) {
+        m_deadline = Clock::now() + timeout.value();
+    }
+}
+
+void Reactor::Wait::await_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    m_queue = job::JobQueue::current();
+    m_priority = job::JobQueue::current_priority();
+    if (m_queue == nullptr) {
+        throw Exception("io::Reactor: Can only wait from coroutines running as a job");
+    }
+    m_reactor.register_wait(*this);
+}
+
+Reactor::Reactor()
+    : m_epoll_fd(-1),
+      m_wake_fd(-1),
+      m_mutex(),
+      m_timers(),
+      m_epoch(Clock::now()),
+      m_stopping(false),
+      m_thread() {
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd == -1) {
+        throw Exception(fmt::format("io::Reactor: Failed to create epoll instance: {}", strerror(errno)));
+    }
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wake_fd == -1) {
+        const int err = errno;
+        close(m_epoll_fd);
+        throw Exception(fmt::format("io::Reactor: Failed to create eventfd: {}", strerror(err)));
+    }
+    // The wakeup is told apart from waits by it's lack of a `Wait`
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &ev);
+    m_thread = std::thread(&Reactor::run, this);
+}
+
+Reactor::~Reactor() {
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        m_stopping = true;
+    }
+    wake();
+    m_thread.join();
+    close(m_wake_fd);
+    close(m_epoll_fd);
+}
+
+Reactor::Wait Reactor::readable(const int fd, const std::optional<std::chrono::milliseconds> timeout) {
+    return Wait{*this, fd, EPOLLIN | EPOLLRDHUP, timeout};
+}
+
+Reactor::Wait Reactor::writable(const int fd, const std::optional<std::chrono::milliseconds> timeout) {
+    return Wait{*this, fd, EPOLLOUT, timeout};
+}
+
+Reactor::Wait Reactor::sleep_for(const std::chrono::milliseconds duration) { return Wait{*this, -1, 0, duration}; }
+
+void Reactor::register_wait(Wait& w) {
+    bool earliest = false;
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        if (w.m_deadline.has_value()) {
+            const auto before = m_timers.next_event();
+            m_timers.schedule(&w, tick_at(w.m_deadline.value()));
+            earliest = m_timers.next_event() != before;
+        }
+        if (w.m_fd >= 0) {
+            epoll_event ev{};
+            ev.events = w.m_events | EPOLLONESHOT;
+            ev.data.ptr = &w;
+            if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, w.m_fd, &ev) == -1) {
+                const int err = errno;
+                m_timers.cancel(&w);
+                throw Exception(fmt::format("io::Reactor: Failed to wait for fd {}: {}", w.m_fd, strerror(err)));
+            }
+        }
+    }
+    // From here on, `w` may already be resumed and gone
+    if (earliest) {
+        wake();
+    }
+}
+
+void Reactor::wake() {
+    const std::uint64_t one = 1;
+    // Can only fail if the counter is about to overflow, in which case the reactor is woken up anyways
+    [[maybe_unused]] const auto ret = write(m_wake_fd, &one, sizeof(one));
+}
+
+void Reactor::run() {
+    std::array<epoll_event, Max_Events> events{};
+    std::vector<Wait*> ready{};
+    while (true) {
+        int timeout_ms = -1;
+        {
+            const std::lock_guard<std::mutex> lock{m_mutex};
+            if (m_stopping) {
+                break;
+            }
+            if (const auto next = m_timers.next_event()) {
+                const auto until = std::chrono::ceil<std::chrono::milliseconds>(
+                    m_epoch + std::chrono::milliseconds(next.value()) - Clock::now());
+                timeout_ms = static_cast<int>(std::clamp<std::int64_t>(until.count(), 0, INT_MAX));
+            }
+        }
+        const int n = epoll_wait(m_epoll_fd, events.data(), static_cast<int>(events.size()), timeout_ms);
+        if (n == -1) {
+            // Interrupted by a signal, just try again
+            continue;
+        }
+
+        {
+            const std::lock_guard<std::mutex> lock{m_mutex};
+            for (std::size_t i = 0; i < static_cast<std::size_t>(n); i++) {
+                auto* w = static_cast<Wait*>(events.at(i).data.ptr);
+                if (w == nullptr) {
+                    std::uint64_t count = 0;
+                    [[maybe_unused]] const auto ret = read(m_wake_fd, &count, sizeof(count));
+                    continue;
+                }
+                epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, w->m_fd, nullptr);
+                m_timers.cancel(w);
+                w->m_ready = true;
+                ready.push_back(w);
+            }
+            // Only whole ticks have passed
+            const auto now = std::chrono::floor<std::chrono::milliseconds>(Clock::now() - m_epoch);
+            m_timers.advance(static_cast<std::uint64_t>(now.count()), [&](Wait* w) {
+                if (w->m_fd >= 0) {
+                    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, w->m_fd, nullptr);
+                }
+                w->m_ready = false;
+                ready.push_back(w);
+            });
+        }
+
+        for (auto* w : ready) {
+            job::resume_on(*w->m_queue, w->m_handle, w->m_priority);
+        }
+        ready.clear();
+    }
+}
+
+std::uint64_t Reactor::tick_at(const Clock::time_point t) const {
+    const auto since = std::chrono::ceil<std::chrono::milliseconds>(t - m_epoch);
+    return static_cast<std::uint64_t>(std::max<std::int64_t>(since.count(), 0));
+}
+
+// Time left until the deadline, if any.
+static std::optional<std::chrono::milliseconds> remaining(
+    const std::optional<std::chrono::steady_clock::time_point> deadline) {
+    if (!deadline.has_value()) {
+        return {};
+    }
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline.value() - std::chrono::steady_clock::now());
+    return std::max(left, std::chrono::milliseconds(0));
+}
+
+static std::optional<std::chrono::steady_clock::time_point> deadline_after(
+    const std::optional<std::chrono::milliseconds> timeout) {
+    if (!timeout.has_value()) {
+        return {};
+    }
+    return std::chrono::steady_clock::now() + timeout.value();
+}
+
+job::Task<std::vector<std::uint8_t>> recv_exact(Reactor& reactor, smolsocket::Sock& sock, const std::size_t len,
+                                                const std::optional<std::chrono::milliseconds> timeout) {
+    const auto deadline = deadline_after(timeout);
+    std::vector<std::uint8_t> buf(len);
+    std::size_t recvd = 0;
+    while (recvd < len) {
+        const auto got = sock.recv_some(buf.data() + recvd, len - recvd);
+        if (got.has_value()) {
+            recvd += got.value();
+            continue;
+        }
+        if (!co_await reactor.readable(sock.native_handle(), remaining(deadline))) {
+            throw Exception(fmt::format("io::recv_exact(): Timed out after receiving {} of {} bytes", recvd, len));
+        }
+    }
+    co_return buf;
+}
+
+job::Task<void> send_all(Reactor& reactor, smolsocket::Sock& sock, std::vector<std::uint8_t> data,
+                         const std::optional<std::chrono::milliseconds> timeout) {
+    const auto deadline = deadline_after(timeout);
+    std::size_t sent = 0;
+    while (sent < data.size()) {
+        const auto n = sock.send_some(data.data() + sent, data.size() - sent);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (!co_await reactor.writable(sock.native_handle(), remaining(deadline))) {
+            throw Exception(fmt::format("io::send_all(): Timed out after sending {} of {} bytes", sent, data.size()));
+        }
+    }
+}
+}  // namespace tt::io
@@ -0,0 +1,105 @@
+#pragma once
+
+//! Waiting for I/O and timers from coroutine jobs (see task.hpp), without tying up a worker thread.
+//! A reactor thread waits for all of them at once using epoll, and resumes coroutines on their job queue when ready.
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "job.hpp"
+#include "reusable/smolsocket.hpp"
+#include "reusable/timerwheel.hpp"
+#include "task.hpp"
+
+namespace tt::io {
+/// Thrown on I/O-related failures.
+class Exception : public std::exception {
+   public:
+    std::string m_msg{};
+    Exception(const std::string_view&);
+    [[nodiscard]] const char* what() const noexcept override;
+};
+
+/// Waits for file descriptors to become ready and for timers to expire, on a thread of it's own.
+///
+/// Coroutines wait by awaiting `readable()`, `writable()` or `sleep_for()`, and are then resumed on the job queue
+/// they were running on, with the priority they were running with.
+/// All waits have to be finished before the reactor is destroyed.
+///
+/// Timeouts are kept on a timing wheel with millisecond ticks, so that each connection can have several
+/// (keepalives, request timeouts, ...) at practically no cost.
+class Reactor {
+   public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Awaitable returned by the waiting functions. Yields true if the file descriptor is ready, false on timeout.
+    class Wait : public timerwheel::Timer {
+       public:
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() const noexcept { return m_ready; }
+
+       private:
+        friend class Reactor;
+        Wait(Reactor& reactor, const int fd, const std::uint32_t events,
+             const std::optional<std::chrono::milliseconds> timeout);
+
+        Reactor& m_reactor;
+        int m_fd;
+        std::uint32_t m_events;
+        std::optional<Clock::time_point> m_deadline;
+        std::coroutine_handle<> m_handle{};
+        job::JobQueue* m_queue = nullptr;
+        job::Priority m_priority = job::Priority::Network;
+        bool m_ready = false;
+    };
+
+    Reactor();
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+    ~Reactor();
+
+    /// Wait until `fd` is readable. Only one coroutine may wait for a file descriptor at a time.
+    [[nodiscard]] Wait readable(const int fd, const std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+    /// Wait until `fd` is writable. Only one coroutine may wait for a file descriptor at a time.
+    [[nodiscard]] Wait writable(const int fd, const std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+    /// Wait for the given time.
+    [[nodiscard]] Wait sleep_for(const std::chrono::milliseconds duration);
+
+   private:
+    int m_epoll_fd;
+    /// Wakes the reactor thread up, to stop or to pick up an earlier timer.
+    int m_wake_fd;
+    /// Guards `m_timers` and the registrations of waits, so they're only resumed once they're fully set up.
+    std::mutex m_mutex;
+    /// Counts milliseconds since `m_epoch`.
+    timerwheel::Wheel<Wait> m_timers;
+    Clock::time_point m_epoch;
+    bool m_stopping;
+    std::thread m_thread;
+
+    void run();
+    void register_wait(Wait& w);
+    void wake();
+    /// The first tick at or after `t`.
+    std::uint64_t tick_at(const Clock::time_point t) const;
+};
+
+/// Receive exactly `len` bytes, suspending while none are available.
+/// Throws if the connection fails, is closed, or the data didn't arrive in time.
+job::Task<std::vector<std::uint8_t>> recv_exact(Reactor& reactor, smolsocket::Sock& sock, const std::size_t len,
+                                                const std::optional<std::chrono::milliseconds> timeout);
+/// Send all of `data`, suspending while the socket's buffer is full.
+/// Throws if the connection fails, or the data couldn't be sent in time.
+job::Task<void> send_all(Reactor& reactor, smolsocket::Sock& sock, std::vector<std::uint8_t> data,
+                         const std::optional<std::chrono::milliseconds> timeout);
+}  // namespace tt::io
@@ -1,15 +1,412 @@
 #include "job.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "reusable/smallalloc.hpp"
+#include "trace.hpp"
+
 namespace tt::job {
-JobQueue::JobQueue() noexcept : m_jobs(std::deque<std::unique_ptr<IJob>>()) {}
+// How often an idle worker looks for work again before going to sleep.
+const std::size_t Idle_Spins = 64;
+// Sleeping workers are woken up on new jobs, this is just a safety net.
+const std::chrono::milliseconds Idle_Sleep{10};
+// Stride of each priority class, i.e. inversely proportional to it's share of the workers' time when all are busy.
+// With these, a Control job is taken 16 times as often as a Background one.
+const std::array<std::uint64_t, Num_Priorities> Strides = {1, 4, 16};
+
+// The queue the current thread is a worker of, if any, and which worker it is.
+static thread_local JobQueue* t_queue = nullptr;
+static thread_local std::size_t t_worker = 0;
+static thread_local Priority t_priority = Priority::Network;
+// Jobs made runnable by this thread, to pick the ones whose wait time is sampled.
+static thread_local std::size_t t_made_runnable = 0;
+
+static std::size_t class_of(const IJob* j) { return static_cast<std::size_t>(j->priority()); }
+
+Priority IJob::priority() const { return Priority::Network; }
+
+void* IJob::operator new(const std::size_t size) { return smallalloc::allocate(size); }
+
+void IJob::operator delete(void* p, const std::size_t size) noexcept { smallalloc::deallocate(p, size); }
+
+void IJob::set_deadline(const Clock::time_point deadline) { m_deadline = deadline; }
+
+void IJob::depends_on(IJob& dep) {
+    m_blockers++;
+    dep.m_dependents.push_back(this);
+}
+
+IJob& IJob::then(std::unique_ptr<IJob> next) {
+    auto& n = *next;
+    n.depends_on(*this);
+    m_continuations.push_back(std::move(next));
+    return n;
+}
+
+JobQueue::JobQueue() noexcept : JobQueue(std::max<std::size_t>(std::thread::hardware_concurrency(), 1)) {}
+
+JobQueue::JobQueue(const std::size_t num_workers) noexcept
+    : m_num_workers(std::max<std::size_t>(num_workers, 1)),
+      m_workers(),
+      m_classes(),
+      m_num_deadlined(0),
+      m_mutex(),
+      m_cv(),
+      m_pending(0),
+      m_sleeping(0),
+      m_error(),
+      m_tracer(nullptr) {
+    for (std::size_t i = 0; i < m_num_workers; i++) {
+        m_workers.push_back(std::make_unique<Worker>());
+    }
+}
+
+JobQueue::~JobQueue() {
+    // Jobs processing didn't get to. The workers' deques don't own theirs, and dependents are only referenced by the
+    // jobs they wait for, so these would leak otherwise.
+    std::vector<std::unique_ptr<IJob>> left{};
+    for (auto& w : m_workers) {
+        for (auto& d : w->m_deques) {
+            while (auto* j = d.pop()) {
+                left.emplace_back(j);
+            }
+        }
+    }
+    for (auto& c : m_classes) {
+        std::move(c.m_jobs.begin(), c.m_jobs.end(), std::back_inserter(left));
+        std::move(c.m_deadlined.begin(), c.m_deadlined.end(), std::back_inserter(left));
+    }
+    while (!left.empty()) {
+        const auto j = std::move(left.back());
+        left.pop_back();
+        for (auto* d : j->m_dependents) {
+            if (unblock(d)) {
+                left.emplace_back(d);
+            }
+        }
+    }
+}
+
+void JobQueue::enqueue(std::unique_ptr<IJob> j) {
+    m_pending++;
+    // From here on, the job is owned by the queue until it's taken out again
+    auto* raw = j.release();
+    if (!unblock(raw)) {
+        // The last dependency to finish pushes it
+        return;
+    }
+    make_runnable(raw);
+}
+
+void JobQueue::process() {
+    std::vector<std::thread> threads{};
+    threads.reserve(m_num_workers);
+    for (std::size_t i = 0; i < m_num_workers; i++) {
+        threads.emplace_back(&JobQueue::work, this, i);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (m_error) {
+        std::rethrow_exception(std::exchange(m_error, nullptr));
+    }
+}
+
+std::size_t JobQueue::num_workers() const { return m_num_workers; }
+
+void JobQueue::retain() { m_pending++; }
+
+void JobQueue::release() { finish_one(); }
+
+void JobQueue::fail(std::exception_ptr error) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    if (!m_error) {
+        m_error = std::move(error);
+    }
+}
+
+JobQueue* JobQueue::current() { return t_queue; }
+
+Priority JobQueue::current_priority() { return t_priority; }
+
+JobQueue::Stats JobQueue::stats(const Priority p) const {
+    const auto cls = static_cast<std::size_t>(p);
+    const auto& c = m_classes.at(cls);
+    std::uint64_t started = 0;
+    for (const auto& w : m_workers) {
+        started += w->m_started[cls].load(std::memory_order_relaxed);
+    }
+    return Stats{
+        c.m_depth.load(),
+        started,
+        c.m_sampled.load(),
+        std::chrono::nanoseconds(c.m_total_wait_ns.load()),
+        std::chrono::nanoseconds(c.m_max_wait_ns.load()),
+    };
+}
+
+void JobQueue::set_tracer(Tracer* tracer) { m_tracer = tracer; }
+
+bool JobQueue::later_deadline(const std::unique_ptr<IJob>& a, const std::unique_ptr<IJob>& b) {
+    return a->m_deadline.value() > b->m_deadline.value();
+}
+
+void JobQueue::make_runnable(IJob* j) {
+    j->m_class = class_of(j);
+    auto& c = m_classes[j->m_class];
+    if (t_made_runnable++ % Wait_Sample_Interval == 0) {
+        j->m_runnable_at = Clock::now();
+    }
+    if (m_tracer != nullptr) {
+        j->m_queued_at = Clock::now();
+    }
+    // Counted before it can be taken, so the depth never drops below zero
+    c.m_depth++;
+    if (j->m_deadline.has_value()) {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        c.m_deadlined.emplace_back(j);
+        std::push_heap(c.m_deadlined.begin(), c.m_deadlined.end(), later_deadline);
+        m_num_deadlined++;
+    } else if (t_queue == this) {
+        m_workers[t_worker]->m_deques[j->m_class].push(j);
+    } else {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        c.m_jobs.emplace_back(j);
+    }
+    wake_one();
+}
+
+IJob* JobQueue::take(const std::size_t worker) {
+    if (m_num_deadlined > 0) {
+        if (auto* j = take_overdue()) {
+            return j;
+        }
+    }
+
+    auto& pass = m_workers[worker]->m_pass;
+    // The class that's furthest behind it's share first, the more urgent one on ties
+    std::array<std::size_t, Num_Priorities> order{};
+    for (std::size_t i = 0; i < Num_Priorities; i++) {
+        // Insertion sort, as there's only a handful
+        std::size_t at = i;
+        for (; at > 0 && pass[order[at - 1]] > pass[i]; at--) {
+            order[at] = order[at - 1];
+        }
+        order[at] = i;
+    }
+
+    for (const auto cls : order) {
+        if (m_classes[cls].m_depth == 0) {
+            continue;
+        }
+        if (auto* j = take_from(worker, cls)) {
+            // Classes that had nothing to do don't bank their share for later
+            for (auto& p : pass) {
+                p = std::max(p, pass[cls]);
+            }
+            pass[cls] += Strides[cls];
+            return j;
+        }
+    }
+    return nullptr;
+}
+
+IJob* JobQueue::take_from(const std::size_t worker, const std::size_t cls) {
+    if (auto* j = m_workers[worker]->m_deques[cls].pop()) {
+        return taken(j);
+    }
+    {
+        auto& c = m_classes[cls];
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        if (!c.m_deadlined.empty()) {
+            std::pop_heap(c.m_deadlined.begin(), c.m_deadlined.end(), later_deadline);
+            auto* j = c.m_deadlined.back().release();
+            c.m_deadlined.pop_back();
+            m_num_deadlined--;
+            return taken(j);
+        }
+        if (!c.m_jobs.empty()) {
+            auto* j = c.m_jobs.front().release();
+            c.m_jobs.pop_front();
+            return taken(j);
+        }
+    }
+    // Start with our neighbour, so that thieves spread out over the victims
+    for (std::size_t i = 1; i < m_num_workers; i++) {
+        if (auto* j = m_workers[(worker + i) % m_num_workers]->m_deques[cls].steal()) {
+            return taken(j);
+        }
+    }
+    return nullptr;
+}
+
+IJob* JobQueue::take_overdue() {
+    const auto now = Clock::now();
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    Class* earliest = nullptr;
+    for (auto& c : m_classes) {
+        if (c.m_deadlined.empty() || c.m_deadlined.front()->m_deadline.value() > now) {
+            continue;
+        }
+        if (earliest == nullptr || later_deadline(earliest->m_deadlined.front(), c.m_deadlined.front())) {
+            earliest = &c;
+        }
+    }
+    if (earliest == nullptr) {
+        return nullptr;
+    }
+    std::pop_heap(earliest->m_deadlined.begin(), earliest->m_deadlined.end(), later_deadline);
+    auto* j = earliest->m_deadlined.back().release();
+    earliest->m_deadlined.pop_back();
+    m_num_deadlined--;
+    return taken(j);
+}
+
+IJob* JobQueue::taken(IJob* j) {
+    auto& c = m_classes[j->m_class];
+    c.m_depth--;
+    count_started(j->m_class);
+    if (!j->m_runnable_at.has_value()) {
+        return j;
+    }
+    const auto wait = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - j->m_runnable_at.value()).count());
+    c.m_sampled.fetch_add(1, std::memory_order_relaxed);
+    c.m_total_wait_ns.fetch_add(wait, std::memory_order_relaxed);
+    auto max = c.m_max_wait_ns.load(std::memory_order_relaxed);
+    while (wait > max && !c.m_max_wait_ns.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {
+    }
+    return j;
+}
+
+void JobQueue::count_started(const std::size_t cls) {
+    auto& started = m_workers[t_worker]->m_started[cls];
+    started.store(started.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+bool JobQueue::has_work() const {
+    return std::any_of(m_classes.begin(), m_classes.end(), [](const auto& c) { return c.m_depth > 0; });
+}
+
+bool JobQueue::more_urgent_waiting(const Priority p) const {
+    for (std::size_t cls = 0; cls < static_cast<std::size_t>(p); cls++) {
+        if (m_classes[cls].m_depth > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobQueue::work(const std::size_t worker) {
+    t_queue = this;
+    t_worker = worker;
+    std::size_t idle_spins = 0;
+    std::unique_ptr<IJob> next{};
+    while (true) {
+        auto j = next ? std::move(next) : std::unique_ptr<IJob>(take(worker));
+        if (j) {
+            next = run(std::move(j));
+            idle_spins = 0;
+            continue;
+        }
+        if (m_pending == 0) {
+            break;
+        }
+        if (idle_spins < Idle_Spins) {
+            idle_spins++;
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_sleeping++;
+        // Pairs with the fence in `wake_one()`: either we see the new job, or the enqueuer sees us sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_cv.wait_for(lock, Idle_Sleep, [&]() { return m_pending == 0 || has_work(); });
+        m_sleeping--;
+        idle_spins = 0;
+    }
+    t_queue = nullptr;
+    t_priority = Priority::Network;
+}
+
+std::unique_ptr<IJob> JobQueue::run(std::unique_ptr<IJob> j) {
+    bool failed = j->m_cancelled;
+    if (!failed) {
+        t_priority = j->priority();
+        const auto started = m_tracer != nullptr ? Clock::now() : Clock::time_point{};
+        try {
+            j->process();
+        } catch (...) {
+            failed = true;
+            fail(std::current_exception());
+        }
+        if (m_tracer != nullptr) {
+            m_tracer->record(*j, t_worker, j->m_queued_at, started, Clock::now());
+        }
+    }
+
+    std::unique_ptr<IJob> next{};
+    const auto on_runnable = [&](IJob* d) {
+        if (!next && !more_urgent_waiting(d->priority())) {
+            next.reset(d);
+            // Didn't have to wait at all
+            count_started(class_of(d));
+            if (m_tracer != nullptr) {
+                d->m_queued_at = Clock::now();
+            }
+        } else {
+            make_runnable(d);
+        }
+    };
+    for (auto* d : j->m_dependents) {
+        if (failed) {
+            d->m_cancelled = true;
+        }
+        if (unblock(d)) {
+            on_runnable(d);
+        }
+    }
+    for (auto& c : j->m_continuations) {
+        m_pending++;
+        auto* raw = c.release();
+        if (unblock(raw)) {
+            on_runnable(raw);
+        }
+    }
+
+    // Jobs enqueued by this one are already counted, so this only hits zero once everything is done
+    j.reset();
+    finish_one();
+    return next;
+}
 
-void JobQueue::enqueue(std::unique_ptr<IJob> j) { m_jobs.push_back(std::move(j)); }
+bool JobQueue::unblock(IJob* j) { return j->m_blockers.fetch_sub(1) == 1; }
 
-std::optional<std::unique_ptr<IJob>> JobQueue::deque() { return {}; }
+void JobQueue::finish_one() {
+    if (m_pending.fetch_sub(1) == 1) {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        m_cv.notify_all();
+    }
+}
 
-void JobQueue::process() {}
-}  // namespace tt::job
\ No newline at end of file
+void JobQueue::wake_one() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping > 0) {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        m_cv.notify_one();
+    }
+}
+}  // namespace tt::job
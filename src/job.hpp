@@ -1,48 +1,227 @@
 #pragma once
 
 //! This module implements a job system, where work units can be queued up and processed.
-//! It's not thread-safe (yet).
+//! Jobs are processed in parallel by a pool of worker threads, which steal work from each other when idle.
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
+#include <exception>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <vector>
 
+#include "reusable/stealdeque.hpp"
+
 namespace tt::job {
+using Clock = std::chrono::steady_clock;
+
+/// How urgent a job is, from most to least.
+///
+/// When there's more work than workers, each class gets a share of the workers' time according to it's weight,
+/// so background work can't hold up the control plane, but isn't starved by it either.
+enum class Priority : std::uint8_t {
+    /// Short jobs others wait on, like handshakes and tracker announces.
+    Control,
+    /// Moving data to and from peers.
+    Network,
+    /// CPU- or disk-heavy bulk work, like hashing and flushing pieces.
+    Background,
+};
+const std::size_t Num_Priorities = 3;
+/// See `JobQueue::Stats`.
+const std::size_t Wait_Sample_Interval = 16;
+
+class Tracer;
+
 /// The key type of this module.
 ///
 /// Jobs can be submitted to job queues for processing,
 /// and they can enqueue new jobs.
 ///
 /// This abstraction is used to schedule all tasks in the program.
+///
+/// Jobs may depend on other jobs, in which case they only become runnable once all of those have finished.
+/// If a dependency throws, the jobs depending on it are cancelled and never run.
 class IJob {
    public:
+    IJob() = default;
+    IJob(const IJob&) = delete;
+    IJob& operator=(const IJob&) = delete;
     /// Drive this job to completion.
-    /// Currently, this will tie up an entire thread.
-    /// Resumption may be implemented later.
+    /// This ties up a worker thread while it runs, so jobs that wait a lot should be coroutines (see `CoroJob`).
     virtual void process() = 0;
     virtual ~IJob() = default;
+    /// Which class this job is scheduled in. Network by default.
+    virtual Priority priority() const;
+
+    /// Jobs are allocated from per-thread pools, as they are created and destroyed at high rates on many threads.
+    /// That only covers the job itself: enqueueing may still allocate from the global allocator, e.g. as the queue's
+    /// deque grows or continuations are added to `m_dependents`.
+    static void* operator new(const std::size_t size);
+    static void operator delete(void* p, const std::size_t size) noexcept;
+
+    /// Run this job as soon as possible after `deadline`, ahead of it's class' other jobs.
+    ///
+    /// Jobs past their deadline are taken before all others, regardless of their class.
+    void set_deadline(const Clock::time_point deadline);
+
+    /// Only run this job once `dep` has finished.
+    ///
+    /// `dep` must not have finished yet: it's either not enqueued yet, or the job currently running this.
+    /// Both jobs have to be enqueued to the same queue.
+    void depends_on(IJob& dep);
+    /// Run `next` once this job has finished, preferably on the same worker thread.
+    ///
+    /// The job takes ownership of `next`, and enqueues it when finished. Returns `next`, for chaining.
+    IJob& then(std::unique_ptr<IJob> next);
+
+   private:
+    friend class JobQueue;
+    /// Unfinished dependencies, plus one until the job is enqueued.
+    std::atomic<std::size_t> m_blockers{1};
+    /// Set if a dependency failed.
+    std::atomic<bool> m_cancelled{false};
+    /// Jobs depending on this one. Not owned.
+    std::vector<IJob*> m_dependents{};
+    /// Jobs to enqueue once this one has finished.
+    std::vector<std::unique_ptr<IJob>> m_continuations{};
+    std::optional<Clock::time_point> m_deadline{};
+    /// `priority()`, as of when the job was queued up.
+    std::size_t m_class = 0;
+    /// When the job was queued up to run, if it's wait time is sampled for the metrics.
+    std::optional<Clock::time_point> m_runnable_at{};
+    /// When the job was queued up to run, only kept while tracing.
+    Clock::time_point m_queued_at{};
 };
 
 /// Where jobs to be processed go.
+///
+/// Thread-safe. Each worker has it's own deque, which jobs enqueued from that worker go to without taking any locks.
+/// Jobs enqueued from other threads go to a shared queue. Idle workers steal from the others.
+/// Once a job finished, the first of it's dependents that became runnable is run right away on the same worker, so
+/// it finds the data it works on in the cache, unless more urgent jobs are waiting. The others go to the worker's
+/// deque.
+///
+/// Each priority class has it's own queues. Workers pick the class to take from by stride scheduling, so under load
+/// each class gets jobs run in proportion to it's weight. Within a class, jobs with deadlines go first.
 class JobQueue {
    public:
+    /// Metrics of a priority class.
+    struct Stats {
+        /// Jobs waiting to be run right now.
+        std::size_t m_depth;
+        /// Jobs that have been run so far.
+        std::uint64_t m_started;
+        /// How long jobs waited between becoming runnable and being started, in total and at most.
+        /// To keep reading the clock off the hot path, only every `Wait_Sample_Interval`th job is timed.
+        std::uint64_t m_sampled;
+        std::chrono::nanoseconds m_total_wait;
+        std::chrono::nanoseconds m_max_wait;
+    };
+
+    /// Use as many workers as there are hardware threads.
     JobQueue() noexcept;
+    explicit JobQueue(const std::size_t num_workers) noexcept;
     JobQueue(JobQueue&) = delete;
     JobQueue operator=(JobQueue&) = delete;
     JobQueue(JobQueue&&) = delete;
     JobQueue& operator=(JobQueue&&) = delete;
+    ~JobQueue();
 
-    /// Enqueue a new job
+    /// Enqueue a new job. May be called from any thread, including from within jobs.
+    ///
+    /// Jobs with unfinished dependencies are held back until those are done.
     void enqueue(std::unique_ptr<IJob> j);
-    /// Process jobs until all done
+    /// Process jobs until all done, including the ones enqueued while processing.
+    ///
+    /// If any job threw, the first exception is rethrown once all others are done.
     void process();
+    /// Number of worker threads used by `process()`.
+    std::size_t num_workers() const;
+    /// Keep `process()` running while no jobs are queued, until a matching `release()`.
+    ///
+    /// For work that will enqueue jobs from elsewhere later, like suspended coroutines.
+    void retain();
+    void release();
+    /// Record an error for `process()` to rethrow, like one thrown by a job.
+    void fail(std::exception_ptr error);
+    /// The queue the calling thread is a worker of, or nullptr if it isn't one.
+    static JobQueue* current();
+    /// Priority of the job the calling thread is running, Network if it isn't running one.
+    static Priority current_priority();
+    /// Metrics of the given priority class, since the queue was created.
+    Stats stats(const Priority p) const;
+    /// Record every job run into `tracer` from now on, or stop recording if nullptr. Not owned.
+    ///
+    /// Only to be called while not processing. Without a tracer, all tracing costs is checking for one.
+    void set_tracer(Tracer* tracer);
 
    private:
-    std::deque<std::unique_ptr<IJob>> m_jobs;
+    struct Worker {
+        std::array<stealdeque::Deque<IJob>, Num_Priorities> m_deques;
+        /// Stride scheduling state: The class furthest behind is served next.
+        std::array<std::uint64_t, Num_Priorities> m_pass{};
+        /// Jobs of each class started by this worker. Atomic, as `stats()` reads them from other threads, but only
+        /// written by the worker, so incrementing needn't be a locked read-modify-write.
+        std::array<std::atomic<std::uint64_t>, Num_Priorities> m_started{};
+    };
+    struct Class {
+        /// Jobs enqueued from outside of the workers.
+        std::deque<std::unique_ptr<IJob>> m_jobs{};
+        /// Jobs with deadlines, as a heap with the earliest on top.
+        std::vector<std::unique_ptr<IJob>> m_deadlined{};
+        std::atomic<std::size_t> m_depth{0};
+        std::atomic<std::uint64_t> m_sampled{0};
+        std::atomic<std::uint64_t> m_total_wait_ns{0};
+        std::atomic<std::uint64_t> m_max_wait_ns{0};
+    };
+    std::size_t m_num_workers;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::array<Class, Num_Priorities> m_classes;
+    /// Jobs with deadlines, across all classes. Spares checking the clock if there are none.
+    std::atomic<std::size_t> m_num_deadlined;
+    /// Guards the classes' shared queues and `m_error`, and is what idle workers sleep on.
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    /// Jobs enqueued but not finished yet.
+    std::atomic<std::size_t> m_pending;
+    std::atomic<std::size_t> m_sleeping;
+    std::exception_ptr m_error;
+    Tracer* m_tracer;
 
-    /// Take a job to work on it
-    std::optional<std::unique_ptr<IJob>> deque();
+    /// Queue up a job whose dependencies are done.
+    void make_runnable(IJob* j);
+    /// Take a job to work on it, from the given worker's point of view. nullptr if there's none.
+    IJob* take(const std::size_t worker);
+    /// Take a job of the given class, nullptr if there's none.
+    IJob* take_from(const std::size_t worker, const std::size_t cls);
+    /// Take the job furthest past it's deadline, nullptr if there's none.
+    IJob* take_overdue();
+    /// Account for a job being taken out of it's class' queues.
+    IJob* taken(IJob* j);
+    /// Count a job as started by the calling worker.
+    void count_started(const std::size_t cls);
+    /// Whether any job is waiting to be taken.
+    bool has_work() const;
+    /// Whether jobs of a class more urgent than `p` are waiting.
+    bool more_urgent_waiting(const Priority p) const;
+    /// Orders the deadline heaps, putting the earliest deadline on top.
+    static bool later_deadline(const std::unique_ptr<IJob>& a, const std::unique_ptr<IJob>& b);
+    void work(const std::size_t worker);
+    /// Run the given job, or skip it if it was cancelled.
+    /// Returns one of it's dependents that became runnable, if any. The others are queued up.
+    std::unique_ptr<IJob> run(std::unique_ptr<IJob> j);
+    /// Drop one blocker of the job, which is owned by the queue. Returns whether it is runnable now.
+    static bool unblock(IJob* j);
+    void wake_one();
+    /// Count a job as done, waking up everyone once all are.
+    void finish_one();
 };
 
-}  // namespace tt::job
\ No newline at end of file
+}  // namespace tt::job
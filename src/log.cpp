@@ -3,27 +3,204 @@
 #include <fmt/color.h>
 #include <fmt/core.h>
 
-#include <iostream>
-#include <string_view>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace tt::log {
-void log(const Level level, const Subsystem subsystem, const std::string_view& msg) {
-    fmt::color color;
-    switch (level) {
-        case Level::Debug:
-            color = Debug_Color;
-            break;
-        case Level::Warning:
-            color = Warn_Color;
-            break;
-        case Level::Fatal:
-            color = Fatal_Color;
-            break;
-        default:
-            color = fmt::color::white;
-    }
-    fmt::print(fg(color), "[{}] [{}] {}\n", level, subsystem, msg);
-    std::cout.flush();
+// Messages each thread can have queued up before further ones are dropped.
+const std::size_t Queue_Size = 1024;
+// How often the writer looks for messages. Fatal ones are written out right away.
+const std::chrono::milliseconds Drain_Interval{5};
+
+std::atomic<Level> detail::min_level{Level::Debug};
+
+namespace {
+struct Record {
+    Level m_level;
+    Subsystem m_subsystem;
+    std::string m_msg;
+};
+
+// Single producer (the thread it belongs to), single consumer (whoever drains).
+class Queue {
+   public:
+    bool push(Record&& r) {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == Queue_Size) {
+            return false;
+        }
+        m_records[tail % Queue_Size] = std::move(r);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Call `f(Record&)` for everything queued up, and take it out of the queue.
+    template <typename F>
+    void drain(F&& f) {
+        auto head = m_head.load(std::memory_order_relaxed);
+        const auto tail = m_tail.load(std::memory_order_acquire);
+        for (; head != tail; head++) {
+            f(m_records[head % Queue_Size]);
+            // Free long messages now, rather than whenever the slot is reused
+            m_records[head % Queue_Size].m_msg = std::string{};
+        }
+        m_head.store(head, std::memory_order_release);
+    }
+
+    bool empty() const { return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire); }
+
+   private:
+    std::array<Record, Queue_Size> m_records{};
+    // Counting up forever, the slot is the remainder
+    std::atomic<std::uint64_t> m_head{0};
+    std::atomic<std::uint64_t> m_tail{0};
+};
+
+class Writer {
+   public:
+    Writer()
+        : m_mutex(), m_queues(), m_drain_mutex(), m_dropped(0), m_reported_dropped(0), m_exited(false), m_thread() {
+        // Whatever is left when the program exits is still written out, but nothing after, as stdout may be gone
+        std::atexit([]() { writer().drain(true); });
+        m_thread = std::thread([this]() {
+            while (true) {
+                std::this_thread::sleep_for(Drain_Interval);
+                drain();
+            }
+        });
+        m_thread.detach();
+    }
+
+    // Never destroyed, as threads may still log while static objects are destroyed on exit
+    static Writer& writer() {
+        static auto* w = new Writer();
+        return *w;
+    }
+
+    std::shared_ptr<Queue> add_queue() {
+        auto q = std::make_shared<Queue>();
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        m_queues.push_back(q);
+        return q;
+    }
+
+    void count_dropped() { m_dropped.fetch_add(1, std::memory_order_relaxed); }
+    std::uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    // Write out everything queued up, in one go. Nothing is written out anymore once the program is exiting.
+    // `last`, if given, is written after it, even when exiting, as it was never queued up.
+    void drain(const bool exiting = false, const Record* last = nullptr) {
+        const std::lock_guard<std::mutex> drain_lock{m_drain_mutex};
+        if (m_exited) {
+            if (last != nullptr) {
+                write(format(*last));
+            }
+            return;
+        }
+        m_exited = exiting;
+        std::vector<std::shared_ptr<Queue>> queues{};
+        {
+            const std::lock_guard<std::mutex> lock{m_mutex};
+            // Queues of exited threads are only held on to here, and go once they're empty
+            std::erase_if(m_queues, [](const auto& q) { return q.use_count() == 1 && q->empty(); });
+            queues = m_queues;
+        }
+
+        fmt::memory_buffer out{};
+        for (const auto& q : queues) {
+            q->drain([&](const Record& r) { format_to(out, r); });
+        }
+        const auto dropped = m_dropped.load(std::memory_order_relaxed);
+        if (dropped != m_reported_dropped) {
+            fmt::format_to(std::back_inserter(out), fg(Warn_Color), "[{}] Dropped {} log messages\n", Level::Warning,
+                           dropped - m_reported_dropped);
+            m_reported_dropped = dropped;
+        }
+        if (last != nullptr) {
+            format_to(out, *last);
+        }
+        write(out);
+    }
+
+   private:
+    // Guards `m_queues`.
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<Queue>> m_queues;
+    // Only one drains at a time, so the queues have a single consumer.
+    std::mutex m_drain_mutex;
+    std::atomic<std::uint64_t> m_dropped;
+    std::uint64_t m_reported_dropped;
+    bool m_exited;
+    std::thread m_thread;
+
+    static void format_to(fmt::memory_buffer& out, const Record& r) {
+        fmt::format_to(std::back_inserter(out), fg(color_of(r.m_level)), "[{}] [{}] {}\n", r.m_level, r.m_subsystem,
+                       r.m_msg);
+    }
+
+    static fmt::memory_buffer format(const Record& r) {
+        fmt::memory_buffer out{};
+        format_to(out, r);
+        return out;
+    }
+
+    static void write(const fmt::memory_buffer& out) {
+        if (out.size() > 0) {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            std::fflush(stdout);
+        }
+    }
+
+    static fmt::color color_of(const Level level) {
+        switch (level) {
+            case Level::Debug:
+                return Debug_Color;
+            case Level::Warning:
+                return Warn_Color;
+            case Level::Fatal:
+                return Fatal_Color;
+            default:
+                return fmt::color::white;
+        }
+    }
+};
+
+// Shared with the writer, so messages logged right before the thread exits are still written out.
+thread_local std::shared_ptr<Queue> t_queue{};
+}  // namespace
+
+void set_level(const Level level) { detail::min_level.store(level, std::memory_order_relaxed); }
+
+void log(const Level level, const Subsystem subsystem, std::string msg) {
+    auto& w = Writer::writer();
+    if (level == Level::Fatal) {
+        // Written out right here rather than queued up, as it mustn't be dropped, and may be the last thing we do
+        const Record r{level, subsystem, std::move(msg)};
+        w.drain(false, &r);
+        return;
+    }
+    if (!t_queue) {
+        t_queue = w.add_queue();
+    }
+    if (!t_queue->push(Record{level, subsystem, std::move(msg)})) {
+        w.count_dropped();
+    }
 }
 
+void flush() { Writer::writer().drain(); }
+
+std::uint64_t dropped() { return Writer::writer().dropped(); }
+
 }  // namespace tt::log
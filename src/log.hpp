@@ -1,10 +1,23 @@
 #pragma once
 
+//! Logging, which doesn't hold up the caller.
+//!
+//! Messages are formatted by the caller and queued up in a ring buffer of the calling thread, which a background
+//! thread drains to stdout. Use `TT_LOG`, which doesn't even format (or evaluate the arguments) for disabled levels.
+
 #include <fmt/color.h>
 #include <fmt/format.h>
 
+#include <atomic>
+#include <cstdint>
+#include <string>
 #include <string_view>
 
+/// The lowest level compiled in: 0 for debug, 1 for warning, 2 for fatal. Messages below it cost nothing.
+#ifndef TT_LOG_LEVEL
+#define TT_LOG_LEVEL 0
+#endif
+
 namespace tt::log {
 const fmt::color Warn_Color = fmt::color::orange;
 const fmt::color Debug_Color = fmt::color::white;
@@ -14,10 +27,43 @@ enum class Level { Debug, Warning, Fatal };
 
 enum class Subsystem { Peer, Tracker, Torrent };
 
-void log(const Level level, const Subsystem subsystem, const std::string_view& msg);
+namespace detail {
+extern std::atomic<Level> min_level;
+}
+
+/// Whether messages of this level are compiled in at all.
+constexpr bool compiled_in(const Level level) { return static_cast<int>(level) >= TT_LOG_LEVEL; }
+/// Whether messages of this level are logged right now.
+inline bool enabled(const Level level) {
+    return compiled_in(level) && level >= detail::min_level.load(std::memory_order_relaxed);
+}
+/// Only log messages of `level` and above from now on. Debug by default.
+void set_level(const Level level);
+
+/// Log a message that's formatted already. Prefer `TT_LOG`.
+///
+/// Never blocks, except for fatal messages, which are written out before returning, after what was queued up.
+/// Other messages are dropped and counted if the thread's queue is full.
+void log(const Level level, const Subsystem subsystem, std::string msg);
+/// Write out all messages logged so far, and wait for that.
+void flush();
+/// Number of messages dropped so far, as their thread's queue was full.
+std::uint64_t dropped();
 
 }  // namespace tt::log
 
+/// Log a message of the given `tt::log::Level` and `tt::log::Subsystem` (without qualification), formatted from the
+/// remaining arguments with `fmt::format()`. These are only evaluated if the level is enabled.
+#define TT_LOG(level, subsystem, ...)                                                               \
+    do {                                                                                            \
+        if constexpr (::tt::log::compiled_in(::tt::log::Level::level)) {                           \
+            if (::tt::log::enabled(::tt::log::Level::level)) {                                      \
+                ::tt::log::log(::tt::log::Level::level, ::tt::log::Subsystem::subsystem,            \
+                               ::fmt::format(__VA_ARGS__));                                         \
+            }                                                                                       \
+        }                                                                                           \
+    } while (false)
+
 // --- Formatting boilerplate ---
 
 // This has to be specialized in the global namespace
@@ -1,46 +1,138 @@
 #include <fmt/core.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <fstream>
+#include <iostream>
 #include <memory>
 #include <optional>
 #include <string_view>
+#include <thread>
 #include <utility>
 
+#include "event_log.hpp"
 #include "job.hpp"
+#include "log.hpp"
+#include "reusable/smolsocket.hpp"
+#include "trace.hpp"
+#include "torrent/cache.hpp"
 #include "torrent/metainfo.hpp"
+#include "torrent/session.hpp"
+#include "torrent/storage.hpp"
 #include "torrent/torrent.hpp"
 #include "torrent/torrent_jobs.hpp"
 #include "torrent/tracker.hpp"
 
 const std::uint16_t PORT = 1337;
+// More acceptor threads than this won't help, as accepting is rarely the bottleneck.
+const std::size_t MAX_ACCEPTOR_THREADS = 4;
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        fmt::print(stderr, "Usage : {} file.torrent\n", argv[0]);
+    const auto usage = [&]() {
+        fmt::print(stderr, "Usage : {} file.torrent [default|lan-bulk|wan-many]\n", argv[0]);
         exit(EXIT_FAILURE);
+    };
+    if (argc != 2 && argc != 3) {
+        usage();
+    }
+    smolsocket::Options socket_options{};
+    try {
+        socket_options = smolsocket::Options::profile(argc == 3 ? argv[2] : "default");
+    } catch (const smolsocket::Exception& e) {
+        fmt::print(stderr, "{}\n", e.what());
+        usage();
+    }
+    // Debug messages are plenty, so they can be turned off without rebuilding
+    const char* log_level{std::getenv("TOYTORRENT_LOG_LEVEL")};
+    if (log_level != nullptr && std::string_view{log_level} == "warning") {
+        tt::log::set_level(tt::log::Level::Warning);
+    } else if (log_level != nullptr && std::string_view{log_level} == "fatal") {
+        tt::log::set_level(tt::log::Level::Fatal);
+    }
+
+    // Setting this to a path records peer events there, for `toytorrent_decode_events`
+    const char* events_path{std::getenv("TOYTORRENT_EVENTS")};
+    std::optional<tt::log::EventLog> event_log{};
+    if (events_path != nullptr) {
+        event_log.emplace(events_path);
     }
 
     tt::job::JobQueue jobs{};
+    // Setting this to a path traces all jobs, writing the trace there and a summary to stderr on exit
+    const char* trace_path{std::getenv("TOYTORRENT_TRACE")};
+    tt::job::Tracer tracer{};
+    if (trace_path != nullptr) {
+        jobs.set_tracer(&tracer);
+    }
+
+    // Setting this to "uring" does disk I/O through io_uring, if the kernel supports it, "mmap" maps the download
+    const char* storage_backend{std::getenv("TOYTORRENT_STORAGE")};
+    tt::storage::Config storage_config{};
+    if (storage_backend != nullptr && std::string_view{storage_backend} == "uring") {
+        storage_config.m_backend = tt::storage::Backend::Uring;
+    } else if (storage_backend != nullptr && std::string_view{storage_backend} == "mmap") {
+        storage_config.m_backend = tt::storage::Backend::Mmap;
+    }
+    // Setting this to "full" reserves all of the download's disk space up front, rather than as pieces come in
+    const char* preallocate{std::getenv("TOYTORRENT_PREALLOCATE")};
+    if (preallocate != nullptr && std::string_view{preallocate} == "full") {
+        storage_config.m_allocation = tt::storage::Allocation::Full;
+    }
+    // Setting this to a number of MiB buffers that much of written pieces, to write adjacent ones in one go
+    const char* coalesce_mib{std::getenv("TOYTORRENT_COALESCE_MIB")};
+    if (coalesce_mib != nullptr) {
+        storage_config.m_coalesce_buffer = std::strtoull(coalesce_mib, nullptr, 10) * 1024 * 1024;
+    }
+
+    // Setting this to a number of MiB bounds the memory all torrents' blocks take up together
+    const char* cache_mib{std::getenv("TOYTORRENT_CACHE_MIB")};
+    tt::cache::Cache::Config cache_config{};
+    if (cache_mib != nullptr) {
+        cache_config.m_budget = std::strtoull(cache_mib, nullptr, 10) * 1024 * 1024;
+    }
+    const auto cache{std::make_shared<tt::cache::Cache>(cache_config)};
 
     const auto metainfo{tt::metainfo_from_path(argv[1])};
     const std::optional<std::string_view> alternative_path{};
-    auto torrent{std::make_shared<tt::Torrent>(metainfo, PORT, alternative_path)};
+    auto torrent{std::make_shared<tt::Torrent>(metainfo, PORT, alternative_path, storage_config, cache)};
+
+    // Allow peers to connect to us
+    const std::size_t acceptor_threads{
+        std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, MAX_ACCEPTOR_THREADS)};
+    tt::Session session{
+        {.m_port = PORT, .m_acceptor_threads = acceptor_threads, .m_socket_options = socket_options}};
+    session.add_torrent(torrent);
+    session.listen();
 
     // Start torrent
-    auto tracker_start_job{
-        std::make_unique<tt::torrent::TrackerInteractionJob>(torrent, tt::tracker::RequestKind::STARTED)};
-    jobs.enqueue(std::move(tracker_start_job));
-    auto handshake_jobs{torrent->create_handshake_jobs()};
+    // Each stage needs the results of the previous one, while the jobs within a stage run in parallel
+    const tt::TorrentHandle handle{torrent};
+    jobs.enqueue(std::make_unique<tt::torrent::TrackerInteractionJob>(handle, tt::tracker::RequestKind::STARTED));
+    jobs.process();
+    jobs.enqueue(std::make_unique<tt::torrent::PeerConnectJob>(handle));
+    jobs.process();
+    auto handshake_jobs{torrent->create_handshake_jobs(session.reactor())};
     for (auto& job : handshake_jobs) {
         jobs.enqueue(std::move(job));
     }
+    jobs.process();
 
     // Create requests for pieces
     // TODO: Do it for all pieces rather than just first once bugs are fixed
-    auto first_piece_download_job{std::make_unique<tt::torrent::PieceDownloadJob>(torrent, 0)};
-    jobs.enqueue(std::move(first_piece_download_job));
-
+    jobs.enqueue(tt::torrent::make_piece_jobs(handle, session.reactor(), 0));
     jobs.process();
+    // Checkpoint: Whatever was flushed is durable from here on
+    torrent->m_storage->sync();
+
+    // Say goodbye to the trackers
+    torrent->stop_tracker();
+    session.stop();
+
+    if (trace_path != nullptr) {
+        std::ofstream trace_file{trace_path};
+        tracer.write_chrome_trace(trace_file);
+        tracer.write_report(std::cerr);
+    }
 
     return EXIT_SUCCESS;
 }
@@ -5,9 +5,12 @@ namespace bo {
 // Convert from network to host endianness
 std::uint16_t ntoh(std::uint16_t x);
 std::uint16_t ntoh(std::array<char, 2> arr);
+std::uint32_t ntoh(std::uint32_t x);
+std::uint64_t ntoh(std::uint64_t x);
 // Convert from host to network endianness
 std::uint16_t hton(std::uint16_t x);
 std::uint32_t hton(std::uint32_t x);
+std::uint64_t hton(std::uint64_t x);
 // Convert from integer type to byte array (endianness is not changed!)
 std::array<std::uint8_t, 4> int_to_arr(std::uint32_t x);
 // Convert from byte array to integer type (endianness is not changed!)
@@ -0,0 +1,84 @@
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace histogram {
+
+const std::size_t Sub_Buckets = std::size_t{1} << Histogram::Sub_Bucket_Bits;
+// Values below this are counted exactly
+const std::size_t Exact = 2 * Sub_Buckets;
+const std::size_t Num_Buckets = ((64 - (Histogram::Sub_Bucket_Bits + 1)) << Histogram::Sub_Bucket_Bits) + Exact;
+
+// Dropping the `e` lowest bits of the value leaves the top Sub_Bucket_Bits + 1 of them, the first of which is set.
+// Each `e` thus has it's own Sub_Buckets buckets, right after those of `e - 1`.
+static std::size_t bucket_of(const std::uint64_t value) {
+    const auto width = static_cast<std::size_t>(std::bit_width(value));
+    const std::size_t e = width > Histogram::Sub_Bucket_Bits + 1 ? width - (Histogram::Sub_Bucket_Bits + 1) : 0;
+    return (e << Histogram::Sub_Bucket_Bits) + static_cast<std::size_t>(value >> e);
+}
+
+// The highest value counted in the given bucket.
+static std::uint64_t highest_in(const std::size_t bucket) {
+    if (bucket < Exact) {
+        return bucket;
+    }
+    const std::size_t e = (bucket >> Histogram::Sub_Bucket_Bits) - 1;
+    const std::uint64_t top = bucket - (e << Histogram::Sub_Bucket_Bits);
+    // Wraps around to the largest value for the very last bucket, as it should
+    return ((top + 1) << e) - 1;
+}
+
+Histogram::Histogram()
+    : m_counts(Num_Buckets, 0), m_count(0), m_min(std::numeric_limits<std::uint64_t>::max()), m_max(0), m_sum(0) {}
+
+void Histogram::record(const std::uint64_t value) {
+    m_counts[bucket_of(value)]++;
+    m_count++;
+    m_min = std::min(m_min, value);
+    m_max = std::max(m_max, value);
+    m_sum += value;
+}
+
+void Histogram::merge(const Histogram& other) {
+    for (std::size_t i = 0; i < Num_Buckets; i++) {
+        m_counts[i] += other.m_counts[i];
+    }
+    m_count += other.m_count;
+    m_min = std::min(m_min, other.m_min);
+    m_max = std::max(m_max, other.m_max);
+    m_sum += other.m_sum;
+}
+
+std::uint64_t Histogram::count() const { return m_count; }
+
+std::uint64_t Histogram::min() const { return m_count == 0 ? 0 : m_min; }
+
+std::uint64_t Histogram::max() const { return m_max; }
+
+double Histogram::mean() const {
+    return m_count == 0 ? 0.0 : static_cast<double>(m_sum) / static_cast<double>(m_count);
+}
+
+std::uint64_t Histogram::percentile(const double percentile) const {
+    if (m_count == 0) {
+        return 0;
+    }
+    const double p = std::clamp(percentile, 0.0, 100.0);
+    // The rank of the value we're looking for, counting from 1
+    const auto rank = std::max<std::uint64_t>(
+        static_cast<std::uint64_t>(std::ceil(p / 100.0 * static_cast<double>(m_count))), 1);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < Num_Buckets; i++) {
+        seen += m_counts[i];
+        if (seen >= rank) {
+            return std::min(highest_in(i), m_max);
+        }
+    }
+    return m_max;
+}
+}  // namespace histogram
@@ -0,0 +1,154 @@
+#include "smallalloc.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+namespace smallalloc {
+
+// Size classes are multiples of this, which is also the guaranteed alignment.
+const std::size_t Granularity = alignof(std::max_align_t);
+const std::size_t Num_Classes = Max_Size / Granularity;
+// Blocks moved between a thread's cache and the shared pool at once.
+const std::size_t Batch = 64;
+// Memory taken from the system at once.
+const std::size_t Chunk_Size = 64 * 1024;
+
+namespace {
+struct Block {
+    Block* m_next;
+};
+
+// A singly-linked stack of blocks of the same size.
+struct FreeList {
+    Block* m_head = nullptr;
+    std::size_t m_len = 0;
+
+    void push(Block* b) {
+        b->m_next = m_head;
+        m_head = b;
+        m_len++;
+    }
+    Block* pop() {
+        auto* b = m_head;
+        m_head = b->m_next;
+        m_len--;
+        return b;
+    }
+};
+
+// Where threads hand back and refill blocks.
+struct Pool {
+    std::mutex m_mutex{};
+    std::array<FreeList, Num_Classes> m_lists{};
+    std::atomic<std::size_t> m_chunks{0};
+    std::atomic<std::size_t> m_large{0};
+};
+
+// Never destroyed, as threads may still free blocks while static objects are destroyed on exit
+Pool& pool() {
+    static auto* p = new Pool();
+    return *p;
+}
+
+// Move up to `n` blocks from `from` to `to`.
+void move_blocks(FreeList& from, FreeList& to, const std::size_t n) {
+    for (std::size_t i = 0; i < n && from.m_head != nullptr; i++) {
+        to.push(from.pop());
+    }
+}
+
+// Whether this thread's cache is gone already. Stays valid during the whole of the thread's exit, unlike the cache.
+thread_local bool t_destroyed = false;
+
+struct Cache {
+    std::array<FreeList, Num_Classes> m_lists{};
+
+    Cache() = default;
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+    // Blocks of exiting threads go back to the pool, so they aren't lost
+    ~Cache() {
+        auto& p = pool();
+        const std::lock_guard<std::mutex> lock{p.m_mutex};
+        for (std::size_t cls = 0; cls < Num_Classes; cls++) {
+            move_blocks(m_lists[cls], p.m_lists[cls], m_lists[cls].m_len);
+        }
+        t_destroyed = true;
+    }
+
+    // Fill the list of a size class, from the pool or else a new chunk.
+    void refill(const std::size_t cls) {
+        auto& p = pool();
+        auto& list = m_lists[cls];
+        {
+            const std::lock_guard<std::mutex> lock{p.m_mutex};
+            move_blocks(p.m_lists[cls], list, Batch);
+        }
+        if (list.m_head != nullptr) {
+            return;
+        }
+        const std::size_t block_size = (cls + 1) * Granularity;
+        auto* chunk = static_cast<std::byte*>(::operator new(Chunk_Size));
+        p.m_chunks++;
+        for (std::size_t offset = 0; offset + block_size <= Chunk_Size; offset += block_size) {
+            list.push(reinterpret_cast<Block*>(chunk + offset));
+        }
+    }
+
+    // Hand blocks back to the pool once the list has grown too long, keeping a batch around.
+    void spill(const std::size_t cls) {
+        auto& p = pool();
+        const std::lock_guard<std::mutex> lock{p.m_mutex};
+        move_blocks(m_lists[cls], p.m_lists[cls], m_lists[cls].m_len - Batch);
+    }
+};
+
+thread_local Cache t_cache{};
+
+std::size_t class_of(const std::size_t size) { return (size + Granularity - 1) / Granularity - 1; }
+}  // namespace
+
+void* allocate(const std::size_t size) {
+    if (size > Max_Size) {
+        pool().m_large++;
+        return ::operator new(size);
+    }
+    const auto cls = class_of(size == 0 ? 1 : size);
+    if (t_destroyed) {
+        // Destructors of other thread-local objects run after the cache's. A whole block, so it may join the pool.
+        return ::operator new((cls + 1) * Granularity);
+    }
+    auto& list = t_cache.m_lists[cls];
+    if (list.m_head == nullptr) {
+        t_cache.refill(cls);
+    }
+    return list.pop();
+}
+
+void deallocate(void* p, const std::size_t size) noexcept {
+    if (p == nullptr) {
+        return;
+    }
+    if (size > Max_Size) {
+        ::operator delete(p);
+        return;
+    }
+    const auto cls = class_of(size == 0 ? 1 : size);
+    if (t_destroyed) {
+        auto& pl = pool();
+        const std::lock_guard<std::mutex> lock{pl.m_mutex};
+        pl.m_lists[cls].push(static_cast<Block*>(p));
+        return;
+    }
+    auto& list = t_cache.m_lists[cls];
+    list.push(static_cast<Block*>(p));
+    if (list.m_len > 4 * Batch) {
+        t_cache.spill(cls);
+    }
+}
+
+Stats stats() { return Stats{pool().m_chunks.load(), pool().m_large.load()}; }
+}  // namespace smallalloc
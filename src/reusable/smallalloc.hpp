@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * A small-object allocator for short-lived objects that are allocated and freed at high rates,
+ * possibly on different threads (e.g. jobs, which are created by one thread and destroyed by whichever runs them).
+ *
+ * Objects are rounded up into size classes. Each thread caches freed blocks per size class, so allocating and
+ * freeing usually just pops or pushes a thread-local list, without locks or atomics. Threads that free more than
+ * they allocate hand batches of blocks back to a shared pool, which threads running dry refill from.
+ * Memory is taken from the system in chunks, and never given back.
+ */
+
+#include <cstddef>
+
+namespace smallalloc {
+
+// Objects larger than this are passed through to the global allocator.
+const std::size_t Max_Size = 512;
+
+// Allocate `size` bytes, aligned for any fundamental type. Throws `std::bad_alloc` if out of memory.
+void* allocate(const std::size_t size);
+// Free memory from `allocate()`. `size` must be the one it was allocated with.
+void deallocate(void* p, const std::size_t size) noexcept;
+
+struct Stats {
+    // Chunks taken from the system for small objects so far.
+    std::size_t m_chunks;
+    // Allocations passed through to the global allocator so far, as they were too large.
+    std::size_t m_large;
+};
+Stats stats();
+}  // namespace smallalloc
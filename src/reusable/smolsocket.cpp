@@ -4,8 +4,13 @@
 
 extern "C" {
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -17,10 +22,14 @@ extern "C" {
 #include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 namespace smolsocket {
 
@@ -36,96 +45,320 @@ Exception::Exception(const std::string_view& msg, const std::optional<int> errno
 
 const char* Exception::what() const noexcept { return this->m_msg.c_str(); }
 
-static void enable_timeout(int sockfd, std::optional<std::uint64_t> timeout_millis) {
+// `direction` is SO_SNDTIMEO or SO_RCVTIMEO.
+static void enable_timeout(int sockfd, int direction, std::optional<std::uint64_t> timeout_millis) {
     // TODO: This is Linux-only, but select() based impl looks to be a massive pain
     if (timeout_millis.has_value()) {
         struct timeval timeout {};
-        timeout.tv_sec = timeout_millis.value() / 1000;
-        timeout.tv_usec = (timeout_millis.value() * 1000) % 1000;
-        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        timeout.tv_sec = static_cast<time_t>(timeout_millis.value() / 1000);
+        timeout.tv_usec = static_cast<suseconds_t>((timeout_millis.value() % 1000) * 1000);
+        setsockopt(sockfd, SOL_SOCKET, direction, &timeout, sizeof(timeout));
     }
 }
 
-static void disable_timeout(int sockfd) {
+static void disable_timeout(int sockfd, int direction) {
     struct timeval disable_timeout;
     disable_timeout.tv_sec = 0;
     disable_timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &disable_timeout, sizeof(disable_timeout));
+    setsockopt(sockfd, SOL_SOCKET, direction, &disable_timeout, sizeof(disable_timeout));
 }
 
-Sock::Sock(const std::string_view& addr, const uint16_t port, const Proto proto,
-           std::optional<std::uint64_t> timeout_millis) {
-    this->m_proto = proto;
+Options Options::lan_bulk() {
+    Options o{};
+    o.m_nodelay = true;
+    o.m_rcvbuf = 4 * 1024 * 1024;
+    o.m_sndbuf = 4 * 1024 * 1024;
+    o.m_quickack = true;
+    return o;
+}
 
-    // Give hints
-    struct addrinfo hints;
-    std::memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
+Options Options::wan_many() {
+    Options o{};
+    o.m_nodelay = true;
+    o.m_notsent_lowat = 128 * 1024;
+    return o;
+}
+
+Options Options::profile(const std::string_view& name) {
+    if (name == "lan-bulk") {
+        return lan_bulk();
+    } else if (name == "wan-many") {
+        return wan_many();
+    } else if (name == "default") {
+        return Options{};
+    }
+    throw Exception(std::string("smolsocket::Options::profile(): Unknown profile ") + std::string(name), {}, {});
+}
+
+static void set_int_opt(const int sockfd, const int level, const int name, const int value, const char* what) {
+    if (setsockopt(sockfd, level, name, &value, sizeof(value)) == -1) {
+        throw Exception(std::string("smolsocket::Sock::apply(): Failed to set ") + what + ": ", {errno}, {});
+    }
+}
+
+static void apply_options(const int sockfd, const Options& opts) {
+    if (opts.m_nodelay.has_value()) {
+        set_int_opt(sockfd, IPPROTO_TCP, TCP_NODELAY, opts.m_nodelay.value() ? 1 : 0, "TCP_NODELAY");
+    }
+    if (opts.m_rcvbuf.has_value()) {
+        set_int_opt(sockfd, SOL_SOCKET, SO_RCVBUF, opts.m_rcvbuf.value(), "SO_RCVBUF");
+    }
+    if (opts.m_sndbuf.has_value()) {
+        set_int_opt(sockfd, SOL_SOCKET, SO_SNDBUF, opts.m_sndbuf.value(), "SO_SNDBUF");
+    }
+    if (opts.m_notsent_lowat.has_value()) {
+        set_int_opt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts.m_notsent_lowat.value(), "TCP_NOTSENT_LOWAT");
+    }
+    if (opts.m_quickack.has_value()) {
+        set_int_opt(sockfd, IPPROTO_TCP, TCP_QUICKACK, opts.m_quickack.value() ? 1 : 0, "TCP_QUICKACK");
+    }
+    if (opts.m_congestion.has_value()) {
+        const auto& algo = opts.m_congestion.value();
+        if (setsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION, algo.data(), static_cast<socklen_t>(algo.size())) ==
+            -1) {
+            throw Exception("smolsocket::Sock::apply(): Failed to set TCP_CONGESTION to " + algo + ": ", {errno}, {});
+        }
+    }
+}
+
+static int socktype_for(const Proto proto) {
     switch (proto) {
         case Proto::TCP:
-            hints.ai_socktype = SOCK_STREAM;
-            break;
+            return SOCK_STREAM;
         case Proto::UDP:
-            hints.ai_socktype = SOCK_DGRAM;
-            break;
+            return SOCK_DGRAM;
         default:
-            std::cerr << "smolsocket::Sock::Sock(): Unknown protocol. This is a bug." << std::endl;
+            std::cerr << "smolsocket::socktype_for(): Unknown protocol. This is a bug." << std::endl;
             std::exit(EXIT_FAILURE);
-            break;
     }
+}
+
+// Order addresses so that families alternate, starting with IPv6 (RFC 8305 section 4).
+static std::vector<ResolvedAddr> interleave_families(const std::vector<ResolvedAddr>& addrs) {
+    std::vector<ResolvedAddr> v6{};
+    std::vector<ResolvedAddr> v4{};
+    for (const auto& a : addrs) {
+        (a.m_kind == AddrKind::V6 ? v6 : v4).push_back(a);
+    }
+    std::vector<ResolvedAddr> out{};
+    out.reserve(addrs.size());
+    for (std::size_t i = 0; i < std::max(v6.size(), v4.size()); i++) {
+        if (i < v6.size()) {
+            out.push_back(v6[i]);
+        }
+        if (i < v4.size()) {
+            out.push_back(v4[i]);
+        }
+    }
+    return out;
+}
+
+static std::vector<ResolvedAddr> lookup(const std::string& host, const std::uint16_t port, const Proto proto,
+                                        const int flags) {
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype_for(proto);
+    hints.ai_flags = flags;
 
-    // Lookup
-    int err;
     struct addrinfo* res;
-    err = getaddrinfo(addr.data(), std::to_string(port).c_str(), &hints, &res);
+    const int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
     if (err != 0) {
-        throw Exception("smolsocket::Sock::Sock(): getaddrinfo() failed: ", {}, {err});
+        throw Exception("smolsocket::Resolver::resolve(): getaddrinfo() failed: ", {}, {err});
+    }
+    std::vector<ResolvedAddr> addrs{};
+    for (const struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+        ResolvedAddr a{};
+        switch (ai->ai_family) {
+            case AF_INET:
+                a.m_kind = AddrKind::V4;
+                break;
+            case AF_INET6:
+                a.m_kind = AddrKind::V6;
+                break;
+            default:
+                // Not something we can connect to
+                continue;
+        }
+        std::memcpy(&a.m_storage, ai->ai_addr, ai->ai_addrlen);
+        a.m_len = ai->ai_addrlen;
+        addrs.push_back(a);
     }
+    freeaddrinfo(res);
+    if (addrs.empty()) {
+        throw Exception("smolsocket::Resolver::resolve(): Lookup result contains no IP addresses", {}, {});
+    }
+    return interleave_families(addrs);
+}
 
-    // Only return 1st addr for now
-    // TODO: Deal with >1
-    if (res == nullptr) {
-        throw Exception("smolsocket::Sock::Sock(): Lookup result contains no IP addresses", {}, {});
+static std::string fmt_cache_key(const std::string& host, const std::uint16_t port, const Proto proto) {
+    return host + "/" + std::to_string(port) + (proto == Proto::TCP ? "/tcp" : "/udp");
+}
+
+Resolver::Resolver(const std::chrono::seconds ttl) : m_ttl(ttl), m_mutex(), m_cache() {}
+
+std::vector<ResolvedAddr> Resolver::resolve(const std::string_view& host, const std::uint16_t port,
+                                            const Proto proto) {
+    const std::string host_str{host};
+    // Literal addresses are what trackers give us in the vast majority of cases, and can be parsed without any I/O.
+    try {
+        return lookup(host_str, port, proto, AI_NUMERICHOST);
+    } catch (const Exception&) {
+        // Not a literal, fall through to a real lookup
     }
-    switch (res->ai_family) {
-        case AF_INET:
-            this->m_addr_kind = AddrKind::V4;
-            break;
-        case AF_INET6:
-            this->m_addr_kind = AddrKind::V6;
-            break;
-        default:
-            freeaddrinfo(res);
-            throw Exception("smolsocket::Sock::Sock(): Unknown address family", {}, {});
-            break;
+
+    const auto key = fmt_cache_key(host_str, port, proto);
+    const auto now = std::chrono::steady_clock::now();
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        const auto entry = m_cache.find(key);
+        if (entry != m_cache.end() && entry->second.m_expires > now) {
+            return entry->second.m_addrs;
+        }
     }
+    // Don't hold the lock during the lookup, so one slow name doesn't stall every other connection.
+    auto addrs = lookup(host_str, port, proto, 0);
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_cache.insert_or_assign(key, Entry{addrs, now + m_ttl});
+    return addrs;
+}
 
-    // Actually open the socket
-    int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sock == -1) {
-        freeaddrinfo(res);
-        throw Exception("smolsocket::Sock::Sock(): Failed to create socket: ", {errno}, {});
+void Resolver::clear() {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_cache.clear();
+}
+
+Resolver& Resolver::shared() {
+    static Resolver resolver{std::chrono::seconds(300)};
+    return resolver;
+}
+
+static void set_blocking(const int sockfd) {
+    const int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+// Prefix of v4-mapped IPv6 addresses, see RFC 4291 section 2.5.5.2.
+const std::array<std::uint8_t, 12> V4_Mapped_Prefix{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+Endpoint Endpoint::from_v4(const std::uint8_t* addr, const std::uint16_t port) {
+    Endpoint e{};
+    std::copy(V4_Mapped_Prefix.begin(), V4_Mapped_Prefix.end(), e.m_addr.begin());
+    std::copy_n(addr, V4_Len_Bytes, e.m_addr.begin() + V4_Mapped_Prefix.size());
+    e.m_port = port;
+    return e;
+}
+
+Endpoint Endpoint::from_v6(const std::uint8_t* addr, const std::uint16_t port) {
+    Endpoint e{};
+    std::copy_n(addr, V6_Len_Bytes, e.m_addr.begin());
+    e.m_port = port;
+    return e;
+}
+
+Endpoint Endpoint::from_sockaddr(const sockaddr_storage& addr) {
+    if (addr.ss_family == AF_INET6) {
+        const auto* in6 = reinterpret_cast<const sockaddr_in6*>(&addr);
+        // Dual-stack sockets report IPv4 remotes as ::ffff:a.b.c.d, which is just what we want
+        return from_v6(in6->sin6_addr.s6_addr, ntohs(in6->sin6_port));
+    } else if (addr.ss_family == AF_INET) {
+        const auto* in4 = reinterpret_cast<const sockaddr_in*>(&addr);
+        return from_v4(reinterpret_cast<const std::uint8_t*>(&in4->sin_addr), ntohs(in4->sin_port));
     }
-    this->m_sockfd = sock;
+    throw Exception("smolsocket::Endpoint::from_sockaddr(): Unsupported address family", {}, {});
+}
 
-    // Set timeout if desired
-    enable_timeout(this->m_sockfd.value(), timeout_millis);
+std::optional<Endpoint> Endpoint::parse(const std::string_view& ip, const std::uint16_t port) {
+    // inet_pton wants a terminated string
+    std::array<char, INET6_ADDRSTRLEN> buf{};
+    if (ip.size() >= buf.size()) {
+        return {};
+    }
+    std::copy(ip.begin(), ip.end(), buf.begin());
+    std::array<std::uint8_t, V6_Len_Bytes> bytes{};
+    if (inet_pton(AF_INET, buf.data(), bytes.data()) == 1) {
+        return from_v4(bytes.data(), port);
+    }
+    if (inet_pton(AF_INET6, buf.data(), bytes.data()) == 1) {
+        return from_v6(bytes.data(), port);
+    }
+    return {};
+}
 
-    // TODO: Also support bind()-ing
-    // And connect
-    err = connect(this->m_sockfd.value(), res->ai_addr, res->ai_addrlen);
-    if (err == -1) {
-        freeaddrinfo(res);
-        disable_timeout(this->m_sockfd.value());
-        throw Exception("smolsocket::Sock::Sock(): Failed to connect() socket: ", {errno}, {});
+AddrKind Endpoint::kind() const {
+    return std::equal(V4_Mapped_Prefix.begin(), V4_Mapped_Prefix.end(), m_addr.begin()) ? AddrKind::V4 : AddrKind::V6;
+}
+
+std::string Endpoint::ip_str() const {
+    if (kind() == AddrKind::V4) {
+        std::array<std::uint8_t, V6_Len_Bytes> v4{};
+        std::copy_n(m_addr.begin() + V4_Mapped_Prefix.size(), V4_Len_Bytes, v4.begin());
+        return ip_to_str(v4, AddrKind::V4);
     }
-    // Re-disable timeout
-    disable_timeout(this->m_sockfd.value());
-    freeaddrinfo(res);
+    return ip_to_str(m_addr, AddrKind::V6);
+}
+
+std::string Endpoint::to_string() const {
+    if (kind() == AddrKind::V4) {
+        return ip_str() + ":" + std::to_string(m_port);
+    }
+    return "[" + ip_str() + "]:" + std::to_string(m_port);
+}
+
+ResolvedAddr Endpoint::to_sockaddr() const {
+    ResolvedAddr res{};
+    if (kind() == AddrKind::V4) {
+        auto* in4 = reinterpret_cast<sockaddr_in*>(&res.m_storage);
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(m_port);
+        std::memcpy(&in4->sin_addr, m_addr.data() + V4_Mapped_Prefix.size(), V4_Len_Bytes);
+        res.m_len = sizeof(sockaddr_in);
+        res.m_kind = AddrKind::V4;
+    } else {
+        auto* in6 = reinterpret_cast<sockaddr_in6*>(&res.m_storage);
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(m_port);
+        std::memcpy(in6->sin6_addr.s6_addr, m_addr.data(), V6_Len_Bytes);
+        res.m_len = sizeof(sockaddr_in6);
+        res.m_kind = AddrKind::V6;
+    }
+    return res;
+}
+
+Sock::Sock(const int sockfd, const AddrKind kind, const Proto proto)
+    : m_sockfd(sockfd), m_addr_kind(kind), m_proto(proto) {}
+
+Sock::Sock(const std::string_view& addr, const uint16_t port, const Proto proto,
+           std::optional<std::uint64_t> timeout_millis) {
+    Connector::Config cfg{};
+    if (timeout_millis.has_value()) {
+        cfg.m_timeout = std::chrono::milliseconds(timeout_millis.value());
+    }
+    Connector connector{cfg};
+    connector.add(addr, port, proto);
+    auto res = std::move(connector.run().at(0));
+    if (!res.m_sock.has_value()) {
+        throw Exception(std::string("smolsocket::Sock::Sock(): Failed to connect() socket: ") + res.m_error, {}, {});
+    }
+    *this = std::move(res.m_sock.value());
+}
+
+Sock::Sock(const Endpoint& remote, const Proto proto, std::optional<std::uint64_t> timeout_millis) {
+    Connector::Config cfg{};
+    if (timeout_millis.has_value()) {
+        cfg.m_timeout = std::chrono::milliseconds(timeout_millis.value());
+    }
+    Connector connector{cfg};
+    connector.add(remote, proto);
+    auto res = std::move(connector.run().at(0));
+    if (!res.m_sock.has_value()) {
+        throw Exception(std::string("smolsocket::Sock::Sock(): Failed to connect() socket: ") + res.m_error, {}, {});
+    }
+    *this = std::move(res.m_sock.value());
 }
 
 Sock::Sock(Sock&& src) : m_sockfd(src.m_sockfd), m_addr_kind(src.m_addr_kind), m_proto(src.m_proto) {
-    src.m_sockfd = -1;
+    src.m_sockfd = {};
 }
 
 Sock& Sock::operator=(Sock&& other) {
@@ -144,45 +377,494 @@ Sock& Sock::operator=(Sock&& other) {
 }
 
 void Sock::send(const std::vector<uint8_t>& data, std::optional<std::uint64_t> timeout_millis) {
-    enable_timeout(this->m_sockfd.value(), timeout_millis);
+    enable_timeout(this->m_sockfd.value(), SO_SNDTIMEO, timeout_millis);
     size_t sent = 0;
     while (sent < data.size()) {
-        const ssize_t ret = ::send(this->m_sockfd.value(), data.data() + sent, data.size() - sent, 0);
+        const ssize_t ret = ::send(this->m_sockfd.value(), data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
         if (ret == -1) {
-            disable_timeout(this->m_sockfd.value());
+            disable_timeout(this->m_sockfd.value(), SO_SNDTIMEO);
             throw Exception("smolsocket::Sock::send(): Failed to send(): ", {errno}, {});
         }
         sent += static_cast<std::size_t>(ret);
     }
-    disable_timeout(this->m_sockfd.value());
+    disable_timeout(this->m_sockfd.value(), SO_SNDTIMEO);
+}
+
+// Unlike send(), sendfile() can't be told not to raise SIGPIPE when the remote is gone, so it's blocked meanwhile.
+// One raised anyway is discarded, rather than killing the process once unblocked.
+class SigpipeBlocker {
+   public:
+    SigpipeBlocker() {
+        sigemptyset(&m_pipe);
+        sigaddset(&m_pipe, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &m_pipe, &m_previous);
+    }
+    SigpipeBlocker(const SigpipeBlocker&) = delete;
+    SigpipeBlocker& operator=(const SigpipeBlocker&) = delete;
+    void discard_raised() {
+        const timespec no_wait{};
+        sigtimedwait(&m_pipe, nullptr, &no_wait);
+    }
+    ~SigpipeBlocker() { pthread_sigmask(SIG_SETMASK, &m_previous, nullptr); }
+
+   private:
+    sigset_t m_pipe{};
+    sigset_t m_previous{};
+};
+
+void Sock::send_file(const std::vector<uint8_t>& header, const int in_fd, const std::uint64_t offset,
+                     const std::size_t len, std::optional<std::uint64_t> timeout_millis) {
+    const int sockfd = this->m_sockfd.value();
+    enable_timeout(sockfd, SO_SNDTIMEO, timeout_millis);
+    size_t sent = 0;
+    while (sent < header.size()) {
+        const ssize_t ret = ::send(sockfd, header.data() + sent, header.size() - sent, MSG_NOSIGNAL | MSG_MORE);
+        if (ret == -1) {
+            disable_timeout(sockfd, SO_SNDTIMEO);
+            throw Exception("smolsocket::Sock::send_file(): Failed to send(): ", {errno}, {});
+        }
+        sent += static_cast<std::size_t>(ret);
+    }
+    SigpipeBlocker blocker{};
+    auto file_offset = static_cast<off_t>(offset);
+    sent = 0;
+    while (sent < len) {
+        const ssize_t ret = ::sendfile(sockfd, in_fd, &file_offset, len - sent);
+        if (ret == -1) {
+            const int sendfile_errno = errno;
+            if (sendfile_errno == EPIPE) {
+                blocker.discard_raised();
+            }
+            disable_timeout(sockfd, SO_SNDTIMEO);
+            throw Exception("smolsocket::Sock::send_file(): Failed to sendfile(): ", {sendfile_errno}, {});
+        }
+        if (ret == 0) {
+            disable_timeout(sockfd, SO_SNDTIMEO);
+            throw Exception("smolsocket::Sock::send_file(): File ended before everything was sent", {}, {});
+        }
+        sent += static_cast<std::size_t>(ret);
+    }
+    disable_timeout(sockfd, SO_SNDTIMEO);
 }
 
 std::vector<std::uint8_t> Sock::recv(const std::size_t data_size, const std::optional<std::uint64_t> timeout_millis) {
     std::vector<std::uint8_t> buf{};
-    buf.reserve(data_size);
-    enable_timeout(this->m_sockfd.value(), timeout_millis);
+    buf.resize(data_size);
+    enable_timeout(this->m_sockfd.value(), SO_RCVTIMEO, timeout_millis);
     std::size_t recvd = 0;
 
     while (recvd < data_size) {
         const ssize_t ret = ::recv(this->m_sockfd.value(), buf.data() + recvd, data_size - recvd, 0);
         if (ret == -1) {
-            disable_timeout(this->m_sockfd.value());
-            throw Exception("smolsocket::Sock::send(): Failed to send(): ", {errno}, {});
+            disable_timeout(this->m_sockfd.value(), SO_RCVTIMEO);
+            throw Exception("smolsocket::Sock::recv(): Failed to recv(): ", {errno}, {});
+        }
+        if (ret == 0) {
+            disable_timeout(this->m_sockfd.value(), SO_RCVTIMEO);
+            throw Exception("smolsocket::Sock::recv(): Connection closed by remote", {}, {});
         }
         recvd += static_cast<std::size_t>(ret);
     }
-    disable_timeout(this->m_sockfd.value());
+    disable_timeout(this->m_sockfd.value(), SO_RCVTIMEO);
     return buf;
 }
 
+std::optional<std::vector<std::uint8_t>> Sock::recv_datagram(const std::size_t max_size,
+                                                             const std::optional<std::uint64_t> timeout_millis) {
+    std::vector<std::uint8_t> buf{};
+    buf.resize(max_size);
+    enable_timeout(this->m_sockfd.value(), SO_RCVTIMEO, timeout_millis);
+    const ssize_t ret = ::recv(this->m_sockfd.value(), buf.data(), buf.size(), 0);
+    const int recv_errno = errno;
+    disable_timeout(this->m_sockfd.value(), SO_RCVTIMEO);
+    if (ret == -1) {
+        if (recv_errno == EAGAIN || recv_errno == EWOULDBLOCK || recv_errno == EINTR) {
+            return {};
+        }
+        throw Exception("smolsocket::Sock::recv_datagram(): Failed to recv(): ", {recv_errno}, {});
+    }
+    buf.resize(static_cast<std::size_t>(ret));
+    return buf;
+}
+
+std::size_t Sock::send_some(const std::uint8_t* data, const std::size_t len) {
+    const ssize_t ret = ::send(this->m_sockfd.value(), data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        throw Exception("smolsocket::Sock::send_some(): Failed to send(): ", {errno}, {});
+    }
+    return static_cast<std::size_t>(ret);
+}
+
+std::optional<std::size_t> Sock::recv_some(std::uint8_t* buf, const std::size_t len) {
+    const ssize_t ret = ::recv(this->m_sockfd.value(), buf, len, MSG_DONTWAIT);
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return {};
+        }
+        throw Exception("smolsocket::Sock::recv_some(): Failed to recv(): ", {errno}, {});
+    }
+    if (ret == 0 && len > 0) {
+        throw Exception("smolsocket::Sock::recv_some(): Connection closed by remote", {}, {});
+    }
+    return static_cast<std::size_t>(ret);
+}
+
+int Sock::native_handle() const { return this->m_sockfd.value(); }
+
+void Sock::apply(const Options& opts) { apply_options(this->m_sockfd.value(), opts); }
+
+TcpInfo Sock::tcp_info() const {
+    struct tcp_info info {};
+    socklen_t len = sizeof(info);
+    if (getsockopt(this->m_sockfd.value(), IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        throw Exception("smolsocket::Sock::tcp_info(): Failed to get TCP_INFO: ", {errno}, {});
+    }
+    return TcpInfo{std::chrono::microseconds(info.tcpi_rtt),
+                   std::chrono::microseconds(info.tcpi_rttvar),
+                   info.tcpi_snd_cwnd,
+                   info.tcpi_snd_ssthresh,
+                   info.tcpi_snd_mss,
+                   info.tcpi_unacked,
+                   info.tcpi_total_retrans};
+}
+
 Sock::~Sock() {
     if (this->m_sockfd.has_value()) {
         close(this->m_sockfd.value());
     }
 }
 
+Connector::Connector(const Config& cfg, Resolver& resolver) : m_cfg(cfg), m_resolver(resolver), m_targets() {}
+
+std::size_t Connector::add(const std::string_view& host, const std::uint16_t port, const Proto proto) {
+    m_targets.push_back(Target{std::string(host), port, proto});
+    return m_targets.size() - 1;
+}
+
+std::size_t Connector::add(const Endpoint& remote, const Proto proto) {
+    Target t{remote.ip_str(), remote.m_port, proto};
+    t.m_addrs.push_back(remote.to_sockaddr());
+    m_targets.push_back(std::move(t));
+    return m_targets.size() - 1;
+}
+
+std::optional<Sock> Connector::start_attempt(Target& t, const std::chrono::steady_clock::time_point now) {
+    const auto& addr = t.m_addrs.at(t.m_next_addr);
+    t.m_next_addr++;
+    t.m_last_attempt = now;
+
+    const int fd = socket(addr.m_storage.ss_family, socktype_for(t.m_proto) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        t.m_last_error = Exception("Failed to create socket: ", {errno}, {}).m_msg;
+        return {};
+    }
+    if (t.m_proto == Proto::TCP) {
+        try {
+            apply_options(fd, m_cfg.m_options);
+        } catch (const Exception& e) {
+            t.m_last_error = e.m_msg;
+            close(fd);
+            return {};
+        }
+    }
+    if (connect(fd, reinterpret_cast<const struct sockaddr*>(&addr.m_storage), addr.m_len) == 0) {
+        // Happens for UDP, and sometimes for loopback TCP
+        set_blocking(fd);
+        return Sock(fd, addr.m_kind, t.m_proto);
+    }
+    if (errno != EINPROGRESS) {
+        // Unreachable networks and such are reported right away, no need to wait for them
+        t.m_last_error = Exception("Failed to connect(): ", {errno}, {}).m_msg;
+        close(fd);
+        return {};
+    }
+    t.m_attempts.push_back(Attempt{fd, addr.m_kind});
+    m_half_open++;
+    return {};
+}
+
+void Connector::abandon_attempts(Target& t) {
+    for (const auto& a : t.m_attempts) {
+        close(a.m_fd);
+        m_half_open--;
+    }
+    t.m_attempts.clear();
+}
+
+void Connector::run(const std::function<void(std::size_t, ConnectResult&&)>& on_done) {
+    using Clock = std::chrono::steady_clock;
+    std::size_t remaining = 0;
+    for (const auto& t : m_targets) {
+        if (!t.m_done) {
+            remaining++;
+        }
+    }
+    auto finish = [&](const std::size_t idx, ConnectResult&& res) {
+        auto& t = m_targets.at(idx);
+        abandon_attempts(t);
+        t.m_done = true;
+        remaining--;
+        on_done(idx, std::move(res));
+    };
+
+    std::vector<struct pollfd> fds{};
+    std::vector<std::size_t> fd_targets{};
+    while (remaining > 0) {
+        const auto now = Clock::now();
+        auto next_wakeup = now + m_cfg.m_timeout;
+
+        for (std::size_t i = 0; i < m_targets.size(); i++) {
+            auto& t = m_targets[i];
+            if (t.m_done) {
+                continue;
+            }
+            if (!t.m_started) {
+                // Targets don't start their clock until there's room for them
+                if (m_half_open >= m_cfg.m_max_half_open) {
+                    continue;
+                }
+                t.m_started = true;
+                t.m_deadline = now + m_cfg.m_timeout;
+                try {
+                    if (t.m_addrs.empty()) {
+                        t.m_addrs = m_resolver.resolve(t.m_host, t.m_port, t.m_proto);
+                    }
+                } catch (const Exception& e) {
+                    finish(i, ConnectResult{{}, e.m_msg});
+                    continue;
+                }
+            }
+            if (now >= t.m_deadline) {
+                finish(i, ConnectResult{{}, "Timed out"});
+                continue;
+            }
+
+            // Start the next candidate if there's nothing in flight or the current attempt is taking too long
+            if (t.m_attempts.empty() || now - t.m_last_attempt >= m_cfg.m_attempt_delay) {
+                while (!t.m_done && t.m_next_addr < t.m_addrs.size() && m_half_open < m_cfg.m_max_half_open) {
+                    const auto in_flight = t.m_attempts.size();
+                    auto sock = start_attempt(t, now);
+                    if (sock.has_value()) {
+                        finish(i, ConnectResult{std::move(sock), ""});
+                    } else if (t.m_attempts.size() > in_flight) {
+                        break;
+                    }
+                }
+            }
+            if (t.m_done) {
+                continue;
+            }
+            if (t.m_attempts.empty() && t.m_next_addr >= t.m_addrs.size()) {
+                finish(i, ConnectResult{{}, t.m_last_error});
+                continue;
+            }
+
+            next_wakeup = std::min(next_wakeup, t.m_deadline);
+            if (!t.m_attempts.empty() && t.m_next_addr < t.m_addrs.size()) {
+                next_wakeup = std::min(next_wakeup, t.m_last_attempt + m_cfg.m_attempt_delay);
+            }
+        }
+
+        fds.clear();
+        fd_targets.clear();
+        for (std::size_t i = 0; i < m_targets.size(); i++) {
+            for (const auto& a : m_targets[i].m_attempts) {
+                fds.push_back({a.m_fd, POLLOUT, 0});
+                fd_targets.push_back(i);
+            }
+        }
+        if (fds.empty()) {
+            continue;
+        }
+
+        const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_wakeup - now).count();
+        const int ready = poll(fds.data(), fds.size(), static_cast<int>(std::max<std::int64_t>(wait, 0)));
+        if (ready == -1 && errno != EINTR) {
+            throw Exception("smolsocket::Connector::run(): poll() failed: ", {errno}, {});
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        const auto completed_at = Clock::now();
+        for (std::size_t j = 0; j < fds.size(); j++) {
+            if (fds[j].revents == 0) {
+                continue;
+            }
+            auto& t = m_targets[fd_targets[j]];
+            // Might have been abandoned because a sibling attempt won during this very round
+            const auto attempt = std::find_if(t.m_attempts.begin(), t.m_attempts.end(),
+                                              [&](const Attempt& a) { return a.m_fd == fds[j].fd; });
+            if (t.m_done || attempt == t.m_attempts.end()) {
+                continue;
+            }
+            const Attempt a = *attempt;
+            t.m_attempts.erase(attempt);
+            m_half_open--;
+
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if (getsockopt(a.m_fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1) {
+                err = errno;
+            }
+            if (err == 0) {
+                set_blocking(a.m_fd);
+                finish(fd_targets[j], ConnectResult{Sock(a.m_fd, a.m_kind, t.m_proto), ""});
+            } else {
+                close(a.m_fd);
+                t.m_last_error = Exception("Failed to connect(): ", {err}, {}).m_msg;
+                // Don't sit out the attempt delay when we already know this one is dead
+                t.m_last_attempt = completed_at - m_cfg.m_attempt_delay;
+            }
+        }
+    }
+}
+
+std::vector<ConnectResult> Connector::run() {
+    std::vector<ConnectResult> results{};
+    results.resize(m_targets.size());
+    run([&](const std::size_t idx, ConnectResult&& res) { results.at(idx) = std::move(res); });
+    return results;
+}
+
+Listener::Listener(const std::string_view& addr, const std::uint16_t port, const Config& cfg)
+    : m_options(cfg.m_options) {
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+
+    struct addrinfo* res;
+    const std::string addr_str{addr};
+    const char* node = addr_str.empty() ? nullptr : addr_str.c_str();
+    const int err = getaddrinfo(node, std::to_string(port).c_str(), &hints, &res);
+    if (err != 0) {
+        throw Exception("smolsocket::Listener::Listener(): getaddrinfo() failed: ", {}, {err});
+    }
+    if (res == nullptr) {
+        throw Exception("smolsocket::Listener::Listener(): Lookup result contains no IP addresses", {}, {});
+    }
+    this->m_addr_kind = res->ai_family == AF_INET6 ? AddrKind::V6 : AddrKind::V4;
+
+    // Non-blocking, so that accept() can't get stuck when another thread wins the race for a connection
+    const int sock = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (sock == -1) {
+        freeaddrinfo(res);
+        throw Exception("smolsocket::Listener::Listener(): Failed to create socket: ", {errno}, {});
+    }
+    // The destructor doesn't run if this throws, so the socket is closed here until it's ours
+    try {
+        const int on = 1;
+        const int off = 0;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (cfg.m_reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            freeaddrinfo(res);
+            throw Exception("smolsocket::Listener::Listener(): Failed to set SO_REUSEPORT: ", {errno}, {});
+        }
+        if (res->ai_family == AF_INET6) {
+            // Accept IPv4 connections on the same socket too
+            setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        }
+
+        // Buffer sizes are inherited by accepted sockets, and must be in place before their handshake completes
+        Options buffers{};
+        buffers.m_rcvbuf = cfg.m_options.m_rcvbuf;
+        buffers.m_sndbuf = cfg.m_options.m_sndbuf;
+        try {
+            apply_options(sock, buffers);
+        } catch (const Exception&) {
+            freeaddrinfo(res);
+            throw;
+        }
+
+        if (bind(sock, res->ai_addr, res->ai_addrlen) == -1) {
+            freeaddrinfo(res);
+            throw Exception("smolsocket::Listener::Listener(): Failed to bind() socket: ", {errno}, {});
+        }
+        freeaddrinfo(res);
+        if (listen(sock, cfg.m_backlog) == -1) {
+            throw Exception("smolsocket::Listener::Listener(): Failed to listen() on socket: ", {errno}, {});
+        }
+    } catch (const Exception&) {
+        close(sock);
+        throw;
+    }
+    this->m_sockfd = sock;
+}
+
+Listener::Listener(Listener&& src)
+    : m_sockfd(src.m_sockfd), m_addr_kind(src.m_addr_kind), m_options(std::move(src.m_options)) {
+    src.m_sockfd = {};
+}
+
+Listener& Listener::operator=(Listener&& other) {
+    if (this != &other) {
+        if (this->m_sockfd.has_value()) {
+            close(this->m_sockfd.value());
+        }
+        this->m_sockfd = other.m_sockfd;
+        this->m_addr_kind = other.m_addr_kind;
+        this->m_options = std::move(other.m_options);
+        other.m_sockfd = {};
+    }
+    return *this;
+}
+
+std::uint16_t Listener::port() const {
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if (getsockname(this->m_sockfd.value(), reinterpret_cast<sockaddr*>(&addr), &len) == -1) {
+        throw Exception("smolsocket::Listener::port(): getsockname() failed: ", {errno}, {});
+    }
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<const sockaddr_in*>(&addr)->sin_port);
+}
+
+std::optional<Accepted> Listener::accept(const std::optional<std::uint64_t> timeout_millis) {
+    struct pollfd pfd {
+        this->m_sockfd.value(), POLLIN, 0
+    };
+    const int timeout = timeout_millis.has_value() ? static_cast<int>(timeout_millis.value()) : -1;
+    const int ready = poll(&pfd, 1, timeout);
+    if (ready == -1 && errno != EINTR) {
+        throw Exception("smolsocket::Listener::accept(): poll() failed: ", {errno}, {});
+    }
+    if (ready <= 0) {
+        return {};
+    }
+
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    // Accepted sockets are blocking, like every other Sock
+    const int fd = accept4(this->m_sockfd.value(), reinterpret_cast<sockaddr*>(&addr), &len, SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR) {
+            // Someone else got it first, or the remote gave up already
+            return {};
+        }
+        throw Exception("smolsocket::Listener::accept(): accept4() failed: ", {errno}, {});
+    }
+
+    const auto remote = Endpoint::from_sockaddr(addr);
+    Sock sock{fd, remote.kind(), Proto::TCP};
+    sock.apply(m_options);
+    return Accepted{std::move(sock), remote};
+}
+
+Listener::~Listener() {
+    if (this->m_sockfd.has_value()) {
+        close(this->m_sockfd.value());
+    }
+}
+
 std::string ip_to_str(const std::array<uint8_t, V6_Len_Bytes>& bytes, const AddrKind kind) {
-    std::array<char, std::max(V4_Len_Bytes, V6_Len_Bytes) + 1> buf;
+    std::array<char, INET6_ADDRSTRLEN> buf;
     std::fill(buf.begin(), buf.end(), '\0');
     const char* res;
     switch (kind) {
@@ -208,3 +890,15 @@ std::string ip_to_str(const std::array<uint8_t, V6_Len_Bytes>& bytes, const Addr
 }
 
 }  // namespace smolsocket
+
+std::size_t std::hash<smolsocket::Endpoint>::operator()(const smolsocket::Endpoint& e) const noexcept {
+    // Fold the address into 64 bits, then mix (splitmix64's finalizer) so that similar addresses spread out
+    std::uint64_t hi = 0;
+    std::uint64_t lo = 0;
+    std::memcpy(&hi, e.m_addr.data(), sizeof(hi));
+    std::memcpy(&lo, e.m_addr.data() + sizeof(hi), sizeof(lo));
+    std::uint64_t x = hi ^ (lo * 0x9e3779b97f4a7c15) ^ e.m_port;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return static_cast<std::size_t>(x ^ (x >> 31));
+}
@@ -13,12 +13,20 @@
 
 #include <bits/stdint-uintn.h>
 
+extern "C" {
+#include <sys/socket.h>
+}
+
 #include <array>
+#include <chrono>
 #include <cstdint>
 #include <exception>
+#include <functional>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace smolsocket {
@@ -36,11 +44,139 @@ class Exception : public std::exception {
     const char* what() const noexcept override;
 };
 
+// A socket address obtained from the resolver, ready to be passed to connect().
+struct ResolvedAddr {
+    sockaddr_storage m_storage;
+    socklen_t m_len;
+    AddrKind m_kind;
+};
+
+const size_t V4_Len_Bytes = 4;
+const size_t V6_Len_Bytes = 16;
+
+/*
+ * A numeric IP address and port.
+ *
+ * IPv4 addresses are stored v4-mapped (::ffff:a.b.c.d), so both families share one fixed-size representation
+ * that's cheap to copy, compare and hash. Use this rather than strings to identify remotes.
+ */
+struct Endpoint {
+    // Address in network byte order.
+    std::array<std::uint8_t, V6_Len_Bytes> m_addr{};
+    std::uint16_t m_port = 0;
+
+    // From 4 bytes of IPv4 address in network byte order.
+    static Endpoint from_v4(const std::uint8_t* addr, const std::uint16_t port);
+    // From 16 bytes of IPv6 address in network byte order.
+    static Endpoint from_v6(const std::uint8_t* addr, const std::uint16_t port);
+    // From an AF_INET or AF_INET6 socket address. Throws for other families.
+    static Endpoint from_sockaddr(const sockaddr_storage& addr);
+    // Parse a numeric address of either family. Returns none for anything else, like host names.
+    static std::optional<Endpoint> parse(const std::string_view& ip, const std::uint16_t port);
+    // Whether this is a (v4-mapped) IPv4 address.
+    AddrKind kind() const;
+    // The address in the usual notation of it's family, without the port.
+    std::string ip_str() const;
+    // Address and port, like "1.2.3.4:5" or "[::1]:5".
+    std::string to_string() const;
+    // The socket address to connect() or bind() to.
+    ResolvedAddr to_sockaddr() const;
+    bool operator==(const Endpoint&) const = default;
+};
+
+/*
+ * A caching wrapper around getaddrinfo().
+ *
+ * getaddrinfo() doesn't tell us the record's real TTL, so results are simply kept for a fixed duration.
+ * Numeric addresses bypass the cache, as parsing them is cheaper than a lookup.
+ *
+ * Thread-safe.
+ */
+class Resolver {
+   public:
+    explicit Resolver(std::chrono::seconds ttl);
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+    /*
+     * Resolve the given host.
+     * The result is ordered for Happy Eyeballs (RFC 8305): address families are interleaved, starting with IPv6.
+     *
+     * Will throw if the lookup fails or yields no usable addresses.
+     */
+    std::vector<ResolvedAddr> resolve(const std::string_view& host, const std::uint16_t port, const Proto proto);
+    // Drop all cached results.
+    void clear();
+    // The resolver shared by all sockets in the process.
+    static Resolver& shared();
+
+   private:
+    struct Entry {
+        std::vector<ResolvedAddr> m_addrs;
+        std::chrono::steady_clock::time_point m_expires;
+    };
+    std::chrono::seconds m_ttl;
+    std::mutex m_mutex;
+    std::unordered_map<std::string, Entry> m_cache;
+};
+
+/*
+ * Tunables for TCP sockets. Fields which are unset leave the OS default alone.
+ *
+ * Buffer sizes have to be known before connecting, as the window scale is negotiated during the TCP handshake.
+ * Note that setting them also disables the kernel's buffer autotuning for that socket.
+ */
+struct Options {
+    // Disable Nagle's algorithm, so small messages go out immediately.
+    std::optional<bool> m_nodelay{};
+    // SO_RCVBUF, in bytes.
+    std::optional<int> m_rcvbuf{};
+    // SO_SNDBUF, in bytes.
+    std::optional<int> m_sndbuf{};
+    // Only report the socket as writable once less than this many bytes are unsent, to keep send queues short.
+    std::optional<int> m_notsent_lowat{};
+    // Ack immediately instead of delaying. The kernel may fall back to delayed acks later on.
+    std::optional<bool> m_quickack{};
+    // Congestion control algorithm, e.g. "cubic" or "bbr". Has to be allowed by the system configuration.
+    std::optional<std::string> m_congestion{};
+
+    // Few, fast peers on a low-latency network: large fixed buffers.
+    static Options lan_bulk();
+    // Lots of peers on the internet: leave buffers to autotuning, but keep unsent data per socket small.
+    static Options wan_many();
+    // Look up one of the profiles above by name ("lan-bulk", "wan-many", or "default" for no tuning).
+    // Throws if the name is unknown.
+    static Options profile(const std::string_view& name);
+};
+
+// The kernel's view of a TCP connection (see TCP_INFO in tcp(7)).
+struct TcpInfo {
+    // Smoothed round trip time and it's variance.
+    std::chrono::microseconds m_rtt;
+    std::chrono::microseconds m_rtt_var;
+    // Congestion window, in segments.
+    std::uint32_t m_snd_cwnd;
+    // Slow start threshold, in segments.
+    std::uint32_t m_snd_ssthresh;
+    std::uint32_t m_snd_mss;
+    // Segments sent but not yet acknowledged.
+    std::uint32_t m_unacked;
+    // Retransmissions over the lifetime of the connection.
+    std::uint32_t m_total_retrans;
+};
+
+class Connector;
+class Listener;
+
 // A socket.
 class Sock {
    private:
     std::optional<int> m_sockfd;
 
+    // Take ownership of an already connected socket.
+    Sock(const int sockfd, const AddrKind kind, const Proto proto);
+    friend class Connector;
+    friend class Listener;
+
    public:
     AddrKind m_addr_kind;
     Proto m_proto;
@@ -49,12 +185,15 @@ class Sock {
      * Takes an IP or domain name string and a protocol,
      * resolves the address and opens a socket.
      *
-     * For now, only connect()-ing to socket is supported.
+     * This constructor connect()s; use a `Listener` to accept connections instead.
+     * If the name resolves to multiple addresses, they're raced against each other (see `Connector`).
      *
      * Will throw on failure or timeout.
      */
     Sock(const std::string_view& addr, const uint16_t port, const Proto proto,
          std::optional<std::uint64_t> timeout_millis);
+    // Like above, but for an address that's already known.
+    Sock(const Endpoint& remote, const Proto proto, std::optional<std::uint64_t> timeout_millis);
     // Moving out replaces the internal socket handle with an invalid one.
     Sock(Sock&& src);
     // Copying is banned, as there should only be a single object managing the socket.
@@ -66,17 +205,171 @@ class Sock {
      * If timeout is set, an exception will be raised if the transfer doesn't complete in time.
      */
     void send(const std::vector<uint8_t>& data, std::optional<std::uint64_t> timeout_millis);
+    /*
+     * Send `header`, followed by `len` bytes of the file `in_fd` from `offset` on, without them passing through
+     * userspace (`sendfile()`). The header is held back until the file's data follows, so they're sent together.
+     * If timeout is set, an exception will be raised if the transfer doesn't complete in time.
+     */
+    void send_file(const std::vector<uint8_t>& header, const int in_fd, const std::uint64_t offset,
+                   const std::size_t len, std::optional<std::uint64_t> timeout_millis);
     /*
      * Receive the given amount of data, retrying until it gets through.
      * If timeout is set, an exception will be raised if the transfer doesn't complete in time.
      */
     std::vector<std::uint8_t> recv(const std::size_t data_size, const std::optional<std::uint64_t> timeout_millis);
+    /*
+     * Receive a single datagram of at most `max_size` bytes (UDP only), truncating anything longer.
+     * Returns none if nothing arrived before the timeout.
+     */
+    std::optional<std::vector<std::uint8_t>> recv_datagram(const std::size_t max_size,
+                                                           const std::optional<std::uint64_t> timeout_millis);
+    /*
+     * Send as much of the given data as possible without blocking, returning how much that was (possibly 0).
+     * Meant for use with an event loop, which waits until the socket is writable (see `native_handle()`).
+     */
+    std::size_t send_some(const std::uint8_t* data, const std::size_t len);
+    /*
+     * Receive up to `len` bytes without blocking, returning how much that was.
+     * Returns none if nothing is available right now. Throws if the connection was closed.
+     */
+    std::optional<std::size_t> recv_some(std::uint8_t* buf, const std::size_t len);
+    // The OS-level socket handle, e.g. for waiting on it in an event loop. Don't close it.
+    int native_handle() const;
+    /*
+     * Apply the given tuning.
+     * Will throw if the kernel rejects an option (e.g. an unavailable congestion control algorithm).
+     */
+    void apply(const Options& opts);
+    // Query TCP statistics. Only valid for TCP sockets.
+    TcpInfo tcp_info() const;
 
     ~Sock();
 };
 
-const size_t V4_Len_Bytes = 4;
-const size_t V6_Len_Bytes = 16;
+// The outcome of a single `Connector` target.
+struct ConnectResult {
+    // Some if the connection was established.
+    std::optional<Sock> m_sock;
+    // Reason for the failure if not.
+    std::string m_error;
+};
+
+/*
+ * Establishes many connections in parallel, without blocking on any single one of them.
+ *
+ * The addresses of each target are raced Happy Eyeballs-style: a new attempt is started whenever the previous one
+ * hasn't completed within the attempt delay (or has failed), and the first one to connect wins.
+ * The number of sockets which are half-open at the same time is capped across all targets.
+ *
+ * Failures are reported through `ConnectResult` rather than thrown, as some peers being unreachable is expected.
+ */
+class Connector {
+   public:
+    struct Config {
+        // Maximum number of connection attempts in flight at once.
+        std::size_t m_max_half_open = 64;
+        // How long to wait for an attempt before starting the next one for the same target.
+        std::chrono::milliseconds m_attempt_delay{250};
+        // How long a target may take in total before being given up on.
+        std::chrono::milliseconds m_timeout{5000};
+        // Tuning applied to each socket before it connects.
+        Options m_options{};
+    };
+
+    explicit Connector(const Config& cfg, Resolver& resolver = Resolver::shared());
+    Connector(const Connector&) = delete;
+    Connector& operator=(const Connector&) = delete;
+    // Queue up a target to connect to. Returns the index the target's result will be reported under.
+    std::size_t add(const std::string_view& host, const std::uint16_t port, const Proto proto);
+    // Like above, but skip the resolver.
+    std::size_t add(const Endpoint& remote, const Proto proto);
+    /*
+     * Drive all queued targets to completion.
+     * The callback is invoked with the target's index as soon as that target succeeds or fails.
+     */
+    void run(const std::function<void(std::size_t, ConnectResult&&)>& on_done);
+    // Like above, but collect the results ordered by target index.
+    std::vector<ConnectResult> run();
+
+   private:
+    struct Attempt {
+        int m_fd;
+        AddrKind m_kind;
+    };
+    struct Target {
+        std::string m_host;
+        std::uint16_t m_port;
+        Proto m_proto;
+        std::vector<ResolvedAddr> m_addrs{};
+        std::size_t m_next_addr = 0;
+        std::vector<Attempt> m_attempts{};
+        std::chrono::steady_clock::time_point m_last_attempt{};
+        std::chrono::steady_clock::time_point m_deadline{};
+        std::string m_last_error{};
+        bool m_started = false;
+        bool m_done = false;
+    };
+
+    Config m_cfg;
+    Resolver& m_resolver;
+    std::vector<Target> m_targets;
+    std::size_t m_half_open = 0;
+
+    // Start connecting to the target's next address. Returns the socket if it connected immediately.
+    std::optional<Sock> start_attempt(Target& t, const std::chrono::steady_clock::time_point now);
+    void abandon_attempts(Target& t);
+};
+
+// A connection accepted by a `Listener`.
+struct Accepted {
+    Sock m_sock;
+    // Address of the remote end. IPv4 remotes of dual-stack listeners are reported as such.
+    Endpoint m_remote;
+};
+
+/*
+ * A TCP socket bound to a local address which accepts incoming connections.
+ *
+ * With `m_reuse_port` set, any number of listeners may bind the same port.
+ * The kernel then spreads incoming connections across them, so each one can be serviced by its own thread without
+ * any contention on a shared accept queue.
+ */
+class Listener {
+   public:
+    struct Config {
+        // Length of the kernel's queue of connections waiting to be accepted.
+        int m_backlog = 128;
+        // Set SO_REUSEPORT, allowing other listeners to share the port.
+        bool m_reuse_port = false;
+        // Tuning applied to each accepted socket. Buffer sizes are already set on the listening socket,
+        // so that accepted connections inherit them in time for the handshake.
+        Options m_options{};
+    };
+
+    /*
+     * Bind to the given numeric local address and port, and start listening.
+     * An empty address means all interfaces. An IPv6 address also accepts IPv4 connections.
+     * Port 0 picks a free port, see `port()`.
+     */
+    Listener(const std::string_view& addr, const std::uint16_t port, const Config& cfg);
+    Listener(Listener&& src);
+    Listener& operator=(Listener&&);
+    Listener(const Listener&) = delete;
+    Listener& operator=(const Listener&) = delete;
+    // The local port this listener is bound to.
+    std::uint16_t port() const;
+    /*
+     * Wait for an incoming connection.
+     * Returns none if the timeout expires first, or if the connection was aborted before it could be accepted.
+     */
+    std::optional<Accepted> accept(const std::optional<std::uint64_t> timeout_millis);
+    ~Listener();
+
+   private:
+    std::optional<int> m_sockfd;
+    AddrKind m_addr_kind;
+    Options m_options;
+};
 
 /*
  * Converts numeric repr (in network byte order) of an IP address to a string.
@@ -85,3 +378,8 @@ const size_t V6_Len_Bytes = 16;
 std::string ip_to_str(const std::array<uint8_t, V6_Len_Bytes>& bytes, const AddrKind kind);
 
 }  // namespace smolsocket
+
+template <>
+struct std::hash<smolsocket::Endpoint> {
+    std::size_t operator()(const smolsocket::Endpoint& e) const noexcept;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+/*
+ * A work-stealing deque (Chase and Lev, "Dynamic Circular Work-Stealing Deque", with the memory orderings of
+ * Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+ *
+ * One thread, the owner, pushes and pops at the bottom like a stack. Any other thread may steal from the top.
+ * None of these operations take locks, and the owner's usually don't even contend with thieves.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace stealdeque {
+
+// Holds pointers to T, which it does not own.
+template <typename T>
+class Deque {
+   public:
+    // Capacity grows as needed, starting at `initial_capacity` (rounded up to a power of two).
+    explicit Deque(const std::size_t initial_capacity = 256) : m_top(0), m_bottom(0), m_array(nullptr), m_arrays() {
+        std::size_t cap = 1;
+        while (cap < initial_capacity) {
+            cap *= 2;
+        }
+        m_arrays.push_back(std::make_unique<Array>(cap));
+        m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+    }
+    Deque(const Deque&) = delete;
+    Deque& operator=(const Deque&) = delete;
+
+    // Owner only.
+    void push(T* x) {
+        const auto b = m_bottom.load(std::memory_order_relaxed);
+        const auto t = m_top.load(std::memory_order_acquire);
+        auto* a = m_array.load(std::memory_order_relaxed);
+        if (b - t > static_cast<std::int64_t>(a->m_cap) - 1) {
+            a = grow(a, t, b);
+        }
+        a->put(b, x);
+        m_bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only. Returns the most recently pushed element, or nullptr if empty.
+    T* pop() {
+        const auto b = m_bottom.load(std::memory_order_relaxed) - 1;
+        auto* a = m_array.load(std::memory_order_relaxed);
+        // Must be ordered before reading `m_top`, so that a concurrent thief can't take the same element
+        m_bottom.store(b, std::memory_order_seq_cst);
+        auto t = m_top.load(std::memory_order_seq_cst);
+        if (t > b) {
+            // Empty
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* x = a->get(b);
+        if (t == b) {
+            // Last element, race thieves for it
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                x = nullptr;
+            }
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return x;
+    }
+
+    // Any thread. Returns the least recently pushed element, or nullptr if empty or another thread won the race.
+    T* steal() {
+        auto t = m_top.load(std::memory_order_seq_cst);
+        const auto b = m_bottom.load(std::memory_order_seq_cst);
+        if (t >= b) {
+            return nullptr;
+        }
+        auto* a = m_array.load(std::memory_order_acquire);
+        T* x = a->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return x;
+    }
+
+    // Any thread. Only a snapshot, which may be outdated by the time it's returned.
+    std::size_t size_approx() const {
+        const auto b = m_bottom.load(std::memory_order_relaxed);
+        const auto t = m_top.load(std::memory_order_relaxed);
+        return b > t ? static_cast<std::size_t>(b - t) : 0;
+    }
+
+   private:
+    struct Array {
+        std::size_t m_cap;
+        std::unique_ptr<std::atomic<T*>[]> m_buf;
+
+        explicit Array(const std::size_t cap) : m_cap(cap), m_buf(new std::atomic<T*>[cap]) {}
+        T* get(const std::int64_t i) const {
+            return m_buf[static_cast<std::size_t>(i) & (m_cap - 1)].load(std::memory_order_relaxed);
+        }
+        void put(const std::int64_t i, T* x) {
+            m_buf[static_cast<std::size_t>(i) & (m_cap - 1)].store(x, std::memory_order_relaxed);
+        }
+    };
+
+    alignas(64) std::atomic<std::int64_t> m_top;
+    alignas(64) std::atomic<std::int64_t> m_bottom;
+    std::atomic<Array*> m_array;
+    // Thieves may still be reading from replaced arrays, so they're only freed with the deque
+    std::vector<std::unique_ptr<Array>> m_arrays;
+
+    Array* grow(Array* old, const std::int64_t t, const std::int64_t b) {
+        auto bigger = std::make_unique<Array>(old->m_cap * 2);
+        for (auto i = t; i < b; i++) {
+            bigger->put(i, old->get(i));
+        }
+        auto* a = bigger.get();
+        m_arrays.push_back(std::move(bigger));
+        m_array.store(a, std::memory_order_release);
+        return a;
+    }
+};
+}  // namespace stealdeque
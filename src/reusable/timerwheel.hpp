@@ -0,0 +1,231 @@
+#pragma once
+
+/*
+ * A hierarchical timing wheel (Varghese and Lauck, "Hashed and Hierarchical Timing Wheels"), as used by the Linux
+ * kernel for it's timers.
+ *
+ * Time is counted in ticks, of whatever length the user likes. Each level is a ring of slots, where a slot of level L
+ * covers 64^L ticks. Timers go into the lowest level that reaches far enough, and are moved down a level whenever the
+ * wheel turns past the start of their slot, until they expire from level 0.
+ * Scheduling and cancelling is O(1), and so is turning the wheel by a tick, apart from moving the timers it carries.
+ * Timers are intrusive, so none of this allocates.
+ */
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace timerwheel {
+
+template <typename T>
+class Wheel;
+
+// Base class of everything that can be scheduled on a `Wheel`. Must not be destroyed or moved while scheduled.
+class Timer {
+   public:
+    Timer() = default;
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    bool is_scheduled() const { return m_next != nullptr; }
+    // The tick this timer expires on.
+    std::uint64_t expiry() const { return m_expiry; }
+
+   private:
+    template <typename T>
+    friend class Wheel;
+
+    // Doubly-linked, circular through the slot's sentinel
+    Timer* m_prev = nullptr;
+    Timer* m_next = nullptr;
+    std::uint64_t m_expiry = 0;
+    // Where this timer is, so the slot can be marked as empty on cancelling. Level `Levels` means it's about to fire.
+    std::uint8_t m_level = 0;
+    std::uint8_t m_slot = 0;
+};
+
+// Holds pointers to T, which must derive from `Timer`, and which it does not own.
+template <typename T>
+class Wheel {
+   public:
+    static constexpr std::size_t Slot_Bits = 6;
+    static constexpr std::size_t Slots = 1 << Slot_Bits;
+    static constexpr std::size_t Levels = 4;
+    // How far ahead timers can be placed. Later ones are parked at the far end, and placed again when reached.
+    static constexpr std::uint64_t Max_Delta = (std::uint64_t{1} << (Slot_Bits * Levels)) - 1;
+
+    // Start turning at tick `now`.
+    explicit Wheel(const std::uint64_t now = 0) : m_now(now), m_size(0), m_occupied(), m_slots() {
+        for (auto& level : m_slots) {
+            for (auto& s : level) {
+                s.m_prev = &s;
+                s.m_next = &s;
+            }
+        }
+    }
+    // The sentinels point at themselves
+    Wheel(const Wheel&) = delete;
+    Wheel& operator=(const Wheel&) = delete;
+
+    // Schedule `t` to fire on tick `expiry`. Ticks that have already passed fire on the next one.
+    // If `t` was already scheduled, it's rescheduled.
+    void schedule(T* t, const std::uint64_t expiry) {
+        Timer* timer = t;
+        if (timer->is_scheduled()) {
+            cancel(t);
+        }
+        timer->m_expiry = expiry > m_now ? expiry : m_now + 1;
+        place(timer);
+        m_size++;
+    }
+
+    // Unschedule `t`, if it was scheduled. Returns whether it was.
+    bool cancel(T* t) {
+        Timer* timer = t;
+        if (!timer->is_scheduled()) {
+            return false;
+        }
+        unlink(timer);
+        if (timer->m_level < Levels) {
+            auto& s = m_slots[timer->m_level][timer->m_slot];
+            if (s.m_next == &s) {
+                m_occupied[timer->m_level] &= ~(std::uint64_t{1} << timer->m_slot);
+            }
+        }
+        m_size--;
+        return true;
+    }
+
+    /*
+     * Turn the wheel up to and including tick `now`, calling `on_expired(T*)` for each timer that expired.
+     * The callback may schedule and cancel timers, including the one that just expired.
+     */
+    template <typename F>
+    void advance(const std::uint64_t now, F&& on_expired) {
+        while (m_now < now) {
+            // Skip over ticks on which nothing happens
+            const auto next = next_event();
+            if (!next.has_value() || next.value() > now) {
+                m_now = now;
+                return;
+            }
+            tick(next.value(), on_expired);
+        }
+    }
+
+    /*
+     * The first tick on which something may happen, none if no timers are scheduled.
+     * No timer expires earlier, but a timer further out may only be moved down a level on it, so check again then.
+     */
+    std::optional<std::uint64_t> next_event() const {
+        if (m_size == 0) {
+            return {};
+        }
+        std::optional<std::uint64_t> first{};
+        for (std::size_t level = 0; level < Levels; level++) {
+            if (m_occupied[level] == 0) {
+                continue;
+            }
+            const std::size_t shift = Slot_Bits * level;
+            // Slots of the current position have been handled already, so start looking at the one after
+            const std::uint64_t pos = (m_now >> shift) + 1;
+            const auto rotated = std::rotr(m_occupied[level], static_cast<int>(pos & (Slots - 1)));
+            const std::uint64_t at = (pos + static_cast<std::uint64_t>(std::countr_zero(rotated))) << shift;
+            if (!first.has_value() || at < first.value()) {
+                first = at;
+            }
+        }
+        return first;
+    }
+
+    // The last tick the wheel has been turned to.
+    std::uint64_t now() const { return m_now; }
+    // Number of scheduled timers.
+    std::size_t size() const { return m_size; }
+
+   private:
+    std::uint64_t m_now;
+    std::size_t m_size;
+    // Per level, a bit for each slot that has timers in it.
+    std::array<std::uint64_t, Levels> m_occupied;
+    std::array<std::array<Timer, Slots>, Levels> m_slots;
+
+    // Put the timer into the slot it belongs to, given the current tick.
+    void place(Timer* timer) {
+        const auto delta = timer->m_expiry - m_now;
+        const auto at = delta > Max_Delta ? m_now + Max_Delta : timer->m_expiry;
+        std::size_t level = 0;
+        while (level < Levels - 1 && (at - m_now) >> (Slot_Bits * (level + 1)) != 0) {
+            level++;
+        }
+        const auto slot = static_cast<std::uint8_t>((at >> (Slot_Bits * level)) & (Slots - 1));
+        timer->m_level = static_cast<std::uint8_t>(level);
+        timer->m_slot = slot;
+        auto& s = m_slots[level][slot];
+        timer->m_prev = s.m_prev;
+        timer->m_next = &s;
+        s.m_prev->m_next = timer;
+        s.m_prev = timer;
+        m_occupied[level] |= std::uint64_t{1} << slot;
+    }
+
+    static void unlink(Timer* timer) {
+        timer->m_prev->m_next = timer->m_next;
+        timer->m_next->m_prev = timer->m_prev;
+        timer->m_prev = nullptr;
+        timer->m_next = nullptr;
+    }
+
+    // Move all timers out of a slot into `out`, marking them as being in neither.
+    void take_slot(const std::size_t level, const std::size_t slot, Timer& out) {
+        auto& s = m_slots[level][slot];
+        m_occupied[level] &= ~(std::uint64_t{1} << slot);
+        if (s.m_next == &s) {
+            return;
+        }
+        out.m_next = s.m_next;
+        out.m_prev = s.m_prev;
+        out.m_next->m_prev = &out;
+        out.m_prev->m_next = &out;
+        s.m_next = &s;
+        s.m_prev = &s;
+        for (auto* t = out.m_next; t != &out; t = t->m_next) {
+            t->m_level = Levels;
+        }
+    }
+
+    template <typename F>
+    void tick(const std::uint64_t t, F& on_expired) {
+        m_now = t;
+        // Higher levels first, so that timers moved down are moved further down right away if it's their time
+        for (std::size_t level = Levels - 1; level > 0; level--) {
+            const std::size_t shift = Slot_Bits * level;
+            if ((t & ((std::uint64_t{1} << shift) - 1)) != 0) {
+                continue;
+            }
+            Timer moving{};
+            moving.m_prev = &moving;
+            moving.m_next = &moving;
+            take_slot(level, (t >> shift) & (Slots - 1), moving);
+            while (moving.m_next != &moving) {
+                auto* timer = moving.m_next;
+                unlink(timer);
+                place(timer);
+            }
+        }
+
+        Timer expired{};
+        expired.m_prev = &expired;
+        expired.m_next = &expired;
+        take_slot(0, t & (Slots - 1), expired);
+        while (expired.m_next != &expired) {
+            auto* timer = expired.m_next;
+            unlink(timer);
+            m_size--;
+            on_expired(static_cast<T*>(timer));
+        }
+    }
+};
+}  // namespace timerwheel
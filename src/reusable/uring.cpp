@@ -0,0 +1,165 @@
+#include "uring.hpp"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <system_error>
+
+namespace uring {
+
+static int sys_setup(const unsigned entries, io_uring_params* p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_enter(const int fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int sys_register(const int fd, const unsigned opcode, const void* arg, const unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+static void* map_ring(const int fd, const std::size_t size, const off_t offset) {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (p == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "uring::Ring: Failed to map ring");
+    }
+    return p;
+}
+
+template <typename T>
+static T* at(void* base, const std::size_t offset) {
+    return reinterpret_cast<T*>(static_cast<std::uint8_t*>(base) + offset);
+}
+
+Ring::Ring(const unsigned entries)
+    : m_fd(-1),
+      m_sqe_head(0),
+      m_sqe_tail(0),
+      m_sq_ring(nullptr),
+      m_sq_ring_size(0),
+      m_cq_ring(nullptr),
+      m_cq_ring_size(0),
+      m_sqes(nullptr),
+      m_sqes_size(0) {
+    io_uring_params p{};
+    m_fd = sys_setup(entries, &p);
+    if (m_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "uring::Ring: io_uring_setup() failed");
+    }
+    try {
+        m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        // Newer kernels map both rings at once
+        if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+            m_sq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+            m_sq_ring = map_ring(m_fd, m_sq_ring_size, IORING_OFF_SQ_RING);
+            m_cq_ring = m_sq_ring;
+        } else {
+            m_sq_ring = map_ring(m_fd, m_sq_ring_size, IORING_OFF_SQ_RING);
+            m_cq_ring = map_ring(m_fd, m_cq_ring_size, IORING_OFF_CQ_RING);
+        }
+        m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe*>(map_ring(m_fd, m_sqes_size, IORING_OFF_SQES));
+    } catch (...) {
+        unmap();
+        throw;
+    }
+
+    m_sq_head = at<unsigned>(m_sq_ring, p.sq_off.head);
+    m_sq_tail = at<unsigned>(m_sq_ring, p.sq_off.tail);
+    m_sq_mask = *at<unsigned>(m_sq_ring, p.sq_off.ring_mask);
+    m_sq_entries = p.sq_entries;
+    m_sq_array = at<unsigned>(m_sq_ring, p.sq_off.array);
+    m_cq_head = at<unsigned>(m_cq_ring, p.cq_off.head);
+    m_cq_tail = at<unsigned>(m_cq_ring, p.cq_off.tail);
+    m_cq_mask = *at<unsigned>(m_cq_ring, p.cq_off.ring_mask);
+    m_cqes = at<io_uring_cqe>(m_cq_ring, p.cq_off.cqes);
+
+    // Entries are always used in ring order, so the indirection array maps each slot to itself
+    for (unsigned i = 0; i < m_sq_entries; i++) {
+        m_sq_array[i] = i;
+    }
+    m_sqe_head = m_sqe_tail = *m_sq_tail;
+}
+
+Ring::~Ring() { unmap(); }
+
+void Ring::unmap() {
+    if (m_sqes != nullptr) {
+        munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_ring != nullptr && m_cq_ring != m_sq_ring) {
+        munmap(m_cq_ring, m_cq_ring_size);
+    }
+    if (m_sq_ring != nullptr) {
+        munmap(m_sq_ring, m_sq_ring_size);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+io_uring_sqe* Ring::get_sqe() {
+    const unsigned head = std::atomic_ref<unsigned>(*m_sq_head).load(std::memory_order_acquire);
+    if (m_sqe_tail - head >= m_sq_entries) {
+        return nullptr;
+    }
+    auto* sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    m_sqe_tail++;
+    return sqe;
+}
+
+void Ring::submit() {
+    const unsigned to_submit = m_sqe_tail - m_sqe_head;
+    if (to_submit == 0) {
+        return;
+    }
+    const unsigned tail = *m_sq_tail;
+    std::atomic_ref<unsigned>(*m_sq_tail).store(m_sqe_tail, std::memory_order_release);
+    m_sqe_head = m_sqe_tail;
+    while (sys_enter(m_fd, to_submit, 0, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            const int err = errno;
+            // The kernel didn't consume any, so they can be taken back before it sees them next time
+            std::atomic_ref<unsigned>(*m_sq_tail).store(tail, std::memory_order_release);
+            m_sqe_head = m_sqe_tail = tail;
+            throw std::system_error(err, std::generic_category(), "uring::Ring: Failed to submit");
+        }
+    }
+}
+
+void Ring::wait(const unsigned min_complete) {
+    while (sys_enter(m_fd, 0, min_complete, IORING_ENTER_GETEVENTS) < 0) {
+        if (errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "uring::Ring: Failed to wait for completions");
+        }
+    }
+}
+
+void Ring::register_files(const std::span<const int> fds) {
+    if (sys_register(m_fd, IORING_REGISTER_FILES, fds.data(), static_cast<unsigned>(fds.size())) < 0) {
+        throw std::system_error(errno, std::generic_category(), "uring::Ring: Failed to register files");
+    }
+}
+
+void Ring::update_files(const unsigned offset, const std::span<const int> fds) {
+    io_uring_files_update update{};
+    update.offset = offset;
+    update.fds = reinterpret_cast<std::uint64_t>(fds.data());
+    if (sys_register(m_fd, IORING_REGISTER_FILES_UPDATE, &update, static_cast<unsigned>(fds.size())) < 0) {
+        throw std::system_error(errno, std::generic_category(), "uring::Ring: Failed to update files");
+    }
+}
+
+}  // namespace uring
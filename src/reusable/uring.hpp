@@ -0,0 +1,83 @@
+/*
+ * A minimal wrapper around a Linux io_uring instance, using the raw syscalls rather than liburing.
+ *
+ * Only covers what's needed to submit entries and collect completions; entries are filled in by the caller using the
+ * kernel's structs. Not thread-safe by itself, except that completions may be collected (`wait()`, `reap()`) by one
+ * thread while another one submits, as the two rings are independent.
+ */
+
+#pragma once
+
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace uring {
+
+class Ring {
+   public:
+    // Create a ring with room for (at least) `entries` submissions. Throws `std::system_error` if io_uring isn't
+    // available.
+    explicit Ring(const unsigned entries);
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+    ~Ring();
+
+    // The next free submission entry, zeroed, or nullptr if the submission queue is full.
+    // The kernel only sees it once submitted.
+    io_uring_sqe* get_sqe();
+    // Pass all entries gotten so far to the kernel, in a single syscall.
+    // Throws `std::system_error` if the kernel took none of them, in which case they're dropped.
+    void submit();
+    // Block until there's at least `min_complete` completions to collect.
+    void wait(const unsigned min_complete);
+    // Call `f(const io_uring_cqe&)` for each completion there is, and free their slots. Returns how many there were.
+    template <typename F>
+    unsigned reap(F&& f) {
+        unsigned head = *m_cq_head;
+        const unsigned tail = std::atomic_ref<unsigned>(*m_cq_tail).load(std::memory_order_acquire);
+        unsigned n = 0;
+        for (; head != tail; head++, n++) {
+            f(m_cqes[head & m_cq_mask]);
+        }
+        std::atomic_ref<unsigned>(*m_cq_head).store(head, std::memory_order_release);
+        return n;
+    }
+
+    // Register file descriptors, so entries flagged `IOSQE_FIXED_FILE` can refer to them by their index.
+    // That spares the kernel looking up the file on every operation.
+    // Slots may be -1, to be filled in later by `update_files()`.
+    void register_files(const std::span<const int> fds);
+    // Replace the registered files from slot `offset` on. -1 empties a slot.
+    void update_files(const unsigned offset, const std::span<const int> fds);
+
+   private:
+    int m_fd;
+    // Entries gotten, but not submitted yet
+    unsigned m_sqe_head;
+    unsigned m_sqe_tail;
+
+    void* m_sq_ring;
+    std::size_t m_sq_ring_size;
+    void* m_cq_ring;
+    std::size_t m_cq_ring_size;
+    io_uring_sqe* m_sqes;
+    std::size_t m_sqes_size;
+
+    unsigned* m_sq_tail;
+    unsigned* m_sq_head;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned* m_sq_array;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+
+    void unmap();
+};
+
+}  // namespace uring
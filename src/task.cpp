@@ -0,0 +1,68 @@
+#include "task.hpp"
+
+#include <coroutine>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include "job.hpp"
+
+namespace tt::job {
+
+// Continues a suspended coroutine.
+class ResumeJob final : public IJob {
+   public:
+    ResumeJob(std::coroutine_handle<> handle, const Priority priority) : m_handle(handle), m_priority(priority) {}
+    void process() override { m_handle.resume(); }
+    Priority priority() const override { return m_priority; }
+
+   private:
+    std::coroutine_handle<> m_handle;
+    Priority m_priority;
+};
+
+// Where a coroutine will be resumed, which is wherever it's running now.
+static JobQueue& current_queue() {
+    auto* q = JobQueue::current();
+    if (q == nullptr) {
+        throw std::logic_error("Coroutines can only suspend while running as a job");
+    }
+    return *q;
+}
+
+CoroJob::CoroJob(Task<void> task, const Priority priority) : m_task(std::move(task)), m_priority(priority) {}
+
+void CoroJob::process() {
+    auto& q = current_queue();
+    // From now on, the coroutine owns itself. It's released from the queue once finished.
+    auto handle = std::exchange(m_task.m_handle, {});
+    handle.promise().m_queue = &q;
+    q.retain();
+    handle.resume();
+}
+
+Priority CoroJob::priority() const { return m_priority; }
+
+void resume_on(JobQueue& queue, std::coroutine_handle<> handle, const Priority priority) {
+    queue.enqueue(std::make_unique<ResumeJob>(handle, priority));
+}
+
+bool Event::Awaiter::await_ready() const noexcept { return m_event.is_set(); }
+
+bool Event::Awaiter::await_suspend(std::coroutine_handle<> handle) {
+    m_event.m_queue = &current_queue();
+    m_event.m_priority = JobQueue::current_priority();
+    m_event.m_waiter = handle;
+    auto expected = State::Empty;
+    // Fails if the event was set in the meantime, in which case we just continue
+    return m_event.m_state.compare_exchange_strong(expected, State::Waiting);
+}
+
+void Event::set() {
+    if (m_state.exchange(State::Set) == State::Waiting) {
+        resume_on(*m_queue, m_waiter, m_priority);
+    }
+}
+
+bool Event::is_set() const { return m_state == State::Set; }
+}  // namespace tt::job
@@ -0,0 +1,177 @@
+#pragma once
+
+//! Coroutine support for the job system.
+//! A coroutine job suspends while it waits (e.g. for I/O, see `io::Reactor`) instead of blocking a worker thread,
+//! and is resumed on the job queue once it can continue. A suspended coroutine only costs it's frame.
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "job.hpp"
+
+namespace tt::job {
+
+template <typename T>
+class Task;
+
+namespace detail {
+struct PromiseBase {
+    /// The coroutine awaiting this one, if any.
+    std::coroutine_handle<> m_continuation{};
+    std::exception_ptr m_error{};
+    /// Only set for the outermost coroutine of a job, which owns itself once started.
+    JobQueue* m_queue = nullptr;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { m_error = std::current_exception(); }
+};
+
+template <typename Promise>
+struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+        auto& p = h.promise();
+        if (p.m_continuation) {
+            return p.m_continuation;
+        }
+        if (p.m_queue != nullptr) {
+            // Nobody is waiting for the outermost coroutine, so it cleans up after itself
+            auto* q = p.m_queue;
+            auto error = p.m_error;
+            h.destroy();
+            if (error) {
+                q->fail(error);
+            }
+            q->release();
+        }
+        return std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    std::optional<T> m_value{};
+
+    Task<T> get_return_object();
+    FinalAwaiter<Promise> final_suspend() noexcept { return {}; }
+    template <typename U>
+    void return_value(U&& value) {
+        m_value.emplace(std::forward<U>(value));
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    FinalAwaiter<Promise> final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+};
+}  // namespace detail
+
+/// A coroutine, which starts running once it's awaited (or wrapped in a `CoroJob`).
+///
+/// Awaiting a task yields it's result, or rethrows the exception it failed with.
+template <typename T = void>
+class [[nodiscard]] Task {
+   public:
+    using promise_type = detail::Promise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    Task(Task&& src) noexcept : m_handle(std::exchange(src.m_handle, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    Task& operator=(Task&&) = delete;
+    ~Task() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        m_handle.promise().m_continuation = awaiting;
+        return m_handle;
+    }
+    T await_resume() {
+        auto& p = m_handle.promise();
+        if (p.m_error) {
+            std::rethrow_exception(p.m_error);
+        }
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(p.m_value.value());
+        }
+    }
+
+   private:
+    friend class CoroJob;
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object() {
+    return Task<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)};
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() {
+    return Task<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)};
+}
+
+/// Runs a coroutine as a job.
+///
+/// The job's `process()` returns as soon as the coroutine first suspends, the rest runs in jobs enqueued as it's
+/// resumed. `JobQueue::process()` keeps going until the coroutine has finished, and rethrows what it failed with.
+/// Note that jobs depending on this one may run before the coroutine has finished.
+class CoroJob final : public IJob {
+   public:
+    /// Every time it's resumed, the coroutine runs with the given priority.
+    explicit CoroJob(Task<void> task, const Priority priority = Priority::Network);
+    CoroJob() = delete;
+    void process() override;
+    Priority priority() const override;
+
+   private:
+    Task<void> m_task;
+    Priority m_priority;
+};
+
+/// Resume a suspended coroutine in a new job on the given queue. May be called from any thread.
+void resume_on(JobQueue& queue, std::coroutine_handle<> handle, const Priority priority);
+
+/// Something a coroutine can wait for, which is completed by another thread, e.g. on a disk I/O completion.
+///
+/// Only a single coroutine may wait for it. It's resumed on the job queue it was running on, with the same priority.
+class Event {
+   public:
+    class Awaiter {
+       public:
+        bool await_ready() const noexcept;
+        bool await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const noexcept {}
+
+       private:
+        friend class Event;
+        explicit Awaiter(Event& event) : m_event(event) {}
+        Event& m_event;
+    };
+
+    Event() = default;
+    Event(const Event&) = delete;
+    Event& operator=(const Event&) = delete;
+    /// Complete the event, resuming the waiting coroutine if there is one. May be called from any thread.
+    void set();
+    bool is_set() const;
+    Awaiter operator co_await() { return Awaiter{*this}; }
+
+   private:
+    enum class State { Empty, Waiting, Set };
+    std::atomic<State> m_state{State::Empty};
+    std::coroutine_handle<> m_waiter{};
+    JobQueue* m_queue = nullptr;
+    Priority m_priority = Priority::Network;
+};
+}  // namespace tt::job
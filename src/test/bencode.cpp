@@ -6,6 +6,9 @@
 #include <deque>
 #include <map>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 using namespace tt::bencode;
 
@@ -69,3 +72,30 @@ TEST(BEncode, parse_dict) {
     ASSERT_EQ(got.value().type, ObjectType::Dict);
     // TODO: Recursively check whether the values match, too tired right now
 }
+
+TEST(BEncode, view_dict) {
+    const std::string_view test_dict{
+        "d4:dictd3:1234:test3:4565:thinge4:listl11:list-item-111:list-item-2e6:numberi-123456e6:string5:valueegarbage"};
+
+    const View view{test_dict};
+    ASSERT_EQ(view.type(), ObjectType::Dict);
+    ASSERT_EQ(view.raw(), test_dict.substr(0, test_dict.size() - 7));
+    ASSERT_EQ(view.find("number")->integer(), -123456);
+    ASSERT_EQ(view.find("string")->str(), "value");
+    ASSERT_EQ(view.find("dict")->find("456")->str(), "thing");
+    ASSERT_FALSE(view.find("missing").has_value());
+    ASSERT_FALSE(view.find("string")->integer().has_value());
+
+    std::vector<std::string_view> items{};
+    ASSERT_TRUE(view.find("list")->for_each([&](const View& item) { items.push_back(item.str().value()); }));
+    ASSERT_EQ(items, (std::vector<std::string_view>{"list-item-1", "list-item-2"}));
+}
+
+TEST(BEncode, view_rejects_malformed) {
+    for (const std::string_view bad : {"", "x", "5:abc", "i12", "ie", "i1x2e", "l3:abc", "d3:abce", "di1ei2ee"}) {
+        ASSERT_THROW(View{bad}, Exception) << bad;
+    }
+    // Deeply nested input must not blow the stack
+    const std::string nested(100000, 'l');
+    ASSERT_THROW(View{nested}, Exception);
+}
@@ -0,0 +1,153 @@
+#include "../torrent/cache.hpp"
+
+#include <gtest/gtest.h>
+#include <sys/uio.h>
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../job.hpp"
+#include "../task.hpp"
+#include "../torrent/piece.hpp"
+#include "../torrent/shared_constants.hpp"
+#include "../torrent/storage.hpp"
+#include "helpers.hpp"
+
+using namespace tt;
+
+class Cache : public TempFileTest {
+   protected:
+    Cache() : TempFileTest("toytorrent_test_cache.bin") {}
+};
+
+TEST_F(Cache, evicts_the_least_recently_used_clean_blocks) {
+    storage::PosixStorage s{m_path};
+    std::vector<std::uint8_t> on_disk(16, 7);
+    s.write(0, std::array<iovec, 1>{iovec{on_disk.data(), on_disk.size()}});
+    cache::Cache c{{.m_budget = 12}};
+
+    c.insert(s, 0, {0, 0, 0, 0});
+    c.insert(s, 4, {1, 1, 1, 1});
+    c.insert(s, 8, {2, 2, 2, 2});
+    // Used, so the one at 4 is the oldest now
+    ASSERT_EQ(*c.read(s, 0, 4), std::vector<std::uint8_t>(4, 0));
+    c.insert(s, 12, {3, 3, 3, 3});
+
+    ASSERT_EQ(*c.read(s, 8, 4), std::vector<std::uint8_t>(4, 2));
+    ASSERT_EQ(*c.read(s, 4, 4), std::vector<std::uint8_t>(4, 7));
+    const auto stats = c.stats();
+    ASSERT_EQ(stats.m_hits, 2);
+    ASSERT_EQ(stats.m_misses, 1);
+    ASSERT_EQ(stats.m_clean_bytes, 12);
+    ASSERT_EQ(stats.m_evictions, 2);
+
+    c.forget(s);
+    ASSERT_EQ(c.stats().m_clean_bytes, 0);
+}
+
+TEST_F(Cache, memory_set_aside_is_taken_out_of_the_budget) {
+    storage::PosixStorage s{m_path};
+    cache::Cache c{{.m_budget = 12}};
+    c.insert(s, 0, {0, 0, 0, 0});
+    c.insert(s, 4, {1, 1, 1, 1});
+
+    auto set_aside = c.set_aside(8);
+    auto stats = c.stats();
+    ASSERT_EQ(stats.m_set_aside_bytes, 8);
+    ASSERT_EQ(stats.m_clean_bytes, 4);
+    ASSERT_EQ(stats.m_evictions, 1);
+    // Only room for one block
+    c.insert(s, 8, {2, 2, 2, 2});
+    ASSERT_EQ(c.stats().m_clean_bytes, 4);
+    ASSERT_EQ(c.stats().m_evictions, 2);
+
+    set_aside.release();
+    c.insert(s, 12, {3, 3, 3, 3});
+    stats = c.stats();
+    ASSERT_EQ(stats.m_set_aside_bytes, 0);
+    ASSERT_EQ(stats.m_clean_bytes, 8);
+    ASSERT_EQ(stats.m_evictions, 2);
+}
+
+static job::Task<void> hold(cache::Cache& c, const std::uint64_t bytes, cache::Reservation& held) {
+    held = co_await c.reserve(bytes);
+}
+
+static job::Task<void> reserve_then_flag(cache::Cache& c, const std::uint64_t bytes, bool& granted) {
+    const auto reservation = co_await c.reserve(bytes);
+    granted = true;
+}
+
+TEST_F(Cache, reserving_past_the_watermark_waits_for_dirty_bytes_to_be_released) {
+    cache::Cache c{{.m_budget = 100, .m_dirty_watermark = 50}};
+    job::JobQueue q{1};
+    cache::Reservation held{};
+    q.enqueue(std::make_unique<job::CoroJob>(hold(c, 40, held)));
+    q.process();
+    ASSERT_EQ(c.stats().m_dirty_bytes, 40);
+
+    bool granted = false;
+    q.enqueue(std::make_unique<job::CoroJob>(reserve_then_flag(c, 40, granted)));
+    std::thread releaser{[&]() {
+        while (c.stats().m_throttled == 0) {
+            std::this_thread::yield();
+        }
+        EXPECT_FALSE(granted);
+        held.release();
+    }};
+    q.process();
+    releaser.join();
+
+    ASSERT_TRUE(granted);
+    ASSERT_EQ(c.stats().m_dirty_bytes, 0);
+}
+
+static job::Task<void> record_state(const piece::Piece& p, piece::State& seen) {
+    seen = p.m_state;
+    co_return;
+}
+
+static job::Task<void> reserve_then_flush(piece::Piece& p, storage::IStorage& s, cache::Cache& c,
+                                          piece::State& seen_once_on_disk) {
+    auto reservation = co_await c.reserve(p.m_size);
+    job::JobQueue::current()->enqueue(piece::make_flush_job(
+        p, s, c, std::move(reservation), std::make_unique<job::CoroJob>(record_state(p, seen_once_on_disk))));
+}
+
+TEST_F(Cache, flushed_pieces_are_moved_into_the_cache) {
+    storage::PosixStorage s{m_path};
+    cache::Cache c{};
+    const std::array<std::uint8_t, piece::Piece_Hash_Len> no_hash{};
+    piece::Piece good{2 * peer::Request_Subpiece_Size, 1, no_hash, piece::State::HaveVerified};
+    piece::Piece bad{2 * peer::Request_Subpiece_Size, 0, no_hash, piece::State::HaveUnverified};
+    for (std::size_t i = 0; i < 2; i++) {
+        good.set_downloaded_subpiece_data(i, std::vector<std::uint8_t>(peer::Request_Subpiece_Size, 0x11));
+        bad.set_downloaded_subpiece_data(i, std::vector<std::uint8_t>(peer::Request_Subpiece_Size, 0x22));
+    }
+
+    job::JobQueue q{};
+    auto good_seen = piece::State::Unwanted;
+    auto bad_seen = piece::State::Unwanted;
+    q.enqueue(std::make_unique<job::CoroJob>(reserve_then_flush(good, s, c, good_seen)));
+    q.enqueue(std::make_unique<job::CoroJob>(reserve_then_flush(bad, s, c, bad_seen)));
+    q.process();
+    ASSERT_EQ(good_seen, piece::State::OnDisk);
+    ASSERT_EQ(bad_seen, piece::State::Unwanted);
+
+    ASSERT_FALSE(good.m_subpieces[0].has_value());
+    ASSERT_EQ(good.m_state.load(), piece::State::OnDisk);
+    ASSERT_EQ(*c.read(s, 3 * peer::Request_Subpiece_Size, peer::Request_Subpiece_Size),
+              std::vector<std::uint8_t>(peer::Request_Subpiece_Size, 0x11));
+    // What didn't check out is thrown away, to be downloaded again
+    ASSERT_FALSE(bad.m_subpieces[0].has_value());
+    ASSERT_EQ(bad.m_state.load(), piece::State::Want);
+    const auto stats = c.stats();
+    ASSERT_EQ(stats.m_hits, 1);
+    ASSERT_EQ(stats.m_dirty_bytes, 0);
+    ASSERT_EQ(stats.m_clean_bytes, good.m_size);
+}
@@ -2,11 +2,25 @@
 
 #include <fmt/core.h>
 
+extern "C" {
+#include <arpa/inet.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include <array>
 #include <boost/process.hpp>
 #include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <memory>
 #include <string>
 #include <string_view>
 
+#include "../torrent/storage.hpp"
+
 namespace bp = boost::process;
 TorrentSwarmTestCtx::TorrentSwarmTestCtx(const std::string_view& torrent_file_path,
                                          const std::string_view& torrent_data_dir_path) {
@@ -43,6 +57,90 @@ TrackerTestCtx::TrackerTestCtx() : m_opentracker(bp::search_path("opentracker"),
 
 TrackerTestCtx::~TrackerTestCtx() { this->m_opentracker.terminate(); }
 
+UdpTrackerStandIn::UdpTrackerStandIn() : m_fd(socket(AF_INET, SOCK_DGRAM, 0)), m_port(0) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(m_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    m_port = ntohs(addr.sin_port);
+    // Wake up regularly to check whether we should stop
+    timeval timeout{0, 20000};
+    setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    m_thread = std::thread(&UdpTrackerStandIn::serve, this);
+}
+
+UdpTrackerStandIn::~UdpTrackerStandIn() {
+    m_stop = true;
+    m_thread.join();
+    close(m_fd);
+}
+
+std::uint16_t UdpTrackerStandIn::port() const { return m_port; }
+
+void UdpTrackerStandIn::serve() {
+    auto put32 = [](std::vector<std::uint8_t>& buf, std::uint32_t x) {
+        x = htonl(x);
+        const auto* p = reinterpret_cast<std::uint8_t*>(&x);
+        buf.insert(buf.end(), p, p + 4);
+    };
+    std::array<std::uint8_t, 2048> buf{};
+    while (!m_stop) {
+        sockaddr_storage from{};
+        socklen_t from_len = sizeof(from);
+        const auto len = recvfrom(m_fd, buf.data(), buf.size(), 0, reinterpret_cast<sockaddr*>(&from), &from_len);
+        if (len < 16 || m_silent) {
+            continue;
+        }
+        std::uint64_t conn_id;
+        std::uint32_t action, txid;
+        std::memcpy(&conn_id, buf.data(), 8);
+        std::memcpy(&action, buf.data() + 8, 4);
+        std::memcpy(&txid, buf.data() + 12, 4);
+        conn_id = be64toh(conn_id);
+        action = ntohl(action);
+
+        std::vector<std::uint8_t> resp{};
+        put32(resp, action);
+        resp.insert(resp.end(), buf.data() + 12, buf.data() + 16);
+        if (action == 0) {
+            m_connects++;
+            const std::uint64_t id = htobe64(Connection_Id);
+            const auto* p = reinterpret_cast<const std::uint8_t*>(&id);
+            resp.insert(resp.end(), p, p + 8);
+        } else if (conn_id != Connection_Id) {
+            resp.clear();
+            put32(resp, 3);
+            resp.insert(resp.end(), buf.data() + 12, buf.data() + 16);
+            const std::string msg{"bad connection id"};
+            resp.insert(resp.end(), msg.begin(), msg.end());
+        } else if (action == 1) {
+            m_announces++;
+            if (m_drop_announces > 0) {
+                m_drop_announces--;
+                continue;
+            }
+            // Interval, leechers, seeders
+            put32(resp, 1800);
+            put32(resp, 1);
+            put32(resp, 2);
+            // Two peers: 10.0.0.1:6881 and 10.0.0.2:6882
+            resp.insert(resp.end(), {10, 0, 0, 1, 0x1a, 0xe1, 10, 0, 0, 2, 0x1a, 0xe2});
+        } else if (action == 2) {
+            m_scrapes++;
+            const auto num_hashes = (static_cast<std::size_t>(len) - 16) / 20;
+            for (std::size_t i = 0; i < num_hashes; i++) {
+                // Seeders, completed, leechers
+                put32(resp, 5);
+                put32(resp, 7);
+                put32(resp, 3);
+            }
+        }
+        sendto(m_fd, resp.data(), resp.size(), 0, reinterpret_cast<sockaddr*>(&from), from_len);
+    }
+}
+
 IntegrationTestCtx::IntegrationTestCtx(const std::string_view& torrent_file_path,
                                        const std::string_view& torrent_data_dir_path)
     : m_have_handshaked(false), m_tracker(TrackerTestCtx()), m_swarm(torrent_file_path, torrent_data_dir_path) {}
@@ -51,4 +149,34 @@ void IntegrationTest::SetUpTestSuite() {
     IntegrationTest::m_ctx = new IntegrationTestCtx(Torrent_File_Path, Torrent_Data_Dir);
 }
 
-void IntegrationTest::TearDownTestSuite() { delete m_ctx; }
\ No newline at end of file
+void IntegrationTest::TearDownTestSuite() { delete m_ctx; }
+
+TempFileTest::TempFileTest(const std::string_view& name)
+    : m_path(std::filesystem::temp_directory_path().append(name)) {}
+
+void TempFileTest::SetUp() { std::filesystem::remove(m_path); }
+
+void TempFileTest::TearDown() {
+    std::filesystem::remove(m_path);
+    for (const auto& p : m_others) {
+        std::filesystem::remove(p);
+    }
+}
+
+std::filesystem::path TempFileTest::another_file(const std::string_view& name) {
+    auto path = std::filesystem::temp_directory_path().append(name);
+    std::filesystem::remove(path);
+    m_others.push_back(path);
+    return path;
+}
+
+std::unique_ptr<tt::storage::UringStorage> open_uring_or_skip(const std::filesystem::path& path,
+                                                              const unsigned queue_depth) {
+    try {
+        return std::make_unique<tt::storage::UringStorage>(path, queue_depth);
+    } catch (const tt::storage::Exception& e) {
+        // Skipping returns, which only a function returning nothing can
+        [&]() { GTEST_SKIP() << e.what(); }();
+        return nullptr;
+    }
+}
@@ -2,11 +2,17 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
 #include <boost/process.hpp>
 #include <cstdint>
+#include <filesystem>
+#include <memory>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include "../torrent/storage.hpp"
+
 class TorrentSwarmTestCtx {
    public:
     // Other peers in the swarm.
@@ -27,6 +33,33 @@ class TrackerTestCtx {
     ~TrackerTestCtx();
 };
 
+// An in-process UDP tracker (BEP 15) which hands out a fixed set of peers and scrape results.
+class UdpTrackerStandIn {
+   public:
+    // The connection ID handed out.
+    static const std::uint64_t Connection_Id = 0x1122334455667788;
+    // Number of requests of each kind received.
+    std::atomic<std::size_t> m_connects{0};
+    std::atomic<std::size_t> m_announces{0};
+    std::atomic<std::size_t> m_scrapes{0};
+    // Ignore this many announces, to make the client retransmit.
+    std::atomic<std::size_t> m_drop_announces{0};
+    // Whether to reply at all.
+    std::atomic<bool> m_silent{false};
+
+    UdpTrackerStandIn();
+    UdpTrackerStandIn(UdpTrackerStandIn&) = delete;
+    ~UdpTrackerStandIn();
+    std::uint16_t port() const;
+
+   private:
+    int m_fd;
+    std::uint16_t m_port;
+    std::atomic<bool> m_stop{false};
+    std::thread m_thread;
+    void serve();
+};
+
 class IntegrationTestCtx {
    public:
     bool m_have_handshaked;
@@ -44,3 +77,22 @@ class IntegrationTest : public ::testing::Test {
     static void SetUpTestSuite();
     static void TearDownTestSuite();
 };
+
+// A test using a file in the temporary directory, which is removed before and after.
+class TempFileTest : public ::testing::Test {
+   protected:
+    std::filesystem::path m_path;
+
+    explicit TempFileTest(const std::string_view& name);
+    void SetUp() override;
+    void TearDown() override;
+    // Another file for tests that need more than one, which is removed now and after the test too.
+    std::filesystem::path another_file(const std::string_view& name);
+
+   private:
+    std::vector<std::filesystem::path> m_others{};
+};
+
+// Open a `UringStorage` at `path`, or skip the calling test and return nullptr if io_uring isn't available.
+std::unique_ptr<tt::storage::UringStorage> open_uring_or_skip(const std::filesystem::path& path,
+                                                              const unsigned queue_depth);
@@ -0,0 +1,234 @@
+#include "../io.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../job.hpp"
+#include "../reusable/smolsocket.hpp"
+#include "../reusable/timerwheel.hpp"
+#include "../task.hpp"
+
+using namespace tt;
+using namespace std::chrono_literals;
+
+struct TestTimer : timerwheel::Timer {
+    std::size_t m_fired = 0;
+};
+
+TEST(TimerWheel, fires_exactly_on_expiry) {
+    using Wheel = timerwheel::Wheel<TestTimer>;
+    Wheel w{1000};
+    std::mt19937_64 rng{42};
+    std::vector<TestTimer> timers(20000);
+    for (std::size_t i = 0; i < timers.size(); i++) {
+        // Spread over all levels, and beyond what the wheel reaches
+        const auto range = std::uint64_t{1} << (i % 28);
+        w.schedule(&timers[i], 1000 + 1 + rng() % range);
+    }
+    // Cancel some, reschedule others
+    for (std::size_t i = 0; i < timers.size(); i += 3) {
+        ASSERT_TRUE(w.cancel(&timers[i]));
+        ASSERT_FALSE(w.cancel(&timers[i]));
+    }
+    for (std::size_t i = 1; i < timers.size(); i += 3) {
+        w.schedule(&timers[i], timers[i].expiry() + 5);
+    }
+    ASSERT_EQ(w.size(), timers.size() - (timers.size() + 2) / 3);
+
+    std::size_t fired = 0;
+    bool on_time = true;
+    while (w.size() > 0) {
+        const auto next = w.next_event();
+        ASSERT_TRUE(next.has_value());
+        // Turning in uneven steps, sometimes past events
+        w.advance(next.value() + rng() % 3, [&](TestTimer* t) {
+            on_time = on_time && t->expiry() == w.now();
+            t->m_fired++;
+            fired++;
+        });
+    }
+    ASSERT_TRUE(on_time);
+    ASSERT_FALSE(w.next_event().has_value());
+    for (std::size_t i = 0; i < timers.size(); i++) {
+        ASSERT_EQ(timers[i].m_fired, i % 3 == 0 ? 0 : 1);
+        ASSERT_FALSE(timers[i].is_scheduled());
+    }
+    ASSERT_EQ(fired, timers.size() - (timers.size() + 2) / 3);
+}
+
+TEST(TimerWheel, past_expiries_fire_on_next_tick) {
+    timerwheel::Wheel<TestTimer> w{100};
+    TestTimer t{};
+    w.schedule(&t, 50);
+    ASSERT_EQ(w.next_event(), 101);
+    std::size_t fired = 0;
+    w.advance(100, [&](TestTimer*) { fired++; });
+    ASSERT_EQ(fired, 0);
+    // Timers may re-arm themselves when firing
+    w.advance(101, [&](TestTimer* x) {
+        fired++;
+        w.schedule(x, 200);
+    });
+    ASSERT_EQ(fired, 1);
+    w.advance(199, [&](TestTimer*) { fired++; });
+    ASSERT_EQ(fired, 1);
+    w.advance(200, [&](TestTimer*) { fired++; });
+    ASSERT_EQ(fired, 2);
+}
+
+// Coroutines are free functions taking everything by reference, as captures of coroutine lambdas don't live
+// in the coroutine frame.
+
+static job::Task<int> add_one(const int x) { co_return x + 1; }
+
+static job::Task<int> throws_after(const int x) {
+    co_await add_one(x);
+    throw std::runtime_error("oops");
+}
+
+static job::Task<void> chain(std::atomic<int>& result) {
+    const int a = co_await add_one(1);
+    const int b = co_await add_one(a);
+    try {
+        co_await throws_after(b);
+    } catch (const std::runtime_error&) {
+        result = b;
+    }
+}
+
+TEST(Task, propagates_values_and_exceptions) {
+    job::JobQueue q{2};
+    std::atomic<int> result{0};
+    q.enqueue(std::make_unique<job::CoroJob>(chain(result)));
+    q.process();
+    ASSERT_EQ(result, 3);
+
+    // Uncaught ones end up with the queue
+    q.enqueue(std::make_unique<job::CoroJob>([]() -> job::Task<void> { co_await throws_after(0); }()));
+    ASSERT_THROW(q.process(), std::runtime_error);
+}
+
+static job::Task<void> sleeper(io::Reactor& reactor, std::atomic<std::size_t>& done) {
+    const auto start = std::chrono::steady_clock::now();
+    const bool ready = co_await reactor.sleep_for(20ms);
+    if (!ready && std::chrono::steady_clock::now() - start >= 20ms) {
+        done++;
+    }
+}
+
+TEST(Reactor, sleeps_without_blocking_workers) {
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    std::atomic<std::size_t> done{0};
+    // More sleepers than a single worker could get through one after another
+    for (std::size_t i = 0; i < 100; i++) {
+        q.enqueue(std::make_unique<job::CoroJob>(sleeper(reactor, done)));
+    }
+    const auto start = std::chrono::steady_clock::now();
+    q.process();
+    ASSERT_EQ(done, 100);
+    ASSERT_LT(std::chrono::steady_clock::now() - start, 1s);
+}
+
+static job::Task<void> wait_and_set(job::Event& event, std::atomic<bool>& resumed) {
+    co_await event;
+    resumed = true;
+}
+
+TEST(Event, resumes_waiter_when_set_from_elsewhere) {
+    job::JobQueue q{2};
+    job::Event event{};
+    std::atomic<bool> resumed{false};
+    q.enqueue(std::make_unique<job::CoroJob>(wait_and_set(event, resumed)));
+    std::thread setter{[&]() {
+        std::this_thread::sleep_for(20ms);
+        event.set();
+    }};
+    q.process();
+    setter.join();
+    ASSERT_TRUE(resumed);
+
+    // Already set, so no suspending
+    q.enqueue(std::make_unique<job::CoroJob>(wait_and_set(event, resumed)));
+    q.process();
+}
+
+// A connected pair of loopback TCP sockets.
+static std::pair<smolsocket::Sock, smolsocket::Sock> connected_pair(smolsocket::Listener& l) {
+    smolsocket::Sock client{smolsocket::Endpoint::parse("127.0.0.1", l.port()).value(), smolsocket::Proto::TCP, 1000};
+    auto accepted = l.accept(1000);
+    EXPECT_TRUE(accepted.has_value());
+    return {std::move(client), std::move(accepted->m_sock)};
+}
+
+static job::Task<void> echo_server(io::Reactor& reactor, smolsocket::Sock& sock, const std::size_t len) {
+    auto data = co_await io::recv_exact(reactor, sock, len, 5000ms);
+    co_await io::send_all(reactor, sock, std::move(data), 5000ms);
+}
+
+static job::Task<void> echo_client(io::Reactor& reactor, smolsocket::Sock& sock, const std::size_t len,
+                                   std::atomic<std::size_t>& ok) {
+    std::vector<std::uint8_t> sent(len);
+    for (std::size_t i = 0; i < len; i++) {
+        sent[i] = static_cast<std::uint8_t>(i * 7 + len);
+    }
+    co_await io::send_all(reactor, sock, sent, 5000ms);
+    const auto echoed = co_await io::recv_exact(reactor, sock, len, 5000ms);
+    ok += echoed == sent;
+}
+
+TEST(Reactor, many_sessions_on_few_workers) {
+    const std::size_t num_sessions = 200;
+    // Larger than the socket buffers, so sending has to wait for the other side
+    const std::size_t len = 1024 * 1024;
+    smolsocket::Listener l{"127.0.0.1", 0, {}};
+    std::vector<std::pair<smolsocket::Sock, smolsocket::Sock>> conns{};
+    for (std::size_t i = 0; i < num_sessions; i++) {
+        conns.push_back(connected_pair(l));
+    }
+
+    io::Reactor reactor{};
+    job::JobQueue q{2};
+    std::atomic<std::size_t> ok{0};
+    for (std::size_t i = 0; i < num_sessions; i++) {
+        // Only a few large ones, to keep memory use in check
+        const std::size_t session_len = i % 50 == 0 ? len : 100 + i;
+        q.enqueue(std::make_unique<job::CoroJob>(echo_server(reactor, conns[i].second, session_len)));
+        q.enqueue(std::make_unique<job::CoroJob>(echo_client(reactor, conns[i].first, session_len, ok)));
+    }
+    q.process();
+    ASSERT_EQ(ok, num_sessions);
+}
+
+static job::Task<void> recv_with_timeout(io::Reactor& reactor, smolsocket::Sock& sock, std::atomic<bool>& timed_out) {
+    try {
+        co_await io::recv_exact(reactor, sock, 1, 20ms);
+    } catch (const io::Exception&) {
+        timed_out = true;
+    }
+}
+
+TEST(Reactor, times_out_waiting_for_data) {
+    smolsocket::Listener l{"127.0.0.1", 0, {}};
+    auto [client, server] = connected_pair(l);
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    std::atomic<bool> timed_out{false};
+    q.enqueue(std::make_unique<job::CoroJob>(recv_with_timeout(reactor, server, timed_out)));
+    q.process();
+    ASSERT_TRUE(timed_out);
+
+    // Waiting only works from coroutine jobs
+    ASSERT_THROW(reactor.readable(server.native_handle()).await_suspend(std::noop_coroutine()), io::Exception);
+}
@@ -0,0 +1,482 @@
+#include "../job.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../reusable/histogram.hpp"
+#include "../reusable/smallalloc.hpp"
+#include "../reusable/stealdeque.hpp"
+#include "../trace.hpp"
+
+using namespace tt;
+
+TEST(StealDeque, owner_pops_lifo_thieves_steal_fifo) {
+    // Small, so it has to grow
+    stealdeque::Deque<int> d{2};
+    std::vector<int> values(100);
+    for (auto& v : values) {
+        d.push(&v);
+    }
+    ASSERT_EQ(d.size_approx(), 100);
+    ASSERT_EQ(d.pop(), &values.at(99));
+    ASSERT_EQ(d.steal(), &values.at(0));
+    ASSERT_EQ(d.steal(), &values.at(1));
+    for (std::size_t i = 98; i >= 2; i--) {
+        ASSERT_EQ(d.pop(), &values.at(i));
+    }
+    ASSERT_EQ(d.pop(), nullptr);
+    ASSERT_EQ(d.steal(), nullptr);
+}
+
+TEST(StealDeque, every_element_is_taken_exactly_once) {
+    const std::size_t n = 100000;
+    stealdeque::Deque<std::size_t> d{};
+    std::vector<std::size_t> values(n);
+    std::vector<std::atomic<int>> taken(n);
+    std::atomic<bool> done{false};
+
+    std::vector<std::thread> thieves{};
+    for (std::size_t i = 0; i < 3; i++) {
+        thieves.emplace_back([&]() {
+            while (!done) {
+                if (auto* x = d.steal()) {
+                    taken.at(static_cast<std::size_t>(x - values.data()))++;
+                }
+            }
+        });
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        d.push(&values.at(i));
+        // Pop every now and then, to race the thieves for the last element
+        if (i % 3 == 0) {
+            if (auto* x = d.pop()) {
+                taken.at(static_cast<std::size_t>(x - values.data()))++;
+            }
+        }
+    }
+    while (auto* x = d.pop()) {
+        taken.at(static_cast<std::size_t>(x - values.data()))++;
+    }
+    done = true;
+    for (auto& t : thieves) {
+        t.join();
+    }
+    for (const auto& t : taken) {
+        ASSERT_EQ(t, 1);
+    }
+}
+
+// Enqueues `fan_out` children of itself until `depth` is reached.
+class TreeJob final : public job::IJob {
+   public:
+    TreeJob(job::JobQueue& q, std::atomic<std::size_t>& count, const std::size_t depth)
+        : m_q(q), m_count(count), m_depth(depth) {}
+    void process() override {
+        m_count++;
+        if (m_depth == 0) {
+            return;
+        }
+        for (std::size_t i = 0; i < 4; i++) {
+            m_q.enqueue(std::make_unique<TreeJob>(m_q, m_count, m_depth - 1));
+        }
+    }
+
+   private:
+    job::JobQueue& m_q;
+    std::atomic<std::size_t>& m_count;
+    std::size_t m_depth;
+};
+
+class FnJob final : public job::IJob {
+   public:
+    explicit FnJob(std::function<void()> fn) : m_fn(std::move(fn)) {}
+    void process() override { m_fn(); }
+
+   private:
+    std::function<void()> m_fn;
+};
+
+TEST(JobQueue, processes_jobs_enqueued_by_jobs) {
+    job::JobQueue q{4};
+    std::atomic<std::size_t> count{0};
+    q.enqueue(std::make_unique<TreeJob>(q, count, 6));
+    q.process();
+    // 1 + 4 + 16 + ... + 4^6
+    ASSERT_EQ(count, 5461);
+
+    // Can be reused
+    q.enqueue(std::make_unique<TreeJob>(q, count, 0));
+    q.process();
+    ASSERT_EQ(count, 5462);
+}
+
+TEST(JobQueue, runs_jobs_in_parallel) {
+    job::JobQueue q{4};
+    ASSERT_EQ(q.num_workers(), 4);
+    std::mutex m{};
+    std::set<std::thread::id> threads{};
+    for (std::size_t i = 0; i < 8; i++) {
+        q.enqueue(std::make_unique<FnJob>([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            const std::lock_guard<std::mutex> lock{m};
+            threads.insert(std::this_thread::get_id());
+        }));
+    }
+    q.process();
+    ASSERT_GT(threads.size(), 1);
+}
+
+TEST(JobQueue, rethrows_after_finishing) {
+    job::JobQueue q{2};
+    std::atomic<std::size_t> count{0};
+    q.enqueue(std::make_unique<FnJob>([]() { throw std::runtime_error("oops"); }));
+    for (std::size_t i = 0; i < 10; i++) {
+        q.enqueue(std::make_unique<FnJob>([&]() { count++; }));
+    }
+    ASSERT_THROW(q.process(), std::runtime_error);
+    ASSERT_EQ(count, 10);
+    // Nothing left over
+    q.process();
+}
+
+TEST(JobQueue, runs_jobs_after_their_dependencies) {
+    job::JobQueue q{4};
+    std::mutex m{};
+    std::vector<int> order{};
+    const auto record = [&](const int x) {
+        return std::make_unique<FnJob>([&, x]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            const std::lock_guard<std::mutex> lock{m};
+            order.push_back(x);
+        });
+    };
+    // Diamond: 0 -> (1, 2) -> 3
+    auto first = record(0);
+    auto left = record(1);
+    auto right = record(2);
+    auto last = record(3);
+    left->depends_on(*first);
+    right->depends_on(*first);
+    last->depends_on(*left);
+    last->depends_on(*right);
+    // Enqueue order doesn't matter
+    q.enqueue(std::move(last));
+    q.enqueue(std::move(right));
+    q.enqueue(std::move(left));
+    q.enqueue(std::move(first));
+    q.process();
+    ASSERT_EQ(order.size(), 4);
+    ASSERT_EQ(order.front(), 0);
+    ASSERT_EQ(order.back(), 3);
+}
+
+TEST(JobQueue, continuations_run_in_order_on_same_worker) {
+    job::JobQueue q{4};
+    const std::size_t num_chains = 100;
+    std::atomic<std::size_t> same_thread{0};
+    std::atomic<std::size_t> in_order{0};
+    std::vector<std::thread::id> threads(num_chains);
+    std::vector<int> steps(num_chains, 0);
+    for (std::size_t i = 0; i < num_chains; i++) {
+        auto head = std::make_unique<FnJob>([&, i]() {
+            threads.at(i) = std::this_thread::get_id();
+            steps.at(i) = 1;
+        });
+        head->then(std::make_unique<FnJob>([&, i]() {
+                in_order += steps.at(i) == 1;
+                steps.at(i) = 2;
+            }))
+            .then(std::make_unique<FnJob>([&, i]() {
+                in_order += steps.at(i) == 2;
+                same_thread += threads.at(i) == std::this_thread::get_id();
+            }));
+        q.enqueue(std::move(head));
+    }
+    q.process();
+    ASSERT_EQ(in_order, 2 * num_chains);
+    // Continuations that become runnable are run right away by the worker that finished their predecessor
+    ASSERT_EQ(same_thread, num_chains);
+}
+
+TEST(JobQueue, cancels_dependents_of_failed_jobs) {
+    job::JobQueue q{2};
+    std::atomic<std::size_t> count{0};
+    auto failing = std::make_unique<FnJob>([]() { throw std::runtime_error("oops"); });
+    failing->then(std::make_unique<FnJob>([&]() { count++; })).then(std::make_unique<FnJob>([&]() { count++; }));
+    q.enqueue(std::move(failing));
+    q.enqueue(std::make_unique<FnJob>([&]() { count += 10; }));
+    ASSERT_THROW(q.process(), std::runtime_error);
+    ASSERT_EQ(count, 10);
+}
+
+// Counts it's destruction.
+class CountedJob final : public job::IJob {
+   public:
+    explicit CountedJob(std::size_t& destroyed) : m_destroyed(destroyed) {}
+    ~CountedJob() override { m_destroyed++; }
+    void process() override {}
+
+   private:
+    std::size_t& m_destroyed;
+};
+
+TEST(JobQueue, destroys_jobs_left_unprocessed) {
+    std::size_t destroyed = 0;
+    {
+        job::JobQueue q{1};
+        auto first = std::make_unique<CountedJob>(destroyed);
+        auto second = std::make_unique<CountedJob>(destroyed);
+        auto dependent = std::make_unique<CountedJob>(destroyed);
+        dependent->depends_on(*first);
+        dependent->depends_on(*second);
+        first->then(std::make_unique<CountedJob>(destroyed));
+        second->set_deadline(job::Clock::now());
+        q.enqueue(std::move(dependent));
+        q.enqueue(std::move(first));
+        q.enqueue(std::move(second));
+    }
+    ASSERT_EQ(destroyed, 4);
+}
+
+// Like `FnJob`, in a given priority class.
+class ClassJob final : public job::IJob {
+   public:
+    ClassJob(const job::Priority priority, std::function<void()> fn) : m_priority(priority), m_fn(std::move(fn)) {}
+    void process() override { m_fn(); }
+    job::Priority priority() const override { return m_priority; }
+
+   private:
+    job::Priority m_priority;
+    std::function<void()> m_fn;
+};
+
+TEST(JobQueue, shares_workers_between_classes_by_weight) {
+    job::JobQueue q{1};
+    std::vector<job::Priority> order{};
+    for (std::size_t i = 0; i < 100; i++) {
+        q.enqueue(std::make_unique<ClassJob>(job::Priority::Background,
+                                             [&]() { order.push_back(job::Priority::Background); }));
+    }
+    for (std::size_t i = 0; i < 40; i++) {
+        q.enqueue(
+            std::make_unique<ClassJob>(job::Priority::Control, [&]() { order.push_back(job::Priority::Control); }));
+    }
+    q.process();
+    ASSERT_EQ(order.size(), 140);
+    // Control jobs jump the queue, but background work still gets it's share
+    std::size_t background_before = 0;
+    std::size_t control_left = 40;
+    for (const auto p : order) {
+        if (control_left == 0) {
+            break;
+        }
+        if (p == job::Priority::Control) {
+            control_left--;
+        } else {
+            background_before++;
+        }
+    }
+    ASSERT_GE(background_before, 2);
+    ASSERT_LE(background_before, 4);
+
+    const auto stats = q.stats(job::Priority::Control);
+    ASSERT_EQ(stats.m_depth, 0);
+    ASSERT_EQ(stats.m_started, 40);
+    ASSERT_GE(stats.m_sampled, 40 / job::Wait_Sample_Interval);
+    ASSERT_GT(stats.m_max_wait.count(), 0);
+    ASSERT_GE(stats.m_total_wait, stats.m_max_wait);
+    ASSERT_EQ(q.stats(job::Priority::Background).m_started, 100);
+    ASSERT_EQ(q.stats(job::Priority::Network).m_started, 0);
+}
+
+TEST(JobQueue, runs_jobs_by_deadline) {
+    job::JobQueue q{1};
+    std::vector<int> order{};
+    const auto record = [&](const job::Priority p, const int x) {
+        return std::make_unique<ClassJob>(p, [&, x]() { order.push_back(x); });
+    };
+    const auto now = job::Clock::now();
+    for (int i = 0; i < 3; i++) {
+        q.enqueue(record(job::Priority::Network, i));
+    }
+    // Earliest deadline first, ahead of others in the class
+    for (int i = 3; i < 6; i++) {
+        auto j = record(job::Priority::Network, i);
+        j->set_deadline(now + std::chrono::hours(1) - std::chrono::seconds(i));
+        q.enqueue(std::move(j));
+    }
+    // Overdue ones before anything else
+    auto overdue = record(job::Priority::Background, 6);
+    overdue->set_deadline(now - std::chrono::seconds(1));
+    q.enqueue(std::move(overdue));
+    q.process();
+    ASSERT_EQ(order, std::vector<int>({6, 5, 4, 3, 0, 1, 2}));
+}
+
+TEST(SmallAlloc, reuses_blocks_across_threads) {
+    // Freed on another thread than they were allocated on, like jobs
+    std::vector<void*> blocks{};
+    for (std::size_t i = 0; i < 10000; i++) {
+        const std::size_t size = 1 + i % smallalloc::Max_Size;
+        auto* p = smallalloc::allocate(size);
+        ASSERT_EQ(reinterpret_cast<std::uintptr_t>(p) % alignof(std::max_align_t), 0);
+        // Must not overlap with others
+        std::memset(p, static_cast<int>(i), size);
+        blocks.push_back(p);
+    }
+    const auto chunks = smallalloc::stats().m_chunks;
+    std::thread freer{[&]() {
+        for (std::size_t i = 0; i < blocks.size(); i++) {
+            smallalloc::deallocate(blocks[i], 1 + i % smallalloc::Max_Size);
+        }
+    }};
+    freer.join();
+    // The exited thread's blocks are reused, rather than new chunks taken
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+        blocks[i] = smallalloc::allocate(1 + i % smallalloc::Max_Size);
+    }
+    ASSERT_EQ(smallalloc::stats().m_chunks, chunks);
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+        smallalloc::deallocate(blocks[i], 1 + i % smallalloc::Max_Size);
+    }
+
+    const auto large = smallalloc::stats().m_large;
+    smallalloc::deallocate(smallalloc::allocate(smallalloc::Max_Size + 1), smallalloc::Max_Size + 1);
+    ASSERT_EQ(smallalloc::stats().m_large, large + 1);
+}
+
+// Frees and allocates once it's thread exits, which may be after the thread's cache is gone.
+struct UsedOnExit {
+    void* m_block = nullptr;
+    ~UsedOnExit() {
+        smallalloc::deallocate(m_block, 32);
+        smallalloc::deallocate(smallalloc::allocate(32), 32);
+    }
+};
+
+TEST(SmallAlloc, can_be_used_by_thread_locals_destroyed_after_the_cache) {
+    std::thread t{[]() {
+        // Constructed before the cache, so destroyed after it
+        thread_local UsedOnExit used{};
+        used.m_block = smallalloc::allocate(32);
+    }};
+    t.join();
+    // What was freed went to the pool, and is still good for others
+    auto* p = smallalloc::allocate(32);
+    std::memset(p, 0, 32);
+    smallalloc::deallocate(p, 32);
+}
+
+TEST(JobQueue, allocates_jobs_from_pools) {
+    job::JobQueue q{4};
+    std::atomic<std::size_t> count{0};
+    const auto round = [&]() {
+        q.enqueue(std::make_unique<TreeJob>(q, count, 5));
+        for (std::size_t i = 0; i < 1000; i++) {
+            q.enqueue(std::make_unique<FnJob>([&]() { count++; }));
+        }
+        q.process();
+    };
+    round();
+    const auto chunks = smallalloc::stats().m_chunks;
+    for (std::size_t i = 0; i < 20; i++) {
+        round();
+    }
+    ASSERT_EQ(count, 21 * (1365 + 1000));
+    // Once warmed up, jobs only recycle memory
+    ASSERT_EQ(smallalloc::stats().m_chunks, chunks);
+}
+
+TEST(Histogram, percentiles_within_precision) {
+    histogram::Histogram h{};
+    ASSERT_EQ(h.percentile(50), 0);
+    // Small values are exact
+    for (std::uint64_t v = 1; v <= 50; v++) {
+        h.record(v);
+    }
+    ASSERT_EQ(h.percentile(50), 25);
+    ASSERT_EQ(h.percentile(100), 50);
+    ASSERT_EQ(h.min(), 1);
+
+    histogram::Histogram big{};
+    for (std::uint64_t v = 1; v <= 1000000; v++) {
+        big.record(v * 1000);
+    }
+    const double error = 1.0 / (1 << histogram::Histogram::Sub_Bucket_Bits);
+    for (const double p : {10.0, 50.0, 90.0, 99.0, 99.9}) {
+        const auto exact = static_cast<double>(p * 10000 * 1000);
+        const auto got = static_cast<double>(big.percentile(p));
+        ASSERT_GE(got, exact);
+        ASSERT_LE(got, exact * (1 + error));
+    }
+    ASSERT_EQ(big.percentile(100), 1000000000);
+    big.record(UINT64_MAX);
+    ASSERT_EQ(big.percentile(100), UINT64_MAX);
+
+    h.merge(big);
+    ASSERT_EQ(h.count(), 50 + 1000001);
+    ASSERT_EQ(h.min(), 1);
+    ASSERT_EQ(h.max(), UINT64_MAX);
+}
+
+class SleepJob final : public job::IJob {
+   public:
+    void process() override { std::this_thread::sleep_for(std::chrono::milliseconds(2)); }
+};
+
+TEST(JobQueue, traces_job_runs) {
+    job::JobQueue q{2};
+    job::Tracer tracer{100};
+    std::atomic<std::size_t> count{0};
+    // Not traced yet
+    q.enqueue(std::make_unique<TreeJob>(q, count, 1));
+    q.process();
+
+    q.set_tracer(&tracer);
+    q.enqueue(std::make_unique<TreeJob>(q, count, 3));
+    for (std::size_t i = 0; i < 10; i++) {
+        q.enqueue(std::make_unique<SleepJob>());
+    }
+    q.process();
+    q.set_tracer(nullptr);
+    q.enqueue(std::make_unique<SleepJob>());
+    q.process();
+
+    const auto latencies = tracer.latencies();
+    ASSERT_EQ(latencies.size(), 2);
+    ASSERT_EQ(latencies[0].m_name, "SleepJob");
+    ASSERT_EQ(latencies[0].m_run.count(), 10);
+    ASSERT_GE(latencies[0].m_run.min(), 2000000);
+    ASSERT_EQ(latencies[1].m_name, "TreeJob");
+    ASSERT_EQ(latencies[1].m_run.count(), 85);
+    // Only the last 100 runs of each thread are kept for the timeline
+    ASSERT_EQ(tracer.dropped(), 0);
+
+    std::ostringstream trace{};
+    tracer.write_chrome_trace(trace);
+    const auto json = trace.str();
+    std::size_t events = 0;
+    for (auto at = json.find("\"ph\":\"X\""); at != std::string::npos; at = json.find("\"ph\":\"X\"", at + 1)) {
+        events++;
+    }
+    ASSERT_EQ(events, 95);
+    ASSERT_NE(json.find("\"name\":\"SleepJob\""), std::string::npos);
+
+    std::ostringstream report{};
+    tracer.write_report(report);
+    ASSERT_NE(report.str().find("TreeJob"), std::string::npos);
+}
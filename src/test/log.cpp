@@ -0,0 +1,142 @@
+#include "../log.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../event_log.hpp"
+
+using namespace tt;
+
+TEST(Log, skips_arguments_of_disabled_levels) {
+    std::size_t evaluated = 0;
+    const auto arg = [&]() {
+        evaluated++;
+        return std::string{"arg"};
+    };
+    log::set_level(log::Level::Warning);
+    ASSERT_FALSE(log::enabled(log::Level::Debug));
+    TT_LOG(Debug, Peer, "Log test: not formatted {}", arg());
+    ASSERT_EQ(evaluated, 0);
+    TT_LOG(Warning, Peer, "Log test: formatted {}", arg());
+    ASSERT_EQ(evaluated, 1);
+    log::set_level(log::Level::Debug);
+    log::flush();
+}
+
+TEST(Log, never_blocks_on_many_threads) {
+    const auto dropped = log::dropped();
+    std::vector<std::thread> threads{};
+    for (std::size_t t = 0; t < 4; t++) {
+        threads.emplace_back([t]() {
+            // Fewer than a thread's queue holds, so none are dropped even if the writer doesn't get to run
+            for (std::size_t i = 0; i < 1000; i++) {
+                TT_LOG(Debug, Torrent, "Log test: thread {} message {}", t, i);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(log::dropped(), dropped);
+    // Messages of exited threads are still written out
+    log::flush();
+}
+
+TEST(Log, fatal_messages_are_never_dropped) {
+    testing::internal::CaptureStdout();
+    std::thread t{[]() {
+        // More than a thread's queue holds, so it's full by now unless the writer got to it
+        for (std::size_t i = 0; i < 2048; i++) {
+            TT_LOG(Debug, Torrent, "Log test: filler {}", i);
+        }
+        const auto dropped = log::dropped();
+        TT_LOG(Fatal, Torrent, "Log test: fatal");
+        EXPECT_EQ(log::dropped(), dropped);
+    }};
+    t.join();
+    const auto out = testing::internal::GetCapturedStdout();
+    ASSERT_NE(out.find("Log test: fatal"), std::string::npos);
+}
+
+// Read back the arguments of all events in the log at `path`, by thread.
+static std::map<std::uint32_t, std::vector<std::uint64_t>> read_events(const std::string& path) {
+    std::ifstream in{path, std::ios::binary};
+    const std::vector<char> file{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    EXPECT_EQ(std::memcmp(file.data(), log::events::Magic.data(), log::events::Magic.size()), 0);
+    std::map<std::uint32_t, std::vector<std::uint64_t>> by_thread{};
+    for (std::size_t block = log::events::Block_Size; block < file.size(); block += log::events::Block_Size) {
+        std::size_t at = block;
+        while (at + sizeof(log::events::EventHeader) <= block + log::events::Block_Size) {
+            log::events::EventHeader h{};
+            std::memcpy(&h, file.data() + at, sizeof(h));
+            if (h.m_event == log::Event::None) {
+                break;
+            }
+            EXPECT_EQ(h.m_event, log::Event::MessageSent);
+            EXPECT_EQ(h.m_num_args, 2);
+            std::uint64_t arg = 0;
+            std::memcpy(&arg, file.data() + at + sizeof(h) + sizeof(arg), sizeof(arg));
+            by_thread[h.m_thread].push_back(arg);
+            at += sizeof(h) + 2 * sizeof(arg);
+        }
+    }
+    return by_thread;
+}
+
+TEST(EventLog, records_events_of_all_threads_in_order) {
+    const auto path = std::filesystem::temp_directory_path().append("toytorrent_test_events.bin").string();
+    const std::size_t per_thread = 20000;
+    {
+        // Nothing is recorded without a log
+        log::event(log::Subsystem::Peer, log::Event::MessageSent, 0, 0);
+        log::EventLog events{path};
+        const auto other_path = path + ".2";
+        std::filesystem::remove(other_path);
+        ASSERT_THROW(log::EventLog{other_path}, std::runtime_error);
+        // Turned down before touching the file
+        ASSERT_FALSE(std::filesystem::exists(other_path));
+        std::vector<std::thread> threads{};
+        for (std::size_t t = 0; t < 4; t++) {
+            threads.emplace_back([&]() {
+                for (std::size_t i = 0; i < per_thread; i++) {
+                    log::event(log::Subsystem::Peer, log::Event::MessageSent, 7, i);
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        ASSERT_EQ(events.dropped(), 0);
+    }
+    ASSERT_FALSE(log::events_enabled());
+    const auto by_thread = read_events(path);
+    ASSERT_EQ(by_thread.size(), 4);
+    for (const auto& [thread, args] : by_thread) {
+        ASSERT_EQ(args.size(), per_thread);
+        for (std::size_t i = 0; i < per_thread; i++) {
+            ASSERT_EQ(args[i], i);
+        }
+    }
+
+    // Events that don't fit anymore are dropped
+    {
+        log::EventLog events{path, 2 * log::events::Block_Size};
+        const std::size_t fit = log::events::Block_Size / (sizeof(log::events::EventHeader) + 16);
+        for (std::size_t i = 0; i < fit + 10; i++) {
+            log::event(log::Subsystem::Peer, log::Event::MessageSent, 7, i);
+        }
+        ASSERT_EQ(events.dropped(), 10);
+    }
+    ASSERT_EQ(read_events(path).begin()->second.size(), log::events::Block_Size / 32);
+    std::filesystem::remove(path);
+}
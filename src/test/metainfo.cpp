@@ -7,6 +7,7 @@
 #include <deque>
 #include <fstream>
 #include <string>
+#include <vector>
 
 using namespace tt;
 
@@ -34,5 +35,17 @@ TEST(Metainfo, parse_single_file_torrent) {
     ASSERT_EQ(metainfo.infohash(), expected_infohash);
 }
 
+TEST(Metainfo, parse_announce_list) {
+    const auto metainfo = metainfo_from_path("../testdata/ubuntu-20.04.2-live-server-amd64.iso.torrent");
+    ASSERT_EQ(metainfo.m_announce_list.size(), 2);
+    ASSERT_EQ(metainfo.m_announce_list.at(0), std::vector<std::string>{"https://torrent.ubuntu.com/announce"});
+    ASSERT_EQ(metainfo.m_announce_list.at(1), std::vector<std::string>{"https://ipv6.torrent.ubuntu.com/announce"});
+
+    // Torrents without an announce-list get a single tier with the primary tracker
+    const auto single = metainfo_from_path("../testdata/zip_10MB.zip.torrent");
+    ASSERT_EQ(single.m_announce_list.size(), 1);
+    ASSERT_EQ(single.m_announce_list.at(0), std::vector<std::string>{single.m_primary_tracker_url});
+}
+
 // TODO: Implement
 TEST(Metainfo, parse_directory_torrent) {}
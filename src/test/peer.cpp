@@ -3,11 +3,21 @@
 #include <gtest/gtest.h>
 #include <gtest/internal/gtest-internal.h>
 
+#include <chrono>
 #include <cstdint>
 #include <memory>
+#include <thread>
 #include <tuple>
+#include <utility>
+#include <vector>
 
+#include "../io.hpp"
+#include "../job.hpp"
+#include "../reusable/smolsocket.hpp"
+#include "../task.hpp"
 #include "../torrent/metainfo.hpp"
+#include "../torrent/peer_registry.hpp"
+#include "../torrent/piece.hpp"
 #include "../torrent/tracker.hpp"
 #include "helpers.hpp"
 
@@ -22,15 +32,16 @@ TEST_F(IntegrationTest, peer_handshake) {
         info.truncated_infohash_binary(),
         tracker::Stats{0, 0, 0},
         us_peer.m_id,
-        us_peer.m_ip,
-        us_peer.m_port,
+        us_peer.m_endpoint.ip_str(),
+        us_peer.m_endpoint.m_port,
     };
-    auto [peers, timeout] = tracker::send_request(info.m_primary_tracker_url, req);
+    const auto peers = tracker::send_request(info.m_primary_tracker_url, req).peers;
 
     // Attempt handshake
-    for (auto& peer : peers) {
+    for (const auto& addr : peers) {
         // TODO: This should probably be handled somewhere else
-        if (peer.m_port != us_peer.m_port) {
+        if (addr != us_peer.m_endpoint) {
+            peer::Peer peer{addr};
             peer.handshake(info.truncated_infohash_binary(), us_peer.m_id);
         }
     }
@@ -46,16 +57,17 @@ TEST_F(IntegrationTest, peer_request_piece) {
         info.truncated_infohash_binary(),
         tracker::Stats{0, 0, 0},
         us_peer.m_id,
-        us_peer.m_ip,
-        us_peer.m_port,
+        us_peer.m_endpoint.ip_str(),
+        us_peer.m_endpoint.m_port,
     };
-    auto [peers, timeout] = tracker::send_request(info.m_primary_tracker_url, req);
+    const auto peers = tracker::send_request(info.m_primary_tracker_url, req).peers;
 
     // Attempt handshake and request piece
     const std::uint32_t piece_to_request = 0;
     const std::uint32_t offset_to_request = 0;
-    for (auto& peer : peers) {
-        if (peer.m_port != us_peer.m_port) {
+    for (const auto& addr : peers) {
+        if (addr != us_peer.m_endpoint) {
+            peer::Peer peer{addr};
             peer.handshake(info.truncated_infohash_binary(), us_peer.m_id);
 
             const auto request{tt::peer::MessageRequest(0, 0, static_cast<std::uint32_t>(info.m_piece_length))};
@@ -72,4 +84,179 @@ TEST_F(IntegrationTest, peer_request_piece) {
             ASSERT_EQ(response_piece.get_piece_data().size(), info.m_piece_length);
         }
     }
-}
\ No newline at end of file
+}
+static smolsocket::Endpoint nth_endpoint(const std::uint32_t n) {
+    const std::uint8_t addr[4] = {10, static_cast<std::uint8_t>(n >> 16), static_cast<std::uint8_t>(n >> 8),
+                                  static_cast<std::uint8_t>(n)};
+    return smolsocket::Endpoint::from_v4(addr, 6881);
+}
+
+TEST(PeerRegistry, dedupes_and_forgets) {
+    peer::Registry r{};
+    const auto now = std::chrono::steady_clock::now();
+    const std::uint32_t n = 5000;
+    // Twice, like a re-announce returning the same peers
+    for (std::size_t round = 0; round < 2; round++) {
+        for (std::uint32_t i = 0; i < n; i++) {
+            ASSERT_EQ(r.add(nth_endpoint(i), peer::Source::Tracker, now), round == 0);
+        }
+    }
+    ASSERT_EQ(r.size(), n);
+
+    for (std::uint32_t i = 0; i < n; i += 2) {
+        ASSERT_TRUE(r.forget(nth_endpoint(i)));
+    }
+    ASSERT_FALSE(r.forget(nth_endpoint(0)));
+    ASSERT_EQ(r.size(), n / 2);
+    // Removing entries mustn't make others unreachable
+    for (std::uint32_t i = 0; i < n; i++) {
+        ASSERT_EQ(r.find(nth_endpoint(i)) != nullptr, i % 2 == 1);
+    }
+}
+
+TEST(PeerRegistry, candidates_back_off) {
+    peer::Registry::Config cfg{};
+    cfg.m_base_backoff = std::chrono::seconds(10);
+    cfg.m_max_failures = 3;
+    peer::Registry r{cfg};
+    const auto now = std::chrono::steady_clock::now();
+    const auto a = nth_endpoint(1);
+    const auto b = nth_endpoint(2);
+    const auto c = nth_endpoint(3);
+    r.add(a, peer::Source::Tracker, now);
+    r.add(b, peer::Source::Tracker, now + std::chrono::seconds(1));
+    r.add(c, peer::Source::Incoming, now);
+    r.on_connected(c, now);
+
+    // More recently seen peers first, connected ones never
+    std::vector<peer::Candidate> out{};
+    r.next_candidates(now + std::chrono::seconds(1), 10, out);
+    ASSERT_EQ(out.size(), 2);
+    ASSERT_EQ(out.at(0).m_endpoint, b);
+    ASSERT_EQ(out.at(1).m_endpoint, a);
+
+    // Failing peers wait before being retried, and rank below the others once they are
+    r.on_connect_failed(b, now);
+    r.next_candidates(now + std::chrono::seconds(5), 10, out);
+    ASSERT_EQ(out.size(), 1);
+    ASSERT_EQ(out.at(0).m_endpoint, a);
+    r.next_candidates(now + std::chrono::seconds(10), 1, out);
+    ASSERT_EQ(out.size(), 1);
+    ASSERT_EQ(out.at(0).m_endpoint, a);
+    r.on_connect_failed(b, now);
+    ASSERT_EQ(r.find(b)->m_retry_at, now + std::chrono::seconds(20));
+
+    // Too many failures
+    r.on_connect_failed(b, now);
+    ASSERT_EQ(r.find(b), nullptr);
+    ASSERT_EQ(r.size(), 2);
+
+    // Peers that hung up don't count until we may reconnect
+    ASSERT_EQ(r.num_connectable(now), 2);
+    r.on_disconnected(c, now);
+    ASSERT_EQ(r.num_connectable(now), 1);
+    ASSERT_EQ(r.num_connectable(now + std::chrono::seconds(10)), 2);
+}
+
+TEST(PeerMessage, frames_and_parses) {
+    const auto framed = peer::frame_message(peer::MessagePiece(3, 16384, {1, 2, 3}));
+    const std::vector<std::uint8_t> expected{0, 0, 0, 12, 7, 0, 0, 0, 3, 0, 0, 64, 0, 1, 2, 3};
+    ASSERT_EQ(framed, expected);
+    const auto parsed = peer::parse_message({framed.begin() + 4, framed.end()});
+    ASSERT_EQ(parsed->get_type(), peer::MessageType::Piece);
+    const auto& piece = dynamic_cast<const peer::MessagePiece&>(*parsed);
+    ASSERT_EQ(piece.m_piece_idx, 3);
+    ASSERT_EQ(piece.m_begin_offset, 16384);
+    ASSERT_EQ(piece.get_piece_data(), std::vector<std::uint8_t>({1, 2, 3}));
+
+    // Keepalives and types we don't handle are skipped, malformed messages are rejected
+    ASSERT_EQ(peer::parse_message({}), nullptr);
+    ASSERT_EQ(peer::parse_message({20, 0, 1}), nullptr);
+    ASSERT_THROW(peer::parse_message({6, 0, 0, 0}), peer::Exception);
+}
+
+static job::Task<void> exchange_messages(io::Reactor& reactor, peer::Peer& us, peer::Peer& them,
+                                         std::unique_ptr<peer::IMessage>& received) {
+    co_await us.async_send_message(reactor, peer::MessageRequest(1, 2, 3));
+    received = co_await them.async_wait_for_message(reactor, std::chrono::milliseconds(1000));
+}
+
+TEST(Peer, async_messages) {
+    smolsocket::Listener l{"127.0.0.1", 0, {}};
+    const auto endpoint = smolsocket::Endpoint::parse("127.0.0.1", l.port()).value();
+    peer::Peer us{endpoint};
+    us.attach_socket(smolsocket::Sock(endpoint, smolsocket::Proto::TCP, 1000));
+    auto accepted = l.accept(1000);
+    ASSERT_TRUE(accepted.has_value());
+    peer::Peer them{accepted->m_remote};
+    them.attach_socket(std::move(accepted->m_sock));
+
+    // Blocking and suspending ones speak the same framing, keepalives included
+    us.send_keepalive();
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    std::unique_ptr<peer::IMessage> received{};
+    q.enqueue(std::make_unique<job::CoroJob>(exchange_messages(reactor, us, them, received)));
+    q.process();
+    ASSERT_NE(received, nullptr);
+    ASSERT_EQ(peer::frame_message(*received), peer::frame_message(peer::MessageRequest(1, 2, 3)));
+
+    them.send_message(peer::MessageInterested());
+    ASSERT_EQ(us.wait_for_message()->get_type(), peer::MessageType::Interested);
+}
+
+static job::Task<void> handshake(io::Reactor& reactor, peer::Peer& us, const std::vector<std::uint8_t>& infohash,
+                                 const peer::ID& our_id) {
+    co_await us.async_handshake(reactor, infohash, our_id);
+}
+
+TEST(Peer, async_handshake) {
+    smolsocket::Listener l{"127.0.0.1", 0, {}};
+    const auto endpoint = smolsocket::Endpoint::parse("127.0.0.1", l.port()).value();
+    peer::Peer us{endpoint};
+    us.attach_socket(smolsocket::Sock(endpoint, smolsocket::Proto::TCP, 1000));
+    auto accepted = l.accept(1000);
+    ASSERT_TRUE(accepted.has_value());
+    peer::Peer them{accepted->m_remote};
+    them.attach_socket(std::move(accepted->m_sock));
+
+    const std::vector<std::uint8_t> infohash(piece::Piece_Hash_Len, 0x5a);
+    const peer::ID our_id{};
+    const peer::ID their_id{};
+    std::vector<std::uint8_t> received{};
+    std::thread remote{[&]() {
+        received = them.receive_handshake();
+        them.send_handshake(infohash, their_id);
+    }};
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    q.enqueue(std::make_unique<job::CoroJob>(handshake(reactor, us, infohash, our_id)));
+    q.process();
+    remote.join();
+    ASSERT_EQ(received, infohash);
+    ASSERT_EQ(them.m_id.as_string(), our_id.as_string());
+    ASSERT_EQ(us.m_id.as_string(), their_id.as_string());
+}
+
+TEST(Peer, async_handshake_fails_if_the_remote_answers_for_another_torrent) {
+    smolsocket::Listener l{"127.0.0.1", 0, {}};
+    const auto endpoint = smolsocket::Endpoint::parse("127.0.0.1", l.port()).value();
+    peer::Peer us{endpoint};
+    us.attach_socket(smolsocket::Sock(endpoint, smolsocket::Proto::TCP, 1000));
+    auto accepted = l.accept(1000);
+    ASSERT_TRUE(accepted.has_value());
+    peer::Peer them{accepted->m_remote};
+    them.attach_socket(std::move(accepted->m_sock));
+
+    const std::vector<std::uint8_t> infohash(piece::Piece_Hash_Len, 0x5a);
+    std::thread remote{[&]() {
+        them.receive_handshake();
+        them.send_handshake(std::vector<std::uint8_t>(piece::Piece_Hash_Len, 0xa5), peer::ID());
+    }};
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    const peer::ID our_id{};
+    q.enqueue(std::make_unique<job::CoroJob>(handshake(reactor, us, infohash, our_id)));
+    ASSERT_THROW(q.process(), peer::Exception);
+    remote.join();
+}
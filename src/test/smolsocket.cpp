@@ -0,0 +1,146 @@
+#include "../reusable/smolsocket.hpp"
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+
+using namespace smolsocket;
+
+// Opens a loopback TCP socket that accepts (but never services) connections, returning the port.
+static std::uint16_t listen_on_loopback(int& fd) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    EXPECT_EQ(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    EXPECT_EQ(listen(fd, 16), 0);
+    socklen_t len = sizeof(addr);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    return ntohs(addr.sin_port);
+}
+
+TEST(SmolSocket, resolver_parses_literals) {
+    Resolver r{std::chrono::seconds(60)};
+    const auto addrs = r.resolve("127.0.0.1", 80, Proto::TCP);
+    ASSERT_EQ(addrs.size(), 1);
+    ASSERT_EQ(addrs.at(0).m_kind, AddrKind::V4);
+    ASSERT_THROW(r.resolve("this-host-does-not-exist.invalid", 80, Proto::TCP), Exception);
+}
+
+TEST(SmolSocket, endpoint_parse_and_compare) {
+    const auto v4 = Endpoint::parse("192.168.1.20", 6881);
+    ASSERT_TRUE(v4.has_value());
+    ASSERT_EQ(v4->kind(), AddrKind::V4);
+    ASSERT_EQ(v4->to_string(), "192.168.1.20:6881");
+    // The v4-mapped form is the same endpoint
+    ASSERT_EQ(Endpoint::parse("::ffff:192.168.1.20", 6881), v4);
+    ASSERT_NE(Endpoint::parse("192.168.1.20", 6882), v4);
+
+    const auto v6 = Endpoint::parse("2001:db8:1234:5678:9abc:def0:1234:5678", 80);
+    ASSERT_TRUE(v6.has_value());
+    ASSERT_EQ(v6->kind(), AddrKind::V6);
+    ASSERT_EQ(v6->to_string(), "[2001:db8:1234:5678:9abc:def0:1234:5678]:80");
+    ASSERT_EQ(v6->to_sockaddr().m_len, sizeof(sockaddr_in6));
+
+    ASSERT_FALSE(Endpoint::parse("example.org", 80).has_value());
+    ASSERT_FALSE(Endpoint::parse("", 80).has_value());
+
+    const std::unordered_set<Endpoint> set{v4.value(), v6.value(), v4.value()};
+    ASSERT_EQ(set.size(), 2);
+}
+
+TEST(SmolSocket, connector_connects_in_parallel) {
+    int listen_fd = -1;
+    const auto port = listen_on_loopback(listen_fd);
+
+    Connector c{Connector::Config{}};
+    for (std::size_t i = 0; i < 8; i++) {
+        c.add("127.0.0.1", port, Proto::TCP);
+    }
+    const auto results = c.run();
+    ASSERT_EQ(results.size(), 8);
+    for (const auto& res : results) {
+        ASSERT_TRUE(res.m_sock.has_value()) << res.m_error;
+    }
+    close(listen_fd);
+}
+
+TEST(SmolSocket, connector_fails_fast_on_refused) {
+    // Grab a free port, then close it again so connecting is refused
+    int listen_fd = -1;
+    const auto port = listen_on_loopback(listen_fd);
+    close(listen_fd);
+
+    Connector::Config cfg{};
+    cfg.m_timeout = std::chrono::milliseconds(10000);
+    Connector c{cfg};
+    c.add("127.0.0.1", port, Proto::TCP);
+    const auto start = std::chrono::steady_clock::now();
+    const auto results = c.run();
+    ASSERT_FALSE(results.at(0).m_sock.has_value());
+    ASSERT_FALSE(results.at(0).m_error.empty());
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+}
+
+TEST(SmolSocket, listeners_share_port_and_accept) {
+    Listener::Config cfg{};
+    cfg.m_reuse_port = true;
+    Listener first{"127.0.0.1", 0, cfg};
+    const auto port = first.port();
+    Listener second{"127.0.0.1", port, cfg};
+    ASSERT_EQ(second.port(), port);
+
+    // Nothing is waiting yet
+    ASSERT_FALSE(first.accept(0).has_value());
+
+    Sock client{"127.0.0.1", port, Proto::TCP, 1000};
+    auto conn = first.accept(100);
+    if (!conn.has_value()) {
+        // The kernel handed it to the other socket
+        conn = second.accept(100);
+    }
+    ASSERT_TRUE(conn.has_value());
+    ASSERT_EQ(conn->m_remote.ip_str(), "127.0.0.1");
+    ASSERT_EQ(conn->m_remote.kind(), AddrKind::V4);
+
+    client.send({1, 2, 3}, 1000);
+    ASSERT_EQ(conn->m_sock.recv(3, 1000), std::vector<std::uint8_t>({1, 2, 3}));
+}
+
+TEST(SmolSocket, options_apply_and_tcp_info) {
+    ASSERT_THROW(Options::profile("no-such-profile"), Exception);
+
+    Listener::Config listener_cfg{};
+    listener_cfg.m_options = Options::lan_bulk();
+    Listener l{"127.0.0.1", 0, listener_cfg};
+
+    Connector::Config cfg{};
+    cfg.m_options = Options::wan_many();
+    Connector c{cfg};
+    c.add("127.0.0.1", l.port(), Proto::TCP);
+    auto res = std::move(c.run().at(0));
+    ASSERT_TRUE(res.m_sock.has_value()) << res.m_error;
+    auto conn = l.accept(1000);
+    ASSERT_TRUE(conn.has_value());
+
+    res.m_sock->send({42}, 1000);
+    conn->m_sock.recv(1, 1000);
+    const auto info = res.m_sock->tcp_info();
+    ASSERT_GT(info.m_snd_mss, 0);
+    ASSERT_GT(info.m_snd_cwnd, 0);
+
+    // Unknown congestion control algorithms are rejected by the kernel
+    Options bogus{};
+    bogus.m_congestion = "no-such-algorithm";
+    ASSERT_THROW(res.m_sock->apply(bogus), Exception);
+}
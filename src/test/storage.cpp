@@ -0,0 +1,354 @@
+#include "../torrent/storage.hpp"
+
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../job.hpp"
+#include "../task.hpp"
+#include "../torrent/piece.hpp"
+#include "../torrent/shared_constants.hpp"
+#include "helpers.hpp"
+
+using namespace tt;
+
+class Storage : public TempFileTest {
+   protected:
+    Storage() : TempFileTest("toytorrent_test_storage.bin") {}
+};
+
+TEST_F(Storage, reads_back_what_was_written_in_other_splits) {
+    storage::PosixStorage s{m_path};
+    std::vector<std::uint8_t> data(100000);
+    std::iota(data.begin(), data.end(), 0);
+
+    // Written in uneven parts, read in others
+    std::array<iovec, 3> out = {iovec{data.data(), 10}, iovec{data.data() + 10, 60000},
+                                iovec{data.data() + 60010, data.size() - 60010}};
+    s.write(4096, out);
+    std::vector<std::uint8_t> first(33333);
+    std::vector<std::uint8_t> second(data.size() - first.size());
+    std::array<iovec, 2> in = {iovec{first.data(), first.size()}, iovec{second.data(), second.size()}};
+    s.read(4096, in);
+
+    first.insert(first.end(), second.begin(), second.end());
+    ASSERT_EQ(first, data);
+    ASSERT_EQ(std::filesystem::file_size(m_path), 4096 + data.size());
+}
+
+TEST_F(Storage, reading_past_the_end_throws) {
+    storage::PosixStorage s{m_path};
+    std::vector<std::uint8_t> data(10, 1);
+    s.write(0, std::array<iovec, 1>{iovec{data.data(), data.size()}});
+    data.resize(11);
+    ASSERT_THROW(s.read(0, std::array<iovec, 1>{iovec{data.data(), data.size()}}), storage::Exception);
+}
+
+TEST_F(Storage, opening_a_directory_throws) {
+    ASSERT_THROW(storage::PosixStorage{std::filesystem::temp_directory_path()}, storage::Exception);
+}
+
+// Flush pieces through `s` in parallel, and check they read back.
+static void flush_pieces_in_parallel(storage::IStorage& s, const std::filesystem::path& path) {
+    const std::uint32_t piece_size = 4 * peer::Request_Subpiece_Size;
+    const std::uint32_t num_pieces = 32;
+
+    std::mt19937 rng{42};
+    std::vector<std::unique_ptr<piece::Piece>> pieces{};
+    job::JobQueue jq{4};
+    const std::array<std::uint8_t, piece::Piece_Hash_Len> no_hash{};
+    for (std::uint32_t i = 0; i < num_pieces; i++) {
+        pieces.push_back(std::make_unique<piece::Piece>(piece_size, i, no_hash, piece::State::HaveVerified));
+        for (std::size_t j = 0; j < pieces.back()->m_subpieces.size(); j++) {
+            std::vector<std::uint8_t> subpiece(peer::Request_Subpiece_Size);
+            std::generate(subpiece.begin(), subpiece.end(), [&]() { return static_cast<std::uint8_t>(rng()); });
+            pieces.back()->set_downloaded_subpiece_data(j, subpiece);
+        }
+        jq.enqueue(piece::make_flush_job(*pieces.back(), s));
+    }
+    jq.process();
+    s.sync();
+
+    ASSERT_EQ(std::filesystem::file_size(path), std::uint64_t{piece_size} * num_pieces);
+    for (const auto& p : pieces) {
+        std::vector<std::uint8_t> read(piece_size);
+        s.read(std::uint64_t{p->m_idx} * piece_size, std::array<iovec, 1>{iovec{read.data(), read.size()}});
+        for (std::size_t j = 0; j < p->m_subpieces.size(); j++) {
+            const auto& expected = p->m_subpieces[j].value();
+            ASSERT_TRUE(std::equal(expected.begin(), expected.end(), read.begin() + j * peer::Request_Subpiece_Size));
+        }
+    }
+}
+
+TEST_F(Storage, pieces_are_flushed_in_parallel) {
+    storage::PosixStorage s{m_path};
+    flush_pieces_in_parallel(s, m_path);
+}
+
+TEST_F(Storage, pieces_are_flushed_in_parallel_through_coalescing) {
+    storage::CoalescingStorage s{std::make_unique<storage::PosixStorage>(m_path), 1024 * 1024, 256 * 1024};
+    flush_pieces_in_parallel(s, m_path);
+}
+
+TEST_F(Storage, pieces_are_flushed_in_parallel_through_io_uring) {
+    // Fewer slots than pieces, so some have to wait for others to complete
+    auto s = open_uring_or_skip(m_path, 4);
+    if (!s) {
+        return;
+    }
+    flush_pieces_in_parallel(*s, m_path);
+}
+
+TEST_F(Storage, pieces_are_flushed_in_parallel_through_a_mapping) {
+    storage::MmapStorage s{m_path};
+    s.allocate(32 * 4 * peer::Request_Subpiece_Size, storage::Allocation::Sparse);
+    flush_pieces_in_parallel(s, m_path);
+}
+
+TEST_F(Storage, corrupt_pieces_are_dropped_rather_than_flushed) {
+    storage::PosixStorage s{m_path};
+    const std::uint32_t piece_size = 2 * peer::Request_Subpiece_Size;
+    std::vector<std::unique_ptr<piece::Piece>> pieces{};
+    job::JobQueue jq{};
+    const std::array<std::uint8_t, piece::Piece_Hash_Len> no_hash{};
+    for (std::uint32_t i = 0; i < 2; i++) {
+        pieces.push_back(std::make_unique<piece::Piece>(piece_size, i, no_hash, piece::State::HaveUnverified));
+        auto& p = *pieces.back();
+        for (std::size_t j = 0; j < p.m_subpieces.size(); j++) {
+            p.set_downloaded_subpiece_data(j, std::vector<std::uint8_t>(peer::Request_Subpiece_Size, 0x5a));
+        }
+        p.m_expected_hash = p.get_curr_hash();
+    }
+    // A peer sent us garbage for the second piece
+    pieces[1]->m_subpieces[1]->at(7) ^= 1;
+    for (auto& p : pieces) {
+        auto verify = std::make_unique<piece::PieceVerificationJob>(*p);
+        verify->then(piece::make_flush_job(*p, s));
+        jq.enqueue(std::move(verify));
+    }
+
+    ASSERT_NO_THROW(jq.process());
+    ASSERT_EQ(pieces[0]->m_state.load(), piece::State::OnDisk);
+    ASSERT_EQ(pieces[1]->m_state.load(), piece::State::Want);
+    ASSERT_FALSE(pieces[1]->m_subpieces[0].has_value());
+    // Only the good piece made it to disk
+    ASSERT_EQ(std::filesystem::file_size(m_path), piece_size);
+}
+
+TEST_F(Storage, io_uring_splits_what_doesnt_fit_into_one_operation) {
+    auto s = open_uring_or_skip(m_path, 1);
+    if (!s) {
+        return;
+    }
+    // More buffers than a single operation takes
+    std::vector<std::uint8_t> data(5000 * 3);
+    std::iota(data.begin(), data.end(), 0);
+    std::vector<iovec> out{};
+    for (std::size_t i = 0; i < data.size(); i += 3) {
+        out.push_back(iovec{data.data() + i, 3});
+    }
+    s->write(0, out);
+
+    std::vector<std::uint8_t> read(data.size());
+    s->read(0, std::array<iovec, 1>{iovec{read.data(), read.size()}});
+    ASSERT_EQ(read, data);
+    read.push_back(0);
+    ASSERT_THROW(s->read(0, std::array<iovec, 1>{iovec{read.data(), read.size()}}), storage::Exception);
+}
+
+static job::Task<void> write_async(storage::IStorage& s, const std::uint64_t offset, std::vector<std::uint8_t>& data) {
+    const iovec buffer{data.data(), data.size()};
+    co_await s.async_write(offset, {&buffer, 1});
+}
+
+TEST_F(Storage, io_uring_storages_on_the_same_device_share_the_queue_depth) {
+    const auto other_path = another_file("toytorrent_test_storage_other.bin");
+    auto s = open_uring_or_skip(m_path, 1);
+    if (!s) {
+        return;
+    }
+    // Takes the queue depth of the first one, so all writes take turns
+    storage::UringStorage other{other_path, 64};
+    std::vector<std::vector<std::uint8_t>> blocks{};
+    for (std::uint8_t i = 0; i < 8; i++) {
+        blocks.emplace_back(4096, i);
+    }
+    job::JobQueue q{2};
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+        auto& target = i % 2 == 0 ? static_cast<storage::IStorage&>(*s) : other;
+        q.enqueue(std::make_unique<job::CoroJob>(write_async(target, i / 2 * 4096, blocks[i])));
+    }
+    q.process();
+
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+        std::vector<std::uint8_t> read(4096);
+        auto& target = i % 2 == 0 ? static_cast<storage::IStorage&>(*s) : other;
+        target.read(i / 2 * 4096, std::array<iovec, 1>{iovec{read.data(), read.size()}});
+        ASSERT_EQ(read, blocks[i]);
+    }
+}
+
+// Blocks actually allocated for the file, in bytes.
+static std::uint64_t allocated_bytes(const std::filesystem::path& path) {
+    struct stat st {};
+    stat(path.c_str(), &st);
+    return static_cast<std::uint64_t>(st.st_blocks) * 512;
+}
+
+TEST_F(Storage, preallocates_sparsely_or_fully_without_shrinking) {
+    const std::uint64_t size = 8 * 1024 * 1024;
+    storage::PosixStorage s{m_path};
+    s.allocate(size, storage::Allocation::Sparse);
+    ASSERT_EQ(std::filesystem::file_size(m_path), size);
+    ASSERT_LT(allocated_bytes(m_path), size);
+
+    s.allocate(size, storage::Allocation::Full);
+    ASSERT_EQ(std::filesystem::file_size(m_path), size);
+    ASSERT_GE(allocated_bytes(m_path), size);
+
+    s.allocate(size / 2, storage::Allocation::Sparse);
+    ASSERT_EQ(std::filesystem::file_size(m_path), size);
+}
+
+// Keeps data in memory, remembering the writes it got.
+class MemoryStorage final : public storage::IStorage {
+   public:
+    std::vector<std::uint8_t> m_data{};
+    std::vector<std::pair<std::uint64_t, std::size_t>> m_writes{};
+
+    void write(const std::uint64_t offset, const std::span<const iovec> buffers) override {
+        std::size_t len = 0;
+        for (const auto& b : buffers) {
+            const auto* p = static_cast<const std::uint8_t*>(b.iov_base);
+            if (m_data.size() < offset + len + b.iov_len) {
+                m_data.resize(offset + len + b.iov_len);
+            }
+            std::copy(p, p + b.iov_len, m_data.begin() + static_cast<std::ptrdiff_t>(offset + len));
+            len += b.iov_len;
+        }
+        m_writes.emplace_back(offset, len);
+    }
+    void read(const std::uint64_t offset, const std::span<const iovec> buffers) override {
+        std::size_t len = 0;
+        for (const auto& b : buffers) {
+            std::copy_n(m_data.begin() + static_cast<std::ptrdiff_t>(offset + len), b.iov_len,
+                        static_cast<std::uint8_t*>(b.iov_base));
+            len += b.iov_len;
+        }
+    }
+    void sync() override {}
+    void allocate(const std::uint64_t, const storage::Allocation) override {}
+    void advise(const std::uint64_t, const std::uint64_t, const storage::Hint) override {}
+};
+
+TEST_F(Storage, coalesces_adjacent_writes) {
+    const std::size_t piece_size = 64 * 1024;
+    const std::size_t num_pieces = 64;
+    auto inner = std::make_unique<MemoryStorage>();
+    auto& mem = *inner;
+    // Runs of 4 pieces are written out right away, and everything once 16 are buffered
+    storage::CoalescingStorage s{std::move(inner), 16 * piece_size, 4 * piece_size};
+
+    // Pieces come in roughly in order
+    std::vector<std::size_t> order(num_pieces);
+    std::iota(order.begin(), order.end(), 0);
+    std::mt19937 rng{42};
+    for (std::size_t i = 0; i + 8 <= num_pieces; i += 8) {
+        std::shuffle(order.begin() + static_cast<std::ptrdiff_t>(i), order.begin() + static_cast<std::ptrdiff_t>(i + 8),
+                     rng);
+    }
+    std::vector<std::uint8_t> expected(piece_size * num_pieces);
+    std::generate(expected.begin(), expected.end(), [&]() { return static_cast<std::uint8_t>(rng()); });
+    for (const auto idx : order) {
+        // In two parts, as the subpieces of a piece aren't contiguous
+        auto* piece = expected.data() + idx * piece_size;
+        s.write(idx * piece_size, std::array<iovec, 2>{iovec{piece, 100}, iovec{piece + 100, piece_size - 100}});
+    }
+    // Overwriting buffered data as well as data that's written out already
+    std::fill_n(expected.begin() + 10, 2 * piece_size, 7);
+    s.write(10, std::array<iovec, 1>{iovec{expected.data() + 10, 2 * piece_size}});
+    s.sync();
+
+    ASSERT_EQ(mem.m_data, expected);
+    // Rather than one per piece
+    ASSERT_LE(mem.m_writes.size(), num_pieces / 3);
+    std::vector<std::uint8_t> read(3 * piece_size);
+    s.read(piece_size, std::array<iovec, 1>{iovec{read.data(), read.size()}});
+    ASSERT_TRUE(std::equal(read.begin(), read.end(), expected.begin() + piece_size));
+}
+
+static job::Task<void> read_async(storage::IStorage& s, const std::uint64_t offset, std::vector<std::uint8_t>& data) {
+    const iovec buffer{data.data(), data.size()};
+    co_await s.async_read(offset, {&buffer, 1});
+}
+
+TEST_F(Storage, coalescing_awaits_overlapping_writes_without_holding_up_the_worker) {
+    std::unique_ptr<storage::IStorage> inner = open_uring_or_skip(m_path, 1);
+    if (!inner) {
+        return;
+    }
+    // Every write is written out right away, so each one has to wait for the one before
+    storage::CoalescingStorage s{std::move(inner), 4096, 1};
+    std::vector<std::vector<std::uint8_t>> blocks{};
+    for (std::uint8_t i = 0; i < 4; i++) {
+        blocks.emplace_back(4096, i);
+    }
+    std::vector<std::uint8_t> read(4096);
+    // A single worker, which the first write has to resume on while the others wait
+    job::JobQueue q{1};
+    for (auto& block : blocks) {
+        q.enqueue(std::make_unique<job::CoroJob>(write_async(s, 0, block)));
+    }
+    q.enqueue(std::make_unique<job::CoroJob>(read_async(s, 0, read)));
+    q.process();
+
+    ASSERT_TRUE(std::any_of(blocks.begin(), blocks.end(), [&](const auto& block) { return block == read; }));
+}
+
+TEST_F(Storage, mapping_serves_views_and_survives_truncation) {
+    const std::size_t size = 64 * 1024;
+    storage::MmapStorage s{m_path};
+    std::vector<std::uint8_t> data(size);
+    std::iota(data.begin(), data.end(), 0);
+    ASSERT_THROW(s.write(0, std::array<iovec, 1>{iovec{data.data(), data.size()}}), storage::Exception);
+
+    s.allocate(size, storage::Allocation::Sparse);
+    s.write(0, std::array<iovec, 2>{iovec{data.data(), 10}, iovec{data.data() + 10, size - 10}});
+    s.advise(0, size, storage::Hint::WillNeed);
+    const auto view = s.view(0, size);
+    ASSERT_TRUE(std::equal(view.begin(), view.end(), data.begin()));
+    ASSERT_THROW(s.view(size - 1, 2), storage::Exception);
+
+    // Behind the storage's back, the pages past the end can't be backed by the file anymore
+    std::filesystem::resize_file(m_path, 4096);
+    std::vector<std::uint8_t> read(size);
+    ASSERT_THROW(s.read(0, std::array<iovec, 1>{iovec{read.data(), read.size()}}), storage::Exception);
+    ASSERT_GT(s.faults(), 0);
+    // Faulted pages read as zeros rather than crashing
+    ASSERT_EQ(s.view(size - 1, 1)[0], 0);
+    ASSERT_EQ(s.view(0, 1)[0], data[0]);
+
+    // Once the file is back, writes to the pages that faulted reach it
+    std::filesystem::resize_file(m_path, size);
+    const std::vector<std::uint8_t> last_page(4096, 0xaa);
+    s.write(size - last_page.size(), std::array<iovec, 1>{iovec{const_cast<std::uint8_t*>(last_page.data()),
+                                                                 last_page.size()}});
+    s.sync();
+    storage::PosixStorage file{m_path};
+    std::vector<std::uint8_t> on_disk(last_page.size());
+    file.read(size - last_page.size(), std::array<iovec, 1>{iovec{on_disk.data(), on_disk.size()}});
+    ASSERT_EQ(on_disk, last_page);
+}
@@ -2,15 +2,28 @@
 
 #include <bits/stdint-uintn.h>
 #include <gtest/gtest.h>
+#include <sys/uio.h>
 
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "../io.hpp"
+#include "../job.hpp"
 #include "../torrent/metainfo.hpp"
+#include "../reusable/smolsocket.hpp"
 #include "../torrent/peer.hpp"
+#include "../torrent/peer_message.hpp"
+#include "../torrent/piece.hpp"
+#include "../torrent/shared_constants.hpp"
+#include "../torrent/storage.hpp"
+#include "../torrent/session.hpp"
 #include "../torrent/torrent_jobs.hpp"
 #include "../torrent/tracker.hpp"
 #include "helpers.hpp"
@@ -38,11 +51,143 @@ TEST_F(IntegrationTest, torrent_download_piece) {
     const std::uint16_t us_port = 12345;
     const auto download_path{std::filesystem::temp_directory_path().append(random_string(32)).string()};
     auto t{std::make_shared<Torrent>(info, us_port, download_path)};
-    auto piece_dl_job{std::make_unique<torrent::PieceDownloadJob>(t, piece_idx)};
+    io::Reactor reactor{};
     job::JobQueue jq{};
-    jq.enqueue(std::move(piece_dl_job));
+    jq.enqueue(torrent::make_download_job(TorrentHandle{t}, reactor, piece_idx));
 
     jq.process();
 
-    ASSERT_EQ(t->m_piece_map.get_piece(piece_idx)->m_state, tt::piece::State::HaveUnverified);
+    ASSERT_EQ(t->m_piece_map.get_piece(piece_idx)->m_state.load(), tt::piece::State::HaveUnverified);
+}
+
+TEST(Torrent, downloading_without_peers_leaves_the_piece_wanted) {
+    const auto info{metainfo_from_path(Torrent_File_Path)};
+    const auto download_path{std::filesystem::temp_directory_path().append(random_string(32)).string()};
+    Torrent t{info, 0, download_path};
+    io::Reactor reactor{};
+    job::JobQueue jq{1};
+    jq.enqueue(torrent::make_piece_jobs(TorrentHandle{t}, reactor, 0));
+
+    ASSERT_NO_THROW(jq.process());
+    ASSERT_EQ(t.m_piece_map.piece(0).m_state.load(), piece::State::Want);
+    ASSERT_EQ(t.m_cache->stats().m_dirty_bytes, 0);
+    std::filesystem::remove(download_path);
+}
+
+// Serve `request` from `t`'s storage to a connected peer, returning what it received, if anything.
+static std::unique_ptr<peer::IMessage> upload(Torrent& t, const peer::MessageRequest& request) {
+    smolsocket::Listener l{"127.0.0.1", 0, {}};
+    const auto endpoint = smolsocket::Endpoint::parse("127.0.0.1", l.port()).value();
+    auto us = std::make_shared<peer::Peer>(endpoint);
+    us->attach_socket(smolsocket::Sock(endpoint, smolsocket::Proto::TCP, 1000));
+    auto accepted = l.accept(1000);
+    peer::Peer them{accepted->m_remote};
+    them.attach_socket(std::move(accepted->m_sock));
+
+    job::JobQueue q{1};
+    q.enqueue(std::make_unique<torrent::PieceUploadJob>(TorrentHandle{t}, us, request));
+    q.process();
+    // Followed by something we know, to tell whether the request was ignored
+    us->send_message(peer::MessageInterested());
+    auto msg = them.wait_for_message();
+    if (msg->get_type() == peer::MessageType::Interested) {
+        return nullptr;
+    }
+    return msg;
+}
+
+TEST(Torrent, uploads_requested_blocks_from_storage) {
+    const auto info{metainfo_from_path(Torrent_File_Path)};
+    const auto download_path{std::filesystem::temp_directory_path().append(random_string(32)).string()};
+    // Sent straight from the file, or copied through memory as a coalescing storage may not have written it yet
+    const std::vector<storage::Config> configs{
+        {.m_backend = storage::Backend::Posix},
+        {.m_backend = storage::Backend::Mmap},
+        {.m_backend = storage::Backend::Posix, .m_coalesce_buffer = 1024 * 1024},
+    };
+    for (const auto& config : configs) {
+        Torrent t{info, 0, download_path, config};
+        auto& piece = t.m_piece_map.piece(1);
+        std::vector<std::uint8_t> data(piece.m_size);
+        std::iota(data.begin(), data.end(), 0);
+        const iovec buffer{data.data(), data.size()};
+        t.m_storage->write(piece.m_size, {&buffer, 1});
+
+        const auto block = peer::MessageRequest(1, peer::Request_Subpiece_Size, peer::Request_Subpiece_Size);
+        ASSERT_EQ(upload(t, block), nullptr);
+        // Checked out, but maybe not written yet
+        piece.m_state = piece::State::HaveVerified;
+        ASSERT_EQ(upload(t, block), nullptr);
+        piece.m_state = piece::State::OnDisk;
+        const auto msg = upload(t, block);
+        ASSERT_NE(msg, nullptr);
+        const auto expected = peer::MessagePiece(
+            1, peer::Request_Subpiece_Size,
+            {data.begin() + peer::Request_Subpiece_Size, data.begin() + 2 * peer::Request_Subpiece_Size});
+        ASSERT_EQ(peer::frame_message(*msg), peer::frame_message(expected));
+        ASSERT_EQ(t.m_bytes_uploaded, peer::Request_Subpiece_Size);
+
+        // Past the end of the piece
+        ASSERT_EQ(upload(t, peer::MessageRequest(1, piece.m_size - 1, 2)), nullptr);
+        ASSERT_EQ(upload(t, peer::MessageRequest(static_cast<std::uint32_t>(t.m_piece_map.size()), 0, 1)), nullptr);
+    }
+    std::filesystem::remove(download_path);
+}
+
+TEST(Torrent, dropped_peers_are_let_go) {
+    const auto info{metainfo_from_path(Torrent_File_Path)};
+    const auto download_path{std::filesystem::temp_directory_path().append(random_string(32)).string()};
+    Torrent t{info, 0, download_path};
+    const auto endpoint = smolsocket::Endpoint::parse("127.0.0.1", 6881).value();
+    auto p = std::make_shared<peer::Peer>(endpoint);
+    t.add_inbound_peer(p);
+
+    t.drop_peer(p);
+    const std::lock_guard<std::mutex> lock{t.m_peers_mutex};
+    ASSERT_TRUE(t.m_peers.empty());
+    // Still known, but not to be reconnected to right away
+    ASSERT_FALSE(t.m_peer_registry.find(endpoint)->m_connected);
+    ASSERT_EQ(t.m_peer_registry.num_connectable(std::chrono::steady_clock::now()), 0);
+    std::filesystem::remove(download_path);
+}
+
+TEST(Session, inbound_peer_is_routed_by_infohash) {
+    const auto info{metainfo_from_path(Torrent_File_Path)};
+    const auto download_path{std::filesystem::temp_directory_path().append(random_string(32)).string()};
+    auto t{std::make_shared<Torrent>(info, 0, download_path)};
+
+    Session session{{0, 2}};
+    session.add_torrent(t);
+    const auto port = session.listen();
+
+    // Act as a remote peer wanting our torrent
+    auto remote = peer::Peer(peer::ID(), "127.0.0.1", port);
+    remote.handshake(info.truncated_infohash_binary(), peer::ID());
+    // Our reply means the connection was routed
+    ASSERT_EQ(remote.receive_handshake(), info.truncated_infohash_binary());
+    session.stop();
+
+    const std::lock_guard<std::mutex> lock{t->m_peers_mutex};
+    ASSERT_EQ(t->m_peers.size(), 1);
+    std::filesystem::remove(download_path);
+}
+
+TEST(Session, keeps_connections_to_peers_alive) {
+    const auto info{metainfo_from_path(Torrent_File_Path)};
+    const auto download_path{std::filesystem::temp_directory_path().append(random_string(32)).string()};
+    auto t{std::make_shared<Torrent>(info, 0, download_path)};
+    Session session{{.m_port = 0, .m_keepalive_interval = std::chrono::milliseconds(20)}};
+    session.add_torrent(t);
+
+    smolsocket::Listener l{"127.0.0.1", 0, {}};
+    const auto endpoint = smolsocket::Endpoint::parse("127.0.0.1", l.port()).value();
+    auto us = std::make_shared<peer::Peer>(endpoint);
+    us->attach_socket(smolsocket::Sock(endpoint, smolsocket::Proto::TCP, 1000));
+    auto accepted = l.accept(1000);
+    ASSERT_TRUE(accepted.has_value());
+    t->add_inbound_peer(us);
+
+    ASSERT_EQ(accepted->m_sock.recv(4, 1000), std::vector<std::uint8_t>(4, 0));
+    session.stop();
+    std::filesystem::remove(download_path);
 }
@@ -2,7 +2,25 @@
 
 #include <gtest/gtest.h>
 
+#include <fmt/core.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../io.hpp"
+#include "../job.hpp"
+#include "../task.hpp"
+#include "../torrent/announce_scheduler.hpp"
 #include "../torrent/metainfo.hpp"
+#include "../torrent/tracker_http.hpp"
+#include "../torrent/tracker_udp.hpp"
 #include "helpers.hpp"
 
 using namespace tt;
@@ -17,8 +35,8 @@ TEST(TrackerCommunication, send) {
         info.truncated_infohash_binary(),
         tracker::Stats{0, 0, 0},
         us_peer.m_id,
-        us_peer.m_ip,
-        us_peer.m_port,
+        us_peer.m_endpoint.ip_str(),
+        us_peer.m_endpoint.m_port,
     };
     for (auto& req_kind : {tracker::RequestKind::STARTED, tracker::RequestKind::UPDATE, tracker::RequestKind::STOPPED,
                            tracker::RequestKind::COMPLETED}) {
@@ -26,3 +44,377 @@ TEST(TrackerCommunication, send) {
         tracker::send_request(info.m_primary_tracker_url, req);
     }
 }
+
+TEST(TrackerResponse, parses_compact_peers) {
+    // A response as big as the largest ones trackers send
+    const std::size_t num_peers = 1000;
+    std::string compact{};
+    for (std::size_t i = 0; i < num_peers; i++) {
+        const std::array<std::uint8_t, 6> entry{10, 0, static_cast<std::uint8_t>(i >> 8),
+                                                static_cast<std::uint8_t>(i & 0xff), 0x1a, 0xe1};
+        compact.append(reinterpret_cast<const char*>(entry.data()), entry.size());
+    }
+    const auto body = fmt::format("d8:completei5e10:incompletei3e8:intervali1800e12:min intervali60e5:peers{}:{}e",
+                                  compact.size(), compact);
+
+    const auto resp = tracker::parse_announce_response(body);
+    ASSERT_EQ(resp.interval, 1800);
+    ASSERT_EQ(resp.min_interval, 60);
+    ASSERT_EQ(resp.peers.size(), num_peers);
+    ASSERT_EQ(resp.peers.at(0), smolsocket::Endpoint::parse("10.0.0.0", 6881));
+    ASSERT_EQ(resp.peers.at(999).ip_str(), "10.0.3.231");
+    ASSERT_EQ(resp.peers.at(999).m_port, 6881);
+}
+
+TEST(TrackerResponse, parses_peers6) {
+    std::string compact6(18, '\0');
+    compact6[15] = 1;
+    compact6[16] = 0x1a;
+    compact6[17] = static_cast<char>(0xe1);
+    const auto body = fmt::format("d8:intervali1800e5:peers6:{}6:peers618:{}e",
+                                  std::string{10, 0, 0, 1, 0x1a, static_cast<char>(0xe1)}, compact6);
+
+    const auto resp = tracker::parse_announce_response(body);
+    ASSERT_EQ(resp.peers.size(), 2);
+    ASSERT_EQ(resp.peers.at(0).kind(), smolsocket::AddrKind::V4);
+    ASSERT_EQ(resp.peers.at(0).to_string(), "10.0.0.1:6881");
+    ASSERT_EQ(resp.peers.at(1).kind(), smolsocket::AddrKind::V6);
+    ASSERT_EQ(resp.peers.at(1).to_string(), "[::1]:6881");
+
+    // A v6-only tracker may leave out the v4 list
+    ASSERT_EQ(tracker::parse_announce_response(fmt::format("d8:intervali1800e6:peers618:{}e", compact6)).peers.size(),
+              1);
+    ASSERT_THROW(tracker::parse_announce_response("d8:intervali1800e6:peers66:abcdefe"), tracker::Exception);
+}
+
+TEST(TrackerResponse, parses_peer_dicts_and_failures) {
+    const auto resp = tracker::parse_announce_response(
+        "d8:intervali900e5:peersld2:ip8:10.1.2.37:peer id20:-TT0001-abcdefghijkl4:porti6881eed2:ip11:example.org"
+        "4:porti1eed2:ip3:::14:porti1eeee");
+    ASSERT_EQ(resp.interval, 900);
+    ASSERT_FALSE(resp.min_interval.has_value());
+    // Host names are skipped
+    ASSERT_EQ(resp.peers.size(), 2);
+    ASSERT_EQ(resp.peers.at(0).ip_str(), "10.1.2.3");
+    ASSERT_EQ(resp.peers.at(1).ip_str(), "::1");
+
+    ASSERT_THROW(tracker::parse_announce_response("d14:failure reason6:go awaye"), tracker::Exception);
+    ASSERT_THROW(tracker::parse_announce_response("d8:intervali900e5:peers5:abcdee"), tracker::Exception);
+    ASSERT_THROW(tracker::parse_announce_response("d8:intervali900e5:peers999:abce"), tracker::Exception);
+    ASSERT_THROW(tracker::parse_announce_response("le"), tracker::Exception);
+}
+
+TEST(HttpTracker, scrape_url) {
+    ASSERT_EQ(tracker::http::scrape_url("http://example.org/announce"), "http://example.org/scrape");
+    ASSERT_EQ(tracker::http::scrape_url("https://example.org:8443/x/announce.php?passkey=1"),
+              "https://example.org:8443/x/scrape.php?passkey=1");
+    ASSERT_FALSE(tracker::http::scrape_url("http://example.org/a").has_value());
+    ASSERT_FALSE(tracker::http::scrape_url("http://example.org/announce/x").has_value());
+    ASSERT_EQ(tracker::http::host_of("HTTP://Example.org:80/announce?x=/y"), "http://example.org:80");
+}
+
+TEST(HttpTracker, parse_scrape_response) {
+    const std::vector<std::uint8_t> known(20, 'a');
+    const std::vector<std::uint8_t> unknown(20, 'b');
+    const auto body = fmt::format("d5:filesd20:{}d8:completei5e10:downloadedi7e10:incompletei3eeee",
+                                  std::string(known.begin(), known.end()));
+    const auto scraped = tracker::http::parse_scrape_response(body, {unknown, known});
+    ASSERT_EQ(scraped.size(), 2);
+    ASSERT_EQ(scraped.at(0).seeders, 0);
+    ASSERT_EQ(scraped.at(1).seeders, 5);
+    ASSERT_EQ(scraped.at(1).completed, 7);
+    ASSERT_EQ(scraped.at(1).leechers, 3);
+    ASSERT_THROW(tracker::http::parse_scrape_response("d14:failure reason4:nopee", {known}), tracker::Exception);
+    ASSERT_THROW(tracker::http::parse_scrape_response("de", {known}), tracker::Exception);
+}
+
+TEST(HttpTracker, session_pool_limits_and_reuses) {
+    tracker::http::SessionPool pool{2};
+    const auto url = "http://tracker.example.org/announce";
+    std::atomic<bool> third_acquired{false};
+    {
+        auto first = pool.acquire(url);
+        auto second = pool.acquire(url);
+        // Other trackers aren't affected by the limit
+        { auto other = pool.acquire("http://other.example.org/announce"); }
+
+        std::thread t{[&]() {
+            auto third = pool.acquire(url);
+            third_acquired = true;
+        }};
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT_FALSE(third_acquired);
+        {
+            auto released = std::move(first);
+        }
+        t.join();
+        ASSERT_TRUE(third_acquired);
+    }
+    // Sessions are kept around instead of being created anew
+    ASSERT_EQ(pool.idle("http://tracker.example.org/scrape"), 2);
+    { auto again = pool.acquire(url); }
+    ASSERT_EQ(pool.idle(url), 2);
+}
+
+static tracker::Request udp_test_request() {
+    return tracker::Request{
+        tracker::RequestKind::STARTED,
+        std::vector<std::uint8_t>(20, 0xab),
+        tracker::Stats{0, 0, 1024},
+        peer::ID(),
+        "127.0.0.1",
+        12345,
+    };
+}
+
+TEST(UdpTracker, parse_url) {
+    ASSERT_EQ(tracker::udp::parse_url("udp://tracker.example.org:1337/announce"),
+              std::make_pair(std::string("tracker.example.org"), std::uint16_t{1337}));
+    ASSERT_EQ(tracker::udp::parse_url("udp://[::1]:6969"), std::make_pair(std::string("::1"), std::uint16_t{6969}));
+    ASSERT_THROW(tracker::udp::parse_url("udp://no-port.example.org/announce"), tracker::Exception);
+    ASSERT_THROW(tracker::udp::parse_url("http://tracker.example.org:80/announce"), tracker::Exception);
+    ASSERT_THROW(tracker::udp::parse_url("udp://tracker.example.org:65536"), tracker::Exception);
+    ASSERT_THROW(tracker::udp::parse_url("udp://tracker.example.org:99999999999999999999"), tracker::Exception);
+    ASSERT_THROW(tracker::udp::parse_url("udp://tracker.example.org:port"), tracker::Exception);
+    ASSERT_THROW(tracker::udp::parse_url("udp://tracker.example.org:80x"), tracker::Exception);
+}
+
+TEST(UdpTracker, announce_and_scrape) {
+    UdpTrackerStandIn stand_in{};
+    const auto url = fmt::format("udp://127.0.0.1:{}/announce", stand_in.port());
+    const tracker::udp::Config cfg{std::chrono::milliseconds(50), 3};
+
+    // The first announce gets lost and has to be retransmitted
+    stand_in.m_drop_announces = 1;
+    const auto resp = tracker::udp::announce(url, udp_test_request(), cfg);
+    const auto& peers = resp.peers;
+    ASSERT_EQ(resp.interval, 1800);
+    ASSERT_FALSE(resp.min_interval.has_value());
+    ASSERT_EQ(peers.size(), 2);
+    ASSERT_EQ(peers.at(0).ip_str(), "10.0.0.1");
+    ASSERT_EQ(peers.at(0).m_port, 6881);
+    ASSERT_EQ(peers.at(1).ip_str(), "10.0.0.2");
+    ASSERT_EQ(peers.at(1).m_port, 6882);
+    ASSERT_EQ(stand_in.m_announces, 2);
+
+    // Goes through the generic entry point too, and reuses the connection ID
+    tracker::send_request(url, udp_test_request());
+    ASSERT_EQ(stand_in.m_connects, 1);
+
+    // More infohashes than fit into one datagram
+    const std::vector<std::vector<std::uint8_t>> infohashes(100, std::vector<std::uint8_t>(20, 0xcd));
+    const auto scraped = tracker::udp::scrape(url, infohashes, cfg);
+    ASSERT_EQ(scraped.size(), infohashes.size());
+    ASSERT_EQ(scraped.at(99).seeders, 5);
+    ASSERT_EQ(scraped.at(99).completed, 7);
+    ASSERT_EQ(scraped.at(99).leechers, 3);
+    ASSERT_EQ(stand_in.m_scrapes, 2);
+}
+
+TEST(UdpTracker, gives_up_on_silent_tracker) {
+    UdpTrackerStandIn stand_in{};
+    stand_in.m_silent = true;
+    const auto url = fmt::format("udp://127.0.0.1:{}/announce", stand_in.port());
+    const tracker::udp::Config cfg{std::chrono::milliseconds(20), 2};
+    ASSERT_THROW(tracker::udp::announce(url, udp_test_request(), cfg), tracker::Exception);
+}
+
+TEST(TieredAnnounce, falls_back_within_tier_and_announces_all_tiers) {
+    UdpTrackerStandIn silent{};
+    silent.m_silent = true;
+    UdpTrackerStandIn first{};
+    UdpTrackerStandIn second{};
+    const auto url = [](const UdpTrackerStandIn& t) { return fmt::format("udp://127.0.0.1:{}/announce", t.port()); };
+    tracker::TieredAnnounce::Tiers tiers{{url(silent), url(first)}, {url(second)}};
+
+    std::mutex mutex{};
+    std::vector<std::string> responders{};
+    std::size_t num_peers = 0;
+    {
+        tracker::TieredAnnounce announce{tiers, udp_test_request(), std::chrono::milliseconds(200),
+                                         [&](const std::string& u, tracker::Response&& resp) {
+                                             const std::lock_guard<std::mutex> lock{mutex};
+                                             responders.push_back(u);
+                                             num_peers += resp.peers.size();
+                                         }};
+        ASSERT_TRUE(announce.wait_first());
+        ASSERT_EQ(announce.wait_all(), 2);
+    }
+    ASSERT_EQ(responders.size(), 2);
+    ASSERT_EQ(num_peers, 4);
+    // The tracker that answered is asked first next time
+    ASSERT_EQ(tiers.at(0).at(0), url(first));
+    ASSERT_EQ(tiers.at(0).at(1), url(silent));
+    ASSERT_EQ(first.m_announces, 1);
+    ASSERT_EQ(second.m_announces, 1);
+}
+
+TEST(TieredAnnounce, moves_on_if_handling_a_response_fails) {
+    UdpTrackerStandIn silent{};
+    silent.m_silent = true;
+    UdpTrackerStandIn first{};
+    UdpTrackerStandIn second{};
+    const auto url = [](const UdpTrackerStandIn& t) { return fmt::format("udp://127.0.0.1:{}/announce", t.port()); };
+    tracker::TieredAnnounce::Tiers tiers{{url(silent), url(first), url(second)}};
+
+    std::vector<std::string> handed{};
+    {
+        tracker::TieredAnnounce announce{tiers, udp_test_request(), std::chrono::milliseconds(200),
+                                         [&](const std::string& u, tracker::Response&&) {
+                                             handed.push_back(u);
+                                             if (u == url(first)) {
+                                                 throw tracker::Exception("Can't handle this one");
+                                             }
+                                         }};
+        ASSERT_EQ(announce.wait_all(), 1);
+    }
+    const std::vector<std::string> expected{url(first), url(second)};
+    ASSERT_EQ(handed, expected);
+    // Only the one that was handled is moved to the front
+    const std::vector<std::string> reordered{url(second), url(silent), url(first)};
+    ASSERT_EQ(tiers.at(0), reordered);
+}
+
+TEST(TieredAnnounce, reports_failure_of_all_tiers) {
+    UdpTrackerStandIn silent{};
+    silent.m_silent = true;
+    tracker::TieredAnnounce::Tiers tiers{{fmt::format("udp://127.0.0.1:{}/announce", silent.port())}};
+    tracker::TieredAnnounce announce{tiers, udp_test_request(), std::chrono::milliseconds(100),
+                                     [](const std::string&, tracker::Response&&) { FAIL(); }};
+    ASSERT_FALSE(announce.wait_first());
+    ASSERT_EQ(announce.wait_all(), 0);
+}
+
+TEST(AnnounceScheduler, longest_interval_wins) {
+    tracker::AnnounceScheduler sched{
+        tracker::AnnounceScheduler::Config{}, [](tracker::RequestKind) {}, []() { return 0; }};
+    sched.on_response(tracker::Response{{}, 900, std::nullopt});
+    sched.on_response(tracker::Response{{}, 1800, std::nullopt});
+    sched.on_response(tracker::Response{{}, 1200, 3600});
+    ASSERT_EQ(sched.current_interval(), std::chrono::seconds(3600));
+}
+
+TEST(AnnounceScheduler, reannounces_early_when_low_on_peers) {
+    std::mutex mutex{};
+    std::vector<tracker::RequestKind> sent{};
+    std::atomic<std::size_t> num_peers{100};
+    tracker::AnnounceScheduler::Config cfg{};
+    cfg.m_low_peer_watermark = 30;
+    cfg.m_default_interval = std::chrono::hours(1);
+    cfg.m_min_interval = std::chrono::milliseconds(50);
+    cfg.m_check_period = std::chrono::milliseconds(10);
+    tracker::AnnounceScheduler sched{cfg,
+                                     [&](tracker::RequestKind kind) {
+                                         const std::lock_guard<std::mutex> lock{mutex};
+                                         sent.push_back(kind);
+                                     },
+                                     [&]() -> std::size_t { return num_peers; }};
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    sched.start(reactor, q);
+    std::thread worker{[&]() { q.process(); }};
+
+    // Plenty of peers, and the interval is far away
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    {
+        const std::lock_guard<std::mutex> lock{mutex};
+        ASSERT_TRUE(sent.empty());
+    }
+
+    // Running low, but not more often than the minimum interval
+    num_peers = 5;
+    std::this_thread::sleep_for(std::chrono::milliseconds(175));
+    sched.stop();
+    worker.join();
+    ASSERT_GE(sent.size(), 2);
+    ASSERT_LE(sent.size(), 5);
+    for (std::size_t i = 0; i + 1 < sent.size(); i++) {
+        ASSERT_EQ(sent.at(i), tracker::RequestKind::UPDATE);
+    }
+    ASSERT_EQ(sent.back(), tracker::RequestKind::STOPPED);
+}
+
+TEST(AnnounceScheduler, reannounces_after_interval) {
+    std::atomic<std::size_t> updates{0};
+    tracker::AnnounceScheduler::Config cfg{};
+    cfg.m_low_peer_watermark = 0;
+    cfg.m_default_interval = std::chrono::milliseconds(50);
+    cfg.m_min_interval = std::chrono::milliseconds(10);
+    tracker::AnnounceScheduler sched{cfg,
+                                     [&](tracker::RequestKind kind) {
+                                         if (kind == tracker::RequestKind::UPDATE) {
+                                             updates++;
+                                         }
+                                     },
+                                     []() -> std::size_t { return 0; }};
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    sched.start(reactor, q);
+    std::thread worker{[&]() { q.process(); }};
+    std::this_thread::sleep_for(std::chrono::milliseconds(125));
+    sched.stop();
+    worker.join();
+    ASSERT_EQ(updates, 2);
+}
+
+TEST(AnnounceScheduler, sends_completed_when_told) {
+    std::mutex mutex{};
+    std::vector<tracker::RequestKind> sent{};
+    tracker::AnnounceScheduler sched{tracker::AnnounceScheduler::Config{},
+                                     [&](tracker::RequestKind kind) {
+                                         const std::lock_guard<std::mutex> lock{mutex};
+                                         sent.push_back(kind);
+                                     },
+                                     []() -> std::size_t { return 100; }};
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    // Before starting, it's held back until then
+    sched.completed();
+    sched.start(reactor, q);
+    std::thread worker{[&]() { q.process(); }};
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    sched.completed();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    sched.stop();
+    worker.join();
+    const std::vector<tracker::RequestKind> expected{tracker::RequestKind::COMPLETED, tracker::RequestKind::COMPLETED,
+                                                     tracker::RequestKind::STOPPED};
+    ASSERT_EQ(sent, expected);
+}
+
+static job::Task<void> set_flag(std::atomic<bool>& flag) {
+    flag = true;
+    co_return;
+}
+
+TEST(AnnounceScheduler, announces_without_holding_up_the_queue) {
+    std::atomic<std::size_t> updates{0};
+    std::atomic<bool> other_ran{false};
+    std::atomic<bool> saw_other{false};
+    tracker::AnnounceScheduler::Config cfg{};
+    cfg.m_default_interval = std::chrono::milliseconds(10);
+    cfg.m_min_interval = std::chrono::milliseconds(10);
+    tracker::AnnounceScheduler sched{cfg,
+                                     [&](tracker::RequestKind kind) {
+                                         if (kind != tracker::RequestKind::UPDATE || updates++ > 0) {
+                                             return;
+                                         }
+                                         // Like a slow tracker, which the queue's only worker mustn't wait for
+                                         const auto until = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+                                         while (!other_ran && std::chrono::steady_clock::now() < until) {
+                                             std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                                         }
+                                         saw_other = other_ran.load();
+                                     },
+                                     []() -> std::size_t { return 100; }};
+    io::Reactor reactor{};
+    job::JobQueue q{1};
+    sched.start(reactor, q);
+    std::thread worker{[&]() { q.process(); }};
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    q.enqueue(std::make_unique<job::CoroJob>(set_flag(other_ran)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    sched.stop();
+    worker.join();
+    ASSERT_TRUE(saw_other);
+}
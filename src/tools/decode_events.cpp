@@ -0,0 +1,190 @@
+// Turns an event log (see event_log.hpp) into text: every event in the order they happened, followed by a summary
+// per peer, including how long our requests took to be answered.
+//
+// Usage: toytorrent_decode_events events.bin [--summary]
+
+#include <fmt/chrono.h>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "../event_log.hpp"
+#include "../log.hpp"
+#include "../reusable/histogram.hpp"
+#include "../reusable/smolsocket.hpp"
+#include "../torrent/peer_message.hpp"
+
+using namespace tt;
+
+struct Record {
+    log::events::EventHeader m_header;
+    std::array<std::uint64_t, log::Max_Event_Args> m_args;
+};
+
+struct PeerSummary {
+    std::string m_address = "unknown address";
+    std::size_t m_sent = 0;
+    std::size_t m_received = 0;
+    std::size_t m_errors = 0;
+    // Requests not answered yet, by piece and offset, with the time they were sent
+    std::map<std::tuple<std::uint64_t, std::uint64_t>, std::uint64_t> m_open_requests{};
+    histogram::Histogram m_request_latency{};
+};
+
+[[noreturn]] static void fail(const std::string_view msg) {
+    fmt::print(stderr, "{}\n", msg);
+    std::exit(EXIT_FAILURE);
+}
+
+// Read all records of all blocks. Records of one thread are in order, but threads are interleaved.
+static std::vector<Record> read_records(const std::vector<char>& file, const std::size_t block_size) {
+    std::vector<Record> records{};
+    for (std::size_t block = block_size; block + block_size <= file.size(); block += block_size) {
+        std::size_t at = block;
+        while (at + sizeof(log::events::EventHeader) <= block + block_size) {
+            Record r{};
+            std::memcpy(&r.m_header, file.data() + at, sizeof(r.m_header));
+            const auto len = sizeof(r.m_header) + r.m_header.m_num_args * sizeof(std::uint64_t);
+            if (r.m_header.m_event == log::Event::None || r.m_header.m_num_args > log::Max_Event_Args ||
+                at + len > block + block_size) {
+                break;
+            }
+            std::memcpy(r.m_args.data(), file.data() + at + sizeof(r.m_header),
+                        r.m_header.m_num_args * sizeof(std::uint64_t));
+            records.push_back(r);
+            at += len;
+        }
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const Record& a, const Record& b) { return a.m_header.m_time_ns < b.m_header.m_time_ns; });
+    return records;
+}
+
+static std::string describe_message(const Record& r) {
+    const auto type = peer::MessageType(r.m_args[1]);
+    const auto payload_len = r.m_args[2];
+    switch (type) {
+        case peer::MessageType::Request:
+        case peer::MessageType::Cancel:
+            return fmt::format("{} piece {} offset {} length {}", type, r.m_args[3], r.m_args[4], r.m_args[5]);
+        case peer::MessageType::Piece:
+            return fmt::format("{} piece {} offset {} length {}", type, r.m_args[3], r.m_args[4],
+                               payload_len >= 8 ? payload_len - 8 : 0);
+        case peer::MessageType::Have:
+            return fmt::format("{} piece {}", type, r.m_args[3]);
+        default:
+            return fmt::format("{} ({} bytes)", type, payload_len);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2 && !(argc == 3 && std::string_view{argv[2]} == "--summary")) {
+        fmt::print(stderr, "Usage: {} events.bin [--summary]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const bool summary_only = argc == 3;
+
+    std::ifstream in{argv[1], std::ios::binary};
+    if (!in) {
+        fail(fmt::format("Failed to open {}", argv[1]));
+    }
+    const std::vector<char> file{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    log::events::FileHeader header{};
+    if (file.size() < sizeof(header)) {
+        fail("Not an event log: Too short");
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.m_magic != log::events::Magic) {
+        fail("Not an event log: Wrong magic");
+    }
+    if (header.m_version != log::events::Version) {
+        fail(fmt::format("Unsupported event log version {}", header.m_version));
+    }
+    if (header.m_block_size < sizeof(header)) {
+        fail(fmt::format("Invalid block size {}", header.m_block_size));
+    }
+
+    const auto records = read_records(file, header.m_block_size);
+    const std::chrono::system_clock::time_point start{std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::nanoseconds(header.m_start_unix_ns))};
+    fmt::print("# Started {:%F %T} UTC, {} events, {} dropped as the log was full\n", fmt::gmtime(start),
+               records.size(), header.m_dropped);
+
+    std::map<std::uint64_t, PeerSummary> peers{};
+    for (const auto& r : records) {
+        const auto& h = r.m_header;
+        std::string details{};
+        switch (h.m_event) {
+            case log::Event::PeerConnected: {
+                std::array<std::uint8_t, 16> addr{};
+                for (std::size_t i = 0; i < 8; i++) {
+                    addr[i] = static_cast<std::uint8_t>(r.m_args[1] >> (56 - 8 * i));
+                    addr[8 + i] = static_cast<std::uint8_t>(r.m_args[2] >> (56 - 8 * i));
+                }
+                const auto port = static_cast<std::uint16_t>(r.m_args[3]);
+                peers[r.m_args[0]].m_address = smolsocket::Endpoint::from_v6(addr.data(), port).to_string();
+                break;
+            }
+            case log::Event::MessageSent: {
+                auto& p = peers[r.m_args[0]];
+                p.m_sent++;
+                if (peer::MessageType(r.m_args[1]) == peer::MessageType::Request) {
+                    p.m_open_requests[{r.m_args[3], r.m_args[4]}] = h.m_time_ns;
+                }
+                details = describe_message(r);
+                break;
+            }
+            case log::Event::MessageReceived: {
+                auto& p = peers[r.m_args[0]];
+                p.m_received++;
+                if (peer::MessageType(r.m_args[1]) == peer::MessageType::Piece) {
+                    const auto request = p.m_open_requests.find({r.m_args[3], r.m_args[4]});
+                    if (request != p.m_open_requests.end()) {
+                        p.m_request_latency.record(h.m_time_ns - request->second);
+                        p.m_open_requests.erase(request);
+                    }
+                }
+                details = describe_message(r);
+                break;
+            }
+            case log::Event::PeerError:
+                peers[r.m_args[0]].m_errors++;
+                details = fmt::format("while trying to {}", log::peer_op_name(log::PeerOp(r.m_args[1])));
+                break;
+            default:
+                break;
+        }
+        if (summary_only) {
+            continue;
+        }
+        const auto peer = h.m_subsystem == static_cast<std::uint8_t>(log::Subsystem::Peer) && h.m_num_args > 0
+                              ? peers[r.m_args[0]].m_address
+                              : std::string{};
+        fmt::print("{:>16.9f} t{:<3} {:<8} {:<16} {} {}\n", static_cast<double>(h.m_time_ns) / 1e9, h.m_thread,
+                   log::Subsystem(h.m_subsystem), log::event_name(h.m_event), peer, details);
+    }
+
+    fmt::print("# {:<46} {:>8} {:>8} {:>6} {:>10} {:>30}\n", "peer", "sent", "received", "errors", "unanswered",
+               "request latency p50/p99/max (ms)");
+    for (const auto& [key, p] : peers) {
+        const auto ms = [](const std::uint64_t ns) { return static_cast<double>(ns) / 1e6; };
+        const auto& l = p.m_request_latency;
+        fmt::print("# {:<46} {:>8} {:>8} {:>6} {:>10} {:>12.3f}/{:>8.3f}/{:>8.3f}\n", p.m_address, p.m_sent,
+                   p.m_received, p.m_errors, p.m_open_requests.size(), ms(l.percentile(50)), ms(l.percentile(99)),
+                   ms(l.max()));
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+#include "announce_scheduler.hpp"
+
+#include <fmt/core.h>
+
+extern "C" {
+#include <sys/eventfd.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "../io.hpp"
+#include "../job.hpp"
+#include "../log.hpp"
+#include "../task.hpp"
+#include "tracker.hpp"
+
+namespace tt::tracker {
+AnnounceScheduler::AnnounceScheduler(const Config& cfg, AnnounceFn announce, PeerCountFn peer_count)
+    : m_cfg(cfg),
+      m_announce(std::move(announce)),
+      m_peer_count(std::move(peer_count)),
+      m_wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      m_mutex(),
+      m_cv(),
+      m_running(false),
+      m_stopping(false),
+      m_completed(false),
+      m_interval(),
+      m_min_interval(),
+      m_last_announce() {
+    if (m_wake_fd == -1) {
+        throw Exception(fmt::format("AnnounceScheduler: Failed to create eventfd: {}", strerror(errno)));
+    }
+}
+
+void AnnounceScheduler::start(io::Reactor& reactor, job::JobQueue& queue) {
+    bool completed = false;
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        if (m_running) {
+            return;
+        }
+        m_running = true;
+        m_stopping = false;
+        m_last_announce = std::chrono::steady_clock::now();
+        completed = m_completed;
+    }
+    // Left over from stopping before
+    std::uint64_t count = 0;
+    [[maybe_unused]] const auto ret = read(m_wake_fd, &count, sizeof(count));
+    if (completed) {
+        wake();
+    }
+    queue.enqueue(std::make_unique<job::CoroJob>(run(reactor), job::Priority::Control));
+}
+
+void AnnounceScheduler::on_response(const Response& resp) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    const std::chrono::milliseconds interval{std::chrono::seconds(resp.interval)};
+    m_interval = std::max(m_interval.value_or(interval), interval);
+    if (resp.min_interval.has_value()) {
+        const std::chrono::milliseconds min_interval{std::chrono::seconds(resp.min_interval.value())};
+        m_min_interval = std::max(m_min_interval.value_or(min_interval), min_interval);
+    }
+}
+
+void AnnounceScheduler::completed() {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_completed = true;
+    if (m_running) {
+        wake();
+    }
+}
+
+void AnnounceScheduler::stop() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    if (!m_running) {
+        return;
+    }
+    m_stopping = true;
+    wake();
+    m_cv.wait(lock, [&]() { return !m_running; });
+}
+
+std::chrono::milliseconds AnnounceScheduler::current_interval() {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    return interval_locked();
+}
+
+AnnounceScheduler::~AnnounceScheduler() {
+    stop();
+    close(m_wake_fd);
+}
+
+void AnnounceScheduler::wake() {
+    const std::uint64_t one = 1;
+    [[maybe_unused]] const auto ret = write(m_wake_fd, &one, sizeof(one));
+}
+
+std::chrono::milliseconds AnnounceScheduler::interval_locked() const {
+    return std::max(m_interval.value_or(m_cfg.m_default_interval), min_interval_locked());
+}
+
+std::chrono::milliseconds AnnounceScheduler::min_interval_locked() const {
+    return std::max(m_min_interval.value_or(m_cfg.m_min_interval), m_cfg.m_min_interval);
+}
+
+job::Task<void> AnnounceScheduler::run(io::Reactor& reactor) {
+    while (true) {
+        std::chrono::milliseconds wait{};
+        {
+            const std::lock_guard<std::mutex> lock{m_mutex};
+            if (m_stopping) {
+                break;
+            }
+            const auto until_regular = std::chrono::ceil<std::chrono::milliseconds>(
+                m_last_announce + interval_locked() - std::chrono::steady_clock::now());
+            wait = std::clamp(until_regular, std::chrono::milliseconds(0), m_cfg.m_check_period);
+        }
+        // Only readable once we're told to stop or send COMPLETED
+        if (co_await reactor.readable(m_wake_fd, wait)) {
+            std::uint64_t count = 0;
+            [[maybe_unused]] const auto ret = read(m_wake_fd, &count, sizeof(count));
+        }
+
+        bool due = false;
+        auto kind = RequestKind::UPDATE;
+        const auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock{m_mutex};
+        if (m_stopping) {
+            break;
+        }
+        if (m_completed) {
+            m_completed = false;
+            kind = RequestKind::COMPLETED;
+            due = true;
+        } else if (now >= m_last_announce + interval_locked()) {
+            due = true;
+        } else if (now >= m_last_announce + min_interval_locked()) {
+            // Checking the peer count may take locks of it's own, so don't hold ours
+            lock.unlock();
+            const auto peers = m_peer_count();
+            lock.lock();
+            if (peers < m_cfg.m_low_peer_watermark) {
+                TT_LOG(Debug, Tracker, "AnnounceScheduler: Only {} peers left, announcing early", peers);
+                due = true;
+            }
+        }
+        if (!due) {
+            continue;
+        }
+
+        // The responses to this announce decide the next interval
+        m_interval.reset();
+        m_min_interval.reset();
+        m_last_announce = now;
+        lock.unlock();
+        try {
+            co_await announce(kind);
+        } catch (const std::exception& e) {
+            // Updates are tried again next interval
+            TT_LOG(Warning, Tracker, "AnnounceScheduler: Announce failed: {}", e.what());
+        }
+    }
+
+    try {
+        co_await announce(RequestKind::STOPPED);
+    } catch (const std::exception& e) {
+        TT_LOG(Warning, Tracker, "AnnounceScheduler: Failed to tell trackers we stopped: {}", e.what());
+    }
+    // Notified under the lock, as `stop()` may return and destroy us as soon as it's released
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_running = false;
+    m_cv.notify_all();
+}
+
+job::Task<void> AnnounceScheduler::announce(const RequestKind kind) {
+    // Waiting for trackers on the queue's worker would hold up the other jobs there, e.g. the session's keepalives
+    job::Event done{};
+    std::exception_ptr error{};
+    std::thread announcer{[&]() {
+        try {
+            m_announce(kind);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done.set();
+    }};
+    co_await done;
+    // The thread may still be returning from `set()`, which touches `done` in our frame
+    announcer.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+}  // namespace tt::tracker
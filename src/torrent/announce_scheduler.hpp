@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <optional>
+
+#include "../io.hpp"
+#include "../job.hpp"
+#include "../task.hpp"
+#include "tracker.hpp"
+
+namespace tt::tracker {
+
+/// Decides when to announce to a torrent's trackers, and does so from a coroutine job.
+/// In between, the job waits on a reactor's timers, without tying up a worker or thread of it's own. Announces block
+/// until the trackers responded, so each runs on a thread of it's own while the job waits for it.
+///
+/// Re-announces once the interval the trackers asked for has passed, and early if we're running
+/// out of peers, but never more often than the trackers' minimum interval allows.
+/// COMPLETED is sent when told to, and STOPPED when the scheduler is stopped.
+class AnnounceScheduler {
+   public:
+    struct Config {
+        /// Re-announce early when we know fewer peers than this.
+        std::size_t m_low_peer_watermark = 30;
+        /// Interval to use until a tracker told us one.
+        std::chrono::milliseconds m_default_interval{std::chrono::minutes(30)};
+        /// Never announce more often than this, even when the tracker doesn't specify a minimum interval.
+        std::chrono::milliseconds m_min_interval{std::chrono::minutes(1)};
+        /// How often the peer count is checked.
+        std::chrono::milliseconds m_check_period{5000};
+    };
+    /// Performs an announce of the given kind. Should feed responses back via `on_response()`.
+    using AnnounceFn = std::function<void(RequestKind)>;
+    /// Returns the number of peers we currently know.
+    using PeerCountFn = std::function<std::size_t()>;
+
+    AnnounceScheduler(const Config& cfg, AnnounceFn announce, PeerCountFn peer_count);
+    AnnounceScheduler(const AnnounceScheduler&) = delete;
+    AnnounceScheduler& operator=(const AnnounceScheduler&) = delete;
+    /// Start scheduling, in a job on `queue` waiting on `reactor`. The caller is expected to have sent STARTED just
+    /// before. The queue has to be processed, and the reactor kept, until `stop()` returned.
+    void start(io::Reactor& reactor, job::JobQueue& queue);
+    /// Record the intervals a tracker gave us.
+    ///
+    /// As several trackers may respond to the same announce, the longest intervals win, so that none of them is
+    /// asked more often than it wants to be.
+    void on_response(const Response& resp);
+    /// Send COMPLETED from the job as soon as possible, or right after starting if it isn't running yet.
+    /// Doesn't wait for it, so it may be called from any job.
+    void completed();
+    /// Send STOPPED and wait for the job to finish. Does nothing if not running.
+    /// Not to be called from a job on the scheduler's queue, as it may take that worker to finish the job.
+    void stop();
+    /// Time between regular announces, as currently scheduled.
+    std::chrono::milliseconds current_interval();
+    /// Calls `stop()`.
+    ~AnnounceScheduler();
+
+   private:
+    Config m_cfg;
+    AnnounceFn m_announce;
+    PeerCountFn m_peer_count;
+    /// Wakes the job up to stop or send COMPLETED, rather than at it's next check.
+    int m_wake_fd;
+    std::mutex m_mutex;
+    /// Signalled once the job finished.
+    std::condition_variable m_cv;
+    bool m_running;
+    bool m_stopping;
+    /// Whether COMPLETED is yet to be sent.
+    bool m_completed;
+    /// Intervals of the current announce round, which are reset before each announce.
+    std::optional<std::chrono::milliseconds> m_interval;
+    std::optional<std::chrono::milliseconds> m_min_interval;
+    std::chrono::steady_clock::time_point m_last_announce;
+
+    job::Task<void> run(io::Reactor& reactor);
+    /// Call `m_announce` on another thread, suspending until it returned. Rethrows what it threw.
+    job::Task<void> announce(const RequestKind kind);
+    void wake();
+    std::chrono::milliseconds interval_locked() const;
+    std::chrono::milliseconds min_interval_locked() const;
+};
+}  // namespace tt::tracker
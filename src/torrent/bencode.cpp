@@ -4,6 +4,7 @@
 #include <fmt/core.h>
 
 #include <algorithm>
+#include <charconv>
 #include <deque>
 #include <iostream>
 #include <iterator>
@@ -12,6 +13,7 @@
 #include <optional>
 #include <string>
 #include <string_view>
+#include <system_error>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -197,4 +199,172 @@ std::optional<Object> Parser::next() {
         return {Object(m_data)};
     }
 }
-}  // namespace tt::bencode
\ No newline at end of file
+
+// Nesting deeper than this is rejected, so malicious input can't exhaust the stack.
+const std::size_t View_Max_Depth = 64;
+
+static ObjectType type_from_first_char(const char c) {
+    if (isdigit(c)) {
+        return ObjectType::String;
+    }
+    switch (c) {
+        case 'i':
+            return ObjectType::Integer;
+        case 'd':
+            return ObjectType::Dict;
+        case 'l':
+            return ObjectType::List;
+        default:
+            throw Exception{fmt::format("Unexpected BEncoded object type starting with character {}", c)};
+    }
+}
+
+// Returns the length of the string at the start of `data`, and where it's contents begin.
+static std::pair<std::size_t, std::size_t> view_string_len(const std::string_view &data) {
+    std::size_t len = 0;
+    std::size_t i = 0;
+    while (i < data.size() && isdigit(data[i])) {
+        // Anything longer than this can't fit into the buffer anyways
+        if (len > data.size()) {
+            throw Exception{"BEncoded string is longer than it's containing buffer"};
+        }
+        len = len * 10 + static_cast<std::size_t>(data[i] - '0');
+        i++;
+    }
+    if (i == 0 || i >= data.size() || data[i] != ':') {
+        throw Exception{"Non-numeric characters not allowed in length specifier of BEncode string"};
+    }
+    i++;
+    if (len > data.size() - i) {
+        throw Exception{"BEncoded string is longer than it's containing buffer"};
+    }
+    return {len, i};
+}
+
+// Returns the length of the BEncoded value at the start of `data`, validating it on the way.
+static std::size_t view_value_len(const std::string_view &data, const std::size_t depth) {
+    if (data.empty()) {
+        throw Exception{"Unexpected end of BEncoded data"};
+    }
+    if (depth > View_Max_Depth) {
+        throw Exception{"BEncoded data is nested too deeply"};
+    }
+    const auto type = type_from_first_char(data.front());
+    switch (type) {
+        case ObjectType::String: {
+            const auto [len, start] = view_string_len(data);
+            return start + len;
+        }
+        case ObjectType::Integer: {
+            const auto end = data.find('e');
+            if (end == std::string_view::npos) {
+                throw Exception{"Unterminated BEncoded integer"};
+            }
+            auto digits = data.substr(1, end - 1);
+            if (digits.starts_with('-')) {
+                digits.remove_prefix(1);
+            }
+            if (digits.empty() || !std::all_of(digits.begin(), digits.end(), [](char c) { return isdigit(c); })) {
+                throw Exception{"Encountered unexpected character while trying to parse BEncoded integer"};
+            }
+            return end + 1;
+        }
+        case ObjectType::Dict:
+        case ObjectType::List: {
+            std::size_t i = 1;
+            while (i < data.size() && data[i] != 'e') {
+                if (type == ObjectType::Dict) {
+                    if (!isdigit(data[i])) {
+                        throw Exception{"BEncode dictionary keys must be strings"};
+                    }
+                    const auto [len, start] = view_string_len(data.substr(i));
+                    i += start + len;
+                }
+                i += view_value_len(data.substr(i), depth + 1);
+            }
+            if (i >= data.size()) {
+                throw Exception{"Unterminated BEncoded dictionary or list"};
+            }
+            return i + 1;
+        }
+    }
+    // Should be unreachable
+    throw Exception{"Unexpected BEncoded object type"};
+}
+
+// Same as `view_value_len()`, but for data that has already been validated.
+static std::size_t view_value_len_trusted(const std::string_view &data) {
+    switch (type_from_first_char(data.front())) {
+        case ObjectType::String: {
+            const auto [len, start] = view_string_len(data);
+            return start + len;
+        }
+        case ObjectType::Integer:
+            return data.find('e') + 1;
+        case ObjectType::Dict:
+        case ObjectType::List: {
+            const bool is_dict = data.front() == 'd';
+            std::size_t i = 1;
+            while (data[i] != 'e') {
+                if (is_dict) {
+                    const auto [len, start] = view_string_len(data.substr(i));
+                    i += start + len;
+                }
+                i += view_value_len_trusted(data.substr(i));
+            }
+            return i + 1;
+        }
+    }
+    // Should be unreachable
+    throw Exception{"Unexpected BEncoded object type"};
+}
+
+View::View(const std::string_view &data)
+    : m_raw(data.substr(0, view_value_len(data, 0))), m_type(type_from_first_char(data.front())) {}
+
+View::View(const std::string_view &data, Trusted)
+    : m_raw(data.substr(0, view_value_len_trusted(data))), m_type(type_from_first_char(data.front())) {}
+
+ObjectType View::type() const { return m_type; }
+
+std::string_view View::raw() const { return m_raw; }
+
+std::optional<std::string_view> View::str() const {
+    if (m_type != ObjectType::String) {
+        return {};
+    }
+    const auto [len, start] = view_string_len(m_raw);
+    return m_raw.substr(start, len);
+}
+
+std::optional<std::int64_t> View::integer() const {
+    if (m_type != ObjectType::Integer) {
+        return {};
+    }
+    std::int64_t value = 0;
+    const auto digits = m_raw.substr(1, m_raw.size() - 2);
+    const auto [_, err] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    if (err != std::errc{}) {
+        throw Exception{"BEncoded integer is out of range"};
+    }
+    return value;
+}
+
+std::optional<View> View::find(const std::string_view &key) const {
+    if (m_type != ObjectType::Dict) {
+        return {};
+    }
+    std::size_t i = 1;
+    while (m_raw[i] != 'e') {
+        const auto [len, start] = view_string_len(m_raw.substr(i));
+        const auto k = m_raw.substr(i + start, len);
+        i += start + len;
+        const View value{m_raw.substr(i), Trusted{}};
+        if (k == key) {
+            return value;
+        }
+        i += value.m_raw.size();
+    }
+    return {};
+}
+}  // namespace tt::bencode
@@ -65,4 +65,45 @@ class Parser {
     // Returns the next member, if available, none otherwise
     std::optional<Object> next();
 };
+
+// A non-owning view of one BEncoded value inside a buffer.
+// Unlike `Object`, nothing is decoded up front or copied, so the buffer must outlive the view.
+// Meant for hot paths like tracker responses, where we only want a few keys out of a large message.
+class View {
+   public:
+    // Validate the value at the start of `data`. Trailing data is ignored.
+    explicit View(const std::string_view& data);
+    // What kind of BEncode-representable object this is.
+    ObjectType type() const;
+    // The value in it's BEncoded form.
+    std::string_view raw() const;
+    // Will be some if the value is a string
+    std::optional<std::string_view> str() const;
+    // Will be some if the value is an integer
+    std::optional<std::int64_t> integer() const;
+    // Look up a key in a dictionary. None if the key is absent, or the value isn't a dictionary.
+    std::optional<View> find(const std::string_view& key) const;
+    // Call `f` with a view of each element, if the value is a list. Returns whether it was one.
+    template <typename F>
+    bool for_each(F&& f) const {
+        if (m_type != ObjectType::List) {
+            return false;
+        }
+        std::string_view rest = m_raw.substr(1, m_raw.size() - 2);
+        while (!rest.empty()) {
+            const View elem{rest, Trusted{}};
+            rest.remove_prefix(elem.m_raw.size());
+            f(elem);
+        }
+        return true;
+    }
+
+   private:
+    // Tag for constructing views of data that has already been validated
+    struct Trusted {};
+    View(const std::string_view& data, Trusted);
+
+    std::string_view m_raw;
+    ObjectType m_type;
+};
 }  // namespace tt::bencode
\ No newline at end of file
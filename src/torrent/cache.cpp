@@ -0,0 +1,178 @@
+#include "cache.hpp"
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "../task.hpp"
+#include "storage.hpp"
+
+namespace tt::cache {
+
+Reservation::Reservation(Reservation&& src) noexcept
+    : m_cache(std::exchange(src.m_cache, nullptr)),
+      m_bytes(std::exchange(src.m_bytes, 0)),
+      m_set_aside(src.m_set_aside) {}
+
+Reservation& Reservation::operator=(Reservation&& src) noexcept {
+    if (this != &src) {
+        release();
+        m_cache = std::exchange(src.m_cache, nullptr);
+        m_bytes = std::exchange(src.m_bytes, 0);
+        m_set_aside = src.m_set_aside;
+    }
+    return *this;
+}
+
+Reservation::~Reservation() { release(); }
+
+void Reservation::release() {
+    if (m_cache != nullptr) {
+        std::exchange(m_cache, nullptr)->release(std::exchange(m_bytes, 0), m_set_aside);
+    }
+}
+
+Cache::Cache() : Cache(Config{}) {}
+
+Cache::Cache(const Config& cfg)
+    : m_budget(cfg.m_budget),
+      m_dirty_watermark(cfg.m_dirty_watermark != 0 ? cfg.m_dirty_watermark : cfg.m_budget / 4 * 3),
+      m_mutex(),
+      m_dirty(0),
+      m_clean(0),
+      m_set_aside(0),
+      m_lru(),
+      m_blocks(),
+      m_waiters(),
+      m_hits(0),
+      m_misses(0),
+      m_evictions(0),
+      m_throttled(0) {}
+
+job::Task<Reservation> Cache::reserve(const std::uint64_t bytes) {
+    Waiter waiter{bytes};
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        // Nobody may overtake those already waiting, or large pieces could wait forever
+        if (m_waiters.empty() && fits(bytes)) {
+            m_dirty += bytes;
+            evict(0);
+            waiter.m_granted.set();
+        } else {
+            m_waiters.push_back(&waiter);
+            m_throttled++;
+        }
+    }
+    co_await waiter.m_granted;
+    co_return Reservation{*this, bytes, false};
+}
+
+Reservation Cache::set_aside(const std::uint64_t bytes) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_set_aside += bytes;
+    evict(0);
+    return Reservation{*this, bytes, true};
+}
+
+void Cache::insert(const storage::IStorage& storage, const std::uint64_t offset, std::vector<std::uint8_t>&& block) {
+    keep({&storage, offset}, std::make_shared<const std::vector<std::uint8_t>>(std::move(block)));
+}
+
+std::shared_ptr<const std::vector<std::uint8_t>> Cache::read(storage::IStorage& storage, const std::uint64_t offset,
+                                                             const std::uint32_t size) {
+    const Key key{&storage, offset};
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        const auto it = m_blocks.find(key);
+        if (it != m_blocks.end() && it->second->m_data->size() == size) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            m_hits++;
+            return it->second->m_data;
+        }
+        m_misses++;
+    }
+    auto block = std::make_shared<std::vector<std::uint8_t>>(size);
+    const iovec buffer{block->data(), block->size()};
+    storage.read(offset, {&buffer, 1});
+    keep(key, block);
+    return block;
+}
+
+void Cache::forget(const storage::IStorage& storage) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    for (auto it = m_lru.begin(); it != m_lru.end();) {
+        if (it->m_key.m_storage == &storage) {
+            m_clean -= it->m_data->size();
+            m_blocks.erase(it->m_key);
+            it = m_lru.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+Cache::Stats Cache::stats() const {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    return {.m_dirty_bytes = m_dirty,
+            .m_clean_bytes = m_clean,
+            .m_hits = m_hits,
+            .m_misses = m_misses,
+            .m_evictions = m_evictions,
+            .m_throttled = m_throttled,
+            .m_set_aside_bytes = m_set_aside};
+}
+
+bool Cache::fits(const std::uint64_t bytes) const {
+    return m_dirty == 0 || m_set_aside + m_dirty + bytes <= m_dirty_watermark;
+}
+
+void Cache::evict(const std::uint64_t extra) {
+    while (!m_lru.empty() && m_set_aside + m_dirty + m_clean + extra > m_budget) {
+        const auto& victim = m_lru.back();
+        m_clean -= victim.m_data->size();
+        m_blocks.erase(victim.m_key);
+        m_lru.pop_back();
+        m_evictions++;
+    }
+}
+
+void Cache::keep(const Key& key, std::shared_ptr<const std::vector<std::uint8_t>> data) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    const auto it = m_blocks.find(key);
+    if (it != m_blocks.end()) {
+        m_clean -= it->second->m_data->size();
+        m_lru.erase(it->second);
+        m_blocks.erase(it);
+    }
+    evict(data->size());
+    if (m_set_aside + m_dirty + m_clean + data->size() > m_budget) {
+        return;
+    }
+    m_clean += data->size();
+    m_lru.push_front({key, std::move(data)});
+    m_blocks.emplace(key, m_lru.begin());
+}
+
+void Cache::release(const std::uint64_t bytes, const bool set_aside) {
+    std::vector<Waiter*> granted{};
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        (set_aside ? m_set_aside : m_dirty) -= bytes;
+        while (!m_waiters.empty() && fits(m_waiters.front()->m_bytes)) {
+            m_dirty += m_waiters.front()->m_bytes;
+            granted.push_back(m_waiters.front());
+            m_waiters.pop_front();
+        }
+        evict(0);
+    }
+    // Granted waiters may resume and be gone right away, so they're left alone afterwards
+    for (auto* waiter : granted) {
+        waiter->m_granted.set();
+    }
+}
+
+}  // namespace tt::cache
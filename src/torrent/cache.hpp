@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "../task.hpp"
+#include "storage.hpp"
+
+namespace tt::cache {
+
+/// Default for `Config::m_budget`.
+const std::uint64_t Default_Budget = 256 * 1024 * 1024;
+
+class Cache;
+
+/// Bytes of blocks being downloaded and not written yet, or memory set aside, accounted to a cache. See
+/// `Cache::reserve()` and `Cache::set_aside()`.
+///
+/// Given back once released or destroyed, whichever comes first.
+class Reservation {
+   public:
+    Reservation() = default;
+    Reservation(Reservation&& src) noexcept;
+    Reservation& operator=(Reservation&& src) noexcept;
+    Reservation(const Reservation&) = delete;
+    Reservation& operator=(const Reservation&) = delete;
+    ~Reservation();
+
+    void release();
+    std::uint64_t bytes() const { return m_bytes; }
+
+   private:
+    friend class Cache;
+    Reservation(Cache& cache, const std::uint64_t bytes, const bool set_aside)
+        : m_cache(&cache), m_bytes(bytes), m_set_aside(set_aside) {}
+
+    Cache* m_cache = nullptr;
+    std::uint64_t m_bytes = 0;
+    bool m_set_aside = false;
+};
+
+/// Memory for the blocks of all torrents, within a fixed budget.
+///
+/// Blocks being downloaded ("dirty") stay with their piece until it's written, but have to be reserved here first.
+/// Once the dirty bytes would exceed the watermark, reserving waits for pieces to be written, which holds back the
+/// downloads. Written pieces are handed over as clean blocks, which are kept to serve reads, and evicted least
+/// recently used first to make room for either. Memory used for blocks elsewhere, such as the write buffers of
+/// storages, is set aside from the budget too.
+///
+/// Thread-safe. Meant to be shared by all torrents of a session.
+class Cache {
+   public:
+    struct Config {
+        /// Memory dirty and clean blocks may take up, together.
+        std::uint64_t m_budget = Default_Budget;
+        /// Dirty bytes downloads are held back at. 0 for three quarters of the budget, leaving the rest for reads.
+        std::uint64_t m_dirty_watermark = 0;
+    };
+
+    struct Stats {
+        std::uint64_t m_dirty_bytes;
+        std::uint64_t m_clean_bytes;
+        std::uint64_t m_hits;
+        std::uint64_t m_misses;
+        std::uint64_t m_evictions;
+        /// Reservations that had to wait for dirty bytes to be written.
+        std::uint64_t m_throttled;
+        std::uint64_t m_set_aside_bytes;
+    };
+
+    Cache();
+    explicit Cache(const Config& cfg);
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+
+    /// Account for `bytes` about to be downloaded.
+    /// Suspends the calling coroutine while that would take the dirty bytes past the watermark, unless nothing is
+    /// dirty. Reservations are granted in the order they were asked for.
+    job::Task<Reservation> reserve(const std::uint64_t bytes);
+    /// Take `bytes` out of the budget for as long as the returned reservation is held, evicting clean blocks to make
+    /// room right away. They count towards the watermark too, but never hold back downloads entirely.
+    Reservation set_aside(const std::uint64_t bytes);
+    /// Keep a block that is on `storage` at `offset` now, to serve reads of it.
+    /// It's dropped right away if it doesn't fit into the budget next to the dirty bytes.
+    void insert(const storage::IStorage& storage, const std::uint64_t offset, std::vector<std::uint8_t>&& block);
+    /// Read a block, from the cache if it's there, else from `storage`, keeping it for next time.
+    std::shared_ptr<const std::vector<std::uint8_t>> read(storage::IStorage& storage, const std::uint64_t offset,
+                                                          const std::uint32_t size);
+    /// Drop all blocks of `storage`, which has to be done before it's destroyed.
+    void forget(const storage::IStorage& storage);
+    Stats stats() const;
+
+   private:
+    friend class Reservation;
+
+    struct Key {
+        const storage::IStorage* m_storage;
+        std::uint64_t m_offset;
+        bool operator==(const Key&) const = default;
+    };
+    struct KeyHash {
+        std::size_t operator()(const Key& k) const {
+            return std::hash<const void*>{}(k.m_storage) ^ std::hash<std::uint64_t>{}(k.m_offset);
+        }
+    };
+    struct Block {
+        Key m_key;
+        std::shared_ptr<const std::vector<std::uint8_t>> m_data;
+    };
+    /// A coroutine waiting in `reserve()`, which lives in it's frame.
+    struct Waiter {
+        std::uint64_t m_bytes;
+        job::Event m_granted{};
+    };
+
+    std::uint64_t m_budget;
+    std::uint64_t m_dirty_watermark;
+    /// Guards the members below.
+    mutable std::mutex m_mutex;
+    std::uint64_t m_dirty;
+    std::uint64_t m_clean;
+    std::uint64_t m_set_aside;
+    /// Clean blocks, the most recently used first.
+    std::list<Block> m_lru;
+    std::unordered_map<Key, std::list<Block>::iterator, KeyHash> m_blocks;
+    std::deque<Waiter*> m_waiters;
+    std::uint64_t m_hits;
+    std::uint64_t m_misses;
+    std::uint64_t m_evictions;
+    std::uint64_t m_throttled;
+
+    /// Whether `bytes` more may become dirty now. `m_mutex` must be held.
+    bool fits(const std::uint64_t bytes) const;
+    /// Evict clean blocks until they fit into the budget with `extra` more bytes. `m_mutex` must be held.
+    void evict(const std::uint64_t extra);
+    /// Put a clean block first in line, replacing what was kept for the same place.
+    void keep(const Key& key, std::shared_ptr<const std::vector<std::uint8_t>> data);
+    /// Give back dirty or set aside bytes, granting waiting reservations that fit now.
+    void release(const std::uint64_t bytes, const bool set_aside);
+};
+
+}  // namespace tt::cache
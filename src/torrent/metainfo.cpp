@@ -12,8 +12,10 @@
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <random>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "bencode.hpp"
@@ -28,6 +30,45 @@ static std::ifstream read_torrent_file(const std::string_view& path) {
 }
 
 namespace tt {
+void MetaInfo::parse_announce_list(const std::map<std::string, bencode::Object>& top_level_dict) {
+    const auto announce = top_level_dict.find("announce");
+    if (announce != top_level_dict.end()) {
+        m_primary_tracker_url = announce->second.str.value();
+    }
+
+    m_announce_list = {};
+    const auto announce_list = top_level_dict.find("announce-list");
+    if (announce_list != top_level_dict.end() && announce_list->second.list.has_value()) {
+        // The spec wants tiers to be shuffled once, so that load is spread between the trackers of a tier
+        std::mt19937 rng{std::random_device{}()};
+        for (const auto& tier_obj : announce_list->second.list.value()) {
+            if (!tier_obj.list.has_value()) {
+                throw std::runtime_error{"Tiers in announce-list must be lists"};
+            }
+            std::vector<std::string> tier{};
+            for (const auto& url : tier_obj.list.value()) {
+                if (!url.str.has_value()) {
+                    throw std::runtime_error{"Tracker URLs in announce-list must be strings"};
+                }
+                tier.push_back(url.str.value());
+            }
+            if (!tier.empty()) {
+                std::shuffle(tier.begin(), tier.end(), rng);
+                m_announce_list.push_back(std::move(tier));
+            }
+        }
+    }
+
+    if (m_announce_list.empty()) {
+        if (m_primary_tracker_url.empty()) {
+            throw std::runtime_error{"Torrent metainfo file must contain 'announce' or 'announce-list' key"};
+        }
+        m_announce_list.push_back({m_primary_tracker_url});
+    } else if (m_primary_tracker_url.empty()) {
+        m_primary_tracker_url = m_announce_list.front().front();
+    }
+}
+
 MetaInfo metainfo_from_path(const std::string_view& path) {
     auto f = read_torrent_file(path);
     std::deque<char> data{};
@@ -50,8 +91,8 @@ MetaInfo::MetaInfo(std::deque<char> in) {
     auto top_level_parser = bencode::Parser(in);
     auto top_level_dict = top_level_parser.next().value().dict.value();
 
-    // Primary tracker announce URL
-    m_primary_tracker_url = top_level_dict.find("announce")->second.str.value();
+    // Tracker announce URLs
+    parse_announce_list(top_level_dict);
 
     // info itself is also a dict
     auto info = top_level_dict.find("info")->second;
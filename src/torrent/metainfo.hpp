@@ -3,10 +3,12 @@
 #include <array>
 #include <cstdint>
 #include <deque>
+#include <map>
 #include <optional>
 #include <string>
 #include <vector>
 
+#include "bencode.hpp"
 #include "shared_constants.hpp"
 
 namespace tt {
@@ -20,9 +22,15 @@ class MetaInfo {
     // Used for computing the infohash
     std::vector<char> m_bencoded_info;
 
+    // Fills the tracker URL fields from the top-level dict of the metainfo.
+    void parse_announce_list(const std::map<std::string, bencode::Object>& top_level_dict);
+
    public:
     // Primary tracker URL embedded in this metainfo.
     std::string m_primary_tracker_url;
+    // Tiers of tracker URLs (BEP 12), in order of preference. The URLs within each tier are shuffled.
+    // If the metainfo has no announce-list, this contains a single tier with just the primary tracker.
+    std::vector<std::vector<std::string>> m_announce_list;
     // Whether we're downloading a file or directory
     DownloadType m_download_type;
     // The file/directory name the metainfo file suggests we store the data under
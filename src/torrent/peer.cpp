@@ -4,15 +4,23 @@
 #include <fmt/core.h>
 
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <semaphore>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include "../event_log.hpp"
+#include "../io.hpp"
 #include "../log.hpp"
+#include "../reusable/byteorder.hpp"
 #include "../reusable/smolsocket.hpp"
+#include "../task.hpp"
 #include "peer_message.hpp"
 #include "shared_constants.hpp"
 
@@ -21,6 +29,58 @@ namespace tt::peer {
 const std::vector<std::uint8_t> Peer_Handshake_Magic = {19,  'B', 'i', 't', 'T', 'o', 'r', 'r', 'e', 'n',
                                                         't', ' ', 'p', 'r', 'o', 't', 'o', 'c', 'o', 'l'};
 const std::optional<std::uint64_t> Timeout{2000};
+const std::chrono::milliseconds Async_Timeout{2000};
+
+// Record a message, given by it's type and payload, in the event log.
+// Only the first `available` of it's `len` bytes need to be at hand, e.g. if the payload is sent from a file.
+static void message_event(const log::Event event, const Peer& peer, const std::uint8_t* body,
+                          const std::size_t available, const std::size_t len) {
+    if (!log::events_enabled() || len == 0) {
+        return;
+    }
+    // The first three fields are enough to tell which block a request or piece is about
+    std::array<std::uint32_t, 3> fields{};
+    for (std::size_t i = 0; i < fields.size() && 1 + 4 * (i + 1) <= available; i++) {
+        fields[i] = bo::ntoh(bo::arr_to_int(std::array<std::uint8_t, 4>{body[1 + 4 * i], body[2 + 4 * i],
+                                                                         body[3 + 4 * i], body[4 + 4 * i]}));
+    }
+    log::event(log::Subsystem::Peer, event, peer.event_key(), body[0], len - 1, fields[0], fields[1], fields[2]);
+}
+
+static void message_event(const log::Event event, const Peer& peer, const std::uint8_t* body, const std::size_t len) {
+    message_event(event, peer, body, len, len);
+}
+
+static void error_event(const Peer& peer, const log::PeerOp op) {
+    log::event(log::Subsystem::Peer, log::Event::PeerError, peer.event_key(), static_cast<std::uint64_t>(op));
+}
+
+static void connected_event(const Peer& peer) {
+    if (!log::events_enabled()) {
+        return;
+    }
+    const auto& addr = peer.m_endpoint.m_addr;
+    std::uint64_t high = 0;
+    std::uint64_t low = 0;
+    for (std::size_t i = 0; i < 8; i++) {
+        high = high << 8 | addr[i];
+        low = low << 8 | addr[8 + i];
+    }
+    log::event(log::Subsystem::Peer, log::Event::PeerConnected, peer.event_key(), high, low,
+               peer.m_endpoint.m_port);
+}
+
+// Holds a peer's send lock for as long as it lives.
+class SendGuard {
+   public:
+    explicit SendGuard(std::binary_semaphore& lock) : m_lock(lock) { m_lock.acquire(); }
+    SendGuard(const SendGuard&) = delete;
+    SendGuard& operator=(const SendGuard&) = delete;
+    ~SendGuard() { m_lock.release(); }
+
+   private:
+    std::binary_semaphore& m_lock;
+};
 
 Exception::Exception(const std::string_view& msg) : m_msg(msg) {}
 
@@ -39,10 +99,10 @@ ID::ID() {
     }
 }
 
-ID::ID(const std::array<char, ID_Length>& str) { std::copy(str.begin(), str.end(), this->m_id.begin()); }
-ID::ID(const std::string_view& str) { std::copy_n(str.begin(), ID_Length, this->m_id.begin()); }
+ID::ID(const std::array<char, ID_Length>& str) : m_id(str.begin(), str.end()) {}
+ID::ID(const std::string_view& str) : m_id(str.substr(0, ID_Length)) {}
 
-std::string ID::as_string() const { return std::string(this->m_id.data()); }
+std::string ID::as_string() const { return this->m_id; }
 
 std::vector<std::uint8_t> ID::as_byte_vec() const {
     auto char_to_bytes = [](char c) { return static_cast<uint8_t>(c); };
@@ -52,15 +112,23 @@ std::vector<std::uint8_t> ID::as_byte_vec() const {
     return result;
 }
 
-Peer::Peer(const ID& id, const std::string_view& ip, const std::uint16_t port)
-    : m_sock({}), m_ip(ip), m_port(port), m_id(id) {}
+Peer::Peer(const ID& id, const smolsocket::Endpoint& endpoint) : m_sock({}), m_endpoint(endpoint), m_id(id) {}
+
+Peer::Peer(const ID& id, const std::string_view& ip, const std::uint16_t port) : m_sock({}), m_endpoint(), m_id(id) {
+    const auto endpoint = smolsocket::Endpoint::parse(ip, port);
+    if (!endpoint.has_value()) {
+        throw Exception(fmt::format("Peer::Peer(): {} is not a numeric IP address", ip));
+    }
+    m_endpoint = endpoint.value();
+}
+
+Peer::Peer(const smolsocket::Endpoint& endpoint) : m_sock({}), m_endpoint(endpoint), m_id(std::string_view()) {}
 
 Peer::Peer(Peer&& src)
     : m_sock(std::move(src.m_sock)),
       m_we_choked(src.m_we_choked),
       m_we_interested(src.m_we_interested),
-      m_ip(std::move(src.m_ip)),
-      m_port(src.m_port),
+      m_endpoint(src.m_endpoint),
       m_id(std::move(src.m_id)) {
     // FIXME: We should invalidate the old one's socket,
     // but initialization in this language is so fucked that after 2 hours of trying I can't figure out how to
@@ -73,28 +141,97 @@ Peer& Peer::operator=(Peer&& other) {
         std::swap(this->m_sock, other.m_sock);
         this->m_we_choked = other.m_we_choked;
         this->m_we_interested = other.m_we_interested;
-        this->m_ip = std::move(other.m_ip);
-        this->m_port = other.m_port;
+        this->m_endpoint = other.m_endpoint;
         this->m_id = std::move(other.m_id);
         return *this;
     }
     return other;
 }
 
-bool Peer::operator==(const Peer& other) const { return m_ip == other.m_ip && m_port == other.m_port; }
+std::uint64_t Peer::event_key() const {
+    // FNV-1a
+    std::uint64_t hash = 0xcbf29ce484222325;
+    const auto mix = [&](const std::uint8_t byte) { hash = (hash ^ byte) * 0x100000001b3; };
+    for (const auto byte : m_endpoint.m_addr) {
+        mix(byte);
+    }
+    mix(static_cast<std::uint8_t>(m_endpoint.m_port >> 8));
+    mix(static_cast<std::uint8_t>(m_endpoint.m_port));
+    return hash;
+}
 
-void Peer::handshake(const std::vector<std::uint8_t>& truncated_infohash, const ID& our_id) {
-    // Create connection
+bool Peer::operator==(const Peer& other) const { return m_endpoint == other.m_endpoint; }
+
+void Peer::attach_socket(smolsocket::Sock&& sock) { this->m_sock.emplace(std::move(sock)); }
+
+bool Peer::is_connected() const { return this->m_sock.has_value(); }
+
+std::optional<smolsocket::TcpInfo> Peer::tcp_info() const {
+    if (!this->is_connected()) {
+        return {};
+    }
+    try {
+        return this->m_sock->tcp_info();
+    } catch (const smolsocket::Exception& e) {
+        TT_LOG(Warning, Peer, "Peer::tcp_info(): Failed to query {}: {}", *this, e.what());
+        return {};
+    }
+}
+
+void Peer::connect() {
+    if (this->is_connected()) {
+        return;
+    }
     try {
-        log::log(log::Level::Debug, log::Subsystem::Peer, fmt::format("Peer::connect(): Trying {}", *this));
-        this->m_sock.emplace(smolsocket::Sock(m_ip, m_port, smolsocket::Proto::TCP, Timeout));
+        TT_LOG(Debug, Peer, "Peer::connect(): Trying {}", *this);
+        this->m_sock.emplace(smolsocket::Sock(m_endpoint, smolsocket::Proto::TCP, Timeout));
     } catch (const smolsocket::Exception& e) {
         auto msg = fmt::format("Conn::Conn(): Failed to connect: {}", e.what());
-        log::log(log::Level::Warning, log::Subsystem::Peer, msg);
+        TT_LOG(Warning, Peer, "{}", msg);
+        error_event(*this, log::PeerOp::Connect);
         throw Exception(msg);
     }
-    // Handshake
+}
+
+void Peer::handshake(const std::vector<std::uint8_t>& truncated_infohash, const ID& our_id) {
+    this->connect();
+    this->send_handshake(truncated_infohash, our_id);
+    TT_LOG(Debug, Peer, "Peer::connect(): connection established to peer {}", *this);
+    connected_event(*this);
+}
+
+job::Task<void> Peer::async_handshake(io::Reactor& reactor, std::vector<std::uint8_t> truncated_infohash,
+                                      ID our_id) {
+    // Peers are usually connected in parallel beforehand (see `Torrent::connect_peers()`), so this rarely blocks
+    this->connect();
+    // Fixed handshake bytes, supported protocol extensions (none), infohash and our peer ID, in one go
+    std::vector<std::uint8_t> handshake{Peer_Handshake_Magic};
+    handshake.resize(handshake.size() + 8);
+    handshake.insert(handshake.end(), truncated_infohash.begin(), truncated_infohash.end());
+    const auto id = our_id.as_byte_vec();
+    handshake.insert(handshake.end(), id.begin(), id.end());
     try {
+        co_await io::send_all(reactor, this->m_sock.value(), std::move(handshake), Async_Timeout);
+    } catch (const std::exception& e) {
+        auto msg = fmt::format("Peer::async_handshake(): Failed to handshake: {}", e.what());
+        TT_LOG(Warning, Peer, "{}", msg);
+        error_event(*this, log::PeerOp::Handshake);
+        throw Exception(msg);
+    }
+    // Otherwise it'd be taken for the first message
+    const auto infohash = co_await this->async_receive_handshake(reactor);
+    if (infohash != truncated_infohash) {
+        auto msg = fmt::format("Peer::async_handshake(): {} answered for another torrent", *this);
+        TT_LOG(Warning, Peer, "{}", msg);
+        error_event(*this, log::PeerOp::Handshake);
+        throw Exception(msg);
+    }
+    TT_LOG(Debug, Peer, "Peer::async_handshake(): connection established to peer {}", *this);
+}
+
+void Peer::send_handshake(const std::vector<std::uint8_t>& truncated_infohash, const ID& our_id) {
+    try {
+        const SendGuard guard{m_send_lock};
         // Fixed handshake bytes
         m_sock.value().send(Peer_Handshake_Magic, Timeout);
         // Supported protocol extensions
@@ -109,47 +246,194 @@ void Peer::handshake(const std::vector<std::uint8_t>& truncated_infohash, const
 
     } catch (const smolsocket::Exception& e) {
         auto msg = fmt::format("Peer::connect(): Failed to handshake: {}", e.what());
-        log::log(log::Level::Warning, log::Subsystem::Peer, msg);
+        TT_LOG(Warning, Peer, "{}", msg);
+        error_event(*this, log::PeerOp::Handshake);
+        throw Exception(msg);
+    }
+}
+
+std::vector<std::uint8_t> Peer::receive_handshake() {
+    const std::size_t reserved_len = 8;
+    try {
+        const auto magic = m_sock.value().recv(Peer_Handshake_Magic.size(), Timeout);
+        if (magic != Peer_Handshake_Magic) {
+            throw Exception(fmt::format("Peer::receive_handshake(): {} doesn't speak the BitTorrent protocol", *this));
+        }
+        // We don't support any extensions, so ignore what the remote supports
+        m_sock.value().recv(reserved_len, Timeout);
+        auto infohash = m_sock.value().recv(piece::Piece_Hash_Len, Timeout);
+        const auto id = m_sock.value().recv(ID_Length, Timeout);
+        this->m_id = ID(std::string_view(reinterpret_cast<const char*>(id.data()), id.size()));
+        connected_event(*this);
+        return infohash;
+    } catch (const smolsocket::Exception& e) {
+        auto msg = fmt::format("Peer::receive_handshake(): Failed to handshake: {}", e.what());
+        TT_LOG(Warning, Peer, "{}", msg);
+        error_event(*this, log::PeerOp::Handshake);
+        throw Exception(msg);
+    }
+}
+
+job::Task<std::vector<std::uint8_t>> Peer::async_receive_handshake(io::Reactor& reactor) {
+    const std::size_t reserved_len = 8;
+    const std::size_t infohash_at = Peer_Handshake_Magic.size() + reserved_len;
+    const std::size_t id_at = infohash_at + piece::Piece_Hash_Len;
+    std::vector<std::uint8_t> handshake{};
+    try {
+        handshake = co_await io::recv_exact(reactor, m_sock.value(), id_at + ID_Length, Async_Timeout);
+    } catch (const std::exception& e) {
+        auto msg = fmt::format("Peer::async_receive_handshake(): Failed to handshake: {}", e.what());
+        TT_LOG(Warning, Peer, "{}", msg);
+        error_event(*this, log::PeerOp::Handshake);
         throw Exception(msg);
     }
-    log::log(log::Level::Debug, log::Subsystem::Peer,
-             fmt::format("Peer::connect(): connection established to peer {}", *this));
+    if (!std::equal(Peer_Handshake_Magic.begin(), Peer_Handshake_Magic.end(), handshake.begin())) {
+        throw Exception(
+            fmt::format("Peer::async_receive_handshake(): {} doesn't speak the BitTorrent protocol", *this));
+    }
+    // We don't support any extensions, so ignore what the remote supports
+    this->m_id = ID(std::string_view(reinterpret_cast<const char*>(handshake.data() + id_at), ID_Length));
+    connected_event(*this);
+    co_return std::vector<std::uint8_t>(handshake.data() + infohash_at, handshake.data() + id_at);
 }
 
 void Peer::send_message(const peer::IMessage& msg) {
     try {
-        log::log(log::Level::Debug, log::Subsystem::Peer,
-                 fmt::format("Peer::send_message(): Sending message {} to {}", *this, msg));
-        // Send message type
-        this->m_sock.value().send({static_cast<std::uint8_t>(msg.get_type())}, Timeout);
-        // Send message payload
-        this->m_sock.value().send(msg.serialize(), Timeout);
+        const auto framed = frame_message(msg);
+        // Only what's known already, so a disabled debug log costs nothing
+        TT_LOG(Debug, Peer, "Peer::send_message(): Sending {} ({} bytes) to {}", msg.get_type(), framed.size(), *this);
+        message_event(log::Event::MessageSent, *this, framed.data() + 4, framed.size() - 4);
+        const SendGuard guard{m_send_lock};
+        this->m_sock.value().send(framed, Timeout);
     } catch (const smolsocket::Exception& e) {
         auto except_msg = fmt::format("Peer::send_message(): Failed to send message: {}", e.what());
-        log::log(log::Level::Warning, log::Subsystem::Peer, except_msg);
+        TT_LOG(Warning, Peer, "{}", except_msg);
+        error_event(*this, log::PeerOp::Send);
+        throw Exception(except_msg);
+    }
+}
+
+void Peer::send_piece_from_file(const std::uint32_t piece_idx, const std::uint32_t begin_offset, const int fd,
+                                const std::uint64_t file_offset, const std::uint32_t len) {
+    // Length, type, piece index and begin offset, followed by the payload
+    std::vector<std::uint8_t> header{};
+    header.reserve(13);
+    const auto append = [&header](const std::uint32_t field) {
+        const auto arr = bo::int_to_arr(bo::hton(field));
+        header.insert(header.end(), arr.begin(), arr.end());
+    };
+    append(9 + len);
+    header.push_back(static_cast<std::uint8_t>(MessageType::Piece));
+    append(piece_idx);
+    append(begin_offset);
+    try {
+        TT_LOG(Debug, Peer, "Peer::send_piece_from_file(): Sending {} ({} bytes) to {}", MessageType::Piece,
+               header.size() + len, *this);
+        message_event(log::Event::MessageSent, *this, header.data() + 4, header.size() - 4, 9 + len);
+        // Header and payload are sent separately, nothing else may get in between
+        const SendGuard guard{m_send_lock};
+        this->m_sock.value().send_file(header, fd, file_offset, len, Timeout);
+    } catch (const smolsocket::Exception& e) {
+        auto except_msg = fmt::format("Peer::send_piece_from_file(): Failed to send piece: {}", e.what());
+        TT_LOG(Warning, Peer, "{}", except_msg);
+        error_event(*this, log::PeerOp::Send);
         throw Exception(except_msg);
     }
 }
 
 void Peer::send_keepalive() {
     try {
-        // keepalives are empty messages.
-        this->m_sock->send({}, Timeout);
+        // keepalives are empty messages, i.e. just a length of 0.
+        const SendGuard guard{m_send_lock};
+        this->m_sock->send({0, 0, 0, 0}, Timeout);
     } catch (const smolsocket::Exception& e) {
         auto msg = fmt::format("Peer::send_keepalive(): Failed to send keepalive: {}", e.what());
-        log::log(log::Level::Warning, log::Subsystem::Peer, msg);
+        TT_LOG(Warning, Peer, "{}", msg);
+        error_event(*this, log::PeerOp::Send);
+        throw Exception(msg);
+    }
+}
+
+job::Task<void> Peer::async_send_keepalive(io::Reactor& reactor) {
+    if (!m_send_lock.try_acquire()) {
+        co_return;
+    }
+    try {
+        // Just a length of 0
+        co_await io::send_all(reactor, this->m_sock.value(), std::vector<std::uint8_t>(4, 0), Async_Timeout);
+    } catch (const std::exception& e) {
+        m_send_lock.release();
+        auto msg = fmt::format("Peer::async_send_keepalive(): Failed to send keepalive: {}", e.what());
+        TT_LOG(Warning, Peer, "{}", msg);
+        error_event(*this, log::PeerOp::Send);
         throw Exception(msg);
     }
+    m_send_lock.release();
 }
 
 std::unique_ptr<IMessage> Peer::wait_for_message() {
     // FIXME: This timeout is wildly inappropriate. It should be decided by the caller.
-    return blocking_read_message_from_socket(this->m_sock.value(), {2000}, Request_Subpiece_Size);
+    while (true) {
+        std::vector<std::uint8_t> body{};
+        try {
+            body = blocking_read_body_from_socket(this->m_sock.value(), {2000});
+        } catch (const std::exception&) {
+            error_event(*this, log::PeerOp::Receive);
+            throw;
+        }
+        message_event(log::Event::MessageReceived, *this, body.data(), body.size());
+        // Skip messages we don't handle yet
+        if (auto msg = parse_message(body)) {
+            return msg;
+        }
+    }
 }
 
-PeerHandshakeJob::PeerHandshakeJob(std::shared_ptr<Peer> peer, std::vector<std::uint8_t> truncated_infohash, ID our_id)
-    : m_peer(std::move(peer)), m_truncated_infohash(std::move(truncated_infohash)), m_our_id(our_id) {}
+job::Task<void> Peer::async_send_message(io::Reactor& reactor, const peer::IMessage& msg) {
+    // Not a coroutine itself, so that `msg` is serialized before the caller gets a chance to drop it
+    auto framed = frame_message(msg);
+    TT_LOG(Debug, Peer, "Peer::async_send_message(): Sending {} ({} bytes) to {}", msg.get_type(), framed.size(),
+           *this);
+    message_event(log::Event::MessageSent, *this, framed.data() + 4, framed.size() - 4);
+    return async_send_framed(reactor, std::move(framed));
+}
+
+job::Task<void> Peer::async_send_framed(io::Reactor& reactor, std::vector<std::uint8_t> framed) {
+    try {
+        co_await io::send_all(reactor, this->m_sock.value(), std::move(framed), Async_Timeout);
+    } catch (const std::exception& e) {
+        auto except_msg = fmt::format("Peer::async_send_message(): Failed to send message: {}", e.what());
+        TT_LOG(Warning, Peer, "{}", except_msg);
+        error_event(*this, log::PeerOp::Send);
+        throw Exception(except_msg);
+    }
+}
 
-void PeerHandshakeJob::process() { m_peer->handshake(m_truncated_infohash, m_our_id); }
+job::Task<std::unique_ptr<IMessage>> Peer::async_wait_for_message(io::Reactor& reactor,
+                                                                  const std::chrono::milliseconds timeout) {
+    auto& sock = this->m_sock.value();
+    while (true) {
+        std::vector<std::uint8_t> body{};
+        try {
+            const auto len_arr = co_await io::recv_exact(reactor, sock, 4, timeout);
+            const auto len = bo::ntoh(bo::arr_to_int(std::array<std::uint8_t, 4>{len_arr[0], len_arr[1], len_arr[2],
+                                                                                  len_arr[3]}));
+            if (len > Max_Message_Len) {
+                throw Exception(fmt::format("Message of length {} is too long", len));
+            }
+            body = co_await io::recv_exact(reactor, sock, len, timeout);
+        } catch (const std::exception& e) {
+            auto except_msg = fmt::format("Peer::async_wait_for_message(): Failed to receive message: {}", e.what());
+            TT_LOG(Warning, Peer, "{}", except_msg);
+            error_event(*this, log::PeerOp::Receive);
+            throw Exception(except_msg);
+        }
+        message_event(log::Event::MessageReceived, *this, body.data(), body.size());
+        // Skip keepalives and messages we don't handle yet
+        if (auto msg = parse_message(body)) {
+            co_return msg;
+        }
+    }
+}
 
 }  // namespace tt::peer
@@ -2,15 +2,19 @@
 
 #include <fmt/format.h>
 
+#include <chrono>
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <semaphore>
 #include <string>
 #include <string_view>
 #include <vector>
 
+#include "../io.hpp"
 #include "../job.hpp"
 #include "../reusable/smolsocket.hpp"
+#include "../task.hpp"
 #include "peer_message.hpp"
 
 namespace tt::peer {
@@ -48,53 +52,94 @@ class ID {
 class Peer {
    private:
     std::optional<smolsocket::Sock> m_sock;
+    // Held for the whole of every send, so messages sent from different jobs don't end up interleaved on the
+    // connection. A semaphore rather than a mutex, as coroutines may be resumed on another thread than they took it
+    // on. Each instance has it's own, it isn't moved along with the socket.
+    std::binary_semaphore m_send_lock{1};
     bool m_we_choked = false;
     bool m_we_interested = false;
 
+    job::Task<void> async_send_framed(io::Reactor& reactor, std::vector<std::uint8_t> framed);
+    // Establish a connection to this peer, unless one was already attached.
+    void connect();
+
    public:
-    std::string m_ip;
-    std::uint16_t m_port;
+    smolsocket::Endpoint m_endpoint;
     ID m_id;
 
+    Peer(const ID& id, const smolsocket::Endpoint& endpoint);
+    // Same as above, but for a numeric IP address. Throws if `ip` isn't one.
     Peer(const ID& id, const std::string_view& ip, const std::uint16_t port);
+    // A peer whose ID we don't know yet. It's filled in when handshaking.
+    explicit Peer(const smolsocket::Endpoint& endpoint);
     Peer() = delete;
     // The underlying socket should only ever be touched by one instance.
     Peer(const Peer&) = delete;
     Peer& operator=(const Peer&) = delete;
     Peer(Peer&& src);
     Peer& operator=(Peer&&);
-    // Establish a connection to this peer.
+    // Hand this peer a connection that has been established elsewhere (e.g. by a `smolsocket::Connector`).
+    void attach_socket(smolsocket::Sock&& sock);
+    // Whether a connection to this peer exists.
+    bool is_connected() const;
+    // The kernel's TCP statistics for the connection to this peer, if connected.
+    std::optional<smolsocket::TcpInfo> tcp_info() const;
+    // Establish a connection to this peer, unless one was already attached, and handshake.
     void handshake(const std::vector<std::uint8_t>& truncated_infohash, const ID& our_id);
-    // Send a message to this peer (after handshaking).
+    /*
+     * Like `handshake()`, but suspends the calling coroutine job instead of blocking while sending, and then waits for
+     * the remote's half, which has to be for the same torrent. Only connecting blocks, if no connection was attached
+     * yet.
+     */
+    job::Task<void> async_handshake(io::Reactor& reactor, std::vector<std::uint8_t> truncated_infohash,
+                                    ID our_id);
+    // Send our half of the handshake over an existing connection.
+    void send_handshake(const std::vector<std::uint8_t>& truncated_infohash, const ID& our_id);
+    /*
+     * Read the remote's half of the handshake from an inbound connection, updating this peer's ID.
+     * Returns the infohash of the torrent the remote wants, so the caller can find out whether we serve it.
+     */
+    std::vector<std::uint8_t> receive_handshake();
+    // Like `receive_handshake()`, but suspends the calling coroutine job until the handshake has arrived.
+    job::Task<std::vector<std::uint8_t>> async_receive_handshake(io::Reactor& reactor);
+    // Send a message to this peer (after handshaking). May be called by several jobs at once.
     void send_message(const peer::IMessage& msg);
+    /*
+     * Send a block to this peer as a Piece message, with the payload taken straight from the file `fd` at
+     * `file_offset` by the kernel, rather than copied through our memory. See `smolsocket::Sock::send_file()`.
+     */
+    void send_piece_from_file(const std::uint32_t piece_idx, const std::uint32_t begin_offset, const int fd,
+                              const std::uint64_t file_offset, const std::uint32_t len);
     /*
      * Send a keepalive to this peer (after handshaking).
      * The protocol requires this to happen at least once every 2 minutes.
      */
     void send_keepalive();
+    /*
+     * Like `send_keepalive()`, but suspends the calling coroutine job instead of blocking while the socket is busy.
+     * Skipped if another message is being sent right now, which keeps the connection alive just as well.
+     */
+    job::Task<void> async_send_keepalive(io::Reactor& reactor);
     // Block until this peer has sent us a message.
     std::unique_ptr<IMessage> wait_for_message();
-    /// Compare this peer against `other` based on IP and Port.
+    /*
+     * Like `send_message()`, but suspends the calling coroutine job instead of blocking while the socket is busy.
+     * The message is copied right away, so it doesn't have to outlive the call.
+     * Doesn't serialize with other sends, so the caller must be the only one sending to this peer meanwhile.
+     */
+    job::Task<void> async_send_message(io::Reactor& reactor, const peer::IMessage& msg);
+    // Like `wait_for_message()`, but suspends the calling coroutine job until the message has arrived.
+    job::Task<std::unique_ptr<IMessage>> async_wait_for_message(io::Reactor& reactor,
+                                                                const std::chrono::milliseconds timeout);
+    /// Identifies this peer in the event log (see `log::Event`), based on it's endpoint.
+    std::uint64_t event_key() const;
+    /// Compare this peer against `other` based on it's endpoint.
     ///
     /// IDs are not used, because the compact tracker protocol omits them.
     /// Therefore, the same peer may have a different IP on next tracker query.
     bool operator==(const Peer& other) const;
 };
 
-/// A job for handshaking with the peer.
-/// What happens if handshaking has already happened is undefined.
-class PeerHandshakeJob final : public job::IJob {
-   public:
-    PeerHandshakeJob() = delete;
-    PeerHandshakeJob(std::shared_ptr<Peer>, std::vector<std::uint8_t> truncated_infohash, ID our_id);
-    void process() override;
-
-   private:
-    std::shared_ptr<Peer> m_peer;
-    std::vector<std::uint8_t> m_truncated_infohash;
-    ID m_our_id;
-};
-
 }  // namespace tt::peer
 
 namespace fmt {
@@ -107,8 +152,8 @@ struct formatter<tt::peer::Peer> {
 
     template <typename FormatContext>
     auto format(const tt::peer::Peer& p, FormatContext& ctx) {
-        return format_to(ctx.out(), "{{ID: \"{}\", IP: \"{}\", Port: \"{}\"}}", p.m_id.as_string(), p.m_ip.c_str(),
-                         p.m_port);
+        return format_to(ctx.out(), "{{ID: \"{}\", IP: \"{}\", Port: \"{}\"}}", p.m_id.as_string(),
+                         p.m_endpoint.ip_str(), p.m_endpoint.m_port);
     }
 };
 }  // namespace fmt
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <vector>
@@ -9,32 +10,92 @@
 #include "../log.hpp"
 #include "../reusable/byteorder.hpp"
 #include "../reusable/smolsocket.hpp"
+#include "peer.hpp"
 
 namespace tt::peer {
 
-/*
- FIXME: This shouldn't assume the length of the returned piece, because it breaks for the final piece.
- An option would be introducing a proxy that intercepts requests and records their size,
- though this would be ugly due to making a stateless module stateful.
-*/
-std::unique_ptr<IMessage> blocking_read_message_from_socket(smolsocket::Sock& sock,
-                                                            std::optional<std::uint64_t> timeout_millis,
-                                                            std::size_t piece_size) {
-    // Read the single byte specifying the message type.
-    auto type_buf = sock.recv(1, timeout_millis);
-    MessageType msg_type = MessageType(type_buf.at(0));
+// Read a big-endian integer from `data` at `offset`.
+static std::uint32_t read_u32(const std::vector<std::uint8_t>& data, const std::size_t offset) {
+    std::array<std::uint8_t, 4> arr{};
+    std::copy_n(data.begin() + static_cast<std::ptrdiff_t>(offset), 4, arr.begin());
+    return bo::ntoh(bo::arr_to_int(arr));
+}
 
-    switch (msg_type) {
+std::vector<std::uint8_t> frame_message(const IMessage& msg) {
+    const auto payload = msg.serialize();
+    std::vector<std::uint8_t> framed{};
+    framed.reserve(4 + 1 + payload.size());
+    const auto len_arr = bo::int_to_arr(bo::hton(static_cast<std::uint32_t>(1 + payload.size())));
+    framed.insert(framed.end(), len_arr.begin(), len_arr.end());
+    framed.push_back(static_cast<std::uint8_t>(msg.get_type()));
+    framed.insert(framed.end(), payload.begin(), payload.end());
+    return framed;
+}
+
+std::unique_ptr<IMessage> parse_message(const std::vector<std::uint8_t>& body) {
+    if (body.empty()) {
+        // Keepalive
+        return nullptr;
+    }
+    const auto type = MessageType(body.at(0));
+    const auto payload_len = body.size() - 1;
+    const auto expect_len = [&](const bool ok) {
+        if (!ok) {
+            throw Exception(
+                fmt::format("peer::parse_message(): Message of type {} has invalid length {}", type, payload_len));
+        }
+    };
+    switch (type) {
+        case MessageType::Choke:
+            expect_len(payload_len == 0);
+            return std::make_unique<MessageChoke>();
+        case MessageType::Unchoke:
+            expect_len(payload_len == 0);
+            return std::make_unique<MessageUnchoke>();
+        case MessageType::Interested:
+            expect_len(payload_len == 0);
+            return std::make_unique<MessageInterested>();
+        case MessageType::NotInterested:
+            expect_len(payload_len == 0);
+            return std::make_unique<MessageNotInterested>();
+        case MessageType::Request:
+            expect_len(payload_len == 12);
+            return std::make_unique<MessageRequest>(read_u32(body, 1), read_u32(body, 5), read_u32(body, 9));
         case MessageType::Piece:
-            return std::make_unique<MessagePiece>(MessagePiece(sock, piece_size));
-            break;
+            expect_len(payload_len >= 8);
+            return std::make_unique<MessagePiece>(read_u32(body, 1), read_u32(body, 5),
+                                                  std::vector<std::uint8_t>(body.begin() + 9, body.end()));
         default:
-            log::log(log::Level::Fatal, log::Subsystem::Peer,
-                     fmt::format("blocking_read_message_from_socket(): Received message of type {} which we don't know "
-                                 "how to handle yet!",
-                                 msg_type));
-            exit(EXIT_FAILURE);
-            break;
+            return nullptr;
+    }
+}
+
+std::vector<std::uint8_t> blocking_read_body_from_socket(smolsocket::Sock& sock,
+                                                         std::optional<std::uint64_t> timeout_millis) {
+    while (true) {
+        const auto len = read_u32(sock.recv(4, timeout_millis), 0);
+        if (len == 0) {
+            // Keepalive
+            continue;
+        }
+        if (len > Max_Message_Len) {
+            throw Exception(fmt::format("peer::blocking_read_body_from_socket(): Message of length {} is too long",
+                                        len));
+        }
+        return sock.recv(len, timeout_millis);
+    }
+}
+
+std::unique_ptr<IMessage> blocking_read_message_from_socket(smolsocket::Sock& sock,
+                                                            std::optional<std::uint64_t> timeout_millis) {
+    while (true) {
+        const auto body = blocking_read_body_from_socket(sock, timeout_millis);
+        if (auto msg = parse_message(body)) {
+            return msg;
+        }
+        TT_LOG(Debug, Peer, "blocking_read_message_from_socket(): Skipping message of type {} which we don't know "
+               "how to handle yet",
+               MessageType(body.at(0)));
     }
 }
 
@@ -84,23 +145,15 @@ std::vector<std::uint8_t> MessageRequest::serialize() const {
     return serialized;
 }
 
-MessageRequest::~MessageRequest() {}
+std::uint32_t MessageRequest::get_piece_idx() const { return this->m_piece_idx; }
 
-/* MessagePiece */
+std::uint32_t MessageRequest::get_begin_offset() const { return this->m_begin_offset; }
 
-MessagePiece::MessagePiece(smolsocket::Sock& s, const std::size_t piece_len) : m_piece_data({}) {
-    const auto data = s.recv(4 + 4 + piece_len, {2000});
-    std::array<std::uint8_t, 4> idx_arr{};
-    std::copy_n(data.begin(), 4, idx_arr.begin());
-    this->m_piece_idx = bo::ntoh(bo::arr_to_int(idx_arr));
+std::uint32_t MessageRequest::get_length() const { return this->m_length; }
 
-    std::array<std::uint8_t, 4> begin_arr{};
-    std::copy_n(data.begin() + 4, 4, begin_arr.begin());
-    this->m_begin_offset = bo::ntoh(bo::arr_to_int(begin_arr));
+MessageRequest::~MessageRequest() {}
 
-    this->m_piece_data.reserve(piece_len);
-    std::copy_n(data.begin() + 8, piece_len, this->m_piece_data.begin());
-}
+/* MessagePiece */
 
 MessagePiece::MessagePiece(const std::uint32_t piece_idx, const std::uint32_t begin_offset,
                            const std::vector<std::uint8_t>& piece_data)
@@ -119,7 +172,7 @@ std::vector<std::uint8_t> MessagePiece::serialize() const {
     for (const auto b : begin_arr) {
         serialized.push_back(b);
     }
-    serialized.insert(serialized.begin(), this->m_piece_data.begin(), this->m_piece_data.end());
+    serialized.insert(serialized.end(), this->m_piece_data.begin(), this->m_piece_data.end());
 
     return serialized;
 }
@@ -35,14 +35,35 @@ class IMessage {
     virtual ~IMessage() {}
 };
 
+// Messages longer than this are rejected, so a broken peer can't make us allocate arbitrary amounts of memory.
+// Generously covers a subpiece plus it's header, and the bitfields of all but the most enormous torrents.
+const std::uint32_t Max_Message_Len = 2 * 1024 * 1024;
+
+/*
+ * Wrap a message for transmission over the wire: A 4-byte big-endian length, followed by the type and payload.
+ */
+std::vector<std::uint8_t> frame_message(const IMessage& msg);
+
+/*
+ * Parse a message from it's type and payload, i.e. a frame without the length prefix.
+ * Returns nullptr for keepalives and messages of types we don't handle, which callers are expected to skip.
+ * Throws a `peer::Exception` if the payload doesn't fit the type.
+ */
+std::unique_ptr<IMessage> parse_message(const std::vector<std::uint8_t>& body);
+
+/*
+ * Read the type and payload of the next message from the given socket, i.e. a frame without the length prefix,
+ * skipping keepalives. Throws if the connection fails, the length is invalid, or the timeout expires.
+ */
+std::vector<std::uint8_t> blocking_read_body_from_socket(smolsocket::Sock& sock,
+                                                         std::optional<std::uint64_t> timeout_millis);
+
 /*
- * Read and parse a message from the given socket.
- * The reason why this has to be coupled to the socket is that various types of messages are dynamically-sized,
- * and therefore have to be able to request more data on their own.
+ * Read and parse the next message from the given socket, skipping keepalives and messages we don't handle.
+ * Throws if the connection fails, the remote sends garbage, or the timeout expires while waiting for any one read.
  */
 std::unique_ptr<IMessage> blocking_read_message_from_socket(smolsocket::Sock& sock,
-                                                            std::optional<std::uint64_t> timeout_millis,
-                                                            std::size_t piece_size);
+                                                            std::optional<std::uint64_t> timeout_millis);
 
 class MessageChoke : public IMessage {
    public:
@@ -77,9 +98,13 @@ class MessageRequest : public IMessage {
 
    public:
     MessageRequest(const std::uint32_t piece_idx, const std::uint32_t begin_offset, const std::uint32_t length);
+    MessageRequest(const MessageRequest&) = default;
 
     MessageType get_type() const override;
     std::vector<std::uint8_t> serialize() const override;
+    std::uint32_t get_piece_idx() const;
+    std::uint32_t get_begin_offset() const;
+    std::uint32_t get_length() const;
     ~MessageRequest() override;
 };
 
@@ -91,7 +116,6 @@ class MessagePiece : public IMessage {
     std::uint32_t m_piece_idx;
     std::uint32_t m_begin_offset;
 
-    MessagePiece(smolsocket::Sock& s, const std::size_t piece_len);
     MessagePiece(const std::uint32_t piece_idx, const std::uint32_t begin_offset,
                  const std::vector<std::uint8_t>& piece_data);
     MessagePiece(const MessagePiece&) = default;
@@ -0,0 +1,156 @@
+#include "peer_registry.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "../reusable/smolsocket.hpp"
+
+namespace tt::peer {
+
+const std::size_t Initial_Slots = 64;
+
+Registry::Registry() : Registry(Config{}) {}
+
+Registry::Registry(const Config& cfg) : m_cfg(cfg), m_slots(Initial_Slots), m_size(0) {}
+
+bool Registry::add(const smolsocket::Endpoint& endpoint, const Source source, const Clock::time_point now) {
+    auto idx = probe(endpoint);
+    if (m_slots[idx].m_used) {
+        auto& c = m_slots[idx].m_candidate;
+        c.m_last_seen = std::max(c.m_last_seen, now);
+        return false;
+    }
+    if ((m_size + 1) * 2 > m_slots.size()) {
+        grow();
+        idx = probe(endpoint);
+    }
+    m_slots[idx] = Slot{Candidate{endpoint, source, false, 0, now, now}, true};
+    m_size++;
+    return true;
+}
+
+const Candidate* Registry::find(const smolsocket::Endpoint& endpoint) const {
+    const auto& slot = m_slots[probe(endpoint)];
+    return slot.m_used ? &slot.m_candidate : nullptr;
+}
+
+void Registry::on_connected(const smolsocket::Endpoint& endpoint, const Clock::time_point now) {
+    auto* c = find_mut(endpoint);
+    if (c == nullptr) {
+        return;
+    }
+    c->m_connected = true;
+    c->m_failures = 0;
+    c->m_last_seen = now;
+}
+
+void Registry::on_connect_failed(const smolsocket::Endpoint& endpoint, const Clock::time_point now) {
+    auto* c = find_mut(endpoint);
+    if (c == nullptr) {
+        return;
+    }
+    c->m_connected = false;
+    c->m_failures++;
+    if (c->m_failures >= m_cfg.m_max_failures) {
+        forget(endpoint);
+        return;
+    }
+    // Shifting by the failure count is fine, as it's bounded by the maximum above
+    const auto backoff = std::min(m_cfg.m_base_backoff * (std::int64_t{1} << (c->m_failures - 1)), m_cfg.m_max_backoff);
+    c->m_retry_at = now + backoff;
+}
+
+void Registry::on_disconnected(const smolsocket::Endpoint& endpoint, const Clock::time_point now) {
+    auto* c = find_mut(endpoint);
+    if (c == nullptr) {
+        return;
+    }
+    c->m_connected = false;
+    c->m_last_seen = now;
+    // Give it some time before reconnecting, it probably had a reason to hang up
+    c->m_retry_at = now + m_cfg.m_base_backoff;
+}
+
+bool Registry::forget(const smolsocket::Endpoint& endpoint) {
+    auto hole = probe(endpoint);
+    if (!m_slots[hole].m_used) {
+        return false;
+    }
+    m_slots[hole].m_used = false;
+    m_size--;
+
+    // Move later entries of the probe sequence into the hole, so lookups don't stop early there
+    const auto mask = m_slots.size() - 1;
+    for (auto i = (hole + 1) & mask; m_slots[i].m_used; i = (i + 1) & mask) {
+        const auto home = home_of(m_slots[i].m_candidate.m_endpoint);
+        // Distance from the entry's home slot to the hole and to where it is now, wrapping around
+        if (((hole - home) & mask) < ((i - home) & mask)) {
+            m_slots[hole] = m_slots[i];
+            m_slots[i].m_used = false;
+            hole = i;
+        }
+    }
+    return true;
+}
+
+void Registry::next_candidates(const Clock::time_point now, const std::size_t max,
+                               std::vector<Candidate>& out) const {
+    out.clear();
+    for (const auto& slot : m_slots) {
+        if (slot.m_used && !slot.m_candidate.m_connected && slot.m_candidate.m_retry_at <= now) {
+            out.push_back(slot.m_candidate);
+        }
+    }
+    const auto better = [](const Candidate& a, const Candidate& b) {
+        if (a.m_failures != b.m_failures) {
+            return a.m_failures < b.m_failures;
+        }
+        return a.m_last_seen > b.m_last_seen;
+    };
+    const auto n = std::min(max, out.size());
+    std::partial_sort(out.begin(), out.begin() + static_cast<std::ptrdiff_t>(n), out.end(), better);
+    out.resize(n);
+}
+
+std::size_t Registry::size() const { return m_size; }
+
+std::size_t Registry::num_connectable(const Clock::time_point now) const {
+    return static_cast<std::size_t>(std::count_if(m_slots.begin(), m_slots.end(), [&](const Slot& slot) {
+        return slot.m_used && (slot.m_candidate.m_connected || slot.m_candidate.m_retry_at <= now);
+    }));
+}
+
+std::size_t Registry::home_of(const smolsocket::Endpoint& endpoint) const {
+    return std::hash<smolsocket::Endpoint>{}(endpoint) & (m_slots.size() - 1);
+}
+
+std::size_t Registry::probe(const smolsocket::Endpoint& endpoint) const {
+    const auto mask = m_slots.size() - 1;
+    auto i = home_of(endpoint);
+    // Terminates, as the table is never full
+    while (m_slots[i].m_used && m_slots[i].m_candidate.m_endpoint != endpoint) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+Candidate* Registry::find_mut(const smolsocket::Endpoint& endpoint) {
+    auto& slot = m_slots[probe(endpoint)];
+    return slot.m_used ? &slot.m_candidate : nullptr;
+}
+
+void Registry::grow() {
+    auto old = std::move(m_slots);
+    m_slots = std::vector<Slot>(old.size() * 2);
+    for (const auto& slot : old) {
+        if (slot.m_used) {
+            m_slots[probe(slot.m_candidate.m_endpoint)] = slot;
+        }
+    }
+}
+}  // namespace tt::peer
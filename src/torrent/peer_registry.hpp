@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "../reusable/smolsocket.hpp"
+
+namespace tt::peer {
+
+/// Where we learned about a peer.
+enum class Source : std::uint8_t {
+    Tracker,
+    Pex,
+    Incoming,
+};
+
+/// What we know about a peer we may connect to.
+struct Candidate {
+    smolsocket::Endpoint m_endpoint;
+    Source m_source;
+    bool m_connected;
+    /// Connection attempts that failed in a row.
+    std::uint16_t m_failures;
+    /// When a tracker or peer last told us about it, or it last connected to us.
+    std::chrono::steady_clock::time_point m_last_seen;
+    /// Don't try to connect again before this.
+    std::chrono::steady_clock::time_point m_retry_at;
+};
+
+/// All peers a torrent knows about, keyed by endpoint.
+///
+/// An open-addressing hash table with linear probing, so lookups and inserts are O(1) and entries are stored inline.
+/// Merging a large peer list doesn't allocate, except for occasionally growing the table.
+/// Not thread-safe.
+class Registry {
+   public:
+    using Clock = std::chrono::steady_clock;
+    struct Config {
+        /// Wait this long after the first failed connection attempt, doubling with each further failure.
+        std::chrono::milliseconds m_base_backoff{std::chrono::seconds(30)};
+        std::chrono::milliseconds m_max_backoff{std::chrono::minutes(30)};
+        /// Forget peers once this many connection attempts in a row failed.
+        std::uint16_t m_max_failures = 8;
+    };
+
+    Registry();
+    explicit Registry(const Config& cfg);
+    /// Add a peer, or refresh when it was last seen if it's already known. Returns whether it was new.
+    bool add(const smolsocket::Endpoint& endpoint, const Source source, const Clock::time_point now);
+    /// Look up a peer. The pointer is invalidated by any modification of the registry.
+    const Candidate* find(const smolsocket::Endpoint& endpoint) const;
+    /// Record that we are now connected to the peer.
+    void on_connected(const smolsocket::Endpoint& endpoint, const Clock::time_point now);
+    /// Record a failed connection attempt, backing off from the peer or forgetting it if it failed too often.
+    void on_connect_failed(const smolsocket::Endpoint& endpoint, const Clock::time_point now);
+    /// Record that the connection to the peer was closed.
+    void on_disconnected(const smolsocket::Endpoint& endpoint, const Clock::time_point now);
+    /// Remove a peer. Returns whether it was known.
+    bool forget(const smolsocket::Endpoint& endpoint);
+    /// Replace the contents of `out` with up to `max` peers worth connecting to now, best first.
+    ///
+    /// Peers we aren't connected to and aren't backing off from qualify. Fewer failures are better, then more
+    /// recently seen ones.
+    void next_candidates(const Clock::time_point now, const std::size_t max, std::vector<Candidate>& out) const;
+    /// Number of known peers.
+    std::size_t size() const;
+    /// Number of peers we're connected to, or may connect to now as we aren't backing off from them.
+    std::size_t num_connectable(const Clock::time_point now) const;
+
+   private:
+    struct Slot {
+        Candidate m_candidate;
+        bool m_used;
+    };
+    Config m_cfg;
+    /// Power-of-two sized, at most half full.
+    std::vector<Slot> m_slots;
+    std::size_t m_size;
+
+    std::size_t home_of(const smolsocket::Endpoint& endpoint) const;
+    /// Index of the slot holding the endpoint, or of the empty slot it would go into.
+    std::size_t probe(const smolsocket::Endpoint& endpoint) const;
+    Candidate* find_mut(const smolsocket::Endpoint& endpoint);
+    void grow();
+};
+}  // namespace tt::peer
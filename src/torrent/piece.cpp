@@ -4,11 +4,12 @@
 #include <botan-2/botan/hex.h>
 #include <fmt/core.h>
 #include <fmt/ranges.h>
+#include <sys/uio.h>
 
 #include <algorithm>
 #include <array>
+#include <cstdint>
 #include <exception>
-#include <fstream>
 #include <functional>
 #include <optional>
 #include <stdexcept>
@@ -16,7 +17,10 @@
 #include <vector>
 
 #include "../log.hpp"
+#include "../task.hpp"
+#include "cache.hpp"
 #include "shared_constants.hpp"
+#include "storage.hpp"
 
 namespace tt::piece {
 Piece::Piece(const std::uint32_t size, const std::uint32_t idx,
@@ -31,6 +35,13 @@ Piece::Piece(const std::uint32_t size, const std::uint32_t idx,
     std::fill(this->m_subpieces.begin(), this->m_subpieces.end(), nothing);
 }
 
+Piece::Piece(const Piece& src)
+    : m_state(src.m_state.load()),
+      m_size(src.m_size),
+      m_idx(src.m_idx),
+      m_expected_hash(src.m_expected_hash),
+      m_subpieces(src.m_subpieces) {}
+
 std::array<std::uint8_t, Piece_Hash_Len> Piece::get_curr_hash() {
     // Iterate over subpieces and collect into vector
     std::vector<std::uint8_t> data{};
@@ -68,26 +79,32 @@ void Piece::set_downloaded_subpiece_data(const std::size_t subpiece_idx, const s
     this->m_subpieces.at(subpiece_idx) = {data};
 }
 
-void Piece::flush_to_disk(std::shared_ptr<std::fstream> f) {
-    // Seek into position
-    f->exceptions(std::fstream::failbit | std::fstream::badbit | std::fstream::eofbit);
+job::Task<void> Piece::flush_to_disk(storage::IStorage& storage) {
+    std::vector<iovec> buffers{};
+    buffers.reserve(this->m_subpieces.size());
+    for (auto& opt_subpiece : this->m_subpieces) {
+        if (opt_subpiece.has_value()) {
+            buffers.push_back(iovec{opt_subpiece->data(), opt_subpiece->size()});
+        }
+    }
+    const auto offset = static_cast<std::uint64_t>(this->m_idx) * this->m_size;
     try {
-        f->seekp(this->m_idx * this->m_size);
-    } catch (const std::ios_base::failure& e) {
-        throw std::runtime_error(fmt::format("Piece::flush_to_disk() failed: Failed to seek (Reason: {})", e.what()));
+        co_await storage.async_write(offset, buffers);
+    } catch (const storage::Exception& e) {
+        throw std::runtime_error(fmt::format("Piece::flush_to_disk() failed: Failed to write (Reason: {})", e.what()));
     }
+    // Done with it, so it needn't take up the page cache
+    storage.advise(offset, this->m_size, storage::Hint::DontNeed);
+}
 
-    // Dump data
-    try {
-        for (auto& opt_subpiece : this->m_subpieces) {
-            if (opt_subpiece.has_value()) {
-                auto& subpiece = opt_subpiece.value();
-                f->write(reinterpret_cast<char*>(subpiece.data()),
-                         static_cast<std::streamsize>(subpiece.size() * sizeof(char)));
-            }
+void Piece::move_to_cache(cache::Cache& cache, const storage::IStorage& storage) {
+    const auto offset = static_cast<std::uint64_t>(this->m_idx) * this->m_size;
+    for (std::size_t i = 0; i < this->m_subpieces.size(); i++) {
+        auto& opt_subpiece = this->m_subpieces[i];
+        if (opt_subpiece.has_value()) {
+            cache.insert(storage, offset + i * peer::Request_Subpiece_Size, std::move(opt_subpiece.value()));
+            opt_subpiece.reset();
         }
-    } catch (const std::ios_base::failure& e) {
-        throw std::runtime_error(fmt::format("Piece::flush_to_disk() failed: Failed to write (Reason: {})", e.what()));
     }
 }
 
@@ -99,25 +116,73 @@ Map::Map(std::vector<Piece> pieces) : m_pieces({}) {
 
 std::shared_ptr<Piece> Map::get_piece(const std::size_t index) { return this->m_pieces.at(index); }
 
-PieceVerificationJob::PieceVerificationJob(std::shared_ptr<piece::Piece> p) : m_piece(std::move(p)){};
+Piece& Map::piece(const std::size_t index) { return *this->m_pieces.at(index); }
+
+std::size_t Map::size() const { return this->m_pieces.size(); }
+
+std::uint64_t Map::verified_bytes() const {
+    std::uint64_t sum = 0;
+    for (const auto& piece : m_pieces) {
+        const auto state = piece->m_state.load();
+        if (state == State::HaveVerified || state == State::OnDisk) {
+            sum += piece->m_size;
+        }
+    }
+    return sum;
+}
+
+PieceVerificationJob::PieceVerificationJob(piece::Piece& p) : m_piece(p){};
 
 void PieceVerificationJob::process() {
-    if (m_piece->hashes_match()) {
-        m_piece->m_state = piece::State::HaveVerified;
+    if (m_piece.hashes_match()) {
+        m_piece.m_state = piece::State::HaveVerified;
     } else {
-        const auto msg{fmt::format("Failed to verify piece hash: expected {}, got {}", m_piece->get_expected_hash_str(),
-                                   m_piece->get_curr_hash_str())};
-        log::log(log::Level::Warning, log::Subsystem::Torrent, msg);
+        const auto msg{fmt::format("Failed to verify piece hash: expected {}, got {}", m_piece.get_expected_hash_str(),
+                                   m_piece.get_curr_hash_str())};
+        TT_LOG(Warning, Torrent, "{}", msg);
+        std::fill(m_piece.m_subpieces.begin(), m_piece.m_subpieces.end(), std::nullopt);
+        m_piece.m_state = piece::State::Want;
+    }
+}
+
+job::Priority PieceVerificationJob::priority() const { return job::Priority::Background; }
+
+static job::Task<void> flush(piece::Piece& p, storage::IStorage& storage) {
+    if (p.m_state != piece::State::HaveVerified) {
+        TT_LOG(Debug, Torrent, "piece::flush(): Skipping piece {}, which isn't verified", p.m_idx);
+        co_return;
     }
+    co_await p.flush_to_disk(storage);
+    // Only now may it be served from storage
+    p.m_state = piece::State::OnDisk;
 }
 
-PieceFlushJob::PieceFlushJob(std::shared_ptr<piece::Piece> p, std::shared_ptr<std::fstream> file)
-    : m_piece(std::move(p)), m_file(std::move(file)){};
+std::unique_ptr<job::IJob> make_flush_job(piece::Piece& p, storage::IStorage& storage) {
+    return std::make_unique<job::CoroJob>(flush(p, storage), job::Priority::Background);
+}
 
-void PieceFlushJob::process() {
-    if (m_piece->m_state != piece::State::HaveVerified) {
-        throw std::runtime_error("PieceFlushJob::process(): Piece not verified");
+static job::Task<void> flush_cached(piece::Piece& p, storage::IStorage& storage, cache::Cache& cache,
+                                    cache::Reservation reservation, std::unique_ptr<job::IJob> on_disk) {
+    if (p.m_state != piece::State::HaveVerified) {
+        // Whatever was downloaded is no good, so it's dropped and the piece is wanted again
+        TT_LOG(Warning, Torrent, "piece::flush_cached(): Dropping piece {}, which isn't verified", p.m_idx);
+        std::fill(p.m_subpieces.begin(), p.m_subpieces.end(), std::nullopt);
+        p.m_state = piece::State::Want;
+        reservation.release();
+        co_return;
     }
-    m_piece->flush_to_disk(m_file);
+    co_await flush(p, storage);
+    // No longer dirty, so the cache has room for the blocks
+    reservation.release();
+    p.move_to_cache(cache, storage);
+    if (on_disk != nullptr) {
+        job::JobQueue::current()->enqueue(std::move(on_disk));
+    }
+}
+
+std::unique_ptr<job::IJob> make_flush_job(piece::Piece& p, storage::IStorage& storage, cache::Cache& cache,
+                                          cache::Reservation reservation, std::unique_ptr<job::IJob> on_disk) {
+    return std::make_unique<job::CoroJob>(flush_cached(p, storage, cache, std::move(reservation), std::move(on_disk)),
+                                          job::Priority::Background);
 }
 }  // namespace tt::piece
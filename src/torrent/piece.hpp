@@ -1,15 +1,18 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <cstdint>
-#include <iosfwd>
 #include <memory>
 #include <optional>
 #include <string>
 #include <vector>
 
 #include "../job.hpp"
+#include "../task.hpp"
+#include "cache.hpp"
 #include "shared_constants.hpp"
+#include "storage.hpp"
 
 namespace tt::piece {
 
@@ -21,6 +24,8 @@ enum class State {
     HaveUnverified,
     // Have the piece and it's hash checked out
     HaveVerified,
+    // Have the piece, it's hash checked out and it's written to storage, so it can be served from there
+    OnDisk,
     // Don't have this piece and don't want it
     Unwanted,
 };
@@ -28,7 +33,8 @@ enum class State {
 // Descriptor for a variable-sized piece of the torrent.
 class Piece {
    public:
-    State m_state;
+    // Set by the jobs verifying and flushing the piece, while others (e.g. uploads) check it.
+    std::atomic<State> m_state;
     std::uint32_t m_size;
     std::uint32_t m_idx;
     std::array<std::uint8_t, Piece_Hash_Len> m_expected_hash;
@@ -38,6 +44,9 @@ class Piece {
 
     Piece(const std::uint32_t size, const std::uint32_t idx,
           const std::array<std::uint8_t, Piece_Hash_Len> expected_hash, const State state);
+    // Copies the state as of now. Only meant for setting up pieces, before any jobs work on them.
+    Piece(const Piece& src);
+    Piece& operator=(const Piece&) = delete;
 
     std::array<std::uint8_t, Piece_Hash_Len> get_curr_hash();
     std::string get_expected_hash_str();
@@ -45,7 +54,12 @@ class Piece {
     bool hashes_match();
 
     void set_downloaded_subpiece_data(const std::size_t subpiece_idx, const std::vector<std::uint8_t>& data);
-    void flush_to_disk(std::shared_ptr<std::fstream> f);
+    /// Write the downloaded subpieces to where the piece belongs, in one go.
+    /// The calling coroutine is suspended while the storage writes, where it supports that.
+    job::Task<void> flush_to_disk(storage::IStorage& storage);
+    /// Hand the subpieces over to `cache`, as the clean blocks of `storage` they are once flushed.
+    /// The piece is left without data.
+    void move_to_cache(cache::Cache& cache, const storage::IStorage& storage);
 };
 
 /*
@@ -62,30 +76,39 @@ class Map {
     Map(std::vector<Piece> pieces);
     /// Obtain a non-owning, mutable reference to a given piece.
     std::shared_ptr<Piece> get_piece(const std::size_t index);
+    /// Same as above, without sharing ownership. Pieces live as long as the map.
+    Piece& piece(const std::size_t index);
+    /// Number of pieces.
+    std::size_t size() const;
+    /// Total size of all pieces we have and verified.
+    std::uint64_t verified_bytes() const;
 };
 
 /// Verifies the hash of an already downloaded piece.
-/// The state of the piece is set accordingly.
+/// The state of the piece is set accordingly. A piece that doesn't check out is a peer's fault rather than ours, so
+/// it's data is dropped and the piece is wanted again, and the job succeeds. The piece must outlive the job.
 class PieceVerificationJob final : public job::IJob {
    public:
-    PieceVerificationJob(std::shared_ptr<piece::Piece> p);
+    PieceVerificationJob(piece::Piece& p);
     PieceVerificationJob() = delete;
     void process() override;
+    job::Priority priority() const override;
 
    private:
-    std::shared_ptr<piece::Piece> m_piece;
+    piece::Piece& m_piece;
 };
 
-/// Flushes a piece to disk.
-/// Note that the piece has to be verified, or an exception will be thrown.
-class PieceFlushJob final : public job::IJob {
-   public:
-    PieceFlushJob(std::shared_ptr<piece::Piece> p, std::shared_ptr<std::fstream> file);
-    PieceFlushJob() = delete;
-    void process() override;
-
-   private:
-    std::shared_ptr<piece::Piece> m_piece;
-    std::shared_ptr<std::fstream> m_file;
-};
+/// Create a job flushing a piece to disk.
+/// Pieces that aren't verified (e.g. as they failed verification) are skipped, the others are `OnDisk` afterwards.
+/// It runs as a coroutine (see `job::CoroJob`), so it doesn't hold up a worker while the disk is busy.
+/// Pieces of the same torrent may be flushed in parallel, which storages allow without locking.
+/// The piece and storage must outlive the job.
+std::unique_ptr<job::IJob> make_flush_job(piece::Piece& p, storage::IStorage& storage);
+/// Same, but the piece's data is then moved to `cache`, and `reservation` for it released.
+/// If the piece turns out not to be verified, it's data is dropped and it's wanted again, without failing the job.
+/// The reservation is released even if the job is cancelled. The cache must outlive the job, too.
+/// `on_disk`, if given, is enqueued once the piece is written. Continuations of the job (see `IJob::then()`) may run
+/// before that, as it's a coroutine.
+std::unique_ptr<job::IJob> make_flush_job(piece::Piece& p, storage::IStorage& storage, cache::Cache& cache,
+                                          cache::Reservation reservation, std::unique_ptr<job::IJob> on_disk = nullptr);
 }  // namespace tt::piece
@@ -0,0 +1,198 @@
+#include "session.hpp"
+
+#include <fmt/core.h>
+
+extern "C" {
+#include <sys/eventfd.h>
+#include <unistd.h>
+}
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../io.hpp"
+#include "../job.hpp"
+#include "../log.hpp"
+#include "../reusable/smolsocket.hpp"
+#include "../task.hpp"
+#include "peer.hpp"
+#include "torrent.hpp"
+
+namespace tt {
+
+// How often acceptor threads check whether they should exit.
+const std::uint64_t Accept_Poll_Interval_Millis = 250;
+
+Session::Session(const Config& cfg)
+    : m_cfg(cfg),
+      m_torrents_mutex(),
+      m_torrents(),
+      m_stopping(false),
+      m_acceptors(),
+      m_reactor(),
+      m_background(1),
+      m_background_thread(),
+      m_wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (m_wake_fd == -1) {
+        throw io::Exception(fmt::format("Session::Session(): Failed to create eventfd: {}", strerror(errno)));
+    }
+    // Kept processing until stopped, even while all jobs are waiting
+    m_background.retain();
+    m_background.enqueue(std::make_unique<job::CoroJob>(keep_alive(), job::Priority::Control));
+    m_background_thread = std::thread([this]() {
+        try {
+            m_background.process();
+        } catch (const std::exception& e) {
+            TT_LOG(Warning, Peer, "Session: Background job failed: {}", e.what());
+        }
+    });
+}
+
+Session::~Session() {
+    this->stop();
+    close(m_wake_fd);
+}
+
+void Session::add_torrent(std::shared_ptr<Torrent> torrent) {
+    auto infohash = torrent->m_metainfo.truncated_infohash_binary();
+    torrent->m_socket_options = m_cfg.m_socket_options;
+    torrent->m_reactor = &m_reactor;
+    torrent->m_background = &m_background;
+    const std::lock_guard<std::mutex> lock{m_torrents_mutex};
+    m_torrents.insert_or_assign(std::move(infohash), std::move(torrent));
+}
+
+std::uint16_t Session::listen() {
+    smolsocket::Listener::Config listener_cfg{};
+    listener_cfg.m_backlog = m_cfg.m_listen_backlog;
+    listener_cfg.m_reuse_port = m_cfg.m_acceptor_threads > 1;
+    listener_cfg.m_options = m_cfg.m_socket_options;
+
+    // Bind the first socket on it's own, so the others know which port to share if we were given port 0
+    std::vector<smolsocket::Listener> listeners{};
+    listeners.emplace_back("::", m_cfg.m_port, listener_cfg);
+    const std::uint16_t port = listeners.front().port();
+    for (std::size_t i = 1; i < m_cfg.m_acceptor_threads; i++) {
+        listeners.emplace_back("::", port, listener_cfg);
+    }
+
+    m_stopping = false;
+    for (auto& listener : listeners) {
+        m_acceptors.emplace_back(&Session::accept_loop, this, std::move(listener));
+    }
+    TT_LOG(Debug, Peer, "Session::listen(): Accepting peers on port {} with {} threads", port, m_acceptors.size());
+    return port;
+}
+
+void Session::stop() {
+    m_stopping = true;
+    for (auto& t : m_acceptors) {
+        t.join();
+    }
+    m_acceptors.clear();
+
+    if (!m_background_thread.joinable()) {
+        return;
+    }
+    // Re-announcing keeps the torrents' jobs running until their trackers are stopped.
+    // Not under our lock, which the keepalive job may be waiting for on the worker they need.
+    std::vector<std::shared_ptr<Torrent>> torrents{};
+    {
+        const std::lock_guard<std::mutex> lock{m_torrents_mutex};
+        for (const auto& [infohash, torrent] : m_torrents) {
+            torrents.push_back(torrent);
+        }
+    }
+    for (const auto& torrent : torrents) {
+        torrent->stop_tracker();
+    }
+    const std::uint64_t one = 1;
+    [[maybe_unused]] const auto ret = write(m_wake_fd, &one, sizeof(one));
+    m_background.release();
+    m_background_thread.join();
+}
+
+io::Reactor& Session::reactor() { return m_reactor; }
+
+void Session::accept_loop(smolsocket::Listener listener) {
+    while (!m_stopping) {
+        try {
+            auto conn = listener.accept(Accept_Poll_Interval_Millis);
+            if (conn.has_value()) {
+                // The handshake may take a while to arrive, and mustn't hold up accepting others meanwhile
+                m_background.enqueue(
+                    std::make_unique<job::CoroJob>(handle_inbound(std::move(conn.value())), job::Priority::Control));
+            }
+        } catch (const smolsocket::Exception& e) {
+            TT_LOG(Warning, Peer, "Session::accept_loop(): Failed to accept connection: {}", e.what());
+        }
+    }
+}
+
+job::Task<void> Session::handle_inbound(smolsocket::Accepted conn) {
+    // Inbound peers identify themselves during the handshake
+    auto peer = std::make_shared<peer::Peer>(conn.m_remote);
+    peer->attach_socket(std::move(conn.m_sock));
+    try {
+        const auto infohash = co_await peer->async_receive_handshake(m_reactor);
+        const auto torrent = this->find_torrent(infohash);
+        if (torrent == nullptr) {
+            TT_LOG(Debug, Peer, "Session::handle_inbound(): {} asked for a torrent we don't have", *peer);
+            co_return;
+        }
+        // Nothing was sent on the connection yet, so our half fits into it's buffer without blocking
+        peer->send_handshake(infohash, torrent->m_us_peer->m_id);
+        TT_LOG(Debug, Peer, "Session::handle_inbound(): Accepted connection from {}", *peer);
+        torrent->add_inbound_peer(std::move(peer));
+    } catch (const peer::Exception& e) {
+        // Already logged
+    }
+}
+
+std::shared_ptr<Torrent> Session::find_torrent(const std::vector<std::uint8_t>& truncated_infohash) {
+    const std::lock_guard<std::mutex> lock{m_torrents_mutex};
+    const auto it = m_torrents.find(truncated_infohash);
+    if (it == m_torrents.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+job::Task<void> Session::keep_alive() {
+    // Only readable once we're told to stop
+    while (!co_await m_reactor.readable(m_wake_fd, m_cfg.m_keepalive_interval)) {
+        std::vector<std::shared_ptr<Torrent>> torrents{};
+        std::vector<std::pair<std::shared_ptr<Torrent>, std::shared_ptr<peer::Peer>>> peers{};
+        {
+            const std::lock_guard<std::mutex> lock{m_torrents_mutex};
+            for (const auto& [infohash, torrent] : m_torrents) {
+                torrents.push_back(torrent);
+                const std::lock_guard<std::mutex> peers_lock{torrent->m_peers_mutex};
+                for (const auto& peer : torrent->m_peers) {
+                    if (peer->is_connected()) {
+                        peers.emplace_back(torrent, peer);
+                    }
+                }
+            }
+        }
+        for (const auto& [torrent, peer] : peers) {
+            try {
+                co_await peer->async_send_keepalive(m_reactor);
+            } catch (const peer::Exception& e) {
+                // Already logged
+                torrent->drop_peer(peer);
+            }
+        }
+        for (const auto& torrent : torrents) {
+            torrent->log_connection_stats();
+        }
+    }
+}
+}  // namespace tt
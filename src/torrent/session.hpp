@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../io.hpp"
+#include "../job.hpp"
+#include "../reusable/smolsocket.hpp"
+#include "../task.hpp"
+#include "torrent.hpp"
+
+namespace tt {
+
+/// State shared by all torrents of a running client, most notably the port peers can connect to us on.
+///
+/// Incoming connections are accepted by one thread per listening socket. All sockets bind the same port with
+/// SO_REUSEPORT, so the kernel spreads connections across the threads.
+/// Each connection is routed to the torrent whose infohash the remote asks for in it's handshake, which is awaited by a
+/// job on the session's queue (see below) rather than the acceptor thread.
+///
+/// Jobs that keep running for as long as the session does (keepalives, the torrents' re-announces) are coroutines on
+/// a job queue of their own, which a single thread processes. They spend most of their time waiting on the session's
+/// reactor, which coroutine jobs on other queues can share.
+class Session {
+   public:
+    struct Config {
+        /// Port we accept peer connections on.
+        std::uint16_t m_port;
+        /// Number of acceptor threads, each with it's own listening socket.
+        std::size_t m_acceptor_threads = 1;
+        /// Length of the kernel's accept queue for each listening socket.
+        int m_listen_backlog = 128;
+        /// Default tuning for peer connections, both accepted and established by us.
+        /// See `smolsocket::Options::profile()` for the predefined ones.
+        smolsocket::Options m_socket_options{};
+        /// How often connected peers are sent keepalives. Peers drop connections they haven't heard anything on for
+        /// 2 minutes.
+        std::chrono::milliseconds m_keepalive_interval{std::chrono::seconds(90)};
+    };
+
+    explicit Session(const Config& cfg);
+    Session() = delete;
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+    Session(Session&&) = delete;
+    Session& operator=(Session&&) = delete;
+    ~Session();
+
+    /// Make a torrent available to peers connecting to us.
+    /// The torrent's outgoing connections will use the session's socket options from now on, and it re-announces from
+    /// the session's jobs once it's tracker is started.
+    void add_torrent(std::shared_ptr<Torrent> torrent);
+    /// Start accepting connections.
+    /// Returns the port being listened on, which is only interesting if the configured port was 0.
+    std::uint16_t listen();
+    /// Stop accepting connections, the torrents' re-announces and keepalives, and wait for all of them to finish.
+    void stop();
+    /// Waits for sockets and timers on behalf of coroutine jobs.
+    io::Reactor& reactor();
+
+   private:
+    Config m_cfg;
+    std::mutex m_torrents_mutex;
+    /// Torrents by truncated binary infohash.
+    std::map<std::vector<std::uint8_t>, std::shared_ptr<Torrent>> m_torrents;
+    std::atomic<bool> m_stopping;
+    std::vector<std::thread> m_acceptors;
+    io::Reactor m_reactor;
+    /// Runs the session's long-running jobs, on `m_background_thread`.
+    job::JobQueue m_background;
+    std::thread m_background_thread;
+    /// Wakes up the keepalive job to exit.
+    int m_wake_fd;
+
+    void accept_loop(smolsocket::Listener listener);
+    /// Handshake with a peer that connected to us, and hand it to the torrent it asks for.
+    job::Task<void> handle_inbound(smolsocket::Accepted conn);
+    std::shared_ptr<Torrent> find_torrent(const std::vector<std::uint8_t>& truncated_infohash);
+    /// Send keepalives to all connected peers, as often as the protocol requires, until stopped.
+    /// Logs how the torrents' connections are doing each time.
+    job::Task<void> keep_alive();
+};
+}  // namespace tt
@@ -0,0 +1,1063 @@
+#include "storage.hpp"
+
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <span>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../log.hpp"
+#include "../reusable/uring.hpp"
+#include "../task.hpp"
+
+namespace tt::storage {
+// The ring is sized for this many operations at most.
+const unsigned Max_Queue_Depth = 4096;
+
+Exception::Exception(const std::string_view& msg) : m_msg(msg) {}
+
+const char* Exception::what() const noexcept { return this->m_msg.c_str(); }
+
+job::Task<void> IStorage::async_write(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    write(offset, buffers);
+    co_return;
+}
+
+job::Task<void> IStorage::async_read(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    read(offset, buffers);
+    co_return;
+}
+
+std::span<const std::uint8_t> IStorage::view(const std::uint64_t, const std::size_t) { return {}; }
+
+int IStorage::native_handle() const { return -1; }
+
+std::unique_ptr<IStorage> open(const std::filesystem::path& path, const Config& config) {
+    std::unique_ptr<IStorage> storage{};
+    if (config.m_backend == Backend::Mmap) {
+        storage = std::make_unique<MmapStorage>(path);
+    } else if (config.m_backend == Backend::Uring) {
+        try {
+            storage = std::make_unique<UringStorage>(path, config.m_queue_depth);
+        } catch (const Exception& e) {
+            TT_LOG(Warning, Torrent, "storage::open(): Falling back to positional I/O (Reason: {})", e.what());
+        }
+    }
+    if (!storage) {
+        storage = std::make_unique<PosixStorage>(path);
+    }
+    if (config.m_coalesce_buffer > 0) {
+        storage = std::make_unique<CoalescingStorage>(std::move(storage), config.m_coalesce_buffer);
+    }
+    return storage;
+}
+
+// Open a file for reading and writing, creating it if it doesn't exist.
+static int open_file(const std::filesystem::path& path, const std::string_view who) {
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw Exception(fmt::format("storage::{}: Failed to open {} (Reason: {})", who, path.c_str(), strerror(errno)));
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        throw Exception(fmt::format("storage::{}: Failed to open {} (Reason: Not a regular file)", who, path.c_str()));
+    }
+    return fd;
+}
+
+// Make room for `size` bytes in the file, see `Allocation`.
+static void allocate_file(const int fd, const std::filesystem::path& path, const std::uint64_t size,
+                          const Allocation allocation, const std::string_view who) {
+    if (allocation == Allocation::Full) {
+        // Also extends the file, but never shrinks it. Blocks that are already there are left alone.
+        if (::fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0) {
+            return;
+        }
+        if (errno != EOPNOTSUPP) {
+            throw Exception(fmt::format("storage::{}: Failed to preallocate {} bytes for {} (Reason: {})", who, size,
+                                        path.c_str(), strerror(errno)));
+        }
+        TT_LOG(Warning, Torrent, "storage::{}: Filesystem can't preallocate {}, leaving it sparse", who, path.c_str());
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        throw Exception(fmt::format("storage::{}: Failed to stat {} (Reason: {})", who, path.c_str(), strerror(errno)));
+    }
+    if (static_cast<std::uint64_t>(st.st_size) < size && ::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        throw Exception(fmt::format("storage::{}: Failed to extend {} to {} bytes (Reason: {})", who, path.c_str(),
+                                    size, strerror(errno)));
+    }
+}
+
+// Pass a hint on to the kernel's page cache. Failing is harmless, so it's ignored.
+static void fadvise_file(const int fd, const std::uint64_t offset, const std::uint64_t size, const Hint hint) {
+    int advice = POSIX_FADV_NORMAL;
+    switch (hint) {
+        case Hint::WillNeed:
+            advice = POSIX_FADV_WILLNEED;
+            break;
+        case Hint::Sequential:
+            advice = POSIX_FADV_SEQUENTIAL;
+            break;
+        case Hint::DontNeed:
+            // Starts writing back dirty pages, and drops the clean ones
+            advice = POSIX_FADV_DONTNEED;
+            break;
+    }
+    ::posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(size), advice);
+}
+
+// Skip the first `done` bytes of the buffers, after an operation did just part of them.
+// If that ends within a buffer, the buffers are copied to `rest` the first time, so that one can be shortened.
+static void advance(std::span<const iovec>& buffers, std::vector<iovec>& rest, std::size_t done) {
+    std::size_t first = 0;
+    while (first < buffers.size() && done >= buffers[first].iov_len) {
+        done -= buffers[first].iov_len;
+        first++;
+    }
+    if (done == 0) {
+        buffers = buffers.subspan(first);
+        return;
+    }
+    if (rest.empty()) {
+        rest.assign(buffers.begin() + static_cast<std::ptrdiff_t>(first), buffers.end());
+        buffers = rest;
+        first = 0;
+    }
+    // From here on, the buffers are always the tail of the copy
+    auto& partial = rest[static_cast<std::size_t>(buffers.data() - rest.data()) + first];
+    partial.iov_base = static_cast<std::uint8_t*>(partial.iov_base) + done;
+    partial.iov_len -= done;
+    buffers = buffers.subspan(first);
+}
+
+// Calls `op(fd, iov, iovcnt, offset)` (`pwritev` or `preadv`) until all of the buffers are done.
+// Only copies the buffers if a call does just part of them, or there are more than a single call takes.
+template <typename Op>
+static void transfer_all(const int fd, std::uint64_t offset, std::span<const iovec> buffers, Op&& op,
+                         const std::string_view what) {
+    std::vector<iovec> rest{};
+    while (!buffers.empty()) {
+        const auto count = static_cast<int>(std::min<std::size_t>(buffers.size(), IOV_MAX));
+        const auto done = op(fd, buffers.data(), count, static_cast<off_t>(offset));
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw Exception(fmt::format("storage::PosixStorage: Failed to {} at offset {}: {}", what, offset,
+                                        strerror(errno)));
+        }
+        if (done == 0) {
+            throw Exception(fmt::format("storage::PosixStorage: Failed to {} at offset {}: Reached end of file", what,
+                                        offset));
+        }
+        offset += static_cast<std::uint64_t>(done);
+        advance(buffers, rest, static_cast<std::size_t>(done));
+    }
+}
+
+PosixStorage::PosixStorage(const std::filesystem::path& path) : m_path(path), m_fd(open_file(path, "PosixStorage")) {}
+
+PosixStorage::~PosixStorage() { ::close(m_fd); }
+
+void PosixStorage::write(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    transfer_all(m_fd, offset, buffers, ::pwritev, "write");
+}
+
+void PosixStorage::read(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    transfer_all(m_fd, offset, buffers, ::preadv, "read");
+}
+
+void PosixStorage::sync() {
+    if (::fdatasync(m_fd) != 0) {
+        throw Exception(
+            fmt::format("storage::PosixStorage: Failed to sync {} (Reason: {})", m_path.c_str(), strerror(errno)));
+    }
+}
+
+void PosixStorage::allocate(const std::uint64_t size, const Allocation allocation) {
+    allocate_file(m_fd, m_path, size, allocation, "PosixStorage");
+}
+
+void PosixStorage::advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) {
+    fadvise_file(m_fd, offset, size, hint);
+}
+
+int PosixStorage::native_handle() const { return m_fd; }
+
+/// An operation of a `UringStorage`, which lives on the stack (or coroutine frame) of whoever waits for it.
+struct UringStorage::Op {
+    /// `IORING_OP_WRITEV`, `IORING_OP_READV` or `IORING_OP_FSYNC`.
+    std::uint8_t m_opcode;
+    /// Where the rest of the buffers goes.
+    std::uint64_t m_offset;
+    /// What's left to do.
+    std::span<const iovec> m_buffers;
+    std::vector<iovec> m_rest{};
+    /// The file, as slot of the ring's registered files if `m_fixed`, else as descriptor.
+    int m_fd = -1;
+    bool m_fixed = false;
+    /// The errno it failed with, 0 if it didn't.
+    int m_error = 0;
+    bool m_eof = false;
+    /// Notified once done: The event for coroutines, the semaphore otherwise.
+    job::Event* m_event = nullptr;
+    std::binary_semaphore* m_done = nullptr;
+};
+
+/// The ring shared by all `UringStorage`s on a device, and the thread collecting it's completions.
+class UringStorage::Device {
+   public:
+    /// The one for the device `dev`, which is created with `queue_depth` if there is none (anymore).
+    static std::shared_ptr<Device> get(const dev_t dev, const unsigned queue_depth);
+
+    explicit Device(const unsigned queue_depth);
+    Device(const Device&) = delete;
+    Device& operator=(const Device&) = delete;
+    ~Device();
+
+    /// Register a file with the ring. Returns it's slot, or -1 if there's no room left.
+    int register_file(const int fd);
+    void unregister_file(const int slot);
+    /// Queue the operation up, submitting it right away if there's a free slot.
+    void start(Op& op);
+
+   private:
+    unsigned m_queue_depth;
+    uring::Ring m_ring;
+    /// Guards submitting to the ring, and the members below.
+    std::mutex m_mutex;
+    /// Slots of the ring's registered files no storage uses.
+    std::vector<int> m_free_files;
+    /// Operations waiting for a free slot.
+    std::deque<Op*> m_waiting;
+    /// Operations the kernel has, by their entries' `user_data` minus one. nullptr for free slots.
+    std::vector<Op*> m_in_flight;
+    /// Free slots of `m_in_flight`.
+    std::vector<unsigned> m_idle;
+    /// The errno the ring broke with, 0 while it works. Operations fail right away once it's broken.
+    int m_error;
+    /// Collects completions.
+    std::thread m_reaper;
+
+    /// Submit waiting operations into free slots, adding those that couldn't be to `failed`. `m_mutex` must be held.
+    void submit_waiting(std::vector<Op*>& failed);
+    void reap();
+    /// Let whoever waits for the operations know they're done. `m_mutex` mustn't be held.
+    static void finish(const std::vector<Op*>& ops);
+};
+
+// Files registered with each device's ring, at most. They count against the process' limit of open files.
+const unsigned Registered_Files = 64;
+
+void UringStorage::Device::finish(const std::vector<Op*>& ops) {
+    // Whoever waits may destroy the operation right away, so this is the last it's touched
+    for (auto* op : ops) {
+        if (op->m_event != nullptr) {
+            op->m_event->set();
+        } else {
+            op->m_done->release();
+        }
+    }
+}
+
+// Rings can't be moved, so this relies on the returned one being constructed in place.
+static uring::Ring make_ring(const unsigned entries) {
+    try {
+        return uring::Ring{entries};
+    } catch (const std::system_error& e) {
+        throw Exception(fmt::format("storage::UringStorage: io_uring isn't available (Reason: {})", e.what()));
+    }
+}
+
+std::shared_ptr<UringStorage::Device> UringStorage::Device::get(const dev_t dev, const unsigned queue_depth) {
+    static std::mutex s_mutex{};
+    static std::map<dev_t, std::weak_ptr<Device>> s_devices{};
+    const std::lock_guard<std::mutex> lock{s_mutex};
+    auto& known = s_devices[dev];
+    auto device = known.lock();
+    if (!device) {
+        device = std::make_shared<Device>(queue_depth);
+        known = device;
+    }
+    return device;
+}
+
+UringStorage::Device::Device(const unsigned queue_depth)
+    : m_queue_depth(std::clamp(queue_depth, 1U, Max_Queue_Depth)),
+      // One more, so the entry stopping the reaper always fits
+      m_ring(make_ring(m_queue_depth + 1)),
+      m_mutex(),
+      m_free_files(),
+      m_waiting(),
+      m_in_flight(m_queue_depth, nullptr),
+      m_idle(),
+      m_error(0),
+      m_reaper() {
+    for (unsigned i = m_queue_depth; i > 0; i--) {
+        m_idle.push_back(i - 1);
+    }
+    try {
+        const std::vector<int> empty(Registered_Files, -1);
+        m_ring.register_files(empty);
+        for (int i = static_cast<int>(Registered_Files) - 1; i >= 0; i--) {
+            m_free_files.push_back(i);
+        }
+    } catch (const std::system_error& e) {
+        // Kernels before 5.5 can't register empty slots. Files are looked up for every operation then.
+        TT_LOG(Debug, Torrent, "storage::UringStorage: Not registering files (Reason: {})", e.what());
+    }
+    m_reaper = std::thread([this]() { reap(); });
+}
+
+UringStorage::Device::~Device() {
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        // The reaper is gone already if the ring broke
+        if (m_error == 0) {
+            // Completes right away, waking the reaper up
+            auto* sqe = m_ring.get_sqe();
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = 0;
+            try {
+                m_ring.submit();
+            } catch (const std::system_error& e) {
+                TT_LOG(Warning, Torrent, "storage::UringStorage: Failed to stop the reaper (Reason: {})", e.what());
+            }
+        }
+    }
+    m_reaper.join();
+}
+
+int UringStorage::Device::register_file(const int fd) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    if (m_free_files.empty()) {
+        return -1;
+    }
+    const int slot = m_free_files.back();
+    try {
+        m_ring.update_files(static_cast<unsigned>(slot), std::span<const int>{&fd, 1});
+    } catch (const std::system_error& e) {
+        TT_LOG(Debug, Torrent, "storage::UringStorage: Failed to register a file (Reason: {})", e.what());
+        return -1;
+    }
+    m_free_files.pop_back();
+    return slot;
+}
+
+void UringStorage::Device::unregister_file(const int slot) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    const int none = -1;
+    try {
+        m_ring.update_files(static_cast<unsigned>(slot), std::span<const int>{&none, 1});
+    } catch (const std::system_error& e) {
+        // The slot would still refer to a closed file, so it isn't used again
+        TT_LOG(Warning, Torrent, "storage::UringStorage: Failed to unregister a file (Reason: {})", e.what());
+        return;
+    }
+    m_free_files.push_back(slot);
+}
+
+void UringStorage::Device::start(Op& op) {
+    std::vector<Op*> failed{};
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        if (m_error != 0) {
+            op.m_error = m_error;
+            failed.push_back(&op);
+        } else {
+            m_waiting.push_back(&op);
+            submit_waiting(failed);
+        }
+    }
+    finish(failed);
+}
+
+void UringStorage::Device::submit_waiting(std::vector<Op*>& failed) {
+    // The ring has room for all operations in flight, and one more
+    const std::size_t n = std::min(m_idle.size(), m_waiting.size());
+    if (n == 0) {
+        return;
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        auto* op = m_waiting[i];
+        auto* sqe = m_ring.get_sqe();
+        sqe->opcode = op->m_opcode;
+        sqe->fd = op->m_fd;
+        sqe->flags = op->m_fixed ? IOSQE_FIXED_FILE : 0;
+        if (op->m_opcode == IORING_OP_FSYNC) {
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        } else {
+            sqe->off = op->m_offset;
+            sqe->addr = reinterpret_cast<std::uint64_t>(op->m_buffers.data());
+            sqe->len = static_cast<std::uint32_t>(std::min<std::size_t>(op->m_buffers.size(), IOV_MAX));
+        }
+        sqe->user_data = m_idle[m_idle.size() - 1 - i] + 1;
+    }
+    // Only what the kernel took is in flight
+    try {
+        m_ring.submit();
+    } catch (const std::system_error& e) {
+        for (std::size_t i = 0; i < n; i++) {
+            m_waiting.front()->m_error = e.code().value();
+            failed.push_back(m_waiting.front());
+            m_waiting.pop_front();
+        }
+        return;
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        m_in_flight[m_idle.back()] = m_waiting.front();
+        m_idle.pop_back();
+        m_waiting.pop_front();
+    }
+}
+
+void UringStorage::Device::reap() {
+    std::vector<Op*> done{};
+    bool stopped = false;
+    while (!stopped) {
+        int error = 0;
+        try {
+            m_ring.wait(1);
+        } catch (const std::system_error& e) {
+            error = e.code().value();
+        }
+        {
+            const std::lock_guard<std::mutex> lock{m_mutex};
+            if (error != 0) {
+                // Nothing will be heard of the operations in flight anymore, so they fail along with the waiting ones
+                TT_LOG(Warning, Torrent, "storage::UringStorage: Failed to wait for completions (Reason: {})",
+                       strerror(error));
+                m_error = error;
+                for (auto*& op : m_in_flight) {
+                    if (op != nullptr) {
+                        done.push_back(std::exchange(op, nullptr));
+                    }
+                }
+                done.insert(done.end(), m_waiting.begin(), m_waiting.end());
+                m_waiting.clear();
+                for (auto* op : done) {
+                    op->m_error = error;
+                }
+                stopped = true;
+            } else {
+                m_ring.reap([&](const io_uring_cqe& cqe) {
+                    if (cqe.user_data == 0) {
+                        stopped = true;
+                        return;
+                    }
+                    const auto slot = static_cast<unsigned>(cqe.user_data - 1);
+                    auto* op = std::exchange(m_in_flight[slot], nullptr);
+                    m_idle.push_back(slot);
+                    if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                        m_waiting.push_front(op);
+                    } else if (cqe.res < 0) {
+                        op->m_error = -cqe.res;
+                        done.push_back(op);
+                    } else if (op->m_opcode == IORING_OP_FSYNC) {
+                        done.push_back(op);
+                    } else if (cqe.res == 0) {
+                        op->m_eof = true;
+                        done.push_back(op);
+                    } else {
+                        // Reads and writes may do just part of it, or there are more buffers than fit into one
+                        op->m_offset += static_cast<std::uint64_t>(cqe.res);
+                        advance(op->m_buffers, op->m_rest, static_cast<std::size_t>(cqe.res));
+                        if (op->m_buffers.empty()) {
+                            done.push_back(op);
+                        } else {
+                            m_waiting.push_front(op);
+                        }
+                    }
+                });
+                submit_waiting(done);
+            }
+        }
+        finish(done);
+        done.clear();
+    }
+}
+
+UringStorage::UringStorage(const std::filesystem::path& path, const unsigned queue_depth)
+    : m_path(path), m_fd(open_file(path, "UringStorage")), m_device(), m_slot(-1) {
+    // Can't fail, `open_file()` did the same
+    struct stat st {};
+    fstat(m_fd, &st);
+    try {
+        m_device = Device::get(st.st_dev, queue_depth);
+    } catch (const Exception&) {
+        ::close(m_fd);
+        throw;
+    }
+    m_slot = m_device->register_file(m_fd);
+}
+
+UringStorage::~UringStorage() {
+    if (m_slot >= 0) {
+        m_device->unregister_file(m_slot);
+    }
+    ::close(m_fd);
+}
+
+void UringStorage::start(Op& op) {
+    op.m_fixed = m_slot >= 0;
+    op.m_fd = op.m_fixed ? m_slot : m_fd;
+    m_device->start(op);
+}
+
+void UringStorage::run(Op& op) {
+    std::binary_semaphore done{0};
+    op.m_done = &done;
+    start(op);
+    done.acquire();
+    check(op);
+}
+
+void UringStorage::check(const Op& op) const {
+    if (op.m_error == 0 && !op.m_eof) {
+        return;
+    }
+    const std::string_view what = op.m_opcode == IORING_OP_WRITEV  ? "write"
+                                  : op.m_opcode == IORING_OP_READV ? "read"
+                                                                   : "sync";
+    const std::string reason = op.m_eof ? "Reached end of file" : strerror(op.m_error);
+    throw Exception(fmt::format("storage::UringStorage: Failed to {} {} at offset {} (Reason: {})", what,
+                                m_path.c_str(), op.m_offset, reason));
+}
+
+void UringStorage::write(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    Op op{IORING_OP_WRITEV, offset, buffers};
+    run(op);
+}
+
+void UringStorage::read(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    Op op{IORING_OP_READV, offset, buffers};
+    run(op);
+}
+
+void UringStorage::sync() {
+    Op op{IORING_OP_FSYNC, 0, {}};
+    run(op);
+}
+
+void UringStorage::allocate(const std::uint64_t size, const Allocation allocation) {
+    allocate_file(m_fd, m_path, size, allocation, "UringStorage");
+}
+
+void UringStorage::advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) {
+    fadvise_file(m_fd, offset, size, hint);
+}
+
+int UringStorage::native_handle() const { return m_fd; }
+
+job::Task<void> UringStorage::async_write(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    job::Event done{};
+    Op op{IORING_OP_WRITEV, offset, buffers};
+    op.m_event = &done;
+    start(op);
+    co_await done;
+    check(op);
+}
+
+job::Task<void> UringStorage::async_read(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    job::Event done{};
+    Op op{IORING_OP_READV, offset, buffers};
+    op.m_event = &done;
+    start(op);
+    co_await done;
+    check(op);
+}
+namespace {
+// Mappings whose faults the SIGBUS handler recovers from. Signal handlers can't take locks, so it's a fixed set of
+// slots, which are claimed by compare-and-swap. See `Max_Mapped_Files`.
+struct Mapping {
+    std::atomic<bool> m_used{false};
+    /// Set last when registering, and cleared first when unregistering, so the handler sees complete entries only.
+    std::atomic<std::uint8_t*> m_begin{nullptr};
+    std::atomic<std::uint64_t> m_size{0};
+    std::atomic<std::atomic<std::uint64_t>*> m_faults{nullptr};
+};
+std::array<Mapping, Max_Mapped_Files> s_mappings{};
+struct sigaction s_previous_sigbus {};
+std::once_flag s_sigbus_installed{};
+
+void on_sigbus(const int sig, siginfo_t* info, void* context) {
+    auto* addr = static_cast<std::uint8_t*>(info->si_addr);
+    const auto page_size = static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    for (auto& m : s_mappings) {
+        auto* begin = m.m_begin.load(std::memory_order_acquire);
+        if (begin == nullptr || addr < begin || addr >= begin + m.m_size.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        // Replace the page by zeros, which the access then completes on. Counted first, so a copy that lands on the
+        // zero page is sure to see the count change once done.
+        auto* page = begin + static_cast<std::uint64_t>(addr - begin) / page_size * page_size;
+        m.m_faults.load(std::memory_order_relaxed)->fetch_add(1, std::memory_order_seq_cst);
+        if (mmap(page, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) !=
+            MAP_FAILED) {
+            return;
+        }
+    }
+    // Not ours, so whoever handled it before gets it, or it's fatal as usual
+    if ((s_previous_sigbus.sa_flags & SA_SIGINFO) != 0 && s_previous_sigbus.sa_sigaction != nullptr) {
+        s_previous_sigbus.sa_sigaction(sig, info, context);
+    } else if (s_previous_sigbus.sa_handler != SIG_DFL && s_previous_sigbus.sa_handler != SIG_IGN) {
+        s_previous_sigbus.sa_handler(sig);
+    } else {
+        signal(SIGBUS, SIG_DFL);
+        raise(SIGBUS);
+    }
+}
+
+void install_sigbus_handler() {
+    std::call_once(s_sigbus_installed, []() {
+        struct sigaction sa {};
+        sa.sa_sigaction = on_sigbus;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGBUS, &sa, &s_previous_sigbus) != 0) {
+            throw Exception(fmt::format("storage::MmapStorage: Failed to install SIGBUS handler: {}", strerror(errno)));
+        }
+    });
+}
+
+// Claim a slot for a mapping, whose faults are counted in `faults`.
+std::size_t claim_slot(std::atomic<std::uint64_t>* faults, const std::filesystem::path& path) {
+    for (std::size_t i = 0; i < Max_Mapped_Files; i++) {
+        auto& m = s_mappings[i];
+        bool expected = false;
+        if (m.m_used.compare_exchange_strong(expected, true)) {
+            m.m_faults.store(faults, std::memory_order_relaxed);
+            return i;
+        }
+    }
+    throw Exception(fmt::format("storage::MmapStorage: Failed to open {} (Reason: {} files are mapped already, which "
+                                "is as many as can be at once)",
+                                path.c_str(), Max_Mapped_Files));
+}
+
+// Copy between the mapping and elsewhere, throwing if that faulted.
+// A fault of another thread on the same mapping meanwhile counts too, as it may have replaced a page being copied to.
+void copy_guarded(void* dst, const void* src, const std::size_t len, const std::atomic<std::uint64_t>& faults,
+                  const std::string_view what, const std::filesystem::path& path, const std::uint64_t offset) {
+    const auto before = faults.load(std::memory_order_seq_cst);
+    std::memcpy(dst, src, len);
+    // The handler may run on this thread, within the copy
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (faults.load(std::memory_order_seq_cst) != before) {
+        throw Exception(fmt::format("storage::MmapStorage: Failed to {} {} at offset {} (Reason: File was truncated, "
+                                    "or the disk failed)",
+                                    what, path.c_str(), offset));
+    }
+}
+}  // namespace
+
+MmapStorage::MmapStorage(const std::filesystem::path& path)
+    : m_path(path),
+      m_fd(open_file(path, "MmapStorage")),
+      m_map(nullptr),
+      m_size(0),
+      m_faults(0),
+      m_repaired(0),
+      m_slot(Max_Mapped_Files) {
+    try {
+        install_sigbus_handler();
+        m_slot = claim_slot(&m_faults, path);
+        struct stat st {};
+        if (fstat(m_fd, &st) != 0) {
+            throw Exception(
+                fmt::format("storage::MmapStorage: Failed to stat {} (Reason: {})", path.c_str(), strerror(errno)));
+        }
+        map(static_cast<std::uint64_t>(st.st_size));
+    } catch (...) {
+        if (m_slot < Max_Mapped_Files) {
+            s_mappings[m_slot].m_used.store(false, std::memory_order_release);
+        }
+        ::close(m_fd);
+        throw;
+    }
+}
+
+MmapStorage::~MmapStorage() {
+    unmap();
+    s_mappings[m_slot].m_used.store(false, std::memory_order_release);
+    ::close(m_fd);
+}
+
+void MmapStorage::map(const std::uint64_t size) {
+    if (size == 0) {
+        return;
+    }
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (p == MAP_FAILED) {
+        throw Exception(
+            fmt::format("storage::MmapStorage: Failed to map {} (Reason: {})", m_path.c_str(), strerror(errno)));
+    }
+    auto& m = s_mappings[m_slot];
+    m.m_size.store(size, std::memory_order_relaxed);
+    m.m_begin.store(static_cast<std::uint8_t*>(p), std::memory_order_release);
+    m_map = static_cast<std::uint8_t*>(p);
+    m_size = size;
+}
+
+void MmapStorage::unmap() {
+    if (m_map == nullptr) {
+        return;
+    }
+    auto& m = s_mappings[m_slot];
+    m.m_begin.store(nullptr, std::memory_order_release);
+    munmap(m_map, m_size);
+    m_map = nullptr;
+    m_size = 0;
+}
+
+void MmapStorage::check_range(const std::uint64_t offset, const std::uint64_t size, const std::string_view what) const {
+    if (offset > m_size || size > m_size - offset) {
+        throw Exception(fmt::format("storage::MmapStorage: Failed to {} {} bytes at offset {} of {} (Reason: Only {} "
+                                    "bytes are allocated)",
+                                    what, size, offset, m_path.c_str(), m_size));
+    }
+}
+
+void MmapStorage::repair() {
+    const auto faults = m_faults.load(std::memory_order_acquire);
+    if (faults == m_repaired.load(std::memory_order_acquire)) {
+        return;
+    }
+    // The file over the zero pages again, so nothing written to them is lost. Pages that the file still can't back
+    // just fault again once touched.
+    if (mmap(m_map, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_fd, 0) == MAP_FAILED) {
+        throw Exception(
+            fmt::format("storage::MmapStorage: Failed to remap {} (Reason: {})", m_path.c_str(), strerror(errno)));
+    }
+    m_repaired.store(faults, std::memory_order_release);
+}
+
+void MmapStorage::write(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    auto at = offset;
+    for (const auto& b : buffers) {
+        check_range(at, b.iov_len, "write");
+        repair();
+        copy_guarded(m_map + at, b.iov_base, b.iov_len, m_faults, "write", m_path, at);
+        at += b.iov_len;
+    }
+}
+
+void MmapStorage::read(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    auto at = offset;
+    for (const auto& b : buffers) {
+        check_range(at, b.iov_len, "read");
+        repair();
+        copy_guarded(b.iov_base, m_map + at, b.iov_len, m_faults, "read", m_path, at);
+        at += b.iov_len;
+    }
+}
+
+void MmapStorage::sync() {
+    if (m_map != nullptr && msync(m_map, m_size, MS_SYNC) != 0) {
+        throw Exception(
+            fmt::format("storage::MmapStorage: Failed to sync {} (Reason: {})", m_path.c_str(), strerror(errno)));
+    }
+}
+
+void MmapStorage::allocate(const std::uint64_t size, const Allocation allocation) {
+    allocate_file(m_fd, m_path, size, allocation, "MmapStorage");
+    if (size > m_size) {
+        unmap();
+        map(size);
+    }
+}
+
+void MmapStorage::advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) {
+    if (hint == Hint::DontNeed || m_map == nullptr || offset >= m_size) {
+        fadvise_file(m_fd, offset, size, hint);
+        return;
+    }
+    // The mapping's own read-ahead, which needs page-aligned ranges
+    const auto page_size = static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    const auto begin = offset / page_size * page_size;
+    const auto end = std::min(offset + size, m_size);
+    ::madvise(m_map + begin, end - begin, hint == Hint::WillNeed ? MADV_WILLNEED : MADV_SEQUENTIAL);
+}
+
+int MmapStorage::native_handle() const { return m_fd; }
+
+std::span<const std::uint8_t> MmapStorage::view(const std::uint64_t offset, const std::size_t size) {
+    check_range(offset, size, "view");
+    repair();
+    return {m_map + offset, size};
+}
+
+std::uint64_t MmapStorage::faults() const { return m_faults.load(std::memory_order_relaxed); }
+
+CoalescingStorage::CoalescingStorage(std::unique_ptr<IStorage> inner, const std::size_t buffer_size,
+                                     const std::size_t run_size)
+    : m_inner(std::move(inner)),
+      m_buffer_size(buffer_size),
+      m_run_size(run_size),
+      m_mutex(),
+      m_written(),
+      m_runs(),
+      m_buffered(0),
+      m_writing(),
+      m_awaiting() {}
+
+CoalescingStorage::~CoalescingStorage() {
+    try {
+        flush();
+    } catch (const std::exception& e) {
+        TT_LOG(Warning, Torrent, "storage::CoalescingStorage: Failed to write out buffered data (Reason: {})",
+               e.what());
+    }
+}
+
+// Bytes in all of the buffers.
+static std::uint64_t total_length(const std::span<const iovec> buffers) {
+    std::uint64_t len = 0;
+    for (const auto& b : buffers) {
+        len += b.iov_len;
+    }
+    return len;
+}
+
+bool CoalescingStorage::writing(const std::uint64_t begin, const std::uint64_t end) const {
+    return std::any_of(m_writing.begin(), m_writing.end(),
+                       [&](const auto& range) { return range.first < end && begin < range.second; });
+}
+
+std::vector<CoalescingStorage::Run> CoalescingStorage::buffer(const std::uint64_t offset,
+                                                              const std::span<const iovec> buffers) {
+    const auto end = offset + total_length(buffers);
+    // The runs this touches or overlaps: the one before, if it reaches this, up to the last one starting within
+    auto first = m_runs.upper_bound(offset);
+    if (first != m_runs.begin() && std::prev(first)->first + std::prev(first)->second.size() >= offset) {
+        first--;
+    }
+    auto last = m_runs.upper_bound(end);
+    auto merged_begin = offset;
+    auto merged_end = end;
+    std::size_t replaced = 0;
+    for (auto it = first; it != last; it++) {
+        merged_begin = std::min(merged_begin, it->first);
+        merged_end = std::max(merged_end, it->first + it->second.size());
+        replaced += it->second.size();
+    }
+
+    // Grow the run starting where the merged one does in place, so appending to a run doesn't copy it
+    std::vector<std::uint8_t> data{};
+    if (first != last && first->first == merged_begin) {
+        data = std::move(first->second);
+        first++;
+    }
+    data.resize(merged_end - merged_begin);
+    for (auto it = first; it != last; it++) {
+        std::copy(it->second.begin(), it->second.end(),
+                  data.begin() + static_cast<std::ptrdiff_t>(it->first - merged_begin));
+    }
+    auto at = data.begin() + static_cast<std::ptrdiff_t>(offset - merged_begin);
+    for (const auto& b : buffers) {
+        const auto* p = static_cast<const std::uint8_t*>(b.iov_base);
+        at = std::copy(p, p + b.iov_len, at);
+    }
+    m_runs.erase(m_runs.lower_bound(merged_begin), last);
+    m_runs.emplace(merged_begin, std::move(data));
+    m_buffered += (merged_end - merged_begin) - replaced;
+    return take(false);
+}
+
+std::vector<CoalescingStorage::Run> CoalescingStorage::take(const bool all) {
+    const bool everything = all || m_buffered > m_buffer_size;
+    std::vector<Run> runs{};
+    for (auto it = m_runs.begin(); it != m_runs.end();) {
+        if (!everything && it->second.size() < m_run_size) {
+            it++;
+            continue;
+        }
+        m_buffered -= it->second.size();
+        m_writing.emplace_back(it->first, it->first + it->second.size());
+        runs.push_back(Run{it->first, std::move(it->second)});
+        it = m_runs.erase(it);
+    }
+    return runs;
+}
+
+void CoalescingStorage::write_out(std::vector<Run>& runs) {
+    std::exception_ptr error{};
+    for (auto& r : runs) {
+        try {
+            m_inner->write(r.m_offset, std::array<iovec, 1>{iovec{r.m_data.data(), r.m_data.size()}});
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    written(runs);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+job::Task<void> CoalescingStorage::async_write_out(std::vector<Run>& runs) {
+    std::exception_ptr error{};
+    for (auto& r : runs) {
+        const std::array<iovec, 1> run{iovec{r.m_data.data(), r.m_data.size()}};
+        try {
+            co_await m_inner->async_write(r.m_offset, run);
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    written(runs);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void CoalescingStorage::written(const std::vector<Run>& runs) {
+    if (runs.empty()) {
+        return;
+    }
+    std::vector<job::Event*> awaiting{};
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        for (const auto& r : runs) {
+            const std::pair<std::uint64_t, std::uint64_t> range{r.m_offset, r.m_offset + r.m_data.size()};
+            m_writing.erase(std::find(m_writing.begin(), m_writing.end(), range));
+        }
+        awaiting.swap(m_awaiting);
+    }
+    m_written.notify_all();
+    // Resumed coroutines may be gone right away, so they're left alone afterwards
+    for (auto* event : awaiting) {
+        event->set();
+    }
+}
+
+void CoalescingStorage::flush() {
+    std::vector<Run> runs{};
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        runs = take(true);
+    }
+    std::exception_ptr error{};
+    try {
+        write_out(runs);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_written.wait(lock, [&]() { return m_writing.empty(); });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+job::Task<void> CoalescingStorage::async_flush() {
+    std::vector<Run> runs{};
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        runs = take(true);
+    }
+    std::exception_ptr error{};
+    try {
+        co_await async_write_out(runs);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    while (true) {
+        job::Event written{};
+        {
+            const std::lock_guard<std::mutex> lock{m_mutex};
+            if (m_writing.empty()) {
+                break;
+            }
+            m_awaiting.push_back(&written);
+        }
+        co_await written;
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void CoalescingStorage::write(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    const auto end = offset + total_length(buffers);
+    std::vector<Run> runs{};
+    {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        // A write of the same range that's still on it's way to the disk mustn't overtake this one
+        m_written.wait(lock, [&]() { return !writing(offset, end); });
+        runs = buffer(offset, buffers);
+    }
+    write_out(runs);
+}
+
+job::Task<void> CoalescingStorage::async_write(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    const auto end = offset + total_length(buffers);
+    std::vector<Run> runs{};
+    while (true) {
+        // Blocking the worker could keep the write in the way from ever resuming on it
+        job::Event written{};
+        {
+            const std::lock_guard<std::mutex> lock{m_mutex};
+            if (!writing(offset, end)) {
+                runs = buffer(offset, buffers);
+                break;
+            }
+            m_awaiting.push_back(&written);
+        }
+        co_await written;
+    }
+    co_await async_write_out(runs);
+}
+
+job::Task<void> CoalescingStorage::async_read(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    co_await async_flush();
+    co_await m_inner->async_read(offset, buffers);
+}
+
+void CoalescingStorage::read(const std::uint64_t offset, const std::span<const iovec> buffers) {
+    flush();
+    m_inner->read(offset, buffers);
+}
+
+void CoalescingStorage::sync() {
+    flush();
+    m_inner->sync();
+}
+
+void CoalescingStorage::allocate(const std::uint64_t size, const Allocation allocation) {
+    m_inner->allocate(size, allocation);
+}
+
+void CoalescingStorage::advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) {
+    m_inner->advise(offset, size, hint);
+}
+}  // namespace tt::storage
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../task.hpp"
+
+namespace tt::storage {
+
+/// Thrown on storage-related failures.
+class Exception : public std::exception {
+   public:
+    std::string m_msg{};
+    Exception(const std::string_view&);
+    [[nodiscard]] const char* what() const noexcept override;
+};
+
+/// How storage is set aside for a torrent up front.
+enum class Allocation {
+    /// Only set the size. Blocks are allocated as pieces are written, in whatever order they come in.
+    Sparse,
+    /// Reserve all blocks right away (`fallocate()`), so the file isn't fragmented by pieces being written in random
+    /// order, and writes don't allocate. Falls back to sparse if the filesystem can't do that.
+    Full,
+};
+
+/// How a range of the storage is going to be used, see `IStorage::advise()`.
+enum class Hint {
+    /// It's going to be read soon, e.g. as a peer requested it. Reads it ahead.
+    WillNeed,
+    /// It's going to be read front to back. Reads ahead more aggressively.
+    Sequential,
+    /// It's done with, e.g. a piece that was written and verified. Frees the page cache it takes up.
+    DontNeed,
+};
+
+/// Where the data of a torrent is kept, addressed by offsets into the torrent as if it was a single file.
+///
+/// Implementations must allow any number of threads to read and write at once, as long as the ranges they write
+/// don't overlap with what others read or write, without the callers having to lock anything.
+class IStorage {
+   public:
+    virtual ~IStorage() = default;
+
+    /// Write the buffers back to back, starting at `offset`. Either everything is written, or this throws.
+    virtual void write(const std::uint64_t offset, const std::span<const iovec> buffers) = 0;
+    /// Fill the buffers back to back with what's stored from `offset` on. Throws if there is less than that stored.
+    virtual void read(const std::uint64_t offset, const std::span<const iovec> buffers) = 0;
+    /// Make everything written so far durable. Meant for checkpoints, rather than after every write.
+    virtual void sync() = 0;
+    /// Make room for `size` bytes in total, see `Allocation`. Never shrinks what's stored.
+    virtual void allocate(const std::uint64_t size, const Allocation allocation) = 0;
+    /// Tell the storage how `[offset, offset + size)` is going to be used. Only a hint, which may be ignored.
+    virtual void advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) = 0;
+    /// The stored bytes in `[offset, offset + size)` without copying them, valid until `allocate()` grows the storage,
+    /// or the storage is destroyed. Storages
+    /// that don't keep their data in memory return an empty span, in which case `read()` has to be used.
+    virtual std::span<const std::uint8_t> view(const std::uint64_t offset, const std::size_t size);
+    /// The file the data is in, for the kernel to send it from directly (`sendfile()`), valid as long as the storage.
+    /// -1 for storages that don't keep everything written in a single file, in which case `read()` has to be used.
+    virtual int native_handle() const;
+
+    /// Same as `write()`, for coroutine jobs. Storages that can do so suspend the coroutine rather than blocking it's
+    /// worker until done, the default just calls `write()`. The buffers must stay valid until done.
+    virtual job::Task<void> async_write(const std::uint64_t offset, const std::span<const iovec> buffers);
+    /// Same as `read()`, for coroutine jobs. See `async_write()`.
+    virtual job::Task<void> async_read(const std::uint64_t offset, const std::span<const iovec> buffers);
+};
+
+/// Storage backends.
+enum class Backend {
+    /// `PosixStorage`
+    Posix,
+    /// `UringStorage`, falling back to `PosixStorage` if io_uring isn't available.
+    Uring,
+    /// `MmapStorage`, for up to `Max_Mapped_Files` torrents at once.
+    Mmap,
+};
+
+/// How many `MmapStorage`s may exist at once, in the whole process. Opening more fails.
+const std::size_t Max_Mapped_Files = 1024;
+/// Default number of operations a storage has in flight at once, for backends that queue them up.
+const unsigned Default_Queue_Depth = 64;
+/// Default size of the writes `CoalescingStorage` merges adjacent ones into.
+const std::size_t Default_Coalesced_Write_Size = 4 * 1024 * 1024;
+
+struct Config {
+    Backend m_backend = Backend::Posix;
+    /// How many operations `UringStorage`s hand to the kernel at once for the file's device, the others wait for a
+    /// free slot. Taken from the first storage opened on the device. NVMe drives want dozens to keep busy, spinning
+    /// disks few.
+    unsigned m_queue_depth = Default_Queue_Depth;
+    /// Used by the torrent to set aside it's storage when it's created.
+    Allocation m_allocation = Allocation::Sparse;
+    /// If not 0, buffer up to this many bytes of writes in a `CoalescingStorage`, to merge adjacent ones.
+    /// Torrents take it out of their cache's budget (see `cache::Cache::set_aside()`).
+    std::size_t m_coalesce_buffer = 0;
+};
+
+/// Open the file at `path` with the configured backend, creating it if it doesn't exist.
+std::unique_ptr<IStorage> open(const std::filesystem::path& path, const Config& config = {});
+
+/// Keeps the data in a single file, using positional vectored I/O (`pwritev()` and `preadv()`).
+///
+/// The file descriptor has no shared file position, so calls don't interfere with each other, and each write of a
+/// piece usually is a single syscall.
+class PosixStorage final : public IStorage {
+   public:
+    /// Open the file at `path` for reading and writing, creating it if it doesn't exist.
+    explicit PosixStorage(const std::filesystem::path& path);
+    PosixStorage(const PosixStorage&) = delete;
+    PosixStorage& operator=(const PosixStorage&) = delete;
+    ~PosixStorage() override;
+
+    void write(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    void read(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    void sync() override;
+    void allocate(const std::uint64_t size, const Allocation allocation) override;
+    void advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) override;
+    int native_handle() const override;
+
+   private:
+    std::filesystem::path m_path;
+    int m_fd;
+};
+
+/// Keeps the data in a single file, doing I/O through io_uring.
+///
+/// Each operation is a single vectored read or write entry. All storages on the same device share a ring, so the
+/// device has up to the queue depth of operations in flight at once, no matter how many files they're spread over.
+/// The others wait in line, and are submitted in batches whenever operations complete. Files are registered with the
+/// ring while there's room, so the kernel doesn't look them up for every operation.
+///
+/// Completions are collected by a thread of the ring's own, which resumes the coroutines waiting for them (see
+/// `async_write()`) on their job queue. So no worker is held up while the disk is busy, and waiting doesn't cost any
+/// CPU. All operations have to be done before the storage is destroyed.
+class UringStorage final : public IStorage {
+   public:
+    /// Open the file at `path` for reading and writing, creating it if it doesn't exist.
+    /// `queue_depth` only applies if no other storage is open on the same device.
+    /// Throws `Exception` if io_uring isn't available.
+    explicit UringStorage(const std::filesystem::path& path, const unsigned queue_depth = Default_Queue_Depth);
+    UringStorage(const UringStorage&) = delete;
+    UringStorage& operator=(const UringStorage&) = delete;
+    ~UringStorage() override;
+
+    /// Block until done, for callers that aren't coroutines.
+    void write(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    void read(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    void sync() override;
+    void allocate(const std::uint64_t size, const Allocation allocation) override;
+    void advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) override;
+    int native_handle() const override;
+
+    job::Task<void> async_write(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    job::Task<void> async_read(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+
+   private:
+    struct Op;
+    class Device;
+
+    std::filesystem::path m_path;
+    int m_fd;
+    std::shared_ptr<Device> m_device;
+    /// Where the file is registered with the device's ring, -1 if it isn't.
+    int m_slot;
+
+    /// Hand the operation on this storage's file to the device.
+    void start(Op& op);
+    /// Run an operation, blocking until done.
+    void run(Op& op);
+    /// Throw the error the operation failed with, if any.
+    void check(const Op& op) const;
+};
+
+/// Keeps the data in a single file, which is mapped into memory.
+///
+/// Reads and writes are copies from and to the mapping, without a syscall, and `view()` hands out the mapped data
+/// itself, so serving a block to a peer needn't copy it at all. Only what `allocate()` made room for is mapped, so
+/// that has to be called before anything is stored, and before any other use.
+///
+/// If a page can't be backed by the file, as it was truncated or the disk failed to read it, the kernel raises SIGBUS
+/// instead of returning an error. That's handled by replacing the page with zeros, so the faulting access completes
+/// and the program keeps running. Reads and writes that hit such a page throw, whoever reads views has to check
+/// `faults()` (or the piece hashes). Before the next read, write or view, the file is mapped over such pages again,
+/// so once it's extended again, nothing written is lost.
+///
+/// Each storage takes one of `Max_Mapped_Files` slots the SIGBUS handler knows about, for as long as it exists.
+class MmapStorage final : public IStorage {
+   public:
+    /// Open the file at `path` for reading and writing, creating it if it doesn't exist, and map what's there.
+    explicit MmapStorage(const std::filesystem::path& path);
+    MmapStorage(const MmapStorage&) = delete;
+    MmapStorage& operator=(const MmapStorage&) = delete;
+    ~MmapStorage() override;
+
+    /// Throw if the range is beyond what's mapped.
+    void write(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    void read(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    void sync() override;
+    /// Grows the mapping along with the file. It may move, which invalidates views.
+    void allocate(const std::uint64_t size, const Allocation allocation) override;
+    void advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) override;
+    int native_handle() const override;
+    /// Throws if the range is beyond what's mapped.
+    std::span<const std::uint8_t> view(const std::uint64_t offset, const std::size_t size) override;
+
+    /// Pages that couldn't be backed by the file so far.
+    std::uint64_t faults() const;
+
+   private:
+    std::filesystem::path m_path;
+    int m_fd;
+    std::uint8_t* m_map;
+    std::uint64_t m_size;
+    std::atomic<std::uint64_t> m_faults;
+    /// `m_faults` as of when the zero pages were last replaced by the file again.
+    std::atomic<std::uint64_t> m_repaired;
+    /// Where the mapping is registered for the SIGBUS handler.
+    std::size_t m_slot;
+
+    void map(const std::uint64_t size);
+    void unmap();
+    /// Map the file over pages that were replaced by zeros since last time, if any.
+    void repair();
+    /// Throw unless the range is mapped.
+    void check_range(const std::uint64_t offset, const std::uint64_t size, const std::string_view what) const;
+};
+
+/// Merges adjacent writes into larger sequential ones before they reach another storage.
+///
+/// Writes are copied into a buffer, where ones that touch or overlap are merged into runs. A run is written out as
+/// soon as it's `run_size` large, and all of them are once more than `buffer_size` bytes are buffered. Pieces tend to
+/// complete roughly in order, so this turns many piece-sized writes into few large ones, which spinning disks and
+/// network filesystems handle a lot better.
+///
+/// Buffered data only reaches the inner storage once written out. Reads and `sync()` write out everything first.
+class CoalescingStorage final : public IStorage {
+   public:
+    CoalescingStorage(std::unique_ptr<IStorage> inner, const std::size_t buffer_size,
+                      const std::size_t run_size = Default_Coalesced_Write_Size);
+    CoalescingStorage(const CoalescingStorage&) = delete;
+    CoalescingStorage& operator=(const CoalescingStorage&) = delete;
+    /// Writes out what's still buffered. Failures are only logged, call `sync()` before to see them.
+    ~CoalescingStorage() override;
+
+    /// Usually only copies the data. Blocks while runs are written out, or a previous write of the same range is.
+    void write(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    void read(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    void sync() override;
+    void allocate(const std::uint64_t size, const Allocation allocation) override;
+    void advise(const std::uint64_t offset, const std::uint64_t size, const Hint hint) override;
+
+    /// Writes runs out through the inner storage's `async_write()`. Suspends rather than blocks while a previous write
+    /// of the same range is written out, as that may be another coroutine waiting for the same worker.
+    job::Task<void> async_write(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+    /// Writes out everything first, like `read()`, but suspends rather than blocks meanwhile.
+    job::Task<void> async_read(const std::uint64_t offset, const std::span<const iovec> buffers) override;
+
+   private:
+    struct Run {
+        std::uint64_t m_offset;
+        std::vector<std::uint8_t> m_data;
+    };
+
+    std::unique_ptr<IStorage> m_inner;
+    std::size_t m_buffer_size;
+    std::size_t m_run_size;
+    /// Guards the members below.
+    std::mutex m_mutex;
+    /// Signalled when runs have been written out.
+    std::condition_variable m_written;
+    /// Buffered data by offset. Runs never touch or overlap each other.
+    std::map<std::uint64_t, std::vector<std::uint8_t>> m_runs;
+    std::size_t m_buffered;
+    /// Ranges of the runs being written out, as begin and end offset.
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> m_writing;
+    /// Coroutines to resume when runs have been written out, which live in their frames.
+    std::vector<job::Event*> m_awaiting;
+
+    /// Whether a run overlapping `[begin, end)` is being written out. `m_mutex` must be held.
+    bool writing(const std::uint64_t begin, const std::uint64_t end) const;
+    /// Copy a write into the buffer, which mustn't overlap runs being written out. Returns the runs to write out now.
+    /// `m_mutex` must be held.
+    std::vector<Run> buffer(const std::uint64_t offset, const std::span<const iovec> buffers);
+    /// Take out the runs to write out: the large enough ones, or all if `all` or the buffer is full.
+    /// `m_mutex` must be held.
+    std::vector<Run> take(const bool all);
+    /// Write the runs taken out to the inner storage, throwing the first error once all were tried.
+    void write_out(std::vector<Run>& runs);
+    job::Task<void> async_write_out(std::vector<Run>& runs);
+    void written(const std::vector<Run>& runs);
+    /// Write everything out, including what others are writing out right now.
+    void flush();
+    job::Task<void> async_flush();
+};
+
+}  // namespace tt::storage
@@ -4,6 +4,7 @@
 #include <fmt/format.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -13,6 +14,7 @@
 #include <istream>
 #include <iterator>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <string>
@@ -20,59 +22,69 @@
 #include <utility>
 #include <vector>
 
+#include "../io.hpp"
+#include "../job.hpp"
 #include "../log.hpp"
+#include "../task.hpp"
+#include "../reusable/smolsocket.hpp"
+#include "cache.hpp"
 #include "metainfo.hpp"
 #include "peer.hpp"
 #include "peer_message.hpp"
+#include "peer_registry.hpp"
 #include "piece.hpp"
 #include "shared_constants.hpp"
+#include "storage.hpp"
 #include "tracker.hpp"
 
 namespace tt {
 
-// Tries to open a file, creating it if it doesn't exist.
-static std::fstream file_open_or_create(const std::filesystem::path &path) {
-    std::fstream f;
-    std::ios::openmode mode = std::ios::binary | std::ios::in | std::ios::out;
-
-    if (std::filesystem::exists(path)) {
-        // Check whether file is usable
-        if (!std::filesystem::is_regular_file(path) && !std::filesystem::is_symlink(path)) {
-            throw std::runtime_error(
-                fmt::format("Torrent::file_open_or_create(): Failed to open destination file {} (Reason: File is not "
-                            "regular file or symlink)",
-                            path.c_str()));
-        }
-    } else {
-        // Create if not exists
-        mode = mode | std::ios::trunc;
-    }
-
-    f.exceptions(std::fstream::failbit | std::fstream::badbit);
-    try {
-        f.open(path.c_str(), mode);
-    } catch (std::system_error &e) {
-        throw std::runtime_error(fmt::format(
-            "Torrent::file_open_or_create(): Failed to open destination file {} (Reason: {}), original exception: {}",
-            path.c_str(), strerror(errno), e.what()));
-    }
-    return f;
-}
+// How many peers we try to connect to at once.
+const std::size_t Max_Half_Open_Connections = 64;
+// How long until we give up on a peer we couldn't connect to.
+const std::chrono::milliseconds Connect_Timeout{3000};
+// How long we wait for a single tracker before moving on to the next one in it's tier.
+const std::chrono::milliseconds Tracker_Timeout{10000};
+// Ask trackers for more peers early once we know fewer than this.
+const std::size_t Low_Peer_Watermark = 30;
+// At most this many peers are tried per call to `connect_peers()`, the best ones first.
+const std::size_t Max_Connect_Attempts = 256;
 
 Torrent::Torrent(const MetaInfo &parsed_file, const std::uint16_t our_port,
-                 std::optional<std::string_view> alternative_path)
+                 std::optional<std::string_view> alternative_path, const storage::Config &storage_config,
+                 std::shared_ptr<cache::Cache> cache)
     : m_metainfo(parsed_file),
       m_piece_map({}),
+      m_cache(cache != nullptr ? std::move(cache) : std::make_shared<cache::Cache>()),
+      m_storage(),
+      m_write_buffer(),
       m_us_peer{std::make_shared<peer::Peer>(peer::Peer(peer::ID(), "127.0.0.1", our_port))},
       m_peers(std::vector<std::shared_ptr<peer::Peer>>()),
-      m_tracker_stats({0, 0, 0}) {
+      m_peer_registry(),
+      m_peers_mutex(),
+      m_verified_pieces(0),
+      m_bytes_downloaded(0),
+      m_bytes_uploaded(0),
+      m_socket_options(),
+      m_reactor(nullptr),
+      m_background(nullptr),
+      m_tracker_tiers(parsed_file.m_announce_list),
+      m_announce_mutex(),
+      m_announce(),
+      m_announce_scheduler(tracker::AnnounceScheduler::Config{.m_low_peer_watermark = Low_Peer_Watermark},
+                           [this](const tracker::RequestKind kind) { announce(kind); },
+                           [this]() {
+                               const std::lock_guard<std::mutex> lock{m_peers_mutex};
+                               return m_peer_registry.num_connectable(std::chrono::steady_clock::now());
+                           }) {
     // Open file
-    if (alternative_path.has_value()) {
-        const std::filesystem::path p{alternative_path.value()};
-        m_file = file_open_or_create(p);
-    } else {
-        const std::filesystem::path p{this->m_metainfo.m_suggested_name};
-        m_file = file_open_or_create(p);
+    const std::filesystem::path p{alternative_path.value_or(this->m_metainfo.m_suggested_name)};
+    m_storage = storage::open(p, storage_config);
+    if (storage_config.m_coalesce_buffer > 0) {
+        m_write_buffer = m_cache->set_aside(storage_config.m_coalesce_buffer);
+    }
+    if (m_metainfo.m_file_length.has_value()) {
+        m_storage->allocate(m_metainfo.total_size(), storage_config.m_allocation);
     }
 
     // Initialize pieces
@@ -87,42 +99,154 @@ Torrent::Torrent(const MetaInfo &parsed_file, const std::uint16_t our_port,
     m_piece_map = {pieces};
 }
 
+Torrent::~Torrent() { m_cache->forget(*m_storage); }
+
 void Torrent::start_tracker() {
-    // Request
+    announce(tracker::RequestKind::STARTED);
+    if (m_reactor != nullptr && m_background != nullptr) {
+        m_announce_scheduler.start(*m_reactor, *m_background);
+    }
+}
+
+void Torrent::stop_tracker() { m_announce_scheduler.stop(); }
+
+void Torrent::announce(const tracker::RequestKind kind) {
     const auto req = tracker::Request{
-        tracker::RequestKind::STARTED,
+        kind,
         m_metainfo.truncated_infohash_binary(),
-        m_tracker_stats,
+        tracker_stats(),
         m_us_peer->m_id,
-        m_us_peer->m_ip,
-        m_us_peer->m_port,
+        m_us_peer->m_endpoint.ip_str(),
+        m_us_peer->m_endpoint.m_port,
     };
-    auto [new_peers, next_checkin] = tracker::send_request(m_metainfo.m_primary_tracker_url, req);
-    std::vector<std::shared_ptr<peer::Peer>> new_peers_ptrs{};
-    new_peers_ptrs.reserve(new_peers.size());
-    for (auto &peer : new_peers) {
-        new_peers_ptrs.push_back(std::make_shared<peer::Peer>(std::move(peer)));
+
+    const std::lock_guard<std::mutex> lock{m_announce_mutex};
+    // Wait for a previous announce to finish before starting the next one, it uses the same tiers
+    m_announce.reset();
+    m_announce = std::make_unique<tracker::TieredAnnounce>(
+        m_tracker_tiers, req, Tracker_Timeout, [this](const std::string &url, tracker::Response &&resp) {
+            TT_LOG(Debug, Tracker, "Torrent::announce: {} gave us {} peers", url, resp.peers.size());
+            m_announce_scheduler.on_response(resp);
+            merge_peers(resp.peers);
+        });
+
+    switch (kind) {
+        case tracker::RequestKind::STARTED:
+        case tracker::RequestKind::UPDATE:
+            if (!m_announce->wait_first()) {
+                throw std::runtime_error("Torrent::announce: No tracker responded");
+            }
+            break;
+        case tracker::RequestKind::COMPLETED:
+        case tracker::RequestKind::STOPPED:
+            m_announce->wait_all();
+            break;
     }
+}
 
-    // Update peers by merging old and new peer lists
-    for (auto &peer : new_peers_ptrs) {
-        // If peer is already present, keep the old version
-        if (std::find(m_peers.begin(), m_peers.end(), peer) == std::end(m_peers)) {
-            continue;
+tracker::Stats Torrent::tracker_stats() const {
+    // The last piece may be shorter than the others, so this may overshoot
+    const std::uint64_t have = m_piece_map.verified_bytes();
+    const std::uint64_t total = m_metainfo.total_size();
+    return tracker::Stats{m_bytes_downloaded, m_bytes_uploaded, have < total ? total - have : 0};
+}
+
+void Torrent::merge_peers(const std::vector<smolsocket::Endpoint> &new_peers) {
+    const auto now = std::chrono::steady_clock::now();
+    const std::lock_guard<std::mutex> lock{m_peers_mutex};
+    for (const auto &endpoint : new_peers) {
+        // We don't want to talk to ourselves
+        if (endpoint != m_us_peer->m_endpoint) {
+            m_peer_registry.add(endpoint, peer::Source::Tracker, now);
+        }
+    }
+}
+
+void Torrent::add_inbound_peer(std::shared_ptr<peer::Peer> peer) {
+    const auto now = std::chrono::steady_clock::now();
+    const std::lock_guard<std::mutex> lock{m_peers_mutex};
+    m_peer_registry.add(peer->m_endpoint, peer::Source::Incoming, now);
+    m_peer_registry.on_connected(peer->m_endpoint, now);
+    m_peers.push_back(std::move(peer));
+}
+
+void Torrent::drop_peer(const std::shared_ptr<peer::Peer> &peer) {
+    const std::lock_guard<std::mutex> lock{m_peers_mutex};
+    m_peer_registry.on_disconnected(peer->m_endpoint, std::chrono::steady_clock::now());
+    std::erase(m_peers, peer);
+}
+
+std::size_t Torrent::connect_peers() {
+    smolsocket::Connector::Config cfg{};
+    cfg.m_max_half_open = Max_Half_Open_Connections;
+    cfg.m_timeout = Connect_Timeout;
+    cfg.m_options = m_socket_options;
+    smolsocket::Connector connector{cfg};
+
+    std::vector<peer::Candidate> candidates{};
+    {
+        const std::lock_guard<std::mutex> lock{m_peers_mutex};
+        m_peer_registry.next_candidates(std::chrono::steady_clock::now(), Max_Connect_Attempts, candidates);
+    }
+    for (const auto &candidate : candidates) {
+        connector.add(candidate.m_endpoint, smolsocket::Proto::TCP);
+    }
+
+    std::size_t connected = 0;
+    connector.run([&](const std::size_t idx, smolsocket::ConnectResult &&res) {
+        const auto &endpoint = candidates.at(idx).m_endpoint;
+        const auto now = std::chrono::steady_clock::now();
+        if (res.m_sock.has_value()) {
+            // The ID is learned when handshaking
+            auto peer = std::make_shared<peer::Peer>(endpoint);
+            peer->attach_socket(std::move(res.m_sock.value()));
+            const std::lock_guard<std::mutex> lock{m_peers_mutex};
+            m_peer_registry.on_connected(endpoint, now);
+            m_peers.push_back(std::move(peer));
+            connected++;
         } else {
-            // Otherwise, insert (but only if the peer aren't we ourselves)
-            if (peer != m_us_peer) {
-                m_peers.push_back(std::move(peer));
-            }
+            TT_LOG(Debug, Torrent, "Torrent::connect_peers(): Failed to connect to {}: {}", endpoint.to_string(),
+                   res.m_error);
+            const std::lock_guard<std::mutex> lock{m_peers_mutex};
+            m_peer_registry.on_connect_failed(endpoint, now);
+        }
+    });
+    TT_LOG(Debug, Torrent, "Torrent::connect_peers(): Connected to {} of {} peers", connected, candidates.size());
+    return connected;
+}
+
+void Torrent::log_connection_stats() {
+    const std::lock_guard<std::mutex> lock{m_peers_mutex};
+    for (const auto &peer : m_peers) {
+        const auto info = peer->tcp_info();
+        if (!info.has_value()) {
+            continue;
         }
+        TT_LOG(Debug, Torrent, "Torrent::log_connection_stats(): {}: rtt {}us (+-{}us), cwnd {} x {}B, ssthresh {}, "
+               "unacked {}, retransmits {}",
+               *peer, info->m_rtt.count(), info->m_rtt_var.count(), info->m_snd_cwnd, info->m_snd_mss,
+               info->m_snd_ssthresh, info->m_unacked, info->m_total_retrans);
+    }
+}
+
+// Holds on to the peer while handshaking, the coroutine's frame being owned by the job.
+static job::Task<void> handshake(Torrent &torrent, std::shared_ptr<peer::Peer> peer, io::Reactor &reactor,
+                                 std::vector<std::uint8_t> truncated_infohash, peer::ID our_id) {
+    try {
+        co_await peer->async_handshake(reactor, std::move(truncated_infohash), std::move(our_id));
+    } catch (const peer::Exception &e) {
+        // Already logged, the other peers carry on
+        torrent.drop_peer(peer);
     }
 }
 
-std::vector<std::unique_ptr<peer::PeerHandshakeJob>> Torrent::create_handshake_jobs() {
-    std::vector<std::unique_ptr<peer::PeerHandshakeJob>> jobs{};
+std::vector<std::unique_ptr<job::IJob>> Torrent::create_handshake_jobs(io::Reactor &reactor) {
+    std::vector<std::unique_ptr<job::IJob>> jobs{};
+    const std::lock_guard<std::mutex> lock{m_peers_mutex};
     for (auto peer : m_peers) {
-        jobs.emplace_back(
-            std::make_unique<peer::PeerHandshakeJob>(peer, m_metainfo.truncated_infohash_binary(), m_us_peer->m_id));
+        jobs.emplace_back(std::make_unique<job::CoroJob>(
+            handshake(*this, peer, reactor, m_metainfo.truncated_infohash_binary(), m_us_peer->m_id),
+            job::Priority::Control));
     }
     return jobs;
 }
@@ -1,16 +1,23 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
-#include <fstream>
-#include <iosfwd>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string_view>
 #include <vector>
 
+#include "../io.hpp"
+#include "../job.hpp"
+#include "../reusable/smolsocket.hpp"
+#include "announce_scheduler.hpp"
+#include "cache.hpp"
 #include "metainfo.hpp"
 #include "peer.hpp"
+#include "peer_registry.hpp"
 #include "piece.hpp"
+#include "storage.hpp"
 #include "tracker.hpp"
 
 namespace tt {
@@ -24,23 +31,94 @@ struct Torrent {
     MetaInfo m_metainfo;
     /// Data structure managing pieces of the torrent.
     piece::Map m_piece_map;
-    /// Handle to file on disk.
-    std::fstream m_file{};
+    /// Memory for blocks, usually shared with all other torrents. Downloads are held back while it's full.
+    std::shared_ptr<cache::Cache> m_cache;
+    /// Where downloaded pieces are written to. Jobs write to it in parallel, without locking.
+    std::unique_ptr<storage::IStorage> m_storage;
+    /// Memory the storage buffers writes in, if it does (see `storage::Config::m_coalesce_buffer`), taken out of the
+    /// cache's budget.
+    cache::Reservation m_write_buffer;
     /// Our peer identity.
     std::shared_ptr<peer::Peer> m_us_peer;
-    /// Other peers we know about.
+    /// Peers we are connected to.
     std::vector<std::shared_ptr<peer::Peer>> m_peers;
-    /// Statistics for the tracker.
-    tracker::Stats m_tracker_stats;
+    /// All peers we know about, connected or not.
+    peer::Registry m_peer_registry;
+    /// Guards `m_peers` and `m_peer_registry`, which inbound connections modify from the session's acceptor threads.
+    std::mutex m_peers_mutex;
+    /// Pieces that checked out and are on disk so far, to tell when the download is complete.
+    std::atomic<std::size_t> m_verified_pieces;
+    /// Payload bytes we downloaded from and uploaded to peers, reported to trackers.
+    std::atomic<std::uint64_t> m_bytes_downloaded;
+    std::atomic<std::uint64_t> m_bytes_uploaded;
+    /// Tuning for connections to this torrent's peers.
+    smolsocket::Options m_socket_options;
+    /// Where jobs running for as long as the torrent is active (re-announcing) wait and run, both not owned.
+    /// Set by `Session::add_torrent()`, without a session the torrent doesn't re-announce.
+    io::Reactor* m_reactor;
+    job::JobQueue* m_background;
+    /// Tracker tiers, reordered as trackers respond (BEP 12).
+    tracker::TieredAnnounce::Tiers m_tracker_tiers;
+    /// Serializes announces, which share `m_tracker_tiers` and `m_announce`.
+    std::mutex m_announce_mutex;
+    /// The announce in flight, if any.
+    /// Declared after everything its callback touches, so it's finished before those are destroyed.
+    std::unique_ptr<tracker::TieredAnnounce> m_announce;
+    /// Decides when to re-announce. Declared last, as stopping it announces one last time.
+    tracker::AnnounceScheduler m_announce_scheduler;
 
     // Create a torrent from the given parsed torrent file.
+    // Without a cache to share, the torrent gets one of it's own, with the default budget.
     Torrent(const MetaInfo& parsed_file, const std::uint16_t our_port,
-            std::optional<std::string_view> alternative_path);
-    /// Send a start message to the torrent's tracker.
+            std::optional<std::string_view> alternative_path, const storage::Config& storage_config = {},
+            std::shared_ptr<cache::Cache> cache = nullptr);
+    /// Drops the torrent's blocks from the cache.
+    ~Torrent();
+    /// Send a start message to all of the torrent's trackers.
     ///
     /// This will register the client and download the initial peer list.
+    /// Returns as soon as the first tracker responded, the other tiers keep adding peers in the background.
+    /// Afterwards, the torrent re-announces on it's own as the trackers ask it to, if it was added to a session.
     void start_tracker();
-    /// Construct a handshake job for each peer.
-    std::vector<std::unique_ptr<peer::PeerHandshakeJob>> create_handshake_jobs();
+    /// Tell the trackers we stopped, and stop re-announcing.
+    void stop_tracker();
+    /// Announce to all of the torrent's trackers.
+    ///
+    /// UPDATE returns once the first tracker responded, and throws if none did.
+    /// COMPLETED and STOPPED return once all tiers are done, as there's nothing to wait for.
+    void announce(const tracker::RequestKind kind);
+    /// What we tell trackers about our progress.
+    tracker::Stats tracker_stats() const;
+    /// Add peers a tracker told us about, skipping ones we already know and ourselves.
+    void merge_peers(const std::vector<smolsocket::Endpoint>& new_peers);
+    /// Add a peer that connected to us and has completed the handshake.
+    void add_inbound_peer(std::shared_ptr<peer::Peer> peer);
+    /// Let go of a peer whose connection failed, and wait a while before connecting to it again.
+    void drop_peer(const std::shared_ptr<peer::Peer>& peer);
+    /// Connect to the most promising known peers which we aren't connected to yet, in parallel.
+    ///
+    /// Unreachable peers are backed off from. Returns the number of newly connected peers.
+    std::size_t connect_peers();
+    /// Log the kernel's TCP statistics (RTT, congestion window, retransmits) for each connected peer.
+    /// The session does so whenever it sends keepalives.
+    void log_connection_stats();
+    /// Construct a handshake job for each peer, suspending on `reactor`, which must outlive them.
+    /// Peers the handshake fails with are dropped, without failing the job.
+    std::vector<std::unique_ptr<job::IJob>> create_handshake_jobs(io::Reactor& reactor);
+};
+
+/// A non-owning reference to a torrent, for jobs working on it.
+///
+/// Unlike copying a `shared_ptr`, creating and copying one doesn't touch an atomic reference count, which adds up
+/// for jobs created per block. The torrent's owner has to keep it alive until all jobs referencing it are done.
+class TorrentHandle {
+   public:
+    explicit TorrentHandle(Torrent& torrent) : m_torrent(&torrent) {}
+    explicit TorrentHandle(const std::shared_ptr<Torrent>& torrent) : m_torrent(torrent.get()) {}
+    Torrent* operator->() const { return m_torrent; }
+    Torrent& operator*() const { return *m_torrent; }
+
+   private:
+    Torrent* m_torrent;
 };
 }  // namespace tt
@@ -1,17 +1,33 @@
 #include "torrent_jobs.hpp"
 
+#include <chrono>
 #include <cstdint>
 #include <exception>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <utility>
 
+#include "../io.hpp"
+#include "../job.hpp"
 #include "../log.hpp"
+#include "../task.hpp"
+#include "cache.hpp"
+#include "peer.hpp"
+#include "peer_message.hpp"
+#include "piece.hpp"
+#include "storage.hpp"
 #include "tracker.hpp"
 
 namespace tr = tt::tracker;
 
 namespace tt::torrent {
-TrackerInteractionJob::TrackerInteractionJob(std::shared_ptr<Torrent> torrent, const tr::RequestKind kind)
+// Requests for larger blocks are ignored. The standard says peers may drop ones larger than 16K, most allow more.
+const std::uint32_t Max_Request_Len = 128 * 1024;
+// How long a peer may take to send a block we requested, or anything else.
+const std::chrono::milliseconds Block_Timeout{30000};
+
+TrackerInteractionJob::TrackerInteractionJob(TorrentHandle torrent, const tr::RequestKind kind)
     : m_torrent(torrent), m_kind(kind){};
 
 void TrackerInteractionJob::process() {
@@ -19,43 +35,160 @@ void TrackerInteractionJob::process() {
         case tr::RequestKind::STARTED:
             m_torrent->start_tracker();
             break;
-        case tr::RequestKind::COMPLETED:
         case tr::RequestKind::STOPPED:
+            m_torrent->stop_tracker();
+            break;
+        case tr::RequestKind::COMPLETED:
         case tr::RequestKind::UPDATE:
-            throw std::runtime_error("TrackerInteractionJob::process(): Unimplemented tracker request kind, aborting");
+            m_torrent->announce(m_kind);
+            break;
     }
 }
 
-PieceDownloadJob::PieceDownloadJob(std::shared_ptr<Torrent> torrent, const std::size_t piece_idx)
-    : m_torrent(torrent), m_piece_idx(piece_idx){};
+job::Priority TrackerInteractionJob::priority() const { return job::Priority::Control; }
+
+PeerConnectJob::PeerConnectJob(TorrentHandle torrent) : m_torrent(std::move(torrent)){};
+
+void PeerConnectJob::process() { m_torrent->connect_peers(); }
+
+job::Priority PeerConnectJob::priority() const { return job::Priority::Control; }
 
-void PieceDownloadJob::process() {
+// Request the piece's missing blocks from a peer one after another.
+static job::Task<void> download_piece(TorrentHandle torrent, io::Reactor &reactor, const std::size_t piece_idx) {
+    auto *wanted = &torrent->m_piece_map.piece(piece_idx);
     // TODO: Use a more reasonable way to choose a peer
-    const auto p = m_torrent->m_peers.at(0);
-    auto wanted{m_torrent->m_piece_map.get_piece(m_piece_idx)};
+    std::shared_ptr<peer::Peer> p{};
+    {
+        // Peers connect and are dropped meanwhile
+        const std::lock_guard<std::mutex> lock{torrent->m_peers_mutex};
+        if (!torrent->m_peers.empty()) {
+            p = torrent->m_peers.front();
+        }
+    }
+    if (p == nullptr) {
+        TT_LOG(Warning, Torrent, "Torrent::download(): No peer to download piece {} from", piece_idx);
+        co_return;
+    }
 
-    // Request subpieces from peer sequentially until finished
     // TODO: Make subpiece downloads their own jobs
-    std::uint32_t subpiece_idx = 0;
-    for (auto &subpiece : wanted->m_subpieces) {
-        if (!subpiece.has_value()) {
-            const auto req = peer::MessageRequest(wanted->m_idx, subpiece_idx * peer::Request_Subpiece_Size,
-                                                  peer::Request_Subpiece_Size);
-            p->send_message(req);
-            const auto &msg = p->wait_for_message();
-            // TODO: Have a message pump with peek() or something rather than discarding messages
-            if (msg->get_type() != peer::MessageType::Piece) {
-                log::log(log::Level::Debug, log::Subsystem::Torrent,
-                         fmt::format("Torrent::download(): Expected message of type {}, got {}. Ignoring.",
-                                     peer::MessageType::Piece, msg->get_type()));
+    try {
+        std::uint32_t subpiece_idx = 0;
+        for (auto &subpiece : wanted->m_subpieces) {
+            if (!subpiece.has_value()) {
+                const auto req = peer::MessageRequest(wanted->m_idx, subpiece_idx * peer::Request_Subpiece_Size,
+                                                      peer::Request_Subpiece_Size);
+                // Not suspending, but under the peer's send lock, as uploads to it may be running meanwhile.
+                // A request is small enough to go straight into the socket's buffer anyway.
+                p->send_message(req);
+                auto msg = co_await p->async_wait_for_message(reactor, Block_Timeout);
+                // TODO: Have a message pump with peek() or something rather than handling messages here
+                while (msg->get_type() != peer::MessageType::Piece) {
+                    if (msg->get_type() == peer::MessageType::Request) {
+                        // Served by another job, so our download isn't held up by the upload
+                        const auto &request = dynamic_cast<const peer::MessageRequest &>(*msg);
+                        job::JobQueue::current()->enqueue(std::make_unique<PieceUploadJob>(torrent, p, request));
+                    } else {
+                        TT_LOG(Debug, Torrent,
+                               "Torrent::download(): Expected message of type {}, got {}. Ignoring.",
+                               peer::MessageType::Piece, msg->get_type());
+                    }
+                    msg = co_await p->async_wait_for_message(reactor, Block_Timeout);
+                }
+                // Push contents into subpiece
+                const auto piece_msg = dynamic_cast<const peer::MessagePiece *>(msg.get());
+                wanted->set_downloaded_subpiece_data(static_cast<std::size_t>(subpiece_idx),
+                                                     piece_msg->get_piece_data());
+                torrent->m_bytes_downloaded += piece_msg->get_piece_data().size();
             }
-            // Push contents into subpiece
-            const auto piece_msg = dynamic_cast<const peer::MessagePiece *>(msg.get());
-            wanted->set_downloaded_subpiece_data(static_cast<std::size_t>(subpiece_idx), piece_msg->get_piece_data());
+            subpiece_idx++;
         }
-        subpiece_idx++;
+    } catch (const peer::Exception &e) {
+        // Already logged. The peer is no use to anyone else now, either
+        torrent->drop_peer(p);
+        throw;
     }
     wanted->m_state = piece::State::HaveUnverified;
 }
 
+std::unique_ptr<job::IJob> make_download_job(TorrentHandle torrent, io::Reactor &reactor, const std::size_t piece_idx) {
+    return std::make_unique<job::CoroJob>(download_piece(torrent, reactor, piece_idx));
+}
+
+PieceUploadJob::PieceUploadJob(TorrentHandle torrent, std::shared_ptr<peer::Peer> peer,
+                               const peer::MessageRequest& request)
+    : m_torrent(torrent), m_peer(std::move(peer)), m_request(request){};
+
+void PieceUploadJob::process() {
+    const auto piece_idx = m_request.get_piece_idx();
+    const auto begin = m_request.get_begin_offset();
+    const auto len = m_request.get_length();
+    if (piece_idx >= m_torrent->m_piece_map.size()) {
+        TT_LOG(Warning, Torrent, "PieceUploadJob: Ignoring request for piece {}, which doesn't exist", piece_idx);
+        return;
+    }
+    const auto& piece = m_torrent->m_piece_map.piece(piece_idx);
+    if (piece.m_state != piece::State::OnDisk || len == 0 || len > Max_Request_Len || begin > piece.m_size ||
+        len > piece.m_size - begin) {
+        TT_LOG(Warning, Torrent,
+               "PieceUploadJob: Ignoring request for {} bytes at {} of piece {}, which we can't serve", len, begin,
+               piece_idx);
+        return;
+    }
+
+    auto& storage = *m_torrent->m_storage;
+    const auto piece_offset = static_cast<std::uint64_t>(piece_idx) * piece.m_size;
+    // Peers usually go on to request the rest of the piece, so it's read ahead while this block is sent
+    if (begin == 0 && len < piece.m_size) {
+        storage.advise(piece_offset + len, piece.m_size - len, storage::Hint::WillNeed);
+    }
+    const int fd = storage.native_handle();
+    try {
+        if (fd >= 0) {
+            m_peer->send_piece_from_file(piece_idx, begin, fd, piece_offset + begin, len);
+        } else {
+            const auto data = m_torrent->m_cache->read(storage, piece_offset + begin, len);
+            m_peer->send_message(peer::MessagePiece(piece_idx, begin, *data));
+        }
+    } catch (const peer::Exception &e) {
+        // Already logged. Uploads are a favour to the peer, so it's no reason to fail
+        m_torrent->drop_peer(m_peer);
+        return;
+    }
+    m_torrent->m_bytes_uploaded += len;
+}
+
+PieceCompletionJob::PieceCompletionJob(TorrentHandle torrent, const std::size_t piece_idx)
+    : m_torrent(torrent), m_piece_idx(piece_idx){};
+
+void PieceCompletionJob::process() {
+    if (m_torrent->m_piece_map.piece(m_piece_idx).m_state != piece::State::OnDisk) {
+        return;
+    }
+    const auto num_pieces = m_torrent->m_piece_map.size();
+    if (++m_torrent->m_verified_pieces == num_pieces) {
+        TT_LOG(Debug, Torrent, "PieceCompletionJob: All {} pieces are on disk, telling the trackers", num_pieces);
+        // Announcing blocks until the trackers responded, which isn't for a worker of ours to wait for
+        m_torrent->m_announce_scheduler.completed();
+    }
+}
+
+job::Priority PieceCompletionJob::priority() const { return job::Priority::Control; }
+
+static job::Task<void> admit_piece(TorrentHandle torrent, io::Reactor& reactor, const std::size_t piece_idx) {
+    auto& piece = torrent->m_piece_map.piece(piece_idx);
+    auto reservation = co_await torrent->m_cache->reserve(piece.m_size);
+    co_await download_piece(torrent, reactor, piece_idx);
+    if (piece.m_state != piece::State::HaveUnverified) {
+        // Nobody to download it from
+        co_return;
+    }
+    auto verify = std::make_unique<piece::PieceVerificationJob>(piece);
+    verify->then(piece::make_flush_job(piece, *torrent->m_storage, *torrent->m_cache, std::move(reservation),
+                                       std::make_unique<PieceCompletionJob>(torrent, piece_idx)));
+    job::JobQueue::current()->enqueue(std::move(verify));
+}
+
+std::unique_ptr<job::IJob> make_piece_jobs(TorrentHandle torrent, io::Reactor& reactor, const std::size_t piece_idx) {
+    return std::make_unique<job::CoroJob>(admit_piece(torrent, reactor, piece_idx));
+}
 }  // namespace tt::torrent
@@ -2,7 +2,10 @@
 
 #include <memory>
 
+#include "../io.hpp"
 #include "../job.hpp"
+#include "peer.hpp"
+#include "peer_message.hpp"
 #include "piece.hpp"
 #include "torrent.hpp"
 #include "tracker.hpp"
@@ -15,25 +18,70 @@ namespace tt::torrent {
 /// For requests that return peers, the torrent's peer list is updated.
 class TrackerInteractionJob final : public job::IJob {
    public:
-    TrackerInteractionJob(std::shared_ptr<Torrent> torrent, const tr::RequestKind kind);
+    TrackerInteractionJob(TorrentHandle torrent, const tr::RequestKind kind);
     TrackerInteractionJob() = delete;
     void process() override;
+    job::Priority priority() const override;
 
    private:
-    std::shared_ptr<Torrent> m_torrent;
+    TorrentHandle m_torrent;
     tr::RequestKind m_kind;
 };
 
-/// Downloads a piece from a peer, but does not verify the hash.
-/// For now, the first peer is always chosen. The API will change this in future.
-class PieceDownloadJob final : public job::IJob {
+/// Connects to all of the torrent's known peers in parallel.
+/// Peers which can't be reached are skipped.
+class PeerConnectJob final : public job::IJob {
    public:
-    PieceDownloadJob(std::shared_ptr<Torrent> torrent, const std::size_t piece_idx);
-    PieceDownloadJob() = delete;
+    PeerConnectJob(TorrentHandle torrent);
+    PeerConnectJob() = delete;
     void process() override;
+    job::Priority priority() const override;
 
    private:
-    std::shared_ptr<Torrent> m_torrent;
+    TorrentHandle m_torrent;
+};
+
+/// Serves a block a peer requested from us, if we have it on disk. Requests for anything else are ignored.
+/// The payload goes from the torrent's storage to the socket without being copied through our memory, unless the
+/// storage doesn't keep it in a single file, in which case it's read through the cache.
+/// Queued by download jobs for the requests they receive while waiting for a block.
+class PieceUploadJob final : public job::IJob {
+   public:
+    PieceUploadJob(TorrentHandle torrent, std::shared_ptr<peer::Peer> peer, const peer::MessageRequest& request);
+    PieceUploadJob() = delete;
+    void process() override;
+
+   private:
+    TorrentHandle m_torrent;
+    std::shared_ptr<peer::Peer> m_peer;
+    peer::MessageRequest m_request;
+};
+
+/// Counts a piece once it's on disk, and has the trackers told we completed after the last one (see
+/// `AnnounceScheduler::completed()`). Meant to run once the piece is flushed.
+class PieceCompletionJob final : public job::IJob {
+   public:
+    PieceCompletionJob(TorrentHandle torrent, const std::size_t piece_idx);
+    PieceCompletionJob() = delete;
+    void process() override;
+    job::Priority priority() const override;
+
+   private:
+    TorrentHandle m_torrent;
     std::size_t m_piece_idx;
 };
+
+/// Create a job downloading a piece from a peer, but not verifying the hash.
+/// It runs as a coroutine (see `job::CoroJob`), so it doesn't hold up a worker while waiting for the peer.
+/// Requests the peer sends meanwhile are handed off to `PieceUploadJob`s.
+/// For now, the first peer is always chosen. The API will change this in future. Without any, the piece is left as it
+/// is, without failing the job.
+std::unique_ptr<job::IJob> make_download_job(TorrentHandle torrent, io::Reactor& reactor, const std::size_t piece_idx);
+
+/// Create the jobs to download, verify and flush a piece. They must be done before the torrent and reactor are
+/// destroyed.
+/// Returns a job that waits for room in the torrent's cache, then downloads the piece, both without tying up a worker.
+/// It then queues up verifying, with flushing as it's continuation. Once flushed, the piece's data is moved to the
+/// cache, and the piece is counted as complete.
+std::unique_ptr<job::IJob> make_piece_jobs(TorrentHandle torrent, io::Reactor& reactor, const std::size_t piece_idx);
 }  // namespace tt::torrent
\ No newline at end of file
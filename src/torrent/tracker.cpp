@@ -1,199 +1,230 @@
 #include "tracker.hpp"
 
-#include <cpr/cpr.h>
 #include <fmt/core.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
-#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "../log.hpp"
-#include "../reusable/byteorder.hpp"
+#include "../reusable/smolsocket.hpp"
 #include "../torrent/bencode.hpp"
 #include "../torrent/peer.hpp"
+#include "tracker_http.hpp"
+#include "tracker_udp.hpp"
 
 namespace tt::tracker {
 Exception::Exception(const std::string_view& msg) : m_msg(msg) {}
 
 const char* Exception::what() const noexcept { return this->m_msg.c_str(); }
 
-static bencode::Object get_object_from_dict_or_throw(std::string key, std::map<std::string, bencode::Object> dict,
-                                                     std::string throw_msg) {
-    auto dict_entry = dict.find(key);
-    if (dict_entry == dict.end()) {
-        // Key doesn't exist
-        throw Exception(throw_msg);
+// Compact peer entries are the address followed by a 2-byte port, both in network byte order.
+template <std::size_t Addr_Len>
+static void decode_compact(const std::string_view& str, std::vector<smolsocket::Endpoint>& out) {
+    const std::size_t entry_len = Addr_Len + 2;
+    if (str.size() % entry_len != 0) {
+        throw Exception(fmt::format(
+            "Tracker violated protocol: Compact peer representation must be multiple of {} bytes long", entry_len));
     }
-    auto obj = dict_entry->second;
-    return obj;
-}
-
-static std::vector<peer::Peer> bencode_peer_list_to_peers(std::vector<bencode::Object> list) {
-    std::vector<peer::Peer> peers{};
-    peers.reserve(list.size());
-    for (bencode::Object const& peer_entry : list) {
-        if (!peer_entry.dict.has_value()) {
-            throw Exception("Tracker violated protocol: peer entry is not a bencoded dictionary");
+    const auto* in = reinterpret_cast<const std::uint8_t*>(str.data());
+    const auto* end = in + str.size();
+    out.reserve(out.size() + str.size() / entry_len);
+    for (; in != end; in += entry_len) {
+        const auto port = static_cast<std::uint16_t>((in[Addr_Len] << 8) | in[Addr_Len + 1]);
+        if constexpr (Addr_Len == smolsocket::V4_Len_Bytes) {
+            out.push_back(smolsocket::Endpoint::from_v4(in, port));
+        } else {
+            out.push_back(smolsocket::Endpoint::from_v6(in, port));
         }
-        auto peer_dict = peer_entry.dict.value();
-        auto peer_id_obj = get_object_from_dict_or_throw("peer id", peer_dict,
-                                                         "Tracker violated protocol: all peers must have peer ID");
-        auto peer_ip_obj =
-            get_object_from_dict_or_throw("ip", peer_dict, "Tracker violated protocol: all peers must have IP address");
-        const std::string_view peer_ip_view = std::string_view(peer_ip_obj.str.value());
-        auto peer_port_obj =
-            get_object_from_dict_or_throw("port", peer_dict, "Tracker violated protocol: all peers must have port");
-        const std::uint16_t peer_port = static_cast<std::uint16_t>(peer_port_obj.integer.value());
-        const peer::ID peer_id{peer_id_obj.str.value()};
-        peers.emplace_back(peer_id, peer_ip_view, peer_port);
     }
-    return peers;
 }
 
-static std::vector<peer::Peer> bep52_peer_str_to_peers(const std::string_view& str) {
-    std::vector<peer::Peer> peers{};
-    size_t i = 0;
-    // v4 addresses are coded as 4 bytes for address, 2 bytes for port
-    if (str.size() % 6 != 0) {
-        throw Exception("Tracker violated protocol: Compact peer representation must be multiple of 6 bytes long");
-    }
-    while (i < str.size()) {
-        // Extract from string
-        std::array<uint8_t, smolsocket::V6_Len_Bytes> ip{};
-        const std::string_view ip_substr = str.substr(i, 4);
-        std::transform(ip_substr.begin(), ip_substr.end(), ip.begin(), [](char x) { return static_cast<uint8_t>(x); });
-        std::array<char, 2> port;
-        std::copy_n(str.substr(i + 4, 2).begin(), 2, port.begin());
-        // Convert to usable repr
-        std::string ip_str = smolsocket::ip_to_str(ip, smolsocket::AddrKind::V4);
-        uint16_t port_native_endian = bo::ntoh(port);
-        // Compact format has no ID, generate at random
-        peers.emplace_back(peer::ID(), ip_str, port_native_endian);
-        i += 6;
-    }
-    return peers;
+void decode_compact_peers(const std::string_view& str, std::vector<smolsocket::Endpoint>& out) {
+    decode_compact<smolsocket::V4_Len_Bytes>(str, out);
 }
 
-// Convert request kind to string
-static std::string req_kind_to_str(const RequestKind r) {
-    std::string event_str{};
-    switch (r) {
-        case RequestKind::STARTED:
-            event_str = "started";
-            break;
-        case RequestKind::COMPLETED:
-            event_str = "completed";
-            break;
-        case RequestKind::STOPPED:
-            event_str = "stopped";
-            break;
-        case RequestKind::UPDATE:
-            event_str = "";
-            break;
-        default:
-            break;
-    }
-    return event_str;
+void decode_compact_peers6(const std::string_view& str, std::vector<smolsocket::Endpoint>& out) {
+    decode_compact<smolsocket::V6_Len_Bytes>(str, out);
 }
 
-static cpr::Response query_tracker(const std::string_view& announce_url, const Request& r) {
-    std::string info_hash_str{};
-    for (const auto b : r.trunc_infohash_binary) {
-        info_hash_str.push_back(static_cast<char>(b));
-    }
-    auto event_str = req_kind_to_str(r.kind);
-    cpr::Parameters p = cpr::Parameters{{"info_hash", info_hash_str},
-                                        {"peer_id", r.our_id.as_string()},
-                                        {"port", std::to_string(r.our_port)},
-                                        {"uploaded", std::to_string(r.stats.bytes_uploaded)},
-                                        {"downloaded", std::to_string(r.stats.bytes_downloaded)},
-                                        {"left", std::to_string(r.stats.bytes_left)},
-                                        {"event", event_str},
-                                        // Some trackers (like opentracker) hate when this is set to 0
-                                        {"compact", "1"}};
-    cpr::Response resp = cpr::Get(cpr::Url{std::string(announce_url)}, p);
-
-    tt::log::log(tt::log::Level::Debug, tt::log::Subsystem::Tracker,
-                 fmt::format("Tracker request URL: {}", resp.url.str()));
-    tt::log::log(tt::log::Level::Debug, tt::log::Subsystem::Tracker,
-                 fmt::format("Raw tracker response: {}", resp.text));
-    if (resp.error.code != cpr::ErrorCode::OK) {
-        if (resp.status_code != cpr::status::HTTP_OK) {
-            throw Exception(fmt::format("tracker::send_request(): Got status code {} from tracker", resp.status_code));
-        } else {
-            throw Exception(fmt::format("tracker::send_request(): Got error \"{}\" from curl", resp.error.message));
+// Decodes a classic peer list, which is a list of dicts with (among others) IP and port.
+static void decode_peer_dicts(const bencode::View& list, std::vector<smolsocket::Endpoint>& out) {
+    list.for_each([&](const bencode::View& entry) {
+        const auto ip = entry.find("ip");
+        const auto port = entry.find("port");
+        if (!ip.has_value() || !ip->str().has_value() || !port.has_value() || !port->integer().has_value()) {
+            throw Exception("Tracker violated protocol: all peers must have IP address and port");
         }
-    }
-    return resp;
+        const auto endpoint =
+            smolsocket::Endpoint::parse(ip->str().value(), static_cast<std::uint16_t>(port->integer().value()));
+        if (!endpoint.has_value()) {
+            // Could be a DNS name, which we don't support
+            TT_LOG(Debug, Tracker, "tracker::send_request(): Skipping peer with unsupported address {}",
+                   ip->str().value());
+            return;
+        }
+        out.push_back(endpoint.value());
+    });
 }
 
-static std::vector<peer::Peer> parse_peers_from_tracker_resp(const std::map<std::string, bencode::Object>& resp_dict) {
-    auto peers = resp_dict.find("peers");
-    if (peers == resp_dict.end()) {
+static std::vector<smolsocket::Endpoint> parse_peers_from_tracker_resp(const bencode::View& resp_dict) {
+    const auto peers = resp_dict.find("peers");
+    const auto peers6 = resp_dict.find("peers6");
+    if (!peers.has_value() && !peers6.has_value()) {
         // The key doesn't exist, meaning the tracker violated the protocol
         throw Exception(
             "tracker::send_request(): Tracker violated protocol: expected a key 'peers' in response, but it was "
             "absent");
     }
-    // Trackers may return BEP52-style compact peer lists unprompted, so we have to always be ready to parse both
-    if (peers->second.list.has_value()) {
+    std::vector<smolsocket::Endpoint> out{};
+    // Trackers may return BEP23-style compact peer lists unprompted, so we have to always be ready to parse both
+    if (!peers.has_value()) {
+        // Only v6 peers
+    } else if (peers->type() == bencode::ObjectType::List) {
         // Classic peer list
-        auto peers_bencoded = peers->second.list.value();
-        return bencode_peer_list_to_peers(peers_bencoded);
-    } else if (peers->second.str.has_value()) {
+        decode_peer_dicts(peers.value(), out);
+    } else if (peers->type() == bencode::ObjectType::String) {
         // Compact peer list
-        auto peers_bencoded = peers->second.str.value();
-        return bep52_peer_str_to_peers(peers_bencoded);
+        decode_compact_peers(peers->str().value(), out);
     } else {
         // Garbage
         throw Exception("tracker::send_request(): Tracker violated protocol: peers weren't list or string");
     }
+    if (peers6.has_value()) {
+        if (!peers6->str().has_value()) {
+            throw Exception("tracker::send_request(): Tracker violated protocol: peers6 wasn't a string");
+        }
+        decode_compact_peers6(peers6->str().value(), out);
+    }
+    return out;
 }
 
-static std::int64_t parse_checkin_interval_from_tracker_resp(const std::map<std::string, bencode::Object>& resp_dict) {
+static std::int64_t parse_checkin_interval_from_tracker_resp(const bencode::View& resp_dict) {
     // Check when we're supposed to contact the tracker next
-    auto interval_mapret = resp_dict.find("interval");
-    if (interval_mapret == resp_dict.end()) {
+    const auto interval = resp_dict.find("interval");
+    if (!interval.has_value() || !interval->integer().has_value()) {
         // The key doesn't exist, meaning the tracker violated the protocol
         throw Exception(
             "tracker::send_request(): Tracker violated protocol: expected a key 'interval' in response, but it was "
             "absent");
     }
-    std::int64_t interval = interval_mapret->second.integer.value();
-    tt::log::log(tt::log::Level::Debug, tt::log::Subsystem::Tracker,
-                 fmt::format("tracker::send_request(): Tracker told us to check in again in {} seconds\n", interval));
-    return interval;
+    TT_LOG(Debug, Tracker, "tracker::send_request(): Tracker told us to check in again in {} seconds\n",
+           interval->integer().value());
+    return interval->integer().value();
 }
 
-std::tuple<std::vector<peer::Peer>, std::int64_t> send_request(const std::string_view& announce_url, const Request& r) {
-    const auto resp = query_tracker(announce_url, r);
-    auto queue = std::deque<char>(resp.text.begin(), resp.text.end());
-    auto parser = bencode::Parser(queue);
-    auto resp_object_maybe_none = parser.next();
-
+Response parse_announce_response(const std::string_view& body) {
     // Sanity check
-    if (!resp_object_maybe_none.has_value()) {
-        throw Exception("tracker::send_request(): Tracker violated protocol: response must be a bencoded dictionary");
-    }
-    auto resp_object = resp_object_maybe_none.value();
-    if (resp_object.type != bencode::ObjectType::Dict) {
+    const auto resp_dict = [&]() {
+        try {
+            return bencode::View(body);
+        } catch (const bencode::Exception& e) {
+            throw Exception(fmt::format("tracker::send_request(): Tracker sent malformed response: {}", e.what()));
+        }
+    }();
+    if (resp_dict.type() != bencode::ObjectType::Dict) {
         throw Exception("tracker::send_request(): Tracker violated protcol: response must be a bencoded dictionary");
     }
 
     // Check whether the tracker returned a failure
-    auto resp_dict = resp_object.dict.value();
-    auto failure_reason = resp_dict.find("failure reason");
-    if (failure_reason != resp_dict.end()) {
+    const auto failure_reason = resp_dict.find("failure reason");
+    if (failure_reason.has_value()) {
         // The key exists, meaning we have a reason
         throw Exception(fmt::format("tracker::send_request(): Tracker indicated failure with reason: {}",
-                                    failure_reason->second.str.value()));
+                                    failure_reason->str().value_or("")));
+    }
+
+    const auto interval = parse_checkin_interval_from_tracker_resp(resp_dict);
+    std::optional<std::int64_t> min_interval{};
+    const auto min_interval_entry = resp_dict.find("min interval");
+    if (min_interval_entry.has_value()) {
+        min_interval = min_interval_entry->integer();
+    }
+    return Response{parse_peers_from_tracker_resp(resp_dict), interval, min_interval};
+}
+
+Response send_request(const std::string_view& announce_url, const Request& r,
+                      const std::optional<std::chrono::milliseconds> timeout) {
+    if (announce_url.starts_with("udp://")) {
+        udp::Config cfg{};
+        cfg.m_total_timeout = timeout;
+        return udp::announce(announce_url, r, cfg);
+    }
+    return http::announce(announce_url, r, timeout);
+}
+
+std::vector<ScrapeResult> scrape(const std::string_view& announce_url,
+                                 const std::vector<std::vector<std::uint8_t>>& trunc_infohashes_binary,
+                                 const std::optional<std::chrono::milliseconds> timeout) {
+    if (announce_url.starts_with("udp://")) {
+        udp::Config cfg{};
+        cfg.m_total_timeout = timeout;
+        return udp::scrape(announce_url, trunc_infohashes_binary, cfg);
+    }
+    return http::scrape(announce_url, trunc_infohashes_binary, timeout);
+}
+
+TieredAnnounce::TieredAnnounce(Tiers& tiers, const Request& r, const std::chrono::milliseconds per_tracker_timeout,
+                               Callback on_response)
+    : m_request(r),
+      m_timeout(per_tracker_timeout),
+      m_on_response(std::move(on_response)),
+      m_mutex(),
+      m_cv(),
+      m_finished(0),
+      m_succeeded(0),
+      m_threads() {
+    m_threads.reserve(tiers.size());
+    for (auto& tier : tiers) {
+        m_threads.emplace_back(&TieredAnnounce::announce_tier, this, std::ref(tier));
     }
+}
 
-    auto interval = parse_checkin_interval_from_tracker_resp(resp_dict);
-    auto peers_vec = parse_peers_from_tracker_resp(resp_dict);
-    return std::tuple<std::vector<peer::Peer>, std::int64_t>(std::move(peers_vec), interval);
+void TieredAnnounce::announce_tier(std::vector<std::string>& tier) {
+    bool succeeded = false;
+    for (auto it = tier.begin(); it != tier.end() && !succeeded; it++) {
+        const auto url = *it;
+        try {
+            m_on_response(url, send_request(url, m_request, m_timeout));
+            // Prefer this tracker next time. Only now, as the loop must not go on over a reordered tier
+            std::rotate(tier.begin(), it, it + 1);
+            succeeded = true;
+        } catch (const std::exception& e) {
+            TT_LOG(Warning, Tracker, "tracker::TieredAnnounce: Announce to {} failed: {}", url, e.what());
+        }
+    }
+
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_finished++;
+    if (succeeded) {
+        m_succeeded++;
+    }
+    m_cv.notify_all();
+}
+
+bool TieredAnnounce::wait_first() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_cv.wait(lock, [&]() { return m_succeeded > 0 || m_finished == m_threads.size(); });
+    return m_succeeded > 0;
+}
+
+std::size_t TieredAnnounce::wait_all() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_cv.wait(lock, [&]() { return m_finished == m_threads.size(); });
+    return m_succeeded;
+}
+
+TieredAnnounce::~TieredAnnounce() {
+    for (auto& t : m_threads) {
+        t.join();
+    }
 }
 }  // namespace tt::tracker
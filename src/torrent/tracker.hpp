@@ -1,12 +1,18 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
-#include <tuple>
+#include <thread>
 #include <vector>
 
+#include "../reusable/smolsocket.hpp"
 #include "bencode.hpp"
 #include "peer.hpp"
 namespace tt::tracker {
@@ -55,9 +61,82 @@ struct Request {
     std::uint16_t our_port;
 };
 
+// What the tracker told us in response to an announce.
+struct Response {
+   public:
+    // Peers in the swarm, of both address families
+    std::vector<smolsocket::Endpoint> peers;
+    // Seconds until we should announce again
+    std::int64_t interval;
+    // Seconds we must wait at least before announcing again, if the tracker cares
+    std::optional<std::int64_t> min_interval;
+};
+
+// What the tracker knows about a torrent's swarm.
+struct ScrapeResult {
+    std::uint32_t seeders;
+    std::uint32_t completed;
+    std::uint32_t leechers;
+};
+
+// Decodes a compact peer list (BEP 23), where each peer is 4 bytes of IPv4 address followed by 2 bytes of port.
+// The peers are appended to `out`.
+void decode_compact_peers(const std::string_view& str, std::vector<smolsocket::Endpoint>& out);
+// Same for the IPv6 variant (BEP 7), where each peer is 16 bytes of address followed by 2 bytes of port.
+void decode_compact_peers6(const std::string_view& str, std::vector<smolsocket::Endpoint>& out);
+
+// Parse the body of a HTTP tracker's announce response.
+// Causes an exception if the tracker indicated failure or violated the protocol.
+Response parse_announce_response(const std::string_view& body);
+
 // Sends a request to the tracker.
+// Both http(s):// and udp:// (BEP 15) announce URLs are supported.
 // See `RequestKind` for semantics of each message type.
-// Returns a vector of peers the tracker gave us if successful.
-// Causes an exception if not.
-std::tuple<std::vector<peer::Peer>, std::int64_t> send_request(const std::string_view& announce_url, const Request& r);
+// Returns the peers and announce interval the tracker gave us if successful.
+// Causes an exception if not, or if the tracker doesn't respond within the timeout.
+Response send_request(const std::string_view& announce_url, const Request& r,
+                      const std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+
+// Query swarm statistics for each of the given truncated binary infohashes, in order, in as few requests as possible.
+// Both http(s):// and udp:// URLs are supported; for HTTP, the scrape URL is derived from the announce URL (BEP 48).
+// Causes an exception if the tracker doesn't support scraping, or doesn't respond within the timeout.
+std::vector<ScrapeResult> scrape(const std::string_view& announce_url,
+                                 const std::vector<std::vector<std::uint8_t>>& trunc_infohashes_binary,
+                                 const std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+
+/// Announces to all tiers of a torrent's trackers (BEP 12) in the background.
+///
+/// Tiers are announced to concurrently. Within a tier, trackers are tried in order until one responds,
+/// which is then moved to the front of it's tier so that it's asked first next time.
+/// Every response is handed to the callback as soon as it arrives, on the thread that received it,
+/// so that peers from the fastest tracker can be used without waiting for the others.
+class TieredAnnounce {
+   public:
+    using Tiers = std::vector<std::vector<std::string>>;
+    using Callback = std::function<void(const std::string& url, Response&& resp)>;
+
+    /// Start announcing. `tiers` is reordered as described above, and must outlive this object.
+    TieredAnnounce(Tiers& tiers, const Request& r, const std::chrono::milliseconds per_tracker_timeout,
+                   Callback on_response);
+    TieredAnnounce(const TieredAnnounce&) = delete;
+    TieredAnnounce& operator=(const TieredAnnounce&) = delete;
+    /// Block until any tier got a response, or all of them failed. Returns whether any succeeded.
+    bool wait_first();
+    /// Block until every tier either got a response or ran out of trackers. Returns how many succeeded.
+    std::size_t wait_all();
+    /// Waits for all tiers, as the callback may reference things that are about to be destroyed.
+    ~TieredAnnounce();
+
+   private:
+    Request m_request;
+    std::chrono::milliseconds m_timeout;
+    Callback m_on_response;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::size_t m_finished;
+    std::size_t m_succeeded;
+    std::vector<std::thread> m_threads;
+
+    void announce_tier(std::vector<std::string>& tier);
+};
 }  // namespace tt::tracker
@@ -0,0 +1,239 @@
+#include "tracker_http.hpp"
+
+#include <cpr/cpr.h>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "../log.hpp"
+#include "bencode.hpp"
+#include "tracker.hpp"
+
+namespace tt::tracker::http {
+
+// Trackers usually cap the length of URLs they accept, so scrapes for many torrents are split up.
+const std::size_t Max_Scrape_Infohashes = 64;
+// Sessions per tracker in the shared pool.
+const std::size_t Default_Max_Sessions_Per_Host = 4;
+
+SessionPool::Lease::Lease(SessionPool& pool, std::string host, std::unique_ptr<cpr::Session> session)
+    : m_pool(&pool), m_host(std::move(host)), m_session(std::move(session)) {}
+
+SessionPool::Lease::Lease(Lease&& src)
+    : m_pool(src.m_pool), m_host(std::move(src.m_host)), m_session(std::move(src.m_session)) {}
+
+cpr::Session& SessionPool::Lease::session() { return *m_session; }
+
+SessionPool::Lease::~Lease() {
+    if (m_session) {
+        m_pool->release(m_host, std::move(m_session));
+    }
+}
+
+SessionPool::SessionPool(const std::size_t max_per_host)
+    : m_max_per_host(std::max<std::size_t>(max_per_host, 1)), m_mutex(), m_cv(), m_hosts() {}
+
+SessionPool::Lease SessionPool::acquire(const std::string_view& url) {
+    auto host = host_of(url);
+    std::unique_lock<std::mutex> lock{m_mutex};
+    auto& h = m_hosts[host];
+    m_cv.wait(lock, [&]() { return h.m_in_use < m_max_per_host; });
+    h.m_in_use++;
+    if (!h.m_idle.empty()) {
+        auto session = std::move(h.m_idle.back());
+        h.m_idle.pop_back();
+        return Lease{*this, std::move(host), std::move(session)};
+    }
+    // Creating the session doesn't need the lock, but it's cheap and keeps this simple
+    return Lease{*this, std::move(host), std::make_unique<cpr::Session>()};
+}
+
+std::size_t SessionPool::idle(const std::string_view& url) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    const auto h = m_hosts.find(host_of(url));
+    return h == m_hosts.end() ? 0 : h->second.m_idle.size();
+}
+
+SessionPool& SessionPool::shared() {
+    static SessionPool pool{Default_Max_Sessions_Per_Host};
+    return pool;
+}
+
+void SessionPool::release(const std::string& host, std::unique_ptr<cpr::Session> session) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    auto& h = m_hosts[host];
+    h.m_in_use--;
+    h.m_idle.push_back(std::move(session));
+    m_cv.notify_all();
+}
+
+std::string host_of(const std::string_view& url) {
+    const auto scheme_end = url.find("://");
+    const auto authority_start = scheme_end == std::string_view::npos ? 0 : scheme_end + 3;
+    const auto authority_end = url.find_first_of("/?#", authority_start);
+    auto host = std::string(url.substr(0, authority_end));
+    std::transform(host.begin(), host.end(), host.begin(), [](unsigned char c) { return std::tolower(c); });
+    return host;
+}
+
+std::optional<std::string> scrape_url(const std::string_view& announce_url) {
+    // Only URLs whose last path segment starts with "announce" can be turned into scrape URLs
+    const auto query_start = std::min(announce_url.find('?'), announce_url.size());
+    const auto last_slash = announce_url.rfind('/', query_start);
+    if (last_slash == std::string_view::npos) {
+        return {};
+    }
+    const auto segment = announce_url.substr(last_slash + 1, query_start - last_slash - 1);
+    if (!segment.starts_with("announce")) {
+        return {};
+    }
+    std::string out{announce_url.substr(0, last_slash + 1)};
+    out += "scrape";
+    out += announce_url.substr(last_slash + 1 + std::string_view("announce").size());
+    return out;
+}
+
+// Convert request kind to string
+static std::string req_kind_to_str(const RequestKind r) {
+    std::string event_str{};
+    switch (r) {
+        case RequestKind::STARTED:
+            event_str = "started";
+            break;
+        case RequestKind::COMPLETED:
+            event_str = "completed";
+            break;
+        case RequestKind::STOPPED:
+            event_str = "stopped";
+            break;
+        case RequestKind::UPDATE:
+            event_str = "";
+            break;
+        default:
+            break;
+    }
+    return event_str;
+}
+
+static std::string bytes_to_str(const std::vector<std::uint8_t>& bytes) {
+    return std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+// Perform a GET request on a pooled session to the URL's host.
+static cpr::Response get(const std::string_view& url, cpr::Parameters&& p,
+                         const std::optional<std::chrono::milliseconds> timeout, SessionPool& pool) {
+    auto lease = pool.acquire(url);
+    auto& session = lease.session();
+    session.SetUrl(cpr::Url{std::string(url)});
+    session.SetParameters(std::move(p));
+    // A zero timeout means none to curl
+    session.SetTimeout(cpr::Timeout{timeout.value_or(std::chrono::milliseconds(0))});
+    cpr::Response resp = session.Get();
+
+    TT_LOG(Debug, Tracker, "Tracker request URL: {}", resp.url.str());
+    TT_LOG(Debug, Tracker, "Raw tracker response: {}", resp.text);
+    if (resp.error.code != cpr::ErrorCode::OK) {
+        throw Exception(fmt::format("tracker::http: Got error \"{}\" from curl", resp.error.message));
+    }
+    if (resp.status_code != cpr::status::HTTP_OK) {
+        throw Exception(fmt::format("tracker::http: Got status code {} from tracker", resp.status_code));
+    }
+    return resp;
+}
+
+Response announce(const std::string_view& url, const Request& r, const std::optional<std::chrono::milliseconds> timeout,
+                  SessionPool& pool) {
+    cpr::Parameters p = cpr::Parameters{{"info_hash", bytes_to_str(r.trunc_infohash_binary)},
+                                        {"peer_id", r.our_id.as_string()},
+                                        {"port", std::to_string(r.our_port)},
+                                        {"uploaded", std::to_string(r.stats.bytes_uploaded)},
+                                        {"downloaded", std::to_string(r.stats.bytes_downloaded)},
+                                        {"left", std::to_string(r.stats.bytes_left)},
+                                        {"event", req_kind_to_str(r.kind)},
+                                        // Some trackers (like opentracker) hate when this is set to 0
+                                        {"compact", "1"}};
+    const auto resp = get(url, std::move(p), timeout, pool);
+    return parse_announce_response(resp.text);
+}
+
+static std::uint32_t scrape_field(const bencode::View& entry, const std::string_view& key) {
+    const auto value = entry.find(key);
+    if (!value.has_value() || !value->integer().has_value()) {
+        return 0;
+    }
+    const std::int64_t max = std::numeric_limits<std::uint32_t>::max();
+    return static_cast<std::uint32_t>(std::clamp<std::int64_t>(value->integer().value(), 0, max));
+}
+
+std::vector<ScrapeResult> parse_scrape_response(const std::string_view& body,
+                                                const std::vector<std::vector<std::uint8_t>>& trunc_infohashes_binary) {
+    const auto resp_dict = [&]() {
+        try {
+            return bencode::View(body);
+        } catch (const bencode::Exception& e) {
+            throw Exception(fmt::format("tracker::http::scrape(): Tracker sent malformed response: {}", e.what()));
+        }
+    }();
+    if (resp_dict.type() != bencode::ObjectType::Dict) {
+        throw Exception("tracker::http::scrape(): Tracker violated protocol: response must be a bencoded dictionary");
+    }
+    const auto failure_reason = resp_dict.find("failure reason");
+    if (failure_reason.has_value()) {
+        throw Exception(fmt::format("tracker::http::scrape(): Tracker indicated failure with reason: {}",
+                                    failure_reason->str().value_or("")));
+    }
+    const auto files = resp_dict.find("files");
+    if (!files.has_value() || files->type() != bencode::ObjectType::Dict) {
+        throw Exception("tracker::http::scrape(): Tracker violated protocol: expected a dictionary 'files'");
+    }
+
+    std::vector<ScrapeResult> out{};
+    out.reserve(trunc_infohashes_binary.size());
+    for (const auto& hash : trunc_infohashes_binary) {
+        const auto entry = files->find(bytes_to_str(hash));
+        if (!entry.has_value()) {
+            out.push_back(ScrapeResult{0, 0, 0});
+            continue;
+        }
+        out.push_back(ScrapeResult{scrape_field(entry.value(), "complete"), scrape_field(entry.value(), "downloaded"),
+                                   scrape_field(entry.value(), "incomplete")});
+    }
+    return out;
+}
+
+std::vector<ScrapeResult> scrape(const std::string_view& announce_url,
+                                 const std::vector<std::vector<std::uint8_t>>& trunc_infohashes_binary,
+                                 const std::optional<std::chrono::milliseconds> timeout, SessionPool& pool) {
+    const auto url = scrape_url(announce_url);
+    if (!url.has_value()) {
+        throw Exception(fmt::format("tracker::http::scrape(): Tracker {} doesn't support scraping", announce_url));
+    }
+    std::vector<ScrapeResult> results{};
+    results.reserve(trunc_infohashes_binary.size());
+    for (std::size_t start = 0; start < trunc_infohashes_binary.size(); start += Max_Scrape_Infohashes) {
+        const auto end = std::min(start + Max_Scrape_Infohashes, trunc_infohashes_binary.size());
+        const std::vector<std::vector<std::uint8_t>> batch(trunc_infohashes_binary.begin() + start,
+                                                           trunc_infohashes_binary.begin() + end);
+        cpr::Parameters p{};
+        for (const auto& hash : batch) {
+            p.Add({"info_hash", bytes_to_str(hash)});
+        }
+        const auto resp = get(url.value(), std::move(p), timeout, pool);
+        const auto batch_results = parse_scrape_response(resp.text, batch);
+        results.insert(results.end(), batch_results.begin(), batch_results.end());
+    }
+    return results;
+}
+}  // namespace tt::tracker::http
@@ -0,0 +1,98 @@
+#pragma once
+
+/*
+ * Client for HTTP(S) trackers (BEP 3, BEP 48 for scraping).
+ *
+ * Connections are kept alive and reused per tracker, as we tend to talk to the same few trackers for all torrents.
+ * Requests to the same tracker are limited in concurrency, so that many torrents announcing at once don't overwhelm it.
+ */
+
+#include <cpr/cpr.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tracker.hpp"
+
+namespace tt::tracker::http {
+
+/*
+ * Idle keep-alive sessions, per tracker.
+ *
+ * Thread-safe.
+ */
+class SessionPool {
+   public:
+    // A session handed out by the pool. Goes back into the pool once destroyed.
+    class Lease {
+       public:
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease(Lease&& src);
+        Lease& operator=(Lease&&) = delete;
+        cpr::Session& session();
+        ~Lease();
+
+       private:
+        friend class SessionPool;
+        Lease(SessionPool& pool, std::string host, std::unique_ptr<cpr::Session> session);
+
+        SessionPool* m_pool;
+        std::string m_host;
+        std::unique_ptr<cpr::Session> m_session;
+    };
+
+    // At most `max_per_host` requests to the same tracker are in flight at once.
+    explicit SessionPool(const std::size_t max_per_host);
+    SessionPool(const SessionPool&) = delete;
+    SessionPool& operator=(const SessionPool&) = delete;
+    // Get a session for the tracker at the given URL, blocking while too many are in use already.
+    Lease acquire(const std::string_view& url);
+    // Number of sessions to the given tracker which are waiting to be reused.
+    std::size_t idle(const std::string_view& url);
+    // The pool shared by all torrents.
+    static SessionPool& shared();
+
+   private:
+    struct Host {
+        std::vector<std::unique_ptr<cpr::Session>> m_idle{};
+        std::size_t m_in_use = 0;
+    };
+    std::size_t m_max_per_host;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::map<std::string, Host> m_hosts;
+
+    void release(const std::string& host, std::unique_ptr<cpr::Session> session);
+};
+
+// The part of a URL identifying the server it points to, e.g. "https://tracker.example.org:443".
+std::string host_of(const std::string_view& url);
+
+// Derive the scrape URL from an announce URL (BEP 48). None if the tracker doesn't support scraping.
+std::optional<std::string> scrape_url(const std::string_view& announce_url);
+
+// Announce to the tracker at the given http(s):// URL. Same semantics as `send_request()`.
+Response announce(const std::string_view& url, const Request& r, const std::optional<std::chrono::milliseconds> timeout,
+                  SessionPool& pool = SessionPool::shared());
+
+// Parse the body of a scrape response for the given infohashes, in order.
+// Torrents the tracker doesn't know about are reported as having no peers.
+std::vector<ScrapeResult> parse_scrape_response(const std::string_view& body,
+                                                const std::vector<std::vector<std::uint8_t>>& trunc_infohashes_binary);
+
+// Query swarm statistics for each of the given truncated binary infohashes, in order.
+std::vector<ScrapeResult> scrape(const std::string_view& announce_url,
+                                 const std::vector<std::vector<std::uint8_t>>& trunc_infohashes_binary,
+                                 const std::optional<std::chrono::milliseconds> timeout,
+                                 SessionPool& pool = SessionPool::shared());
+}  // namespace tt::tracker::http
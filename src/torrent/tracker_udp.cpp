@@ -0,0 +1,312 @@
+#include "tracker_udp.hpp"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "../log.hpp"
+#include "../reusable/byteorder.hpp"
+#include "../reusable/smolsocket.hpp"
+#include "peer.hpp"
+#include "shared_constants.hpp"
+#include "tracker.hpp"
+
+namespace tt::tracker::udp {
+
+// Magic constant identifying the protocol in connect requests.
+const std::uint64_t Protocol_Id = 0x41727101980;
+// How long a connection ID may be used after it was handed out.
+const std::chrono::seconds Connection_Id_Lifetime{60};
+// More infohashes than this don't fit into a single scrape request.
+const std::size_t Max_Scrape_Infohashes = 74;
+// Comfortably larger than any response a tracker will send.
+const std::size_t Max_Datagram_Size = 8192;
+// Size of the fixed part of the responses, before any peers or scrape entries.
+const std::size_t Connect_Response_Len = 16;
+const std::size_t Announce_Response_Header_Len = 20;
+const std::size_t Response_Header_Len = 8;
+const std::size_t Scrape_Entry_Len = 12;
+
+enum class Action : std::uint32_t { Connect = 0, Announce = 1, Scrape = 2, Error = 3 };
+
+template <typename T>
+static void put_be(std::vector<std::uint8_t>& buf, const T x) {
+    const T be = bo::hton(x);
+    const auto* bytes = reinterpret_cast<const std::uint8_t*>(&be);
+    buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+static T get_be(const std::vector<std::uint8_t>& buf, const std::size_t offset) {
+    T be;
+    std::memcpy(&be, buf.data() + offset, sizeof(T));
+    return bo::ntoh(be);
+}
+
+static std::uint32_t random_u32() {
+    thread_local std::mt19937 rng{std::random_device{}()};
+    return static_cast<std::uint32_t>(rng());
+}
+
+// Identifies us across IP changes. Doesn't need to be secret, just unique.
+static std::uint32_t our_key() {
+    static const std::uint32_t key = random_u32();
+    return key;
+}
+
+static std::uint32_t event_to_id(const RequestKind kind) {
+    switch (kind) {
+        case RequestKind::UPDATE:
+            return 0;
+        case RequestKind::COMPLETED:
+            return 1;
+        case RequestKind::STARTED:
+            return 2;
+        case RequestKind::STOPPED:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+std::optional<std::uint64_t> ConnectionCache::get(const std::string& tracker) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    const auto it = m_ids.find(tracker);
+    if (it == m_ids.end() || it->second.second <= std::chrono::steady_clock::now()) {
+        return {};
+    }
+    return it->second.first;
+}
+
+void ConnectionCache::put(const std::string& tracker, const std::uint64_t id) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_ids.insert_or_assign(tracker, std::make_pair(id, std::chrono::steady_clock::now() + Connection_Id_Lifetime));
+}
+
+void ConnectionCache::invalidate(const std::string& tracker) {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_ids.erase(tracker);
+}
+
+ConnectionCache& ConnectionCache::shared() {
+    static ConnectionCache cache{};
+    return cache;
+}
+
+std::pair<std::string, std::uint16_t> parse_url(const std::string_view& url) {
+    const std::string_view scheme = "udp://";
+    if (!url.starts_with(scheme)) {
+        throw Exception(fmt::format("tracker::udp::parse_url(): Not a UDP tracker URL: {}", url));
+    }
+    auto authority = url.substr(scheme.size());
+    authority = authority.substr(0, authority.find('/'));
+    const auto colon = authority.rfind(':');
+    if (colon == std::string_view::npos) {
+        throw Exception(fmt::format("tracker::udp::parse_url(): UDP tracker URL lacks a port: {}", url));
+    }
+    auto host = authority.substr(0, colon);
+    // IPv6 literals come in brackets
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    const auto port_str = authority.substr(colon + 1);
+    std::uint32_t port = 0;
+    const auto [end, err] = std::from_chars(port_str.data(), port_str.data() + port_str.size(), port);
+    if (err != std::errc{} || end != port_str.data() + port_str.size() || port == 0 || port > UINT16_MAX) {
+        throw Exception(fmt::format("tracker::udp::parse_url(): Invalid port in UDP tracker URL: {}", url));
+    }
+    return {std::string(host), static_cast<std::uint16_t>(port)};
+}
+
+// Wait until `deadline` for the response to the given transaction.
+// Stray datagrams (e.g. late replies to an earlier transmission) are skipped.
+static std::optional<std::vector<std::uint8_t>> await_response(smolsocket::Sock& sock, const std::uint32_t txid,
+                                                               const std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return {};
+        }
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        auto resp = sock.recv_datagram(Max_Datagram_Size, static_cast<std::uint64_t>(remaining));
+        if (!resp.has_value()) {
+            return {};
+        }
+        if (resp->size() >= Response_Header_Len && get_be<std::uint32_t>(resp.value(), 4) == txid) {
+            return resp;
+        }
+    }
+}
+
+// Turns an error response into an exception, and checks that the response is what we asked for.
+static void check_response(const std::vector<std::uint8_t>& resp, const Action expected, const std::size_t min_len) {
+    const auto action = static_cast<Action>(get_be<std::uint32_t>(resp, 0));
+    if (action == Action::Error) {
+        const std::string msg(resp.begin() + Response_Header_Len, resp.end());
+        throw Exception(fmt::format("tracker::udp: Tracker indicated failure with reason: {}", msg));
+    }
+    if (action != expected || resp.size() < min_len) {
+        throw Exception("tracker::udp: Tracker violated protocol: unexpected or truncated response");
+    }
+}
+
+// A tracker's reply, and the address family we reached the tracker over.
+struct Reply {
+    std::vector<std::uint8_t> data;
+    smolsocket::AddrKind family;
+};
+
+/*
+ * Perform a request, retransmitting with exponential backoff until the tracker replies.
+ * A fresh connection ID is obtained first if there's no valid one cached.
+ * `build` is handed the connection ID and transaction ID to use and must return the serialized request.
+ */
+static Reply transact(
+    const std::string_view& url, const Action action, const std::size_t min_resp_len, const Config& cfg,
+    const std::function<std::vector<std::uint8_t>(std::uint64_t, std::uint32_t)>& build) {
+    const auto [host, port] = parse_url(url);
+    const std::string cache_key = fmt::format("{}:{}", host, port);
+    auto& cache = ConnectionCache::shared();
+    smolsocket::Sock sock = [&]() {
+        try {
+            return smolsocket::Sock(host, port, smolsocket::Proto::UDP, {});
+        } catch (const smolsocket::Exception& e) {
+            throw Exception(fmt::format("tracker::udp: Failed to open socket to {}: {}", url, e.what()));
+        }
+    }();
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto give_up_at = cfg.m_total_timeout.has_value() ? start + cfg.m_total_timeout.value()
+                                                            : std::chrono::steady_clock::time_point::max();
+    try {
+        for (unsigned int n = 0; n <= cfg.m_max_retransmits; n++) {
+            const auto timeout = cfg.m_base_timeout * (1 << n);
+            auto deadline_for = [&](const std::chrono::steady_clock::time_point now) {
+                return std::min(now + timeout, give_up_at);
+            };
+            if (std::chrono::steady_clock::now() >= give_up_at) {
+                break;
+            }
+
+            auto conn_id = cache.get(cache_key);
+            if (!conn_id.has_value()) {
+                const auto txid = random_u32();
+                std::vector<std::uint8_t> req{};
+                put_be<std::uint64_t>(req, Protocol_Id);
+                put_be<std::uint32_t>(req, static_cast<std::uint32_t>(Action::Connect));
+                put_be<std::uint32_t>(req, txid);
+                sock.send(req, {});
+                const auto resp = await_response(sock, txid, deadline_for(std::chrono::steady_clock::now()));
+                if (!resp.has_value()) {
+                    continue;
+                }
+                check_response(resp.value(), Action::Connect, Connect_Response_Len);
+                conn_id = get_be<std::uint64_t>(resp.value(), 8);
+                cache.put(cache_key, conn_id.value());
+            }
+
+            const auto txid = random_u32();
+            sock.send(build(conn_id.value(), txid), {});
+            const auto resp = await_response(sock, txid, deadline_for(std::chrono::steady_clock::now()));
+            if (!resp.has_value()) {
+                TT_LOG(Debug, Tracker, "tracker::udp: No response from {} after {}ms, retransmitting", url,
+                       std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count());
+                continue;
+            }
+            try {
+                check_response(resp.value(), action, min_resp_len);
+            } catch (const Exception&) {
+                // The connection ID might have been the problem, don't keep using it
+                cache.invalidate(cache_key);
+                throw;
+            }
+            return Reply{resp.value(), sock.m_addr_kind};
+        }
+    } catch (const smolsocket::Exception& e) {
+        throw Exception(fmt::format("tracker::udp: Failed to talk to {}: {}", url, e.what()));
+    }
+    throw Exception(fmt::format("tracker::udp: Tracker {} did not respond", url));
+}
+
+Response announce(const std::string_view& url, const Request& r, const Config& cfg) {
+    auto build = [&](const std::uint64_t conn_id, const std::uint32_t txid) {
+        std::vector<std::uint8_t> req{};
+        req.reserve(98);
+        put_be<std::uint64_t>(req, conn_id);
+        put_be<std::uint32_t>(req, static_cast<std::uint32_t>(Action::Announce));
+        put_be<std::uint32_t>(req, txid);
+        req.insert(req.end(), r.trunc_infohash_binary.begin(), r.trunc_infohash_binary.end());
+        const auto id = r.our_id.as_byte_vec();
+        req.insert(req.end(), id.begin(), id.end());
+        put_be<std::uint64_t>(req, r.stats.bytes_downloaded);
+        put_be<std::uint64_t>(req, r.stats.bytes_left);
+        put_be<std::uint64_t>(req, r.stats.bytes_uploaded);
+        put_be<std::uint32_t>(req, event_to_id(r.kind));
+        // IP address: 0 means "use the sender's"
+        put_be<std::uint32_t>(req, 0);
+        put_be<std::uint32_t>(req, our_key());
+        // Number of peers wanted: -1 means "the default"
+        put_be<std::uint32_t>(req, UINT32_MAX);
+        put_be<std::uint16_t>(req, r.our_port);
+        return req;
+    };
+    const auto [resp, family] = transact(url, Action::Announce, Announce_Response_Header_Len, cfg, build);
+
+    const auto interval = static_cast<std::int64_t>(get_be<std::uint32_t>(resp, 8));
+    const std::string_view compact_peers(reinterpret_cast<const char*>(resp.data()) + Announce_Response_Header_Len,
+                                         resp.size() - Announce_Response_Header_Len);
+    TT_LOG(Debug, Tracker, "tracker::udp::announce(): Tracker told us to check in again in {} seconds", interval);
+    std::vector<smolsocket::Endpoint> peers{};
+    // The peers' address family is the one we're talking to the tracker over
+    if (family == smolsocket::AddrKind::V6) {
+        decode_compact_peers6(compact_peers, peers);
+    } else {
+        decode_compact_peers(compact_peers, peers);
+    }
+    // BEP 15 has no minimum interval
+    return Response{std::move(peers), interval, std::nullopt};
+}
+
+std::vector<ScrapeResult> scrape(const std::string_view& url,
+                                 const std::vector<std::vector<std::uint8_t>>& trunc_infohashes_binary,
+                                 const Config& cfg) {
+    std::vector<ScrapeResult> results{};
+    results.reserve(trunc_infohashes_binary.size());
+    for (std::size_t batch = 0; batch < trunc_infohashes_binary.size(); batch += Max_Scrape_Infohashes) {
+        const auto batch_end = std::min(batch + Max_Scrape_Infohashes, trunc_infohashes_binary.size());
+        auto build = [&](const std::uint64_t conn_id, const std::uint32_t txid) {
+            std::vector<std::uint8_t> req{};
+            put_be<std::uint64_t>(req, conn_id);
+            put_be<std::uint32_t>(req, static_cast<std::uint32_t>(Action::Scrape));
+            put_be<std::uint32_t>(req, txid);
+            for (std::size_t i = batch; i < batch_end; i++) {
+                const auto& infohash = trunc_infohashes_binary[i];
+                req.insert(req.end(), infohash.begin(), infohash.end());
+            }
+            return req;
+        };
+        const auto resp =
+            transact(url, Action::Scrape, Response_Header_Len + (batch_end - batch) * Scrape_Entry_Len, cfg, build)
+                .data;
+        for (std::size_t i = 0; i < batch_end - batch; i++) {
+            const auto offset = Response_Header_Len + i * Scrape_Entry_Len;
+            results.push_back(ScrapeResult{get_be<std::uint32_t>(resp, offset), get_be<std::uint32_t>(resp, offset + 4),
+                                           get_be<std::uint32_t>(resp, offset + 8)});
+        }
+    }
+    return results;
+}
+}  // namespace tt::tracker::udp
@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+ * Client for the UDP tracker protocol (BEP 15).
+ *
+ * Compared to HTTP, an announce costs two small datagrams (one of which is only needed once a minute),
+ * rather than a TCP handshake and a round of HTTP headers.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "peer.hpp"
+#include "tracker.hpp"
+
+namespace tt::tracker::udp {
+
+struct Config {
+    // How long to wait for the first reply. Doubles with every retransmission.
+    std::chrono::milliseconds m_base_timeout{15000};
+    // How often a request is retransmitted before giving up.
+    unsigned int m_max_retransmits = 8;
+    // Give up after this long, regardless of how many retransmissions are left.
+    std::optional<std::chrono::milliseconds> m_total_timeout{};
+};
+
+/*
+ * Connection IDs handed out by trackers.
+ * The protocol allows reusing them for a minute, which saves a round trip on every other request in that time.
+ *
+ * Thread-safe.
+ */
+class ConnectionCache {
+   public:
+    // Returns the cached ID for the given tracker, if it's still valid.
+    std::optional<std::uint64_t> get(const std::string& tracker);
+    void put(const std::string& tracker, const std::uint64_t id);
+    // Forget the ID for the given tracker, e.g. because it was rejected.
+    void invalidate(const std::string& tracker);
+    // The cache shared by all torrents.
+    static ConnectionCache& shared();
+
+   private:
+    std::mutex m_mutex{};
+    std::map<std::string, std::pair<std::uint64_t, std::chrono::steady_clock::time_point>> m_ids{};
+};
+
+// Split an announce URL of the form udp://host:port[/path] into host and port.
+std::pair<std::string, std::uint16_t> parse_url(const std::string_view& url);
+
+// Announce to the tracker at the given udp:// URL. Same semantics as `send_request()`.
+Response announce(const std::string_view& url, const Request& r, const Config& cfg = Config{});
+
+// Query swarm statistics for each of the given truncated binary infohashes, in order.
+std::vector<ScrapeResult> scrape(const std::string_view& url,
+                                 const std::vector<std::vector<std::uint8_t>>& trunc_infohashes_binary,
+                                 const Config& cfg = Config{});
+}  // namespace tt::tracker::udp
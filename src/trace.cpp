@@ -0,0 +1,210 @@
+#include "trace.hpp"
+
+#include <cxxabi.h>
+#include <fmt/core.h>
+#include <fmt/ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+namespace tt::job {
+
+struct Tracer::ThreadLog {
+    /// A ring of the latest spans, which only grows as needed up to it's capacity.
+    std::vector<Span> m_spans{};
+    /// Spans ever recorded, the next one goes to `m_written % capacity`.
+    std::uint64_t m_written = 0;
+    /// Wait and run times per job type. There's only a handful of types, so they're just searched.
+    std::vector<std::pair<const std::type_info*, std::pair<histogram::Histogram, histogram::Histogram>>>
+        m_latencies{};
+};
+
+static std::atomic<std::uint64_t> s_next_tracer_id{1};
+
+// The log of the tracer the current thread recorded into last.
+struct CachedLog {
+    std::uint64_t m_tracer = 0;
+    void* m_log = nullptr;
+};
+static thread_local CachedLog t_log{};
+
+// The name of a type as written in the source, rather than mangled.
+static std::string demangle(const char* mangled) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(mangled, nullptr, nullptr, &status);
+    if (status != 0 || demangled == nullptr) {
+        return mangled;
+    }
+    std::string name{demangled};
+    std::free(demangled);
+    return name;
+}
+
+static std::string_view priority_name(const Priority p) {
+    switch (p) {
+        case Priority::Control:
+            return "control";
+        case Priority::Network:
+            return "network";
+        case Priority::Background:
+            return "background";
+        default:
+            return "unknown";
+    }
+}
+
+// Enough for type names, which have no control characters.
+static std::string json_escape(const std::string_view s) {
+    std::string escaped{};
+    escaped.reserve(s.size());
+    for (const char c : s) {
+        if (c == '"' || c == '\\') {
+            escaped.push_back('\\');
+        }
+        escaped.push_back(c);
+    }
+    return escaped;
+}
+
+static double micros(const Clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); }
+
+static std::uint64_t nanos(const Clock::duration d) {
+    return static_cast<std::uint64_t>(std::max<std::int64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), 0));
+}
+
+Tracer::Tracer(const std::size_t spans_per_thread)
+    : m_id(s_next_tracer_id++),
+      m_spans_per_thread(std::max<std::size_t>(spans_per_thread, 1)),
+      m_epoch(Clock::now()),
+      m_mutex(),
+      m_logs() {}
+
+Tracer::~Tracer() = default;
+
+Tracer::ThreadLog& Tracer::thread_log() {
+    if (t_log.m_tracer == m_id) {
+        return *static_cast<ThreadLog*>(t_log.m_log);
+    }
+    auto log = std::make_unique<ThreadLog>();
+    auto* raw = log.get();
+    {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        m_logs.push_back(std::move(log));
+    }
+    t_log = CachedLog{m_id, raw};
+    return *raw;
+}
+
+void Tracer::record(const IJob& j, const std::size_t worker, const Clock::time_point queued,
+                    const Clock::time_point started, const Clock::time_point ended) {
+    auto& log = thread_log();
+    const auto& type = typeid(j);
+    const Span span{&type, j.priority(), worker, queued, started, ended};
+    if (log.m_spans.size() < m_spans_per_thread) {
+        log.m_spans.push_back(span);
+    } else {
+        log.m_spans[log.m_written % m_spans_per_thread] = span;
+    }
+    log.m_written++;
+
+    auto it = std::find_if(log.m_latencies.begin(), log.m_latencies.end(),
+                           [&](const auto& l) { return l.first == &type; });
+    if (it == log.m_latencies.end()) {
+        log.m_latencies.emplace_back(&type, std::pair<histogram::Histogram, histogram::Histogram>{});
+        it = std::prev(log.m_latencies.end());
+    }
+    auto& [wait, run] = it->second;
+    wait.record(nanos(started - queued));
+    run.record(nanos(ended - started));
+}
+
+std::vector<Tracer::Latencies> Tracer::latencies() const {
+    std::map<std::string, Latencies> by_name{};
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    for (const auto& log : m_logs) {
+        for (const auto& [type, hists] : log->m_latencies) {
+            auto name = demangle(type->name());
+            auto it = by_name.find(name);
+            if (it == by_name.end()) {
+                it = by_name.emplace(name, Latencies{name, {}, {}}).first;
+            }
+            it->second.m_wait.merge(hists.first);
+            it->second.m_run.merge(hists.second);
+        }
+    }
+    std::vector<Latencies> latencies{};
+    for (auto& [name, l] : by_name) {
+        latencies.push_back(std::move(l));
+    }
+    return latencies;
+}
+
+std::uint64_t Tracer::dropped() const {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    std::uint64_t dropped = 0;
+    for (const auto& log : m_logs) {
+        dropped += log->m_written - log->m_spans.size();
+    }
+    return dropped;
+}
+
+void Tracer::write_chrome_trace(std::ostream& out) const {
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    std::map<const std::type_info*, std::string> names{};
+    std::set<std::size_t> workers{};
+    fmt::print(out, "{{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    for (const auto& log : m_logs) {
+        for (const auto& span : log->m_spans) {
+            auto name = names.find(span.m_type);
+            if (name == names.end()) {
+                name = names.emplace(span.m_type, json_escape(demangle(span.m_type->name()))).first;
+            }
+            workers.insert(span.m_worker);
+            fmt::print(out,
+                       "{}\n{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"pid\":0,\"tid\":{},\"ts\":{:.3f},"
+                       "\"dur\":{:.3f},\"args\":{{\"wait_us\":{:.3f}}}}}",
+                       first ? "" : ",", name->second, priority_name(span.m_priority), span.m_worker,
+                       micros(span.m_started - m_epoch), micros(span.m_ended - span.m_started),
+                       micros(span.m_started - span.m_queued));
+            first = false;
+        }
+    }
+    for (const auto w : workers) {
+        fmt::print(out,
+                   "{}\n{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":{},"
+                   "\"args\":{{\"name\":\"worker {}\"}}}}",
+                   first ? "" : ",", w, w);
+        first = false;
+    }
+    fmt::print(out, "\n]}}\n");
+}
+
+void Tracer::write_report(std::ostream& out) const {
+    fmt::print(out, "{:<48} {:>9} | {:>27} | {:>27}\n", "job type", "runs", "wait p50/p99/max (us)",
+               "run p50/p99/max (us)");
+    const auto column = [](const histogram::Histogram& h) {
+        const auto us = [](const std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+        return fmt::format("{:>9.1f}/{:>8.1f}/{:>8.1f}", us(h.percentile(50)), us(h.percentile(99)), us(h.max()));
+    };
+    for (const auto& l : latencies()) {
+        fmt::print(out, "{:<48} {:>9} | {} | {}\n", l.m_name, l.m_run.count(), column(l.m_wait), column(l.m_run));
+    }
+}
+}  // namespace tt::job
@@ -0,0 +1,82 @@
+#pragma once
+
+//! Opt-in tracing of the job system: when each job was queued up, started and finished, on which worker.
+//! Traces can be viewed on a timeline (chrome://tracing or Perfetto), and summed up as latencies per job type.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include "job.hpp"
+#include "reusable/histogram.hpp"
+
+namespace tt::job {
+/// How many runs each thread keeps for the timeline by default. Older ones are overwritten.
+const std::size_t Default_Spans_Per_Thread = 1 << 16;
+
+/// Collects what the job queues it's attached to (see `JobQueue::set_tracer()`) ran.
+///
+/// Each thread records into a log of it's own, so recording takes no locks and threads don't contend.
+/// The logs are only read once the queues are done with them, so reading is only safe while none of those is
+/// processing, e.g. after `process()` returned.
+class Tracer {
+   public:
+    /// One run of a job.
+    struct Span {
+        const std::type_info* m_type;
+        Priority m_priority;
+        std::size_t m_worker;
+        /// When the job was queued up to run, i.e. enqueued with all of it's dependencies done.
+        Clock::time_point m_queued;
+        Clock::time_point m_started;
+        Clock::time_point m_ended;
+    };
+    /// Latencies of all runs of a job type, in nanoseconds.
+    struct Latencies {
+        std::string m_name;
+        /// Between being queued up and being started.
+        histogram::Histogram m_wait;
+        /// Between being started and finishing.
+        histogram::Histogram m_run;
+    };
+
+    /// Keep the last `spans_per_thread` runs of each thread for the timeline. Latencies always include all runs.
+    explicit Tracer(const std::size_t spans_per_thread = Default_Spans_Per_Thread);
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+    ~Tracer();
+
+    /// Record a run of `j`. Called by the job queue, from the worker that ran it.
+    void record(const IJob& j, const std::size_t worker, const Clock::time_point queued,
+                const Clock::time_point started, const Clock::time_point ended);
+
+    /// Latencies per job type, by type name.
+    std::vector<Latencies> latencies() const;
+    /// Number of runs that were overwritten on the timeline, as they were too many.
+    std::uint64_t dropped() const;
+    /// Write the timeline as Chrome trace-event JSON. Jobs are on the timeline of the worker that ran them.
+    void write_chrome_trace(std::ostream& out) const;
+    /// Write a table of latency percentiles per job type.
+    void write_report(std::ostream& out) const;
+
+   private:
+    struct ThreadLog;
+
+    /// Tells tracers apart for the threads' cached logs, even if one is created where another one was.
+    std::uint64_t m_id;
+    std::size_t m_spans_per_thread;
+    Clock::time_point m_epoch;
+    /// Guards adding to `m_logs`.
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<ThreadLog>> m_logs;
+
+    /// The calling thread's log, created on first use.
+    ThreadLog& thread_log();
+};
+
+}  // namespace tt::job